@@ -0,0 +1,280 @@
+/**
+ *  @file aesdarena.c
+ *  @brief Size class arena with per-thread free lists (see aesdarena.h).
+ */
+#define _GNU_SOURCE
+#include "aesdarena.h"
+
+#include <pthread.h>     /**< @brief Provides the mutex of the shared lists and the thread exit hook. */
+#include <sched.h>       /**< @brief Provides `getcpu()` used to find the NUMA node of the calling thread. */
+#include <stdatomic.h>   /**< @brief Provides the atomic statistics. */
+#include <stdbool.h>     /**< @brief Provides a boolean type and values (`true`, `false`). */
+#include <stdint.h>      /**< @brief Provides fixed width integer types (e.g., `uint64_t`, `uintptr_t`). */
+#include <stdlib.h>      /**< @brief Provides `malloc()`, `free()`. */
+#include <string.h>      /**< @brief Provides `memset()`. */
+#include <sys/mman.h>    /**< @brief Provides `mmap()`, `madvise()`, `MAP_HUGETLB`. */
+#include <sys/syscall.h> /**< @brief Provides `SYS_mbind`; the tree does not link libnuma. */
+#include <syslog.h>      /**< @brief Provides `syslog()`. */
+#include <unistd.h>      /**< @brief Provides `syscall()`. */
+
+#define HUGE_PAGE_LEN (2UL * 1024 * 1024)      /**< @brief Size (and alignment) of a huge page. */
+#define MPOL_PREFERRED 1                        /**< @brief `mbind()` mode: allocate on the given node if possible. */
+
+/**
+ * @struct arena_node
+ * @brief A free buffer; the link lives in the buffer itself.
+ */
+struct arena_node {
+        struct arena_node *next;        /**< Next free buffer of the same class. */
+};
+
+/**
+ * @struct arena_cache
+ * @brief The free lists of one thread.
+ */
+struct arena_cache {
+        struct arena_node *head[ARENA_CLASSES];        /**< Free buffers per class. */
+        unsigned count[ARENA_CLASSES];                  /**< Length of each list. */
+        bool registered;                                /**< Whether the exit hook knows this cache. */
+};
+
+// --- Arena State ---
+static char *arena = NULL;                                      /**< Start of the mapping, aligned to `HUGE_PAGE_LEN`. */
+static size_t arena_len = 0;                                    /**< Usable bytes of the arena. */
+static void *map_base = NULL;                                   /**< The mapping as returned by `mmap()`. */
+static size_t map_len = 0;                                      /**< Length of the mapping. */
+static bool hugetlb = false;                                    /**< Whether the mapping uses reserved huge pages. */
+static int region_count = 1;                                    /**< NUMA nodes, each with a region of its own. */
+static size_t region_len = 0;                                   /**< Bytes per region, whole huge pages. */
+static pthread_mutex_t arena_lock = PTHREAD_MUTEX_INITIALIZER;  /**< Guards `carved` and `shared`. */
+static size_t carved[ARENA_MAX_NODES];                          /**< Bytes of each region handed out so far. */
+static struct arena_cache shared[ARENA_MAX_NODES];              /**< Free lists shared by the threads of each node. */
+static pthread_key_t cache_key;                                 /**< Runs `cache_exit()` when a thread ends. */
+static __thread struct arena_cache cache;                       /**< Free lists of the calling thread. */
+
+// --- Statistics (reported on close) ---
+static _Atomic uint64_t stat_allocs = 0;                        /**< Requests served. */
+static _Atomic uint64_t stat_thread_hits = 0;                   /**< Requests served from the thread's own list. */
+static _Atomic uint64_t stat_shared_hits = 0;                   /**< Requests served from a shared list. */
+static _Atomic uint64_t stat_fallbacks = 0;                     /**< Requests served by `malloc()`. */
+static _Atomic uint64_t stat_requested = 0;                     /**< Bytes requested by arena-served requests. */
+static _Atomic uint64_t stat_class_bytes = 0;                   /**< Bytes of the classes that served them. */
+
+/**
+ * @brief The smallest class holding `len` bytes, or -1 if `len` exceeds the largest class.
+ */
+static int class_of(size_t len) {
+        size_t size = ARENA_MIN_CLASS;
+        for (int c = 0; c < ARENA_CLASSES; c++, size <<= 1) {
+                if (len <= size) return c;
+        }
+        return -1;
+}
+
+/**
+ * @brief The region (NUMA node) the calling thread runs on.
+ */
+static int current_region(void) {
+        unsigned cpu, node;
+        if (region_count == 1 || getcpu(&cpu, &node) != 0 || node >= (unsigned)region_count) {
+                return 0;
+        }
+        return (int)node;
+}
+
+/**
+ * @brief Moves up to `n` buffers of class `c` from a thread's list to the shared list of their region.
+ * @pre The caller holds `arena_lock`.
+ */
+static void move_nodes(struct arena_cache *from, int c, unsigned n) {
+        while (n-- > 0 && from->head[c] != NULL) {
+                struct arena_node *node = from->head[c];
+                struct arena_cache *to = &shared[((char *)node - arena) / region_len];
+                from->head[c] = node->next;
+                from->count[c]--;
+                node->next = to->head[c];
+                to->head[c] = node;
+                to->count[c]++;
+        }
+}
+
+/**
+ * @brief Hands the free lists of an exiting thread to the shared lists.
+ */
+static void cache_exit(void *arg) {
+        struct arena_cache *own = arg;
+        pthread_mutex_lock(&arena_lock);
+        for (int c = 0; c < ARENA_CLASSES; c++) {
+                move_nodes(own, c, own->count[c]);
+        }
+        pthread_mutex_unlock(&arena_lock);
+}
+
+/**
+ * @brief Maps the arena, on huge pages if possible.
+ * @param `len` Size of the arena in bytes; rounded up to whole huge pages per region.
+ * @param `nodes` Number of NUMA nodes to keep a region for (1 to ignore placement).
+ * @return 0 on success, -1 on failure.
+ * @details With several nodes the arena is split into equal regions, and each region
+ * prefers the memory of its node. A thread carves buffers from the region of the node it
+ * runs on, so a pinned thread's buffers are node-local.
+ */
+int aesdarena_init(size_t len, int nodes) {
+        region_count = nodes < 1 ? 1 : nodes > ARENA_MAX_NODES ? ARENA_MAX_NODES : nodes;
+        region_len = (len / (size_t)region_count + HUGE_PAGE_LEN - 1) & ~(HUGE_PAGE_LEN - 1);
+        arena_len = region_len * (size_t)region_count;
+        map_len = arena_len;
+        map_base = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        hugetlb = map_base != MAP_FAILED;
+        if (!hugetlb) {
+                // No reserved huge pages: over-map by one huge page so the arena can start on a huge page boundary.
+                map_len = arena_len + HUGE_PAGE_LEN;
+                map_base = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (map_base == MAP_FAILED) {
+                        syslog(LOG_ERR, "Cannot map a buffer arena of %zu bytes: %m", arena_len);
+                        map_base = NULL;
+                        return -1;
+                }
+        }
+        arena = (char *)(((uintptr_t)map_base + HUGE_PAGE_LEN - 1) & ~(uintptr_t)(HUGE_PAGE_LEN - 1));
+        if (!hugetlb && madvise(arena, arena_len, MADV_HUGEPAGE) != 0) {
+                syslog(LOG_WARNING, "Buffer arena without huge pages: %m");
+        }
+        // Pages are placed when first touched, so the policy is set before any buffer is handed out.
+        for (int r = 0; r < region_count && region_count > 1; r++) {
+                unsigned long mask = 1UL << r;
+                if (syscall(SYS_mbind, arena + (size_t)r * region_len, region_len, MPOL_PREFERRED,
+                            &mask, sizeof(mask) * 8, 0) != 0) {
+                        syslog(LOG_WARNING, "Cannot place buffer arena region %d on its node: %m", r);
+                }
+        }
+        if (pthread_key_create(&cache_key, cache_exit) != 0) {
+                munmap(map_base, map_len);
+                map_base = NULL;
+                arena = NULL;
+                return -1;
+        }
+        return 0;
+}
+
+/**
+ * @brief Hands out a buffer of at least `len` bytes.
+ * @param `len` The size needed.
+ * @return The buffer, or NULL if even `malloc()` failed.
+ * @details Release it with `aesdarena_free()` and the same `len`.
+ */
+void *aesdarena_alloc(size_t len) {
+        int c = class_of(len);
+        if (arena == NULL || c < 0) {
+                atomic_fetch_add(&stat_allocs, 1);
+                atomic_fetch_add(&stat_fallbacks, 1);
+                return malloc(len);
+        }
+        size_t size = (size_t)ARENA_MIN_CLASS << c;
+        atomic_fetch_add(&stat_allocs, 1);
+        struct arena_node *node = cache.head[c];
+        if (node != NULL) {
+                cache.head[c] = node->next;
+                cache.count[c]--;
+                atomic_fetch_add(&stat_thread_hits, 1);
+        } else {
+                int r = current_region();
+                pthread_mutex_lock(&arena_lock);
+                node = shared[r].head[c];
+                if (node != NULL) {
+                        shared[r].head[c] = node->next;
+                        shared[r].count[c]--;
+                        atomic_fetch_add(&stat_shared_hits, 1);
+                } else {
+                        // Fresh buffers are aligned to their size, so none of them straddles a huge page.
+                        size_t start = (carved[r] + size - 1) & ~(size - 1);
+                        if (start + size <= region_len) {
+                                node = (struct arena_node *)(arena + (size_t)r * region_len + start);
+                                carved[r] = start + size;
+                        }
+                }
+                pthread_mutex_unlock(&arena_lock);
+                if (node == NULL) {
+                        atomic_fetch_add(&stat_fallbacks, 1);
+                        return malloc(len);
+                }
+        }
+        atomic_fetch_add(&stat_requested, len);
+        atomic_fetch_add(&stat_class_bytes, size);
+        return node;
+}
+
+/**
+ * @brief Returns a buffer from `aesdarena_alloc()`.
+ * @param `buf` The buffer, may be NULL.
+ * @param `len` The size it was requested with.
+ * @details The buffer goes to the calling thread's list; once that list holds
+ * `ARENA_THREAD_KEEP` buffers half of them move to the shared list.
+ */
+void aesdarena_free(void *buf, size_t len) {
+        if (buf == NULL) {
+                return;
+        }
+        if (arena == NULL || (char *)buf < arena || (char *)buf >= arena + arena_len) {
+                free(buf);
+                return;
+        }
+        int c = class_of(len);
+        if (!cache.registered) {
+                cache.registered = true;
+                pthread_setspecific(cache_key, &cache);
+        }
+        struct arena_node *node = buf;
+        node->next = cache.head[c];
+        cache.head[c] = node;
+        if (++cache.count[c] >= ARENA_THREAD_KEEP) {
+                pthread_mutex_lock(&arena_lock);
+                move_nodes(&cache, c, ARENA_THREAD_KEEP / 2);
+                pthread_mutex_unlock(&arena_lock);
+        }
+}
+
+/**
+ * @brief Hands every free buffer of the calling thread to the shared lists.
+ * @details For a thread about to block for a long time (an idle connection), so the
+ * buffers it freed serve other connections meanwhile.
+ */
+void aesdarena_idle(void) {
+        cache_exit(&cache);
+}
+
+/**
+ * @brief Reports the hit rate and the fragmentation, then unmaps the arena.
+ * @pre No buffer of the arena is in use any more.
+ * @details Internal fragmentation is the part of the handed out class bytes that was not
+ * requested. The carved bytes are the high-water mark of the arena, including the gaps
+ * left by aligning buffers to their class size.
+ */
+void aesdarena_close(void) {
+        if (arena == NULL) {
+                return;
+        }
+        uint64_t allocs = atomic_load(&stat_allocs);
+        uint64_t hits = atomic_load(&stat_thread_hits) + atomic_load(&stat_shared_hits);
+        uint64_t class_bytes = atomic_load(&stat_class_bytes);
+        size_t carved_total = 0;
+        for (int r = 0; r < region_count; r++) {
+                carved_total += carved[r];
+        }
+        syslog(LOG_INFO, "Buffer arena (%s): %llu allocations, %.1f%% from free lists (%llu own thread, %llu shared), "
+               "%llu fell back to malloc; %.1f%% internal fragmentation, %zu of %zu bytes carved in %d regions",
+               hugetlb ? "MAP_HUGETLB" : "MADV_HUGEPAGE", (unsigned long long)allocs,
+               allocs ? 100.0 * (double)hits / (double)allocs : 0.0,
+               (unsigned long long)atomic_load(&stat_thread_hits), (unsigned long long)atomic_load(&stat_shared_hits),
+               (unsigned long long)atomic_load(&stat_fallbacks),
+               class_bytes ? 100.0 * (1.0 - (double)atomic_load(&stat_requested) / (double)class_bytes) : 0.0,
+               carved_total, arena_len, region_count);
+        // The free lists point into the mapping and go away with it.
+        memset(&cache, 0, sizeof(cache));
+        memset(shared, 0, sizeof(shared));
+        memset(carved, 0, sizeof(carved));
+        pthread_key_delete(cache_key);
+        munmap(map_base, map_len);
+        map_base = NULL;
+        arena = NULL;
+}
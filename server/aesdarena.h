@@ -0,0 +1,36 @@
+/**
+ *  @file aesdarena.h
+ *  @brief Huge page backed arena for connection receive and replay buffers.
+ *
+ *  With `-A <MiB>` the receive buffer of every connection and the send buffer of every
+ *  replay come from one arena of that size instead of the thread stacks. The arena is
+ *  mapped with `MAP_HUGETLB` (2 MiB pages); if no huge pages are reserved it is mapped
+ *  with normal pages and `madvise(MADV_HUGEPAGE)`, so transparent huge pages can back it.
+ *  Either way thousands of buffers share a few TLB entries.
+ *
+ *  Buffers come in the fixed size classes `ARENA_MIN_CLASS << i`. Freed buffers go to a
+ *  free list of the calling thread, which serves the next request of that class without
+ *  a lock; surplus buffers and the lists of exiting or idle threads go to shared free lists.
+ *  Fresh buffers are carved from the arena, and requests the arena cannot serve fall back
+ *  to `malloc()`. The hit rate and the fragmentation are reported on close.
+ *
+ *  On NUMA hosts (with `-a`) the arena is split into one region per node, each preferring
+ *  its node's memory; threads carve from and share buffers within the region of their node.
+ */
+#ifndef AESDARENA_H
+#define AESDARENA_H
+
+#include <stddef.h>      /**< @brief Provides `size_t`. */
+
+#define ARENA_MIN_CLASS 4096            /**< @brief Size of the smallest class; every class is a power of two. */
+#define ARENA_CLASSES 5                 /**< @brief Number of size classes (4 KiB to 64 KiB). */
+#define ARENA_THREAD_KEEP 32            /**< @brief Buffers per class a thread keeps before handing half of them back. */
+#define ARENA_MAX_NODES 8               /**< @brief Most NUMA nodes the arena keeps a region for. */
+
+int aesdarena_init(size_t len, int nodes);
+void *aesdarena_alloc(size_t len);
+void aesdarena_free(void *buf, size_t len);
+void aesdarena_idle(void);
+void aesdarena_close(void);
+
+#endif /* AESDARENA_H */
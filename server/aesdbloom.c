@@ -0,0 +1,426 @@
+/**
+ *  @file aesdbloom.c
+ *  @brief Per-segment blocked Bloom filters of the data file (see aesdbloom.h).
+ *
+ *  The open segment and the directory of sealed segments are guarded by the store lock,
+ *  like the commits that extend them. Sealed filter records and committed bytes never
+ *  change, so lookups read them without the lock.
+ */
+#include "aesdbloom.h"
+#include "aesdmem.h"
+
+#include <errno.h>       /**< @brief Provides definitions for error numbers (e.g., `EINTR`). */
+#include <fcntl.h>       /**< @brief Provides `open()`. */
+#include <stdatomic.h>   /**< @brief Provides the atomic statistics updated by lookups. */
+#include <stdio.h>       /**< @brief Provides `snprintf()`. */
+#include <stdlib.h>      /**< @brief Provides `malloc()`, `calloc()`, `realloc()`, `free()`. */
+#include <string.h>      /**< @brief Provides `memcpy()`, `memset()`. */
+#include <syslog.h>      /**< @brief Provides `syslog()`. */
+#include <unistd.h>      /**< @brief Provides `pread()`, `pwrite()`, `close()`, `unlink()`. */
+
+#define BLOOM_BLOCK_LEN 64                                      /**< @brief Bytes of a filter block, one cache line. */
+#define BLOOM_BLOCKS (AESDBLOOM_FILTER_LEN / BLOOM_BLOCK_LEN)   /**< @brief Blocks per filter. */
+#define BLOOM_HDR_LEN 64                                        /**< @brief Bytes of a record header, which keeps blocks aligned. */
+#define BLOOM_RECORD_LEN (BLOOM_HDR_LEN + AESDBLOOM_FILTER_LEN) /**< @brief Bytes of a sealed segment in the filter file. */
+#define BLOOM_SCAN_LEN (64 * 1024)                              /**< @brief Bytes read from the data file at a time. */
+#define FNV_OFFSET 14695981039346656037ull                      /**< @brief FNV-1a 64-bit offset basis. */
+#define FNV_PRIME 1099511628211ull                              /**< @brief FNV-1a 64-bit prime. */
+
+/**
+ * @struct bloom_header
+ * @brief Header of a sealed segment's record in the filter file.
+ */
+struct bloom_header {
+        uint64_t start;         /**< First byte of the segment in the data file. */
+        uint64_t end;           /**< End of the segment, just after the newline of its last line. */
+        uint32_t keys;          /**< Lines in the segment. */
+};
+
+/** @brief Odd multipliers picking one bit in each of the 8 words of a block. */
+static const uint32_t salts[8] = {
+        0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU, 0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U
+};
+
+// --- Filter State (guarded by the store lock) ---
+static int bloom_fd = -1;                       /**< The filter file, or -1 while disabled. */
+static char bloom_path[256];                    /**< `<data_file>.bloom`. */
+static uint8_t *scan = NULL;                    /**< Newly committed bytes read by `aesdbloom_commit()`. */
+static uint64_t indexed = 0;                    /**< Bytes of the data file whose lines were hashed. */
+static uint64_t line_count = 0;                 /**< Lines added to a filter. */
+static uint64_t line_start = 0;                 /**< Offset of the line being hashed. */
+static uint64_t line_hash = FNV_OFFSET;         /**< FNV-1a state of the line being hashed. */
+static uint64_t *open_filter = NULL;            /**< Filter of the open segment, `BLOOM_BLOCKS` blocks of 8 words. */
+static uint64_t open_start = 0;                 /**< First byte of the open segment. */
+static uint32_t open_keys = 0;                  /**< Lines in the open segment. */
+static struct bloom_header *sealed = NULL;      /**< Sealed segments, oldest first; record `i` is `sealed[i]`. */
+static size_t sealed_count = 0;                 /**< Entries in `sealed`. */
+static size_t sealed_cap = 0;                   /**< Capacity of `sealed`. */
+
+// --- Statistics (reported on close) ---
+static atomic_ulong stat_queries = 0;           /**< `EXISTS` lookups. */
+static atomic_ulong stat_filter_only = 0;       /**< Lookups answered without reading the data file. */
+static atomic_ulong stat_found = 0;             /**< Lookups answered `YES`. */
+static atomic_ulong stat_probes = 0;            /**< Segment filters tested. */
+static atomic_ulong stat_maybe = 0;             /**< Tests that reported the line. */
+static atomic_ulong stat_false = 0;             /**< Of those, segments the scan did not find the line in. */
+static _Atomic uint64_t stat_scanned = 0;       /**< Data file bytes scanned to confirm. */
+static _Atomic uint64_t stat_ns = 0;            /**< Time spent in lookups. */
+static _Atomic uint64_t stat_max_ns = 0;        /**< Slowest lookup. */
+
+/**
+ * @brief Finishes an FNV-1a state into a well-mixed 64-bit hash (MurmurHash3 finalizer).
+ */
+static uint64_t hash_final(uint64_t h) {
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h;
+}
+
+/**
+ * @brief The block a hash falls into.
+ */
+static size_t block_of(uint64_t hash) {
+        return (size_t)(((hash >> 32) * BLOOM_BLOCKS) >> 32);
+}
+
+/**
+ * @brief Sets the 8 bits of a hash in its block.
+ */
+static void block_set(uint64_t *block, uint64_t hash) {
+        for (int i = 0; i < 8; i++) {
+                block[i] |= 1ULL << (((uint32_t)hash * salts[i]) >> 26);
+        }
+}
+
+/**
+ * @brief Whether all 8 bits of a hash are set in its block.
+ */
+static bool block_test(const uint64_t *block, uint64_t hash) {
+        for (int i = 0; i < 8; i++) {
+                if (!(block[i] & (1ULL << (((uint32_t)hash * salts[i]) >> 26)))) {
+                        return false;
+                }
+        }
+        return true;
+}
+
+/**
+ * @brief Writes all of `buf` at `off`.
+ * @return 0 on success, -1 on failure.
+ */
+static int pwrite_all(int fd, const void *buf, size_t len, off_t off) {
+        const char *p = buf;
+        while (len > 0) {
+                ssize_t n = pwrite(fd, p, len, off);
+                if (n < 0 && errno == EINTR) continue;
+                if (n < 0) return -1;
+                p += n;
+                len -= (size_t)n;
+                off += n;
+        }
+        return 0;
+}
+
+/**
+ * @brief Reads exactly `len` bytes at `off`.
+ * @return 0 on success, -1 on failure or a short file.
+ */
+static int pread_all(int fd, void *buf, size_t len, off_t off) {
+        char *p = buf;
+        while (len > 0) {
+                ssize_t n = pread(fd, p, len, off);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) return -1;
+                p += n;
+                len -= (size_t)n;
+                off += n;
+        }
+        return 0;
+}
+
+/**
+ * @brief Creates an empty filter file next to `data_path` and an empty open segment.
+ * @return 0 on success, -1 on failure.
+ */
+int aesdbloom_open(const char *data_path) {
+        snprintf(bloom_path, sizeof(bloom_path), "%s.bloom", data_path);
+        open_filter = calloc(BLOOM_BLOCKS * 8, sizeof(*open_filter));
+        scan = malloc(BLOOM_SCAN_LEN);
+        bloom_fd = open(bloom_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (open_filter == NULL || scan == NULL || bloom_fd == -1) {
+                syslog(LOG_ERR, "Cannot create %s: %m", bloom_path);
+                free(open_filter);
+                open_filter = NULL;
+                free(scan);
+                scan = NULL;
+                if (bloom_fd != -1) {
+                        close(bloom_fd);
+                        bloom_fd = -1;
+                        unlink(bloom_path);
+                }
+                return -1;
+        }
+        aesdmem_charge(AESDMEM_INDEX, AESDBLOOM_FILTER_LEN + BLOOM_SCAN_LEN);
+        return 0;
+}
+
+/**
+ * @brief Writes the open segment's filter as record `index` of the filter file.
+ * @param `end` End of the segment in the data file.
+ * @return 0 on success, -1 on failure.
+ */
+static int write_record(size_t index, uint64_t end) {
+        uint8_t hdr[BLOOM_HDR_LEN] = { 0 };
+        struct bloom_header h = { .start = open_start, .end = end, .keys = open_keys };
+        memcpy(hdr, &h, sizeof(h));
+        off_t off = (off_t)index * BLOOM_RECORD_LEN;
+        if (pwrite_all(bloom_fd, hdr, sizeof(hdr), off) != 0 ||
+            pwrite_all(bloom_fd, open_filter, AESDBLOOM_FILTER_LEN, off + BLOOM_HDR_LEN) != 0) {
+                syslog(LOG_ERR, "Cannot write %s: %m", bloom_path);
+                return -1;
+        }
+        return 0;
+}
+
+/**
+ * @brief Seals the open segment, which ends at `end`, and starts the next one there.
+ * @details If the record cannot be written, the segment stays open and keeps growing;
+ * its filter then only fills up faster.
+ */
+static void seal(uint64_t end) {
+        if (sealed_count == sealed_cap) {
+                size_t cap = sealed_cap ? sealed_cap * 2 : 64;
+                struct bloom_header *s = realloc(sealed, cap * sizeof(*s));
+                if (s == NULL) {
+                        return;
+                }
+                aesdmem_charge(AESDMEM_INDEX, (cap - sealed_cap) * sizeof(*s));
+                sealed = s;
+                sealed_cap = cap;
+        }
+        if (write_record(sealed_count, end) != 0) {
+                return;
+        }
+        sealed[sealed_count++] = (struct bloom_header) { .start = open_start, .end = end, .keys = open_keys };
+        memset(open_filter, 0, AESDBLOOM_FILTER_LEN);
+        open_start = end;
+        open_keys = 0;
+}
+
+/**
+ * @brief Adds the lines committed since the previous call to the filters.
+ * @param `data_fd` The data file.
+ * @param `committed_len` The new committed length of the data file.
+ * @pre The caller holds the store lock.
+ * @details The new bytes were just written, so they are read back from the page cache.
+ * A line that is not terminated yet keeps its hash state until the next commit.
+ */
+void aesdbloom_commit(int data_fd, uint64_t committed_len) {
+        if (bloom_fd == -1) {
+                return;
+        }
+        while (indexed < committed_len) {
+                size_t want = committed_len - indexed < BLOOM_SCAN_LEN ? (size_t)(committed_len - indexed) : BLOOM_SCAN_LEN;
+                ssize_t n = pread(data_fd, scan, want, (off_t)indexed);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) {
+                        syslog(LOG_WARNING, "Cannot read the data file for the existence filters: %m");
+                        return;
+                }
+                // Loop invariant: `line_hash` covers the bytes from `line_start` up to `indexed + i`.
+                for (ssize_t i = 0; i < n; i++) {
+                        if (scan[i] != '\n') {
+                                line_hash = (line_hash ^ scan[i]) * FNV_PRIME;
+                                continue;
+                        }
+                        uint64_t h = hash_final(line_hash);
+                        block_set(&open_filter[block_of(h) * 8], h);
+                        open_keys++;
+                        line_count++;
+                        line_hash = FNV_OFFSET;
+                        line_start = indexed + (uint64_t)i + 1;
+                        if (open_keys >= AESDBLOOM_SEGMENT_KEYS || line_start - open_start >= AESDBLOOM_SEGMENT_LEN) {
+                                seal(line_start);
+                        }
+                }
+                indexed += (uint64_t)n;
+        }
+}
+
+/**
+ * @brief Starts an `EXISTS` lookup: tests the open segment and lists every segment to check.
+ * @param `line` The line, without its newline.
+ * @param `len` Length of `line`.
+ * @param `query` Receives the candidates; release them with `aesdbloom_confirm()`.
+ * @return 0 on success, -1 if memory runs out.
+ * @pre The caller holds the store lock.
+ * @details The open segment is a candidate if its filter reports the line, or if the
+ * unterminated last line of the data file has the same length (it is not in a filter
+ * yet). Sealed segments are listed untested; their filters are read without the lock.
+ */
+int aesdbloom_lookup(const char *line, size_t len, struct aesdbloom_query *query) {
+        clock_gettime(CLOCK_MONOTONIC, &query->start);
+        uint64_t h = FNV_OFFSET;
+        for (size_t i = 0; i < len; i++) {
+                h = (h ^ (unsigned char)line[i]) * FNV_PRIME;
+        }
+        query->hash = hash_final(h);
+        query->count = 0;
+        query->ranges = malloc((sealed_count + 1) * sizeof(*query->ranges));
+        if (query->ranges == NULL) {
+                return -1;
+        }
+        bool filtered = block_test(&open_filter[block_of(query->hash) * 8], query->hash);
+        atomic_fetch_add(&stat_probes, 1);
+        if (filtered) {
+                atomic_fetch_add(&stat_maybe, 1);
+        }
+        if (filtered || (len > 0 && indexed - line_start == len)) {
+                query->ranges[query->count++] = (struct aesdbloom_range) {
+                        .start = open_start, .end = indexed, .index = -1, .filtered = filtered
+                };
+        }
+        for (size_t i = sealed_count; i-- > 0;) {
+                query->ranges[query->count++] = (struct aesdbloom_range) {
+                        .start = sealed[i].start, .end = sealed[i].end, .index = (long)i, .filtered = false
+                };
+        }
+        return 0;
+}
+
+/**
+ * @brief Looks for a whole line in a range of the data file.
+ * @return 1 if the range holds it, 0 if not, -1 on a read error.
+ * @details The range starts at a line boundary. Its end counts as the end of a line,
+ * which only matters for the unterminated last line of the open segment.
+ */
+static int range_contains(int data_fd, uint64_t start, uint64_t end, const char *line, size_t len) {
+        char buf[16 * 1024];
+        // `matched` bytes of the current line equal the start of `line`, or it is SIZE_MAX
+        // once the current line differs; `mid` says whether the current line has any bytes.
+        size_t matched = 0;
+        bool mid = false;
+        uint64_t pos = start;
+        while (pos < end) {
+                size_t want = end - pos < sizeof(buf) ? (size_t)(end - pos) : sizeof(buf);
+                ssize_t n = pread(data_fd, buf, want, (off_t)pos);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) return -1;
+                atomic_fetch_add(&stat_scanned, (uint64_t)n);
+                for (ssize_t i = 0; i < n; i++) {
+                        if (buf[i] == '\n') {
+                                if (matched == len) return 1;
+                                matched = 0;
+                                mid = false;
+                                continue;
+                        }
+                        mid = true;
+                        if (matched != SIZE_MAX) {
+                                matched = matched < len && buf[i] == line[matched] ? matched + 1 : SIZE_MAX;
+                        }
+                        if (matched == SIZE_MAX) {
+                                // Skip the rest of a line that differs.
+                                char *nl = memchr(buf + i, '\n', (size_t)(n - i));
+                                if (nl == NULL) break;
+                                i = nl - buf - 1;
+                        }
+                }
+                pos += (uint64_t)n;
+        }
+        return mid && matched == len ? 1 : 0;
+}
+
+/**
+ * @brief Finishes an `EXISTS` lookup: tests the sealed filters and scans the segments they report.
+ * @param `data_fd` The data file.
+ * @param `line` The line, without its newline.
+ * @param `len` Length of `line`.
+ * @param `query` The lookup started by `aesdbloom_lookup()`; its candidates are freed.
+ * @return 1 if the data file holds the line, 0 if not, -1 on a read error.
+ * @details Segments are checked newest first and the first confirmed one ends the lookup.
+ */
+int aesdbloom_confirm(int data_fd, const char *line, size_t len, struct aesdbloom_query *query) {
+        int rc = 0;
+        bool scanned = false;
+        uint64_t block[8];
+        for (size_t i = 0; i < query->count && rc == 0; i++) {
+                struct aesdbloom_range *r = &query->ranges[i];
+                if (r->index >= 0) {
+                        off_t off = (off_t)r->index * BLOOM_RECORD_LEN + BLOOM_HDR_LEN +
+                                    (off_t)block_of(query->hash) * BLOOM_BLOCK_LEN;
+                        if (pread_all(bloom_fd, block, sizeof(block), off) != 0) {
+                                rc = -1;
+                                break;
+                        }
+                        atomic_fetch_add(&stat_probes, 1);
+                        if (!block_test(block, query->hash)) {
+                                continue;
+                        }
+                        atomic_fetch_add(&stat_maybe, 1);
+                        r->filtered = true;
+                }
+                scanned = true;
+                rc = range_contains(data_fd, r->start, r->end, line, len);
+                if (rc == 0 && r->filtered) {
+                        atomic_fetch_add(&stat_false, 1);
+                }
+        }
+        free(query->ranges);
+        query->ranges = NULL;
+        struct timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        uint64_t ns = (uint64_t)((end.tv_sec - query->start.tv_sec) * 1000000000LL + (end.tv_nsec - query->start.tv_nsec));
+        atomic_fetch_add(&stat_queries, 1);
+        atomic_fetch_add(&stat_ns, ns);
+        uint64_t max = atomic_load(&stat_max_ns);
+        while (ns > max && !atomic_compare_exchange_weak(&stat_max_ns, &max, ns));
+        if (!scanned) {
+                atomic_fetch_add(&stat_filter_only, 1);
+        }
+        if (rc == 1) {
+                atomic_fetch_add(&stat_found, 1);
+        }
+        return rc;
+}
+
+/**
+ * @brief Reports the false positive rate and the lookup latency, then frees the filters.
+ * @param `keep` Whether the filter file is kept, with the open segment written as its
+ * last record; otherwise it is removed like the data file.
+ */
+void aesdbloom_close(bool keep) {
+        if (bloom_fd != -1) {
+                // A test that reported the line is a false positive unless the segment held it.
+                unsigned long probes = atomic_load(&stat_probes);
+                unsigned long positives = atomic_load(&stat_maybe) - atomic_load(&stat_false);
+                unsigned long queries = atomic_load(&stat_queries);
+                syslog(LOG_INFO, "Existence filters: %zu sealed segments, %llu lines; %lu queries, %lu found, "
+                       "%lu answered without reading the data file; %lu filter tests, %.3f%% false positives; "
+                       "%.1f us per query, %.1f us max, %llu bytes scanned",
+                       sealed_count, (unsigned long long)line_count, queries, atomic_load(&stat_found),
+                       atomic_load(&stat_filter_only), probes,
+                       probes > positives ? 100.0 * (double)atomic_load(&stat_false) / (double)(probes - positives) : 0.0,
+                       queries ? (double)atomic_load(&stat_ns) / 1000.0 / (double)queries : 0.0,
+                       (double)atomic_load(&stat_max_ns) / 1000.0, (unsigned long long)atomic_load(&stat_scanned));
+                if (keep && open_keys > 0) {
+                        write_record(sealed_count, line_start);
+                }
+                close(bloom_fd);
+                bloom_fd = -1;
+                if (!keep) {
+                        unlink(bloom_path);
+                }
+                aesdmem_release(AESDMEM_INDEX, AESDBLOOM_FILTER_LEN + BLOOM_SCAN_LEN + sealed_cap * sizeof(*sealed));
+        }
+        free(open_filter);
+        open_filter = NULL;
+        free(scan);
+        scan = NULL;
+        free(sealed);
+        sealed = NULL;
+        sealed_count = 0;
+        sealed_cap = 0;
+}
@@ -0,0 +1,61 @@
+/**
+ *  @file aesdbloom.h
+ *  @brief Blocked Bloom filters answering `EXISTS <line>` without reading the data file.
+ *
+ *  With `-e` the committed part of the shared data file is split into segments of at
+ *  most `AESDBLOOM_SEGMENT_KEYS` lines or `AESDBLOOM_SEGMENT_LEN` bytes, each with a
+ *  blocked Bloom filter of `AESDBLOOM_FILTER_LEN` bytes over its lines (without their
+ *  newline). A line sets 8 bits in one 64-byte block of the filter, so testing it reads
+ *  a single cache line. Filters are built as commits make new lines visible; a full
+ *  segment is sealed and its filter appended to `<data_file>.bloom`, after a 64-byte
+ *  header holding the segment's range of the data file. Only the open segment's filter
+ *  stays in memory.
+ *
+ *  A packet `EXISTS <line>` is not stored; it is answered `YES` or `NO`. The filter
+ *  block of every segment is read from the filter file; only segments whose filter
+ *  reports the line are scanned in the data file to confirm it, so a negative answer
+ *  never reads the data file and a positive one reads a single segment. The false
+ *  positive rate of the filters and the query latency are reported on close.
+ */
+#ifndef AESDBLOOM_H
+#define AESDBLOOM_H
+
+#include <stdbool.h>     /**< @brief Provides a boolean type and values (`true`, `false`). */
+#include <stddef.h>      /**< @brief Provides `size_t`. */
+#include <stdint.h>      /**< @brief Provides fixed width integer types (e.g., `uint64_t`). */
+#include <time.h>        /**< @brief Provides `struct timespec`. */
+
+#define AESDBLOOM_EXISTS "EXISTS "              /**< @brief Start of a packet that asks whether a line was stored. */
+#define AESDBLOOM_SEGMENT_KEYS 16384            /**< @brief Most lines per segment. */
+#define AESDBLOOM_SEGMENT_LEN (4 * 1024 * 1024) /**< @brief Most bytes per segment, which bounds a confirming scan. */
+#define AESDBLOOM_FILTER_LEN (32 * 1024)        /**< @brief Bytes of a segment's filter: 16 bits per line. */
+
+/**
+ * @struct aesdbloom_range
+ * @brief A segment that may hold the line being looked up.
+ */
+struct aesdbloom_range {
+        uint64_t start;         /**< First byte of the segment in the data file. */
+        uint64_t end;           /**< End of the segment in the data file. */
+        long index;             /**< Record of a sealed segment in the filter file, or -1 for the open one. */
+        bool filtered;          /**< Whether the filter already reported the line (the open segment). */
+};
+
+/**
+ * @struct aesdbloom_query
+ * @brief An `EXISTS` lookup, started under the store lock and confirmed without it.
+ */
+struct aesdbloom_query {
+        uint64_t hash;                          /**< Hash of the line. */
+        struct aesdbloom_range *ranges;         /**< Candidate segments, newest first. */
+        size_t count;                           /**< Entries in `ranges`. */
+        struct timespec start;                  /**< When the lookup started. */
+};
+
+int aesdbloom_open(const char *data_path);
+void aesdbloom_commit(int data_fd, uint64_t committed_len);
+int aesdbloom_lookup(const char *line, size_t len, struct aesdbloom_query *query);
+int aesdbloom_confirm(int data_fd, const char *line, size_t len, struct aesdbloom_query *query);
+void aesdbloom_close(bool keep);
+
+#endif /* AESDBLOOM_H */
@@ -0,0 +1,125 @@
+/**
+ *  @file aesdcache.c
+ *  @brief Rolling writeback and drop-behind of the data file (see aesdcache.h).
+ */
+#define _GNU_SOURCE
+#include "aesdcache.h"
+
+#include <fcntl.h>       /**< @brief Provides `sync_file_range()`, `posix_fadvise()`. */
+#include <stdatomic.h>   /**< @brief Provides the atomic statistics updated by replays. */
+#include <stdbool.h>     /**< @brief Provides a boolean type and values (`true`, `false`). */
+#include <syslog.h>      /**< @brief Provides `syslog()`. */
+#include <time.h>        /**< @brief Provides `clock_gettime()` used to measure writeback waits. */
+
+/** @brief Rounds `n` down to a multiple of `CACHE_WINDOW`. */
+#define WINDOW_DOWN(n) ((n) & ~(uint64_t)(CACHE_WINDOW - 1))
+
+// --- Writeback State (guarded by `store_lock`) ---
+static uint64_t wb_next = 0;            /**< Start of the first window whose writeback has not been started. */
+static uint64_t dropped = 0;            /**< Everything before this offset has been dropped from the cache. */
+static bool used = false;               /**< Whether any hint was given, i.e. whether to report on close. */
+
+// --- Statistics (reported on close) ---
+static uint64_t stat_windows = 0;                       /**< Windows whose writeback was started early. */
+static uint64_t stat_wait_ns = 0;                       /**< Time spent waiting for earlier windows. */
+static uint64_t stat_dropped = 0;                       /**< Bytes dropped after a commit. */
+static _Atomic uint64_t stat_replay_drops = 0;          /**< Replays that dropped the pages they read. */
+
+/**
+ * @brief Nanoseconds of `CLOCK_MONOTONIC`.
+ */
+static uint64_t now_ns(void) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * @brief Starts writeback of the complete windows written so far.
+ * @param `fd` The data file, with everything up to `end` already handed to the kernel.
+ * @param `end` The current end of the data file.
+ * @details For each new window the writeback of the window before it is waited for
+ * first, so dirty pages stay bounded to about two windows. A file that shrank (replaced
+ * by the compactor) starts over from its beginning.
+ */
+void aesdcache_written(int fd, uint64_t end) {
+        used = true;
+        if (end < wb_next) {
+                wb_next = 0;
+                dropped = 0;
+        }
+        // Loop invariant: writeback of every complete window before `wb_next` has been started.
+        while (wb_next + CACHE_WINDOW <= end) {
+                if (wb_next >= CACHE_WINDOW) {
+                        uint64_t t0 = now_ns();
+                        sync_file_range(fd, (off64_t)(wb_next - CACHE_WINDOW), CACHE_WINDOW,
+                                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+                        stat_wait_ns += now_ns() - t0;
+                }
+                sync_file_range(fd, (off64_t)wb_next, CACHE_WINDOW, SYNC_FILE_RANGE_WRITE);
+                wb_next += CACHE_WINDOW;
+                stat_windows++;
+        }
+}
+
+/**
+ * @brief Drops durable ranges that left the hot part of the log from the page cache.
+ * @param `fd` The data file.
+ * @param `committed_len` The committed length; everything before it is durable.
+ */
+void aesdcache_committed(int fd, uint64_t committed_len) {
+        used = true;
+        if (committed_len < dropped) {
+                dropped = 0;
+        }
+        if (committed_len <= CACHE_HOT_KEEP) {
+                return;
+        }
+        uint64_t cold_end = WINDOW_DOWN(committed_len - CACHE_HOT_KEEP);
+        if (cold_end > dropped) {
+                posix_fadvise(fd, (off_t)dropped, (off_t)(cold_end - dropped), POSIX_FADV_DONTNEED);
+                stat_dropped += cold_end - dropped;
+                dropped = cold_end;
+        }
+}
+
+/**
+ * @brief Announces a sequential read of `[start, end)` so readahead grows early.
+ * @param `fd` The data file.
+ * @param `start` First byte the replay reads.
+ * @param `end` The committed length the replay stops at.
+ */
+void aesdcache_replay_begin(int fd, uint64_t start, uint64_t end) {
+        if (end > start) {
+                posix_fadvise(fd, (off_t)start, (off_t)(end - start), POSIX_FADV_SEQUENTIAL);
+        }
+}
+
+/**
+ * @brief Drops the cold pages a replay of `[0, end)` brought back into the cache.
+ * @param `fd` The data file.
+ * @param `end` The committed length the replay stopped at.
+ * @details The range is durable, so the pages are clean and dropping them costs no I/O.
+ * No state is touched, so this runs without `store_lock`.
+ */
+void aesdcache_replay_end(int fd, uint64_t end) {
+        if (end <= CACHE_HOT_KEEP) {
+                return;
+        }
+        posix_fadvise(fd, 0, (off_t)WINDOW_DOWN(end - CACHE_HOT_KEEP), POSIX_FADV_DONTNEED);
+        atomic_fetch_add(&stat_replay_drops, 1);
+}
+
+/**
+ * @brief Reports how much writeback was started early and how much was dropped.
+ */
+void aesdcache_close(void) {
+        if (!used) {
+                return;
+        }
+        syslog(LOG_INFO, "Page cache: %llu windows written back early, %.1f ms waiting for writeback, "
+               "%llu bytes dropped after commits, %llu replays dropped behind",
+               (unsigned long long)stat_windows, (double)stat_wait_ns / 1e6,
+               (unsigned long long)stat_dropped, (unsigned long long)atomic_load(&stat_replay_drops));
+        used = false;
+}
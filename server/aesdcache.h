@@ -0,0 +1,30 @@
+/**
+ *  @file aesdcache.h
+ *  @brief Page cache hygiene for the buffered data file.
+ *
+ *  With `-H` the shared data file is written back and dropped from the page cache as it
+ *  streams, instead of piling up dirty and clean pages until the next `fsync()`:
+ *  - writeback of every complete `CACHE_WINDOW` of new data is started right away with
+ *    `sync_file_range()`, and the window before it is waited for, so at most about two
+ *    windows are ever dirty and a commit only has to flush the last partial one;
+ *  - once a commit made them durable, ranges older than the most recent `CACHE_HOT_KEEP`
+ *    bytes are dropped with `POSIX_FADV_DONTNEED`;
+ *  - replays announce `POSIX_FADV_SEQUENTIAL` and drop the cold pages they read behind them.
+ *
+ *  The functions are called with `store_lock` held, except the replay hints.
+ */
+#ifndef AESDCACHE_H
+#define AESDCACHE_H
+
+#include <stdint.h>      /**< @brief Provides fixed width integer types (e.g., `uint64_t`). */
+
+#define CACHE_WINDOW (1024 * 1024)      /**< @brief Bytes of new data per writeback window. */
+#define CACHE_HOT_KEEP (1024 * 1024)    /**< @brief Most recent committed bytes that stay cached. */
+
+void aesdcache_written(int fd, uint64_t end);
+void aesdcache_committed(int fd, uint64_t committed_len);
+void aesdcache_replay_begin(int fd, uint64_t start, uint64_t end);
+void aesdcache_replay_end(int fd, uint64_t end);
+void aesdcache_close(void);
+
+#endif /* AESDCACHE_H */
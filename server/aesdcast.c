@@ -0,0 +1,379 @@
+/**
+ *  @file aesdcast.c
+ *  @brief Shared block cache of coalesced replays (see aesdcast.h).
+ */
+#include "aesdcast.h"
+#include "aesdmem.h"
+
+#include <errno.h>       /**< @brief Provides definitions for error numbers (e.g., `EINTR`). */
+#include <pthread.h>     /**< @brief Provides the lock guarding the slots and the condition signalling finished reads. */
+#include <stdatomic.h>   /**< @brief Provides the atomic statistics updated by replays. */
+#include <stdbool.h>     /**< @brief Provides a boolean type and values (`true`, `false`). */
+#include <stdlib.h>      /**< @brief Provides `malloc()`, `calloc()`, `free()`. */
+#include <sys/sendfile.h>/**< @brief Provides `sendfile()` for blocks no slot is free for. */
+#include <sys/socket.h>  /**< @brief Provides `send()`. */
+#include <sys/stat.h>    /**< @brief Provides `fstat()` identifying the data file. */
+#include <syslog.h>      /**< @brief Provides `syslog()`. */
+#include <unistd.h>      /**< @brief Provides `pread()`. */
+
+/**
+ * @struct cast_slot
+ * @brief One cached block of the data file.
+ * @details Bytes below `len` never change while the slot holds the block, so replays
+ * send them without the lock; a read only ever writes past `len`.
+ */
+struct cast_slot {
+        dev_t dev;              /**< Device of the data file. */
+        ino_t ino;              /**< Inode of the data file. */
+        unsigned generation;    /**< Compaction generation of the data file. */
+        uint64_t block;         /**< Block number, or `UINT64_MAX` while the slot is empty. */
+        size_t len;             /**< Bytes of the block read so far. */
+        int users;              /**< Replays sending from (or reading into) the slot. */
+        bool loading;           /**< Whether a replay is reading more of the block. */
+        char *buf;              /**< `block_len` bytes, or NULL until the slot is first used or after a flush. */
+};
+
+// --- Cache State (guarded by `cast_lock`) ---
+static size_t block_len = 0;                                    /**< Bytes per block, 0 while disabled. */
+static struct cast_slot *slots = NULL;                          /**< The slots. */
+static size_t slot_count = 0;                                   /**< Entries in `slots`. */
+static uint64_t cursors[AESDCAST_MAX_CURSORS];                 /**< Block each replay in progress reads next, `UINT64_MAX` if free. */
+static pthread_mutex_t cast_lock = PTHREAD_MUTEX_INITIALIZER;   /**< Guards the slot headers. */
+static pthread_cond_t cast_loaded = PTHREAD_COND_INITIALIZER;   /**< Signalled when a read into a slot ends. */
+
+// --- Statistics (reported on close) ---
+static atomic_ulong stat_replays = 0;           /**< Replays served. */
+static _Atomic uint64_t stat_sent = 0;          /**< Bytes they sent. */
+static atomic_ulong stat_reads = 0;             /**< Reads of the data file into a slot. */
+static _Atomic uint64_t stat_read_bytes = 0;    /**< Bytes those reads returned. */
+static atomic_ulong stat_hits = 0;              /**< Blocks sent from the cache as they were. */
+static atomic_ulong stat_joined = 0;            /**< Blocks sent after waiting for another replay's read. */
+static atomic_ulong stat_direct = 0;            /**< Blocks sent with `sendfile()` because no slot was free. */
+
+/**
+ * @brief Allocates the slot headers of the block cache.
+ * @param `block_kib` Block size in KiB, `AESDCAST_MIN_KIB` to `AESDCAST_MAX_KIB`.
+ * @return 0 on success, -1 on a bad block size or if memory runs out.
+ * @details The buffer of a slot is only allocated once a block is read into it.
+ */
+int aesdcast_init(long block_kib) {
+        if (block_kib < AESDCAST_MIN_KIB || block_kib > AESDCAST_MAX_KIB) {
+                return -1;
+        }
+        block_len = (size_t)block_kib * 1024;
+        slot_count = AESDCAST_CACHE_LEN / block_len;
+        slots = calloc(slot_count, sizeof(*slots));
+        if (slots == NULL) {
+                block_len = 0;
+                return -1;
+        }
+        for (size_t i = 0; i < slot_count; i++) {
+                slots[i].block = UINT64_MAX;
+        }
+        for (int i = 0; i < AESDCAST_MAX_CURSORS; i++) {
+                cursors[i] = UINT64_MAX;
+        }
+        return 0;
+}
+
+/**
+ * @brief Sends all of `buf`.
+ * @return 0 on success, -1 on failure.
+ */
+static int send_all(int fd, const char *buf, size_t len) {
+        while (len > 0) {
+                ssize_t n = send(fd, buf, len, 0);
+                if (n < 0 && errno == EINTR) continue;
+                if (n < 0) return -1;
+                buf += n;
+                len -= (size_t)n;
+        }
+        return 0;
+}
+
+/**
+ * @brief Reads exactly `len` bytes at `off`.
+ * @return 0 on success, -1 on failure or a short file.
+ */
+static int pread_all(int fd, char *buf, size_t len, off_t off) {
+        while (len > 0) {
+                ssize_t n = pread(fd, buf, len, off);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) return -1;
+                buf += n;
+                len -= (size_t)n;
+                off += n;
+        }
+        return 0;
+}
+
+/**
+ * @brief Empties a slot nobody sends from and frees its buffer.
+ * @return The bytes freed.
+ * @pre The caller holds `cast_lock`.
+ */
+static size_t drop(struct cast_slot *s) {
+        s->block = UINT64_MAX;
+        s->len = 0;
+        if (s->buf == NULL) {
+                return 0;
+        }
+        free(s->buf);
+        s->buf = NULL;
+        aesdmem_release(AESDMEM_CACHE, block_len);
+        return block_len;
+}
+
+/**
+ * @brief Empties every slot nobody sends from.
+ * @return The bytes freed.
+ * @pre The caller holds `cast_lock`.
+ */
+static size_t flush_idle(void) {
+        size_t freed = 0;
+        for (size_t i = 0; i < slot_count; i++) {
+                if (slots[i].users == 0) {
+                        freed += drop(&slots[i]);
+                }
+        }
+        return freed;
+}
+
+/**
+ * @brief Finds the slot holding a block.
+ * @details The compaction generation tells a file swapped in by "-c" from an earlier one
+ * that had the same inode number.
+ * @pre The caller holds `cast_lock`.
+ */
+static struct cast_slot *find(const struct stat *st, unsigned generation, uint64_t block) {
+        for (size_t i = 0; i < slot_count; i++) {
+                if (slots[i].block == block && slots[i].ino == st->st_ino && slots[i].dev == st->st_dev
+                    && slots[i].generation == generation) {
+                        return &slots[i];
+                }
+        }
+        return NULL;
+}
+
+/**
+ * @brief How many blocks the nearest replay behind a block still has to read before it needs it.
+ * @return The distance, or `UINT64_MAX` if every replay in progress is past the block.
+ * @pre The caller holds `cast_lock`.
+ */
+static uint64_t next_use(uint64_t block) {
+        uint64_t best = UINT64_MAX;
+        for (int i = 0; i < AESDCAST_MAX_CURSORS; i++) {
+                if (cursors[i] <= block && block - cursors[i] < best) {
+                        best = block - cursors[i];
+                }
+        }
+        return best;
+}
+
+/**
+ * @brief Picks the slot nobody sends from whose block is needed last.
+ * @return The slot, or NULL if every slot is in use.
+ * @pre The caller holds `cast_lock`.
+ * @details Replays scan forward, so a block every replay in progress has passed is only
+ * useful to replays that have not started yet, and among the others the one the nearest
+ * replay reaches last is the one to give up. Least recently used would evict exactly the
+ * blocks the replays behind the first one are about to read.
+ */
+static struct cast_slot *victim(void) {
+        struct cast_slot *best = NULL;
+        uint64_t best_use = 0;
+        for (size_t i = 0; i < slot_count; i++) {
+                if (slots[i].users != 0) {
+                        continue;
+                }
+                uint64_t use = slots[i].block == UINT64_MAX ? UINT64_MAX : next_use(slots[i].block);
+                if (best == NULL || use > best_use) {
+                        best = &slots[i];
+                        best_use = use;
+                }
+        }
+        return best;
+}
+
+/**
+ * @brief Takes the slot holding the first `need` bytes of a block, reading what is missing.
+ * @param `data_fd` The data file.
+ * @param `st` Identity of the data file.
+ * @param `generation` Compaction generation of the data file.
+ * @param `block` The block number.
+ * @param `need` Bytes of the block the replay sends from its start, at most `block_len`.
+ * @param `cursor` The replay's entry in `cursors`, or -1 if it has none.
+ * @param `out` Receives the slot; give it back with `put()`.
+ * @return 0 on success, 1 if no slot is free, -1 on a read error.
+ * @details If another replay is reading the block, the caller waits for that read rather
+ * than issuing its own.
+ */
+static int take(int data_fd, const struct stat *st, unsigned generation, uint64_t block, size_t need, int cursor,
+                struct cast_slot **out) {
+        bool joined = false;
+        pthread_mutex_lock(&cast_lock);
+        if (cursor >= 0) {
+                cursors[cursor] = block;
+        }
+        // Loop invariant: the caller holds no slot.
+        for (;;) {
+                struct cast_slot *s = find(st, generation, block);
+                if (s != NULL && s->len >= need) {
+                        s->users++;
+                        pthread_mutex_unlock(&cast_lock);
+                        atomic_fetch_add(joined ? &stat_joined : &stat_hits, 1);
+                        *out = s;
+                        return 0;
+                }
+                if (s != NULL && s->loading) {
+                        joined = true;
+                        pthread_cond_wait(&cast_loaded, &cast_lock);
+                        continue;
+                }
+                if (s == NULL) {
+                        if ((s = victim()) == NULL) {
+                                pthread_mutex_unlock(&cast_lock);
+                                return 1;
+                        }
+                        if (s->buf == NULL) {
+                                if ((s->buf = malloc(block_len)) == NULL) {
+                                        pthread_mutex_unlock(&cast_lock);
+                                        return 1;
+                                }
+                                aesdmem_charge(AESDMEM_CACHE, block_len);
+                        }
+                        s->dev = st->st_dev;
+                        s->ino = st->st_ino;
+                        s->generation = generation;
+                        s->block = block;
+                        s->len = 0;
+                }
+                // Others may be sending the first `len` bytes; only the rest is read.
+                size_t from = s->len;
+                s->loading = true;
+                s->users++;
+                pthread_mutex_unlock(&cast_lock);
+                int rc = pread_all(data_fd, s->buf + from, need - from, (off_t)(block * block_len + from));
+                pthread_mutex_lock(&cast_lock);
+                s->loading = false;
+                if (rc == 0) {
+                        s->len = need;
+                } else {
+                        s->users--;
+                }
+                pthread_cond_broadcast(&cast_loaded);
+                pthread_mutex_unlock(&cast_lock);
+                if (rc != 0) {
+                        return -1;
+                }
+                atomic_fetch_add(&stat_reads, 1);
+                atomic_fetch_add(&stat_read_bytes, need - from);
+                *out = s;
+                return 0;
+        }
+}
+
+/**
+ * @brief Gives back a slot taken with `take()`.
+ * @details Under memory pressure the slot is dropped once nobody sends from it.
+ */
+static void put(struct cast_slot *s) {
+        pthread_mutex_lock(&cast_lock);
+        s->users--;
+        if (s->users == 0 && !s->loading && aesdmem_pressure()) {
+                aesdmem_evicted(drop(s));
+        }
+        pthread_mutex_unlock(&cast_lock);
+}
+
+/**
+ * @brief Sends bytes `start` to `end` of the data file through the shared block cache.
+ * @param `client_fd` The connected client socket.
+ * @param `data_fd` The data file.
+ * @param `start` First byte to send.
+ * @param `end` The committed length of the replay's snapshot.
+ * @param `generation` Compaction generation of the data file `data_fd` refers to.
+ * @return 0 on success, -1 on failure.
+ * @details Under memory pressure the idle slots are dropped first, like the "-w" frame cache.
+ */
+int aesdcast_replay(int client_fd, int data_fd, uint64_t start, uint64_t end, unsigned generation) {
+        struct stat st;
+        if (fstat(data_fd, &st) != 0) {
+                return -1;
+        }
+        // Register where this replay reads, so eviction keeps what it is about to need.
+        int cursor = -1;
+        pthread_mutex_lock(&cast_lock);
+        if (aesdmem_pressure()) {
+                aesdmem_evicted(flush_idle());
+        }
+        for (int i = 0; i < AESDCAST_MAX_CURSORS && cursor == -1; i++) {
+                if (cursors[i] == UINT64_MAX) {
+                        cursor = i;
+                        cursors[i] = start / block_len;
+                }
+        }
+        pthread_mutex_unlock(&cast_lock);
+        int rc = 0;
+        uint64_t pos = start;
+        // Loop invariant: the bytes from `start` up to `pos` were sent.
+        while (pos < end && rc == 0) {
+                uint64_t block = pos / block_len;
+                uint64_t block_start = block * block_len;
+                size_t need = end - block_start < block_len ? (size_t)(end - block_start) : block_len;
+                size_t skip = (size_t)(pos - block_start);
+                struct cast_slot *s;
+                int got = take(data_fd, &st, generation, block, need, cursor, &s);
+                if (got == 0) {
+                        rc = send_all(client_fd, s->buf + skip, need - skip);
+                        put(s);
+                } else if (got == 1) {
+                        // Every slot is being sent to a client; do not wait behind them.
+                        atomic_fetch_add(&stat_direct, 1);
+                        off_t off = (off_t)pos;
+                        while (rc == 0 && (uint64_t)off < block_start + need) {
+                                ssize_t n = sendfile(client_fd, data_fd, &off, (size_t)(block_start + need - (uint64_t)off));
+                                if (n < 0 && errno == EINTR) continue;
+                                if (n <= 0) rc = -1;
+                        }
+                } else {
+                        rc = -1;
+                }
+                pos = block_start + need;
+        }
+        if (cursor >= 0) {
+                pthread_mutex_lock(&cast_lock);
+                cursors[cursor] = UINT64_MAX;
+                pthread_mutex_unlock(&cast_lock);
+        }
+        atomic_fetch_add(&stat_replays, 1);
+        atomic_fetch_add(&stat_sent, pos - start);
+        return rc;
+}
+
+/**
+ * @brief Reports how many reads the replays shared, then frees the cache.
+ */
+void aesdcast_close(void) {
+        if (block_len == 0) {
+                return;
+        }
+        unsigned long replays = atomic_load(&stat_replays);
+        unsigned long reads = atomic_load(&stat_reads);
+        unsigned long direct = atomic_load(&stat_direct);
+        syslog(LOG_INFO, "Coalesced replays: %lu replays of %llu bytes with %zu KiB blocks; %lu reads of %llu bytes "
+               "(%.2f reads and %.1f KiB read per replay), %lu blocks from the cache, %lu after joining a read, "
+               "%lu sent directly",
+               replays, (unsigned long long)atomic_load(&stat_sent), block_len / 1024, reads,
+               (unsigned long long)atomic_load(&stat_read_bytes),
+               replays ? (double)(reads + direct) / (double)replays : 0.0,
+               replays ? (double)atomic_load(&stat_read_bytes) / 1024.0 / (double)replays : 0.0,
+               atomic_load(&stat_hits), atomic_load(&stat_joined), direct);
+        pthread_mutex_lock(&cast_lock);
+        flush_idle();
+        pthread_mutex_unlock(&cast_lock);
+        free(slots);
+        slots = NULL;
+        slot_count = 0;
+        block_len = 0;
+}
@@ -0,0 +1,41 @@
+/**
+ *  @file aesdcast.h
+ *  @brief Coalesced replays: concurrent replays share the reads of the data file.
+ *
+ *  With `-B <KiB>` replays read the data file in blocks of that size (64 to 1024 KiB)
+ *  through a shared cache of `AESDCAST_CACHE_LEN` bytes:
+ *  - the first replay that needs a block reads it into a free slot; replays that need
+ *    the same block meanwhile wait for that read instead of issuing their own, then
+ *    every one of them sends the slot to its client, so a thundering herd of replays
+ *    advances behind a single read cursor;
+ *  - a replay that joins later finds the blocks still cached and catches up from memory;
+ *  - a block is only read up to the committed length of the replay that loads it; a
+ *    replay with a longer snapshot extends the slot in place, past the bytes others may
+ *    be sending.
+ *
+ *  Every replay in progress registers the block it reads next. A slot is recycled when
+ *  every registered replay is past its block, otherwise the slot the nearest replay
+ *  reaches last goes first; unlike least recently used this keeps the blocks that the
+ *  replays behind the first one are about to read. When every slot is being sent from,
+ *  a replay sends its block with `sendfile()` instead of waiting for a slow client.
+ *  Cached blocks are matched by device, inode and compaction generation, so a compacted
+ *  data file never serves the old file's bytes, even when it reuses the old inode number.
+ *  Slot buffers are allocated on first use; under memory pressure (`-M`) idle slots are
+ *  freed, and a slot is freed as soon as its last replay is done with it, like the `-w`
+ *  frame cache. Reads per replay are reported on close.
+ */
+#ifndef AESDCAST_H
+#define AESDCAST_H
+
+#include <stdint.h>      /**< @brief Provides fixed width integer types (e.g., `uint64_t`). */
+
+#define AESDCAST_MIN_KIB 64                     /**< @brief Smallest block size. */
+#define AESDCAST_MAX_KIB 1024                   /**< @brief Largest block size. */
+#define AESDCAST_CACHE_LEN (8 * 1024 * 1024)    /**< @brief Bytes of the shared block cache. */
+#define AESDCAST_MAX_CURSORS 256                /**< @brief Replays in progress whose position guides eviction. */
+
+int aesdcast_init(long block_kib);
+int aesdcast_replay(int client_fd, int data_fd, uint64_t start, uint64_t end, unsigned generation);
+void aesdcast_close(void);
+
+#endif /* AESDCAST_H */
@@ -0,0 +1,504 @@
+/**
+ *  @file aesdcold.c
+ *  @brief Cold block compressor and replay for the aesdsocket data file (see aesdcold.h).
+ */
+#define _GNU_SOURCE
+#include "aesdcold.h"
+#include "aesdlz.h"
+
+#include <errno.h>       /**< @brief Provides definitions for error numbers (e.g., `EINTR`). */
+#include <fcntl.h>       /**< @brief Provides `open()`, `fallocate()`, `FALLOC_FL_PUNCH_HOLE`. */
+#include <pthread.h>     /**< @brief Provides threads, mutexes and the index lock. */
+#include <signal.h>      /**< @brief Provides `pthread_sigmask()`. */
+#include <stdatomic.h>   /**< @brief Provides the atomic committed length. */
+#include <stdbool.h>     /**< @brief Provides a boolean type and values (`true`, `false`). */
+#include <stdio.h>       /**< @brief Provides `snprintf()`. */
+#include <stdlib.h>      /**< @brief Provides `malloc()`, `realloc()`, `free()`. */
+#include <string.h>      /**< @brief Provides `memcpy()`. */
+#include <sys/sendfile.h>/**< @brief Provides `sendfile()` used for blocks stored uncompressed. */
+#include <sys/socket.h>  /**< @brief Provides `send()`. */
+#include <syslog.h>      /**< @brief Provides `syslog()`. */
+#include <time.h>        /**< @brief Provides `clock_gettime()`. */
+#include <unistd.h>      /**< @brief Provides `pread()`, `pwrite()`, `fdatasync()`, `close()`, `unlink()`. */
+
+#define COLD_INTERVAL_S 5                       /**< @brief Seconds between two looks at the committed length. */
+#define COLD_POOL_MAX 4                         /**< @brief Decompression buffers kept for reuse. */
+
+/**
+ * @struct cold_block
+ * @brief Block index entry: where block `i` of the log lives in the cold file.
+ * @details A block whose compressed form would not be smaller is stored as it is,
+ * marked by `comp_len == COLD_BLOCK_LEN`.
+ */
+struct cold_block {
+        uint64_t comp_off;      /**< Offset in the cold file. */
+        uint32_t comp_len;      /**< Stored length. */
+};
+
+/**
+ * @struct cold_work
+ * @brief Scratch memory of the compressor thread.
+ */
+struct cold_work {
+        uint8_t raw[COLD_BLOCK_LEN];                    /**< The block being compressed. */
+        uint8_t comp[AESDLZ_BOUND(COLD_BLOCK_LEN)];     /**< Its compressed form. */
+        struct aesdlz_work lz;                          /**< Match finder state. */
+};
+
+// --- Compressor State ---
+static pthread_t cold_thread;                                           /**< The compressor thread. */
+static bool cold_running = false;                                       /**< Whether `cold_thread` was started. */
+static pthread_mutex_t stop_lock = PTHREAD_MUTEX_INITIALIZER;           /**< Protects `cold_stop`. */
+static pthread_cond_t stop_cond = PTHREAD_COND_INITIALIZER;             /**< Wakes the compressor up early on shutdown. */
+static bool cold_stop = false;                                          /**< Asks the compressor to exit. */
+static char data_path[256];                                             /**< The data file. */
+static char cold_path[272];                                             /**< The cold file. */
+static int cold_fd = -1;                                                /**< The cold file, read by replays. */
+static pthread_rwlock_t index_lock = PTHREAD_RWLOCK_INITIALIZER;        /**< Guards the block index. */
+static int cold_level;                                                  /**< Compression level. */
+static _Atomic uint64_t committed = 0;                                  /**< Latest committed length of the data file. */
+static struct cold_block *blocks = NULL;                                /**< The block index. */
+static size_t block_count = 0;                                          /**< Blocks in the index. */
+static size_t block_cap = 0;                                            /**< Capacity of `blocks`. */
+
+// --- Hole Punching ---
+static pthread_mutex_t pin_lock = PTHREAD_MUTEX_INITIALIZER;            /**< Protects `punch_epoch` and `pinned`. */
+static uint64_t punch_epoch = 0;                                        /**< Epoch new pins are counted in. */
+static unsigned pinned[2] = { 0, 0 };                                   /**< Replays in progress, by parity of their epoch. */
+static size_t flipped = 0;                                              /**< Blocks frozen when the epoch last advanced (compressor only). */
+static size_t punched = 0;                                              /**< Blocks whose range of the data file is released (compressor only). */
+
+// --- Buffer Pool ---
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;           /**< Protects the pool. */
+static char *pool[COLD_POOL_MAX];                                       /**< Free decompression buffers. */
+static int pool_len = 0;                                                /**< Buffers in `pool`. */
+
+// --- Statistics (reported on stop) ---
+static uint64_t stat_raw = 0;                                           /**< Log bytes compressed. */
+static uint64_t stat_stored = 0;                                        /**< Bytes written to the cold file. */
+static _Atomic uint64_t stat_inflated = 0;                              /**< Bytes decompressed by replays. */
+static _Atomic uint64_t stat_inflate_ns = 0;                            /**< Time spent decompressing. */
+static _Atomic uint64_t stat_replays = 0;                               /**< Replays that read cold blocks. */
+static _Atomic uint64_t stat_replay_ns = 0;                             /**< Time those replays spent on cold blocks. */
+static uint64_t stat_postponed = 0;                                     /**< Times punching waited for a pinned replay. */
+
+/**
+ * @brief Returns nanoseconds elapsed since `t0`.
+ */
+static uint64_t elapsed_ns(const struct timespec *t0) {
+        struct timespec t1;
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        return (uint64_t)((t1.tv_sec - t0->tv_sec) * 1000000000LL + (t1.tv_nsec - t0->tv_nsec));
+}
+
+/**
+ * @brief Takes a decompression buffer from the pool, allocating one if the pool is empty.
+ */
+static char *pool_get(void) {
+        char *buf = NULL;
+        pthread_mutex_lock(&pool_lock);
+        if (pool_len > 0) {
+                buf = pool[--pool_len];
+        }
+        pthread_mutex_unlock(&pool_lock);
+        return buf != NULL ? buf : malloc(COLD_BLOCK_LEN);
+}
+
+/**
+ * @brief Returns a buffer to the pool, or frees it if the pool is full.
+ */
+static void pool_put(char *buf) {
+        pthread_mutex_lock(&pool_lock);
+        if (pool_len < COLD_POOL_MAX) {
+                pool[pool_len++] = buf;
+                buf = NULL;
+        }
+        pthread_mutex_unlock(&pool_lock);
+        free(buf);
+}
+
+/**
+ * @brief Writes exactly `len` bytes at `off` of a file.
+ */
+static int pwrite_all(int fd, const void *buf, size_t len, off_t off) {
+        const char *p = buf;
+        while (len > 0) {
+                ssize_t n = pwrite(fd, p, len, off);
+                if (n < 0) {
+                        if (errno == EINTR) continue;
+                        return -1;
+                }
+                p += n;
+                len -= (size_t)n;
+                off += n;
+        }
+        return 0;
+}
+
+/**
+ * @brief Sends exactly `len` bytes to a socket.
+ */
+static int send_all(int fd, const char *buf, size_t len) {
+        while (len > 0) {
+                ssize_t n = send(fd, buf, len, 0);
+                if (n < 0) {
+                        if (errno == EINTR) continue;
+                        return -1;
+                }
+                buf += n;
+                len -= (size_t)n;
+        }
+        return 0;
+}
+
+/**
+ * @brief Compresses the next block of the data file and releases its range.
+ * @param `data_fd` The data file, opened for reading and writing.
+ * @param `cold_len` Bytes used in the cold file; advanced past the new block.
+ * @param `work` Scratch memory of the compressor thread.
+ * @return 0 on success, -1 on failure.
+ * @details The block is already committed, so it never changes and is read without a lock.
+ * Only adding it to the index takes `index_lock`; from then on new replays read the block
+ * from the cold file, and `punch_blocks()` releases its range of the data file once the
+ * replays pinned before are done.
+ */
+static int freeze_block(int data_fd, uint64_t *cold_len, struct cold_work *work) {
+        uint8_t *raw = work->raw;
+        uint8_t *comp = work->comp;
+        off_t raw_off = (off_t)block_count * COLD_BLOCK_LEN;
+
+        size_t got = 0;
+        while (got < COLD_BLOCK_LEN) {
+                ssize_t n = pread(data_fd, raw + got, COLD_BLOCK_LEN - got, raw_off + (off_t)got);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) return -1;
+                got += (size_t)n;
+        }
+        size_t comp_len = aesdlz_compress(raw, COLD_BLOCK_LEN, comp, cold_level, &work->lz);
+        const uint8_t *stored = comp;
+        if (comp_len >= COLD_BLOCK_LEN) {
+                stored = raw;
+                comp_len = COLD_BLOCK_LEN;
+        }
+        if (pwrite_all(cold_fd, stored, comp_len, (off_t)*cold_len) != 0 || fdatasync(cold_fd) != 0) {
+                return -1;
+        }
+
+        pthread_rwlock_wrlock(&index_lock);
+        if (block_count == block_cap) {
+                size_t cap = block_cap ? block_cap * 2 : 64;
+                struct cold_block *b = realloc(blocks, cap * sizeof(*b));
+                if (b == NULL) {
+                        pthread_rwlock_unlock(&index_lock);
+                        return -1;
+                }
+                blocks = b;
+                block_cap = cap;
+        }
+        blocks[block_count++] = (struct cold_block) { .comp_off = *cold_len, .comp_len = (uint32_t)comp_len };
+        pthread_rwlock_unlock(&index_lock);
+        stat_raw += COLD_BLOCK_LEN;
+        stat_stored += comp_len;
+        *cold_len += comp_len;
+        return 0;
+}
+
+/**
+ * @brief Releases the ranges of the data file that no replay in progress can still read.
+ * @param `data_fd` The data file, opened for reading and writing.
+ * @details A replay reads the data file from the block count it pinned. The blocks frozen
+ * before the epoch last advanced are released once every replay pinned in an earlier
+ * epoch has ended; then the epoch advances past the blocks frozen since. A replay never
+ * waits for this, and the compressor never waits for a replay.
+ */
+static void punch_blocks(int data_fd) {
+        pthread_mutex_lock(&pin_lock);
+        if (punched == flipped && block_count > flipped) {
+                punch_epoch++;
+                flipped = block_count;
+        }
+        size_t until = punched;
+        if (punched < flipped) {
+                if (pinned[(punch_epoch - 1) & 1] == 0) {
+                        until = flipped;
+                } else {
+                        stat_postponed++;
+                }
+        }
+        pthread_mutex_unlock(&pin_lock);
+        if (until > punched &&
+            fallocate(data_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)punched * COLD_BLOCK_LEN,
+                      (off_t)(until - punched) * COLD_BLOCK_LEN) != 0) {
+                // Replays are still correct, the blocks just occupy space twice.
+                syslog(LOG_WARNING, "Cannot release cold blocks of %s: %m", data_path);
+        }
+        punched = until;
+}
+
+/**
+ * @brief Compressor thread: freezes every block that has fallen out of the hot tail.
+ */
+static void *cold_main(void *arg) {
+        (void)arg;
+        sigset_t all;
+        sigfillset(&all);
+        pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+        // The data file is created by the first connection, so it is opened on first use.
+        int data_fd = -1;
+        struct cold_work *work = malloc(sizeof(*work));
+        if (work == NULL) {
+                syslog(LOG_ERR, "The cold block compressor cannot start: %m");
+                return NULL;
+        }
+        uint64_t cold_len = 0;
+        pthread_mutex_lock(&stop_lock);
+        while (!cold_stop) {
+                struct timespec deadline;
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_sec += COLD_INTERVAL_S;
+                pthread_cond_timedwait(&stop_cond, &stop_lock, &deadline);
+                // Loop invariant: blocks `[0, block_count)` are in the cold file.
+                while (!cold_stop &&
+                       atomic_load(&committed) >= (uint64_t)(block_count + 1) * COLD_BLOCK_LEN + COLD_HOT_KEEP) {
+                        pthread_mutex_unlock(&stop_lock);
+                        if (data_fd == -1) {
+                                data_fd = open(data_path, O_RDWR | O_CLOEXEC);
+                        }
+                        int rc = data_fd == -1 ? -1 : freeze_block(data_fd, &cold_len, work);
+                        pthread_mutex_lock(&stop_lock);
+                        if (rc != 0) {
+                                syslog(LOG_ERR, "Compressing a cold block of %s failed: %m", data_path);
+                                break;
+                        }
+                }
+                // Also retries the blocks a long replay held back at the last look.
+                if (data_fd != -1) {
+                        punch_blocks(data_fd);
+                }
+        }
+        pthread_mutex_unlock(&stop_lock);
+        if (data_fd != -1) {
+                close(data_fd);
+        }
+        free(work);
+        return NULL;
+}
+
+/**
+ * @brief Starts the cold block compressor.
+ * @param `path` The data file.
+ * @param `level` Compression level, 1 (fastest) to 9 (smallest).
+ * @return 0 on success, -1 on failure.
+ */
+int aesdcold_start(const char *path, int level) {
+        if (level < 1 || level > 9) {
+                syslog(LOG_ERR, "The compression level must be between 1 and 9");
+                return -1;
+        }
+        snprintf(data_path, sizeof(data_path), "%s", path);
+        snprintf(cold_path, sizeof(cold_path), "%s.cold", path);
+        cold_fd = open(cold_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (cold_fd == -1) {
+                syslog(LOG_ERR, "Cannot create %s: %m", cold_path);
+                return -1;
+        }
+        cold_level = level;
+        if (pthread_create(&cold_thread, NULL, cold_main, NULL) != 0) {
+                close(cold_fd);
+                cold_fd = -1;
+                unlink(cold_path);
+                return -1;
+        }
+        cold_running = true;
+        return 0;
+}
+
+/**
+ * @brief Tells the compressor how much of the data file is committed.
+ * @param `committed_len` Committed length of the data file.
+ * @details Cheap enough to call on every commit; only the compressor thread reads the value.
+ */
+void aesdcold_commit(uint64_t committed_len) {
+        atomic_store(&committed, committed_len);
+}
+
+/**
+ * @brief Pins the cold blocks of a replay.
+ * @param `pin` Receives the number of cold blocks and the epoch the replay is counted in.
+ * @pre The caller holds the store lock while it takes the replay's snapshot, so the blocks
+ * pinned lie within the snapshot.
+ * @details Until `aesdcold_unpin()`, the range of the data file past the pinned blocks is
+ * not punched out, even as more blocks are frozen.
+ */
+void aesdcold_pin(struct aesdcold_pin *pin) {
+        // Holding `index_lock` keeps a new block from being frozen between the count and the pin.
+        pthread_rwlock_rdlock(&index_lock);
+        pin->blocks = block_count;
+        pthread_mutex_lock(&pin_lock);
+        pin->epoch = punch_epoch;
+        pinned[pin->epoch & 1]++;
+        pthread_mutex_unlock(&pin_lock);
+        pthread_rwlock_unlock(&index_lock);
+}
+
+/**
+ * @brief Releases a pin taken by `aesdcold_pin()` once its replay has ended.
+ */
+void aesdcold_unpin(const struct aesdcold_pin *pin) {
+        pthread_mutex_lock(&pin_lock);
+        pinned[pin->epoch & 1]--;
+        pthread_mutex_unlock(&pin_lock);
+}
+
+/**
+ * @brief Sends the pinned cold blocks of the log to a client.
+ * @param `client_fd` The connected client socket.
+ * @param `pin` The blocks pinned for this replay by `aesdcold_pin()`.
+ * @param `replayed` Receives the number of log bytes sent; the caller continues from there in the data file.
+ * @return 0 on success, -1 on failure.
+ * @details Runs without the store lock: the cold file is only appended to, and each index
+ * entry is read under `index_lock`.
+ */
+int aesdcold_replay(int client_fd, const struct aesdcold_pin *pin, uint64_t *replayed) {
+        *replayed = 0;
+        if (pin->blocks == 0) {
+                return 0;
+        }
+        struct timespec t0;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        char *raw = pool_get();
+        char *comp = pool_get();
+        int rc = raw != NULL && comp != NULL ? 0 : -1;
+        for (size_t i = 0; i < pin->blocks && rc == 0; i++) {
+                // `blocks` may be reallocated by the compressor meanwhile, so the entry is copied.
+                pthread_rwlock_rdlock(&index_lock);
+                struct cold_block b = blocks[i];
+                pthread_rwlock_unlock(&index_lock);
+                if (b.comp_len == COLD_BLOCK_LEN) {
+                        // Stored uncompressed: let the kernel copy it.
+                        off_t pos = (off_t)b.comp_off;
+                        size_t left = COLD_BLOCK_LEN;
+                        while (left > 0 && rc == 0) {
+                                ssize_t n = sendfile(client_fd, cold_fd, &pos, left);
+                                if (n < 0 && errno == EINTR) continue;
+                                if (n <= 0) rc = -1;
+                                else left -= (size_t)n;
+                        }
+                } else {
+                        struct timespec ti;
+                        if (pread(cold_fd, comp, b.comp_len, (off_t)b.comp_off) != (ssize_t)b.comp_len) {
+                                rc = -1;
+                                break;
+                        }
+                        clock_gettime(CLOCK_MONOTONIC, &ti);
+                        if (aesdlz_decompress((uint8_t *)comp, b.comp_len, (uint8_t *)raw, COLD_BLOCK_LEN) != COLD_BLOCK_LEN) {
+                                syslog(LOG_ERR, "Cold block %zu of %s is corrupt", i, cold_path);
+                                rc = -1;
+                                break;
+                        }
+                        atomic_fetch_add(&stat_inflate_ns, elapsed_ns(&ti));
+                        atomic_fetch_add(&stat_inflated, COLD_BLOCK_LEN);
+                        rc = send_all(client_fd, raw, COLD_BLOCK_LEN);
+                }
+                if (rc == 0) {
+                        *replayed += COLD_BLOCK_LEN;
+                }
+        }
+        if (comp != NULL) {
+                pool_put(comp);
+        }
+        if (raw != NULL) {
+                pool_put(raw);
+        }
+        atomic_fetch_add(&stat_replays, 1);
+        atomic_fetch_add(&stat_replay_ns, elapsed_ns(&t0));
+        return rc;
+}
+
+/**
+ * @brief Writes the blocks whose range of the data file was released back into it.
+ * @return 0 on success, -1 on failure.
+ * @details Only called once the compressor has stopped and no replay runs any more.
+ */
+static int restore_blocks(void) {
+        if (punched == 0) {
+                return 0;
+        }
+        int data_fd = open(data_path, O_WRONLY | O_CLOEXEC);
+        char *raw = pool_get();
+        char *comp = pool_get();
+        int rc = data_fd != -1 && raw != NULL && comp != NULL ? 0 : -1;
+        for (size_t i = 0; i < punched && rc == 0; i++) {
+                const char *block = raw;
+                if (pread(cold_fd, comp, blocks[i].comp_len, (off_t)blocks[i].comp_off) != (ssize_t)blocks[i].comp_len) {
+                        rc = -1;
+                } else if (blocks[i].comp_len == COLD_BLOCK_LEN) {
+                        block = comp;
+                } else if (aesdlz_decompress((uint8_t *)comp, blocks[i].comp_len, (uint8_t *)raw, COLD_BLOCK_LEN) != COLD_BLOCK_LEN) {
+                        rc = -1;
+                }
+                if (rc == 0) {
+                        rc = pwrite_all(data_fd, block, COLD_BLOCK_LEN, (off_t)i * COLD_BLOCK_LEN);
+                }
+        }
+        if (rc == 0) {
+                rc = fdatasync(data_fd);
+        }
+        if (comp != NULL) {
+                pool_put(comp);
+        }
+        if (raw != NULL) {
+                pool_put(raw);
+        }
+        if (data_fd != -1) {
+                close(data_fd);
+        }
+        return rc;
+}
+
+/**
+ * @brief Stops the compressor, reports the ratio and replay cost, and removes the cold file.
+ * @param `keep` Whether the data file is kept ("-K"); its released ranges are then restored
+ * from the cold file first, and the cold file is kept if that fails.
+ */
+void aesdcold_stop(bool keep) {
+        if (!cold_running) {
+                return;
+        }
+        pthread_mutex_lock(&stop_lock);
+        cold_stop = true;
+        pthread_cond_signal(&stop_cond);
+        pthread_mutex_unlock(&stop_lock);
+        pthread_join(cold_thread, NULL);
+        cold_running = false;
+
+        uint64_t inflated = atomic_load(&stat_inflated);
+        uint64_t inflate_ns = atomic_load(&stat_inflate_ns);
+        uint64_t replays = atomic_load(&stat_replays);
+        uint64_t replay_ns = atomic_load(&stat_replay_ns);
+        syslog(LOG_INFO, "Cold blocks: %llu bytes stored as %llu (ratio %.2f); decompression %.1f MB/s; "
+               "%llu replays spent %.1f us each on cold blocks; punching postponed %llu times for a replay",
+               (unsigned long long)stat_raw, (unsigned long long)stat_stored,
+               stat_stored ? (double)stat_raw / (double)stat_stored : 0.0,
+               inflate_ns ? (double)inflated * 1000.0 / (double)inflate_ns : 0.0,
+               (unsigned long long)replays,
+               replays ? (double)replay_ns / 1000.0 / (double)replays : 0.0,
+               (unsigned long long)stat_postponed);
+        if (keep && restore_blocks() != 0) {
+                syslog(LOG_ERR, "Cannot restore the cold blocks of %s, keeping %s: %m", data_path, cold_path);
+        } else {
+                unlink(cold_path);
+        }
+        close(cold_fd);
+        cold_fd = -1;
+        free(blocks);
+        blocks = NULL;
+        block_count = 0;
+        block_cap = 0;
+        flipped = 0;
+        punched = 0;
+        while (pool_len > 0) {
+                free(pool[--pool_len]);
+        }
+}
@@ -0,0 +1,49 @@
+/**
+ *  @file aesdcold.h
+ *  @brief Transparent block compression of cold data file history.
+ *
+ *  With `-z <level>` a background thread compresses the committed part of the data file,
+ *  except for the most recent `COLD_HOT_KEEP` bytes, in fixed `COLD_BLOCK_LEN` blocks into
+ *  `<data_file>.cold`. Once a block is durable in the cold file its range of the data file
+ *  is released with `FALLOC_FL_PUNCH_HOLE`, so offsets in the data file never change.
+ *
+ *  Replays run without the store lock. A replay pins the number of cold blocks together
+ *  with its snapshot and reads the data file from there on; a block frozen later keeps
+ *  its range of the data file until every replay pinned before it has ended, so punching
+ *  is postponed rather than waited for.
+ *
+ *  Blocks are compressed with the in-tree codec of aesdlz.h at the given level. Block `i` covers bytes `[i * COLD_BLOCK_LEN, (i + 1) * COLD_BLOCK_LEN)`
+ *  of the log, and the block index maps it to its place in the cold file, so any block
+ *  can be read on its own. Replays decompress block by block into buffers taken from a
+ *  small reusable pool.
+ *
+ *  With `-K` the released ranges are written back into the data file on stop, so the
+ *  kept file is the whole log again and the cold file can go.
+ */
+#ifndef AESDCOLD_H
+#define AESDCOLD_H
+
+#include <stdbool.h>     /**< @brief Provides a boolean type and values (`true`, `false`). */
+#include <stddef.h>      /**< @brief Provides `size_t`. */
+#include <stdint.h>      /**< @brief Provides fixed width integer types (e.g., `uint64_t`). */
+
+#define COLD_BLOCK_LEN (64 * 1024)      /**< @brief Bytes of the log per compressed block. */
+#define COLD_HOT_KEEP (256 * 1024)      /**< @brief Most recent committed bytes that are never compressed. */
+
+/**
+ * @struct aesdcold_pin
+ * @brief The cold blocks of one replay, pinned together with its snapshot.
+ */
+struct aesdcold_pin {
+        size_t blocks;          /**< Blocks replayed from the cold file; the data file is read from their end. */
+        uint64_t epoch;         /**< Punching epoch the replay started in. */
+};
+
+int aesdcold_start(const char *data_path, int level);
+void aesdcold_commit(uint64_t committed_len);
+void aesdcold_pin(struct aesdcold_pin *pin);
+int aesdcold_replay(int client_fd, const struct aesdcold_pin *pin, uint64_t *replayed);
+void aesdcold_unpin(const struct aesdcold_pin *pin);
+void aesdcold_stop(bool keep);
+
+#endif /* AESDCOLD_H */
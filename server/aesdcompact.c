@@ -0,0 +1,363 @@
+/**
+ *  @file aesdcompact.c
+ *  @brief Compactor thread for the aesdsocket data file (see aesdcompact.h).
+ */
+#include "aesdcompact.h"
+#include "aesdkv.h"
+#include "aesdshm.h"
+
+#include <errno.h>       /**< @brief Provides definitions for error numbers (e.g., `EINTR`). */
+#include <fcntl.h>       /**< @brief Provides `open()`. */
+#include <signal.h>      /**< @brief Provides `pthread_sigmask()`. */
+#include <stdatomic.h>   /**< @brief Provides atomic types shared with connection threads. */
+#include <stdint.h>      /**< @brief Provides fixed width integer types (e.g., `uint64_t`). */
+#include <stdio.h>       /**< @brief Provides `snprintf()`, `rename()`. */
+#include <stdlib.h>      /**< @brief Provides `malloc()`, `realloc()`, `free()`. */
+#include <string.h>      /**< @brief Provides `memchr()`, `memcmp()`, `memcpy()`. */
+#include <sys/sendfile.h>/**< @brief Provides `sendfile()` used to copy the tail into the new file. */
+#include <sys/stat.h>    /**< @brief Provides `fstat()`, `stat()`. */
+#include <syslog.h>      /**< @brief Provides `syslog()`. */
+#include <time.h>        /**< @brief Provides `clock_gettime()`, `nanosleep()`. */
+#include <unistd.h>      /**< @brief Provides `read()`, `write()`, `fsync()`, `close()`, `unlink()`. */
+
+#define COMPACT_INTERVAL_S 30           /**< @brief Seconds between two compaction attempts. */
+#define COMPACT_MIN_GROWTH (64 * 1024)  /**< @brief Bytes the data file must have grown by since the last compaction. */
+#define COMPACT_CHUNK_LEN (64 * 1024)   /**< @brief Bytes read per step; the rate limit is enforced between steps. */
+
+// --- Compactor State ---
+static pthread_t compact_thread;                                        /**< The compactor thread. */
+static bool compact_running = false;                                    /**< Whether `compact_thread` was started. */
+static pthread_mutex_t stop_lock = PTHREAD_MUTEX_INITIALIZER;           /**< Protects `compact_stop`. */
+static pthread_cond_t stop_cond = PTHREAD_COND_INITIALIZER;             /**< Wakes the compactor up early on shutdown. */
+static bool compact_stop = false;                                       /**< Asks the compactor to exit. */
+static atomic_uint generation = 0;                                      /**< Bumped every time a compacted file is swapped in. */
+static char data_path[256];                                             /**< The data file. */
+static char tmp_path[272];                                              /**< The file being written by the compactor. */
+static pthread_mutex_t *lock;                                           /**< The store lock serialising appends. */
+static long rate_bytes;                                                 /**< Read budget in bytes per second. */
+static bool keyed_mode;                                                 /**< Whether superseded `PUT` packets are dropped. */
+
+/**
+ * @struct compact_pass
+ * @brief State of a single compaction pass.
+ */
+struct compact_pass {
+        int out_fd;             /**< The new file. */
+        uint64_t out_len;       /**< Bytes written to the new file. */
+        char *line;             /**< The line being assembled across reads. */
+        size_t line_len;        /**< Bytes in `line`. */
+        size_t line_cap;        /**< Capacity of `line`. */
+        uint64_t line_off;      /**< Offset of `line` in the old file. */
+        char *prev;             /**< Copy of the last kept line that was not a `PUT`. */
+        size_t prev_len;        /**< Bytes in `prev`. */
+        uint64_t *old_offs;     /**< Old offsets of the kept `PUT` values, ascending. */
+        uint64_t *new_offs;     /**< New offsets of the same values. */
+        size_t kept;            /**< Entries in `old_offs`/`new_offs`. */
+        size_t kept_cap;        /**< Capacity of `old_offs`/`new_offs`. */
+};
+
+/**
+ * @brief Returns whether the compactor has been asked to stop.
+ */
+static bool stopping(void) {
+        pthread_mutex_lock(&stop_lock);
+        bool stop = compact_stop;
+        pthread_mutex_unlock(&stop_lock);
+        return stop;
+}
+
+/**
+ * @brief Writes exactly `len` bytes to a file.
+ */
+static int write_all(int fd, const char *buf, size_t len) {
+        while (len > 0) {
+                ssize_t n = write(fd, buf, len);
+                if (n < 0) {
+                        if (errno == EINTR) continue;
+                        return -1;
+                }
+                buf += n;
+                len -= (size_t)n;
+        }
+        return 0;
+}
+
+/**
+ * @brief Remembers that the value at `old_off` now lives at `new_off`.
+ */
+static int remember_value(struct compact_pass *p, uint64_t old_off, uint64_t new_off) {
+        if (p->kept == p->kept_cap) {
+                size_t cap = p->kept_cap ? p->kept_cap * 2 : 256;
+                uint64_t *o = realloc(p->old_offs, cap * sizeof(*o));
+                if (o == NULL) return -1;
+                p->old_offs = o;
+                uint64_t *n = realloc(p->new_offs, cap * sizeof(*n));
+                if (n == NULL) return -1;
+                p->new_offs = n;
+                p->kept_cap = cap;
+        }
+        p->old_offs[p->kept] = old_off;
+        p->new_offs[p->kept] = new_off;
+        p->kept++;
+        return 0;
+}
+
+/**
+ * @brief Decides whether the complete line in `p->line` survives and writes it if so.
+ * @return 0 on success, -1 on failure.
+ */
+static int process_line(struct compact_pass *p) {
+        const char *line = p->line;
+        size_t len = p->line_len;
+        size_t put_len = strlen(AESDKV_PUT);
+        if (keyed_mode && len > put_len && memcmp(line, AESDKV_PUT, put_len) == 0) {
+                const char *key = line + put_len;
+                const char *space = memchr(key, ' ', len - put_len);
+                if (space != NULL && space != key) {
+                        size_t value_start = (size_t)(space + 1 - line);
+                        uint64_t value_off = p->line_off + value_start;
+                        uint64_t latest;
+                        uint32_t latest_len;
+                        bool indexed = aesdkv_get(key, space - key, &latest, &latest_len);
+                        // Only a value the index holds a newer one for is superseded. A `PUT` the
+                        // index never saw (longer than the receive buffer, inside a frame, or with
+                        // a key over `AESDKV_KEY_MAX`) is kept as it is.
+                        if (indexed && latest > value_off) {
+                                return 0;
+                        }
+                        if (indexed && latest == value_off &&
+                            remember_value(p, value_off, p->out_len + value_start) != 0) {
+                                return -1;
+                        }
+                        if (write_all(p->out_fd, line, len) != 0) return -1;
+                        p->out_len += len;
+                        // A kept `PUT` ends any run of identical lines.
+                        free(p->prev);
+                        p->prev = NULL;
+                        return 0;
+                }
+        }
+        // Collapse runs of identical lines into their first occurrence.
+        if (p->prev != NULL && p->prev_len == len && memcmp(p->prev, line, len) == 0) {
+                return 0;
+        }
+        char *copy = realloc(p->prev, len ? len : 1);
+        if (copy == NULL) return -1;
+        memcpy(copy, line, len);
+        p->prev = copy;
+        p->prev_len = len;
+        if (write_all(p->out_fd, line, len) != 0) return -1;
+        p->out_len += len;
+        return 0;
+}
+
+/**
+ * @brief Appends bytes to the line being assembled.
+ */
+static int line_append(struct compact_pass *p, const char *buf, size_t len) {
+        if (p->line_len + len > p->line_cap) {
+                size_t cap = p->line_cap ? p->line_cap : 4096;
+                while (cap < p->line_len + len) cap *= 2;
+                char *l = realloc(p->line, cap);
+                if (l == NULL) return -1;
+                p->line = l;
+                p->line_cap = cap;
+        }
+        memcpy(p->line + p->line_len, buf, len);
+        p->line_len += len;
+        return 0;
+}
+
+/**
+ * @brief Sleeps long enough to keep the read rate at or below `rate_bytes` per second.
+ * @param `start` When the pass started.
+ * @param `done` Bytes read since `start`.
+ */
+static void throttle(const struct timespec *start, uint64_t done) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double elapsed = (double)(now.tv_sec - start->tv_sec) + (double)(now.tv_nsec - start->tv_nsec) / 1e9;
+        double due = (double)done / (double)rate_bytes;
+        if (due > elapsed) {
+                double wait = due - elapsed;
+                struct timespec ts = { .tv_sec = (time_t)wait, .tv_nsec = (long)((wait - (double)(time_t)wait) * 1e9) };
+                nanosleep(&ts, NULL);
+        }
+}
+
+/**
+ * @brief Runs one compaction pass over the first `boundary` bytes of the data file.
+ * @param `boundary` Size of the data file when the pass started.
+ * @return 0 on success (the new file was swapped in), -1 if the pass was abandoned.
+ */
+static int compact_once(uint64_t boundary) {
+        struct compact_pass p = { .out_fd = -1 };
+        int rc = -1;
+        int in_fd = open(data_path, O_RDONLY | O_CLOEXEC);
+        char *buf = malloc(COMPACT_CHUNK_LEN);
+        p.out_fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (in_fd == -1 || p.out_fd == -1 || buf == NULL) {
+                goto out;
+        }
+
+        // --- Rewrite the old part without holding any lock ---
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        uint64_t pos = 0;
+        while (pos < boundary) {
+                if (stopping()) goto out;
+                size_t want = COMPACT_CHUNK_LEN;
+                if (boundary - pos < want) want = (size_t)(boundary - pos);
+                ssize_t n = pread(in_fd, buf, want, (off_t)pos);
+                if (n <= 0) goto out;
+                // Loop invariant: `buf[0..i)` has been added to lines; `p.line` holds an incomplete line.
+                size_t i = 0;
+                while (i < (size_t)n) {
+                        const char *nl = memchr(buf + i, '\n', (size_t)n - i);
+                        size_t take = nl ? (size_t)(nl - (buf + i)) + 1 : (size_t)n - i;
+                        if (p.line_len == 0) p.line_off = pos + i;
+                        if (line_append(&p, buf + i, take) != 0) goto out;
+                        i += take;
+                        if (nl != NULL) {
+                                if (process_line(&p) != 0) goto out;
+                                p.line_len = 0;
+                        }
+                }
+                pos += (uint64_t)n;
+                throttle(&start, pos);
+        }
+        // An unterminated packet at the boundary is copied as it is.
+        if (p.line_len > 0) {
+                if (write_all(p.out_fd, p.line, p.line_len) != 0) goto out;
+                p.out_len += p.line_len;
+        }
+        if (fsync(p.out_fd) != 0) goto out;
+
+        // --- Swap: copy what was appended meanwhile and rename, under the store lock ---
+        pthread_mutex_lock(lock);
+        struct stat st;
+        if (fstat(in_fd, &st) != 0) {
+                pthread_mutex_unlock(lock);
+                goto out;
+        }
+        off_t tail = (off_t)boundary;
+        while ((uint64_t)tail < (uint64_t)st.st_size) {
+                ssize_t n = sendfile(p.out_fd, in_fd, &tail, (size_t)((uint64_t)st.st_size - (uint64_t)tail));
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) {
+                        pthread_mutex_unlock(lock);
+                        goto out;
+                }
+        }
+        uint64_t new_len = p.out_len + ((uint64_t)st.st_size - boundary);
+        if (fsync(p.out_fd) != 0 || rename(tmp_path, data_path) != 0) {
+                pthread_mutex_unlock(lock);
+                goto out;
+        }
+        aesdkv_relocate(boundary, boundary - p.out_len, p.old_offs, p.new_offs, p.kept);
+        aesdshm_publisher_replace(new_len);
+        atomic_fetch_add(&generation, 1);
+        pthread_mutex_unlock(lock);
+
+        syslog(LOG_INFO, "Compaction reclaimed %llu bytes (%llu -> %llu)",
+               (unsigned long long)(boundary - p.out_len), (unsigned long long)st.st_size, (unsigned long long)new_len);
+        rc = 0;
+out:
+        if (rc != 0) {
+                unlink(tmp_path);
+        }
+        if (p.out_fd != -1) close(p.out_fd);
+        if (in_fd != -1) close(in_fd);
+        free(buf);
+        free(p.line);
+        free(p.prev);
+        free(p.old_offs);
+        free(p.new_offs);
+        return rc;
+}
+
+/**
+ * @brief Compactor thread: compacts the data file every `COMPACT_INTERVAL_S` seconds once it has grown enough.
+ */
+static void *compact_main(void *arg) {
+        (void)arg;
+        sigset_t all;
+        sigfillset(&all);
+        pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+        uint64_t compacted_len = 0;
+        pthread_mutex_lock(&stop_lock);
+        while (!compact_stop) {
+                struct timespec deadline;
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_sec += COMPACT_INTERVAL_S;
+                pthread_cond_timedwait(&stop_cond, &stop_lock, &deadline);
+                if (compact_stop) {
+                        break;
+                }
+                pthread_mutex_unlock(&stop_lock);
+
+                struct stat st;
+                pthread_mutex_lock(lock);
+                int have = stat(data_path, &st);
+                pthread_mutex_unlock(lock);
+                if (have == 0 && (uint64_t)st.st_size >= compacted_len + COMPACT_MIN_GROWTH &&
+                    compact_once((uint64_t)st.st_size) == 0) {
+                        if (stat(data_path, &st) == 0) {
+                                compacted_len = (uint64_t)st.st_size;
+                        }
+                }
+                pthread_mutex_lock(&stop_lock);
+        }
+        pthread_mutex_unlock(&stop_lock);
+        return NULL;
+}
+
+/**
+ * @brief Starts the compactor thread.
+ * @param `path` The data file.
+ * @param `store_lock` The lock serialising appends to the data file.
+ * @param `rate_kib` Read budget of the compactor in KiB per second.
+ * @param `keyed` Whether superseded `PUT` packets may be dropped.
+ * @return 0 on success, -1 on failure.
+ */
+int aesdcompact_start(const char *path, pthread_mutex_t *store_lock, long rate_kib, bool keyed) {
+        if (rate_kib <= 0) {
+                syslog(LOG_ERR, "The compaction rate must be positive");
+                return -1;
+        }
+        snprintf(data_path, sizeof(data_path), "%s", path);
+        snprintf(tmp_path, sizeof(tmp_path), "%s.compact", path);
+        lock = store_lock;
+        rate_bytes = rate_kib * 1024;
+        keyed_mode = keyed;
+        if (pthread_create(&compact_thread, NULL, compact_main, NULL) != 0) {
+                return -1;
+        }
+        compact_running = true;
+        return 0;
+}
+
+/**
+ * @brief Returns how many times a compacted data file has been swapped in.
+ * @details Connections compare it with the value seen when they opened the data file and
+ * re-open the file when it changed.
+ */
+unsigned aesdcompact_generation(void) {
+        return atomic_load(&generation);
+}
+
+/**
+ * @brief Stops the compactor, abandoning a pass in progress, and waits for it to exit.
+ */
+void aesdcompact_stop(void) {
+        if (!compact_running) {
+                return;
+        }
+        pthread_mutex_lock(&stop_lock);
+        compact_stop = true;
+        pthread_cond_signal(&stop_cond);
+        pthread_mutex_unlock(&stop_lock);
+        pthread_join(compact_thread, NULL);
+        compact_running = false;
+}
@@ -0,0 +1,27 @@
+/**
+ *  @file aesdcompact.h
+ *  @brief Background compaction of the aesdsocket data file.
+ *
+ *  With `-c <KiB/s>` a compactor thread periodically rewrites the committed part of
+ *  the data file into `<data_file>.compact`, dropping
+ *  - `PUT` packets whose key has a newer value in the key index (keyed mode, `-k`);
+ *    a `PUT` the index never saw is kept, and
+ *  - lines identical to the line kept right before them (runs collapse to one line).
+ *
+ *  The rewrite reads at most the configured number of KiB per second and runs without
+ *  any lock, so appends and replays continue. Only the final step, copying the bytes
+ *  appended in the meantime and renaming the new file over the data file, happens
+ *  under the store lock. Connections notice the swap through
+ *  `aesdcompact_generation()` and re-open the data file.
+ */
+#ifndef AESDCOMPACT_H
+#define AESDCOMPACT_H
+
+#include <pthread.h>     /**< @brief Provides `pthread_mutex_t`. */
+#include <stdbool.h>     /**< @brief Provides a boolean type and values (`true`, `false`). */
+
+int aesdcompact_start(const char *data_path, pthread_mutex_t *store_lock, long rate_kib, bool keyed);
+unsigned aesdcompact_generation(void);
+void aesdcompact_stop(void);
+
+#endif /* AESDCOMPACT_H */
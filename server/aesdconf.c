@@ -0,0 +1,408 @@
+/**
+ *  @file aesdconf.c
+ *  @brief Config file, `SIGHUP` reload and control socket for the runtime tunables (see aesdconf.h).
+ */
+#include "aesdconf.h"
+#include "aesdmem.h"
+
+#include <ctype.h>       /**< @brief Provides `isspace()`. */
+#include <errno.h>       /**< @brief Provides definitions for error numbers (e.g., `EINTR`). */
+#include <pthread.h>     /**< @brief Provides the control thread and the lock serialising changes. */
+#include <signal.h>      /**< @brief Provides `pthread_sigmask()`. */
+#include <stdatomic.h>   /**< @brief Provides the atomic tunables read by connection threads. */
+#include <stdbool.h>     /**< @brief Provides a boolean type and values (`true`, `false`). */
+#include <stdio.h>       /**< @brief Provides `fopen()`, `fgets()`, `snprintf()`. */
+#include <stdlib.h>      /**< @brief Provides `strtol()`. */
+#include <string.h>      /**< @brief Provides `strcmp()`, `strchr()`, `strlen()`. */
+#include <sys/socket.h>  /**< @brief Provides `socket()`, `bind()`, `listen()`, `accept()`. */
+#include <sys/stat.h>    /**< @brief Provides `chmod()`. */
+#include <sys/time.h>    /**< @brief Provides `struct timeval` for the control client timeout. */
+#include <sys/un.h>      /**< @brief Provides `struct sockaddr_un`. */
+#include <syslog.h>      /**< @brief Provides `syslog()`, `setlogmask()`. */
+#include <unistd.h>      /**< @brief Provides `read()`, `write()`, `close()`, `unlink()`. */
+
+#define CTL_LINE_MAX 256        /**< @brief Longest control command or config file line. */
+#define CTL_TIMEOUT_S 5         /**< @brief Seconds a control client may stay silent before it is dropped. */
+
+/**
+ * @struct conf
+ * @brief A complete set of tunables, staged before it is applied.
+ */
+struct conf {
+        int recv_buffer;        /**< Bytes of a connection's receive buffer. */
+        int replay_buffer;      /**< Bytes of a replay's send buffer. */
+        int backlog;            /**< Pending connection queue of the listening socket. */
+        int durability;         /**< `CONF_DURABILITY_*` of commits. */
+        int log_level;          /**< Highest `syslog()` priority that is logged. */
+        int drain_ms;           /**< Milliseconds a shutdown waits for connections to finish. */
+        int memory_budget;      /**< MiB of the memory budget, 0 for none (kept by aesdmem.c). */
+};
+
+static const char *durability_names[] = { "fsync", "fdatasync", "none" };
+static const char *level_names[] = { "emerg", "alert", "crit", "err", "warning", "notice", "info", "debug" };
+
+// --- Active Tunables (read without a lock, changed under `conf_lock`) ---
+static atomic_int recv_buffer = 4096;                           /**< See `struct conf`. */
+static atomic_int replay_buffer = 4096;                         /**< See `struct conf`. */
+static atomic_int backlog = 5;                                  /**< See `struct conf`. */
+static atomic_int durability = CONF_DURABILITY_FSYNC;           /**< See `struct conf`. */
+static atomic_int log_level = LOG_DEBUG;                        /**< See `struct conf`. */
+static atomic_int drain_ms = 5000;                              /**< See `struct conf`. */
+static pthread_mutex_t conf_lock = PTHREAD_MUTEX_INITIALIZER;   /**< Serialises reloads and `SET` commands. */
+
+// --- Control Socket State ---
+static char conf_path[256];             /**< The config file. */
+static char ctl_path[108];              /**< The control socket, `<conf_path>.sock`. */
+static int listen_sock = -1;            /**< The server's listening socket, re-listened on backlog changes. */
+static int ctl_fd = -1;                 /**< The listening control socket. */
+static pthread_t ctl_thread;            /**< Serves control clients one at a time. */
+static bool ctl_running = false;        /**< Whether `ctl_thread` was started. */
+
+/**
+ * @brief Copies the active tunables.
+ */
+static void current(struct conf *c) {
+        c->recv_buffer = atomic_load(&recv_buffer);
+        c->replay_buffer = atomic_load(&replay_buffer);
+        c->backlog = atomic_load(&backlog);
+        c->durability = atomic_load(&durability);
+        c->log_level = atomic_load(&log_level);
+        c->drain_ms = atomic_load(&drain_ms);
+        c->memory_budget = (int)(aesdmem_budget() / (1024 * 1024));
+}
+
+/**
+ * @brief Looks a name up in a table, also accepting its index as a number.
+ * @return The index, or -1 if `value` names no entry.
+ */
+static int lookup(const char *value, const char **names, int count) {
+        for (int i = 0; i < count; i++) {
+                if (strcmp(value, names[i]) == 0) {
+                        return i;
+                }
+        }
+        char *end;
+        long n = strtol(value, &end, 10);
+        return end != value && *end == '\0' && n >= 0 && n < count ? (int)n : -1;
+}
+
+/**
+ * @brief Changes one tunable of a staged configuration.
+ * @param `c` The staged configuration.
+ * @param `key` The tunable.
+ * @param `value` Its new value.
+ * @return NULL on success, otherwise the reason the setting was rejected.
+ */
+static const char *stage(struct conf *c, const char *key, const char *value) {
+        char *end;
+        long n = strtol(value, &end, 10);
+        bool number = end != value && *end == '\0';
+        if (strcmp(key, "recv_buffer") == 0 || strcmp(key, "replay_buffer") == 0) {
+                if (!number || n < CONF_MIN_BUFFER || n > CONF_MAX_BUFFER) {
+                        return "buffer size out of range";
+                }
+                if (strcmp(key, "recv_buffer") == 0) {
+                        c->recv_buffer = (int)n;
+                } else {
+                        c->replay_buffer = (int)n;
+                }
+        } else if (strcmp(key, "backlog") == 0) {
+                if (!number || n < 1 || n > 65535) {
+                        return "backlog out of range";
+                }
+                c->backlog = (int)n;
+        } else if (strcmp(key, "durability") == 0) {
+                int mode = lookup(value, durability_names, 3);
+                if (mode < 0) {
+                        return "durability must be fsync, fdatasync or none";
+                }
+                c->durability = mode;
+        } else if (strcmp(key, "log_level") == 0) {
+                int level = lookup(value, level_names, 8);
+                if (level < 0) {
+                        return "unknown log level";
+                }
+                c->log_level = level;
+        } else if (strcmp(key, "drain_ms") == 0) {
+                if (!number || n < 0 || n > 3600000) {
+                        return "drain time out of range";
+                }
+                c->drain_ms = (int)n;
+        } else if (strcmp(key, "memory_budget") == 0) {
+                if (!number || n < 0 || n > 1048576) {
+                        return "memory budget out of range";
+                }
+                c->memory_budget = (int)n;
+        } else {
+                return "unknown tunable";
+        }
+        return NULL;
+}
+
+/**
+ * @brief Makes a staged configuration the active one.
+ * @pre The caller holds `conf_lock`.
+ * @details The backlog and the log level act on the process right away; the other
+ * tunables are read by connections, replays and commits when they start.
+ */
+static void apply(const struct conf *c) {
+        if (c->backlog != atomic_load(&backlog) && listen_sock != -1) {
+                // `listen()` on a listening socket only changes its queue length.
+                if (listen(listen_sock, c->backlog) != 0) {
+                        syslog(LOG_WARNING, "Cannot change the backlog to %d: %m", c->backlog);
+                }
+        }
+        setlogmask(LOG_UPTO(c->log_level));
+        atomic_store(&recv_buffer, c->recv_buffer);
+        atomic_store(&replay_buffer, c->replay_buffer);
+        atomic_store(&backlog, c->backlog);
+        atomic_store(&durability, c->durability);
+        atomic_store(&log_level, c->log_level);
+        atomic_store(&drain_ms, c->drain_ms);
+        if ((uint64_t)c->memory_budget * 1024 * 1024 != aesdmem_budget()) {
+                aesdmem_set_budget((uint64_t)c->memory_budget * 1024 * 1024);
+        }
+        syslog(LOG_NOTICE, "Configuration: recv_buffer=%d replay_buffer=%d backlog=%d durability=%s log_level=%s drain_ms=%d "
+               "memory_budget=%d", c->recv_buffer, c->replay_buffer, c->backlog, durability_names[c->durability],
+               level_names[c->log_level], c->drain_ms, c->memory_budget);
+}
+
+/**
+ * @brief Splits a `key value` or `key = value` line in place.
+ * @param `line` The line; comments and the line terminator are cut off.
+ * @param `key` Receives the key, or NULL for an empty line.
+ * @param `value` Receives the value.
+ * @return 0 on success, -1 if the line has a key but no value.
+ */
+static int split(char *line, char **key, char **value) {
+        char *hash = strchr(line, '#');
+        if (hash != NULL) *hash = '\0';
+        char *p = line;
+        while (isspace((unsigned char)*p)) p++;
+        *key = NULL;
+        if (*p == '\0') {
+                return 0;
+        }
+        *key = p;
+        while (*p != '\0' && *p != '=' && !isspace((unsigned char)*p)) p++;
+        char *key_end = p;
+        while (isspace((unsigned char)*p) || *p == '=') p++;
+        *key_end = '\0';
+        *value = p;
+        char *end = p + strlen(p);
+        while (end > p && isspace((unsigned char)end[-1])) end--;
+        *end = '\0';
+        return **value == '\0' ? -1 : 0;
+}
+
+/**
+ * @brief Sets the compile-time defaults the config file starts from.
+ * @param `recv` Bytes of a receive buffer.
+ * @param `replay` Bytes of a replay buffer.
+ * @param `queue` Backlog of the listening socket.
+ * @param `drain` Milliseconds a shutdown waits for connections to finish.
+ */
+void aesdconf_defaults(int recv, int replay, int queue, int drain) {
+        atomic_store(&recv_buffer, recv);
+        atomic_store(&replay_buffer, replay);
+        atomic_store(&backlog, queue);
+        atomic_store(&drain_ms, drain);
+}
+
+/**
+ * @brief Re-reads the config file and applies it.
+ * @return 0 on success, -1 if the file cannot be read or holds an invalid setting.
+ * @details The whole file is validated before anything is applied, so a broken file
+ * leaves the active configuration as it was. Tunables the file does not mention keep
+ * their active value.
+ */
+int aesdconf_reload(void) {
+        FILE *fp = fopen(conf_path, "r");
+        if (fp == NULL) {
+                syslog(LOG_ERR, "Cannot read config file %s: %m", conf_path);
+                return -1;
+        }
+        pthread_mutex_lock(&conf_lock);
+        struct conf next;
+        current(&next);
+        char line[CTL_LINE_MAX];
+        int line_no = 0;
+        int rc = 0;
+        while (rc == 0 && fgets(line, sizeof(line), fp) != NULL) {
+                line_no++;
+                char *key, *value;
+                const char *err = split(line, &key, &value) != 0 ? "missing value" : NULL;
+                if (err == NULL && key != NULL) {
+                        err = stage(&next, key, value);
+                }
+                if (err != NULL) {
+                        syslog(LOG_ERR, "%s:%d: %s; configuration unchanged", conf_path, line_no, err);
+                        rc = -1;
+                }
+        }
+        fclose(fp);
+        if (rc == 0) {
+                apply(&next);
+        }
+        pthread_mutex_unlock(&conf_lock);
+        return rc;
+}
+
+/**
+ * @brief Runs one control command.
+ * @param `line` The command without its line terminator.
+ * @param `reply` Receives the answer.
+ * @param `len` Capacity of `reply`.
+ */
+static void control_command(char *line, char *reply, size_t len) {
+        char *key, *value;
+        if (strcmp(line, "SHOW") == 0) {
+                struct conf c;
+                current(&c);
+                snprintf(reply, len, "recv_buffer=%d\nreplay_buffer=%d\nbacklog=%d\ndurability=%s\nlog_level=%s\ndrain_ms=%d\n"
+                         "memory_budget=%d\nOK\n", c.recv_buffer, c.replay_buffer, c.backlog, durability_names[c.durability],
+                         level_names[c.log_level], c.drain_ms, c.memory_budget);
+        } else if (strcmp(line, "METRICS") == 0) {
+                aesdmem_metrics(reply, len);
+                size_t used = strlen(reply);
+                snprintf(reply + used, len - used, "OK\n");
+        } else if (strcmp(line, "RELOAD") == 0) {
+                snprintf(reply, len, aesdconf_reload() == 0 ? "OK\n" : "ERR config file rejected, see syslog\n");
+        } else if (strncmp(line, "SET ", 4) == 0 && split(line + 4, &key, &value) == 0 && key != NULL) {
+                pthread_mutex_lock(&conf_lock);
+                struct conf next;
+                current(&next);
+                const char *err = stage(&next, key, value);
+                if (err == NULL) {
+                        apply(&next);
+                }
+                pthread_mutex_unlock(&conf_lock);
+                snprintf(reply, len, err == NULL ? "OK\n" : "ERR %s\n", err);
+        } else {
+                snprintf(reply, len, "ERR expected SHOW, METRICS, SET <key> <value> or RELOAD\n");
+        }
+}
+
+/**
+ * @brief Serves control clients until `aesdconf_stop()` shuts the control socket down.
+ */
+static void *control_main(void *arg) {
+        (void)arg;
+        for (;;) {
+                int fd = accept(ctl_fd, NULL, NULL);
+                if (fd == -1) {
+                        if (errno == EINTR || errno == ECONNABORTED) continue;
+                        break;
+                }
+                struct timeval timeout = { .tv_sec = CTL_TIMEOUT_S };
+                setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+                char line[CTL_LINE_MAX];
+                size_t held = 0;
+                ssize_t n;
+                // Loop invariant: `line` holds the start of a command that has no newline yet.
+                while ((n = read(fd, line + held, sizeof(line) - 1 - held)) > 0) {
+                        held += (size_t)n;
+                        char *nl;
+                        while ((nl = memchr(line, '\n', held)) != NULL) {
+                                *nl = '\0';
+                                if (nl > line && nl[-1] == '\r') nl[-1] = '\0';
+                                char reply[1024];
+                                control_command(line, reply, sizeof(reply));
+                                if (write(fd, reply, strlen(reply)) < 0) {
+                                        break;
+                                }
+                                held -= (size_t)(nl + 1 - line);
+                                memmove(line, nl + 1, held);
+                        }
+                        if (held == sizeof(line) - 1) {
+                                break;
+                        }
+                }
+                close(fd);
+        }
+        return NULL;
+}
+
+/**
+ * @brief Loads the config file and opens the control socket.
+ * @param `path` The config file; the control socket is `<path>.sock`.
+ * @param `listen_fd` The server's listening socket, whose backlog the `backlog` tunable sets.
+ * @return 0 on success, -1 on failure.
+ */
+int aesdconf_start(const char *path, int listen_fd) {
+        snprintf(conf_path, sizeof(conf_path), "%s", path);
+        if ((size_t)snprintf(ctl_path, sizeof(ctl_path), "%s.sock", path) >= sizeof(ctl_path)) {
+                return -1;
+        }
+        listen_sock = listen_fd;
+        if (aesdconf_reload() != 0) {
+                return -1;
+        }
+        ctl_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (ctl_fd == -1) {
+                return -1;
+        }
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        memcpy(addr.sun_path, ctl_path, strlen(ctl_path) + 1);
+        unlink(ctl_path);
+        if (bind(ctl_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || chmod(ctl_path, 0600) != 0 ||
+            listen(ctl_fd, 4) != 0) {
+                close(ctl_fd);
+                ctl_fd = -1;
+                return -1;
+        }
+        // Signals are for the main thread.
+        sigset_t all_signals, old_signals;
+        sigfillset(&all_signals);
+        pthread_sigmask(SIG_BLOCK, &all_signals, &old_signals);
+        int rc = pthread_create(&ctl_thread, NULL, control_main, NULL);
+        pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+        if (rc != 0) {
+                close(ctl_fd);
+                ctl_fd = -1;
+                unlink(ctl_path);
+                return -1;
+        }
+        ctl_running = true;
+        return 0;
+}
+
+/** @brief Bytes of a connection's receive buffer. */
+int aesdconf_recv_buffer(void) {
+        return atomic_load(&recv_buffer);
+}
+
+/** @brief Bytes of a replay's send buffer. */
+int aesdconf_replay_buffer(void) {
+        return atomic_load(&replay_buffer);
+}
+
+/** @brief Pending connection queue of the listening socket. */
+int aesdconf_backlog(void) {
+        return atomic_load(&backlog);
+}
+
+/** @brief `CONF_DURABILITY_*` of commits of the shared data file. */
+int aesdconf_durability(void) {
+        return atomic_load(&durability);
+}
+
+/** @brief Milliseconds a shutdown waits for connections to finish their replays. */
+int aesdconf_drain_ms(void) {
+        return atomic_load(&drain_ms);
+}
+
+/**
+ * @brief Stops the control thread and removes the control socket.
+ */
+void aesdconf_stop(void) {
+        if (!ctl_running) {
+                return;
+        }
+        shutdown(ctl_fd, SHUT_RDWR);
+        pthread_join(ctl_thread, NULL);
+        close(ctl_fd);
+        ctl_fd = -1;
+        unlink(ctl_path);
+        ctl_running = false;
+}
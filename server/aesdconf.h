@@ -0,0 +1,48 @@
+/**
+ *  @file aesdconf.h
+ *  @brief Runtime tunables, loaded from a config file and changed through a control socket.
+ *
+ *  With `-R <path>` the tunables below are read from `<path>` at start and again on
+ *  `SIGHUP`, and a Unix control socket `<path>.sock` (mode 0600) accepts one command per line:
+ *  - `SHOW` answers the active configuration, one `key=value` line each, then `OK`;
+ *  - `METRICS` answers the current memory usage the same way (see aesdmem.h);
+ *  - `SET <key> <value>` changes one tunable and answers `OK` or `ERR <reason>`;
+ *  - `RELOAD` re-reads the config file.
+ *
+ *  The config file holds `key = value` lines; `#` starts a comment. Tunables and when a
+ *  new value takes effect:
+ *  - `recv_buffer`, `replay_buffer`: bytes of a connection's receive buffer and of a
+ *    replay's send buffer, `CONF_MIN_BUFFER` to `CONF_MAX_BUFFER`; for connections and
+ *    replays that start afterwards;
+ *  - `backlog`: pending connection queue of the listening socket; right away;
+ *  - `durability`: `fsync`, `fdatasync` or `none` (committed means handed to the page
+ *    cache), for commits of the shared data file; from the next commit on;
+ *  - `log_level`: `emerg` to `debug` (or 0-7); right away;
+ *  - `drain_ms`: how long a shutdown waits for connections to finish their replays
+ *    before it aborts them; for the next shutdown;
+ *  - `memory_budget`: MiB that buffers, caches and indexes are held under, 0 for no
+ *    limit (the default unless `-M` is given); right away.
+ *
+ *  No connection is dropped by a change. Without `-R` the compile-time defaults apply.
+ */
+#ifndef AESDCONF_H
+#define AESDCONF_H
+
+#define CONF_MIN_BUFFER 256             /**< @brief Smallest receive or replay buffer. */
+#define CONF_MAX_BUFFER 65536           /**< @brief Largest receive or replay buffer; they may live on a thread's stack. */
+
+#define CONF_DURABILITY_FSYNC 0         /**< @brief Commits `fsync()` the data file. */
+#define CONF_DURABILITY_FDATASYNC 1     /**< @brief Commits `fdatasync()` the data file. */
+#define CONF_DURABILITY_NONE 2          /**< @brief Commits only flush the data file to the page cache. */
+
+void aesdconf_defaults(int recv_buffer, int replay_buffer, int backlog, int drain_ms);
+int aesdconf_start(const char *path, int listen_fd);
+int aesdconf_reload(void);
+int aesdconf_recv_buffer(void);
+int aesdconf_replay_buffer(void);
+int aesdconf_backlog(void);
+int aesdconf_durability(void);
+int aesdconf_drain_ms(void);
+void aesdconf_stop(void);
+
+#endif /* AESDCONF_H */
@@ -0,0 +1,241 @@
+/**
+ *  @file aesdcpu.c
+ *  @brief CPU affinity and NUMA placement of server threads (see aesdcpu.h).
+ */
+#define _GNU_SOURCE
+#include "aesdcpu.h"
+
+#include <pthread.h>     /**< @brief Provides `pthread_setaffinity_np()`. */
+#include <sched.h>       /**< @brief Provides `cpu_set_t` and its macros. */
+#include <stdatomic.h>   /**< @brief Provides the atomic statistics updated by connection threads. */
+#include <stdbool.h>     /**< @brief Provides a boolean type and values (`true`, `false`). */
+#include <stdint.h>      /**< @brief Provides fixed width integer types (e.g., `uint64_t`). */
+#include <stdio.h>       /**< @brief Provides `fopen()`, `fscanf()`, `sscanf()`. */
+#include <stdlib.h>      /**< @brief Provides `strtol()`. */
+#include <string.h>      /**< @brief Provides `strcmp()`. */
+#include <sys/socket.h>  /**< @brief Provides `getsockopt()`, `SO_INCOMING_CPU`. */
+#include <syslog.h>      /**< @brief Provides `syslog()`. */
+
+#define ROLES 3                 /**< @brief Number of thread roles (`AESDCPU_ACCEPT` to `AESDCPU_STORAGE`). */
+
+/**
+ * @struct numa_counters
+ * @brief The NUMA allocation counters of `/proc/vmstat` (in pages).
+ * @details `numa_miss` counts pages allocated on a node other than the preferred one,
+ * `numa_foreign` the same from the preferred node's view, and `numa_other` pages a
+ * process allocated on a node other than the one it ran on.
+ */
+struct numa_counters {
+        uint64_t hit;           /**< `numa_hit`: allocated on the intended node. */
+        uint64_t miss;          /**< `numa_miss`: allocated on another node than intended. */
+        uint64_t foreign;       /**< `numa_foreign`: intended for this node, allocated elsewhere. */
+        uint64_t other;         /**< `numa_other`: allocated here by a thread running on another node. */
+};
+
+// --- Placement State (written by `aesdcpu_init()` only) ---
+static bool enabled = false;                    /**< Whether `-a` was given. */
+static cpu_set_t role_cpus[ROLES];              /**< CPUs of each role; an empty set leaves the role unpinned. */
+static int node_count = 1;                      /**< NUMA nodes of the host. */
+static struct numa_counters numa_start;         /**< The counters when the server started. */
+
+// --- Statistics (reported on close) ---
+static atomic_ulong stat_steered = 0;           /**< Connections moved to the CPU that received their packets. */
+static atomic_ulong stat_fallback = 0;          /**< Connections whose CPU was unknown or not a worker CPU. */
+
+/**
+ * @brief Parses one role of the specification, a CPU list like `2-7,10`.
+ * @param `list` The list; parsing stops at the end of the string or at a `/`.
+ * @param `set` Receives the CPUs.
+ * @param `rest` Receives a pointer to the character that stopped the parse.
+ * @return 0 on success, -1 on a malformed list.
+ */
+static int parse_cpu_list(const char *list, cpu_set_t *set, const char **rest) {
+        CPU_ZERO(set);
+        const char *p = list;
+        // Loop invariant: every range before `p` has been added to `set`.
+        while (*p != '\0' && *p != '/') {
+                char *end;
+                long first = strtol(p, &end, 10);
+                long last = first;
+                if (end == p || first < 0 || first >= CPU_SETSIZE) {
+                        return -1;
+                }
+                if (*end == '-') {
+                        p = end + 1;
+                        last = strtol(p, &end, 10);
+                        if (end == p || last < first || last >= CPU_SETSIZE) {
+                                return -1;
+                        }
+                }
+                for (long cpu = first; cpu <= last; cpu++) {
+                        CPU_SET((int)cpu, set);
+                }
+                p = end;
+                if (*p == ',') {
+                        p++;
+                } else if (*p != '\0' && *p != '/') {
+                        return -1;
+                }
+        }
+        *rest = p;
+        return 0;
+}
+
+/**
+ * @brief Counts the NUMA nodes from `/sys/devices/system/node/online` (e.g. `0-1`).
+ * @return The number of nodes, 1 if the host does not report any.
+ */
+static int read_node_count(void) {
+        FILE *fp = fopen("/sys/devices/system/node/online", "r");
+        if (fp == NULL) {
+                return 1;
+        }
+        char line[128];
+        int count = 1;
+        cpu_set_t nodes;
+        const char *rest;
+        if (fgets(line, sizeof(line), fp) != NULL) {
+                line[strcspn(line, "\n")] = '\0';
+                if (parse_cpu_list(line, &nodes, &rest) == 0 && CPU_COUNT(&nodes) > 0) {
+                        count = CPU_COUNT(&nodes);
+                }
+        }
+        fclose(fp);
+        return count;
+}
+
+/**
+ * @brief Reads the NUMA allocation counters of the host.
+ * @param `counters` Receives the counters; they stay zero on hosts without NUMA statistics.
+ */
+static void read_numa_counters(struct numa_counters *counters) {
+        memset(counters, 0, sizeof(*counters));
+        FILE *fp = fopen("/proc/vmstat", "r");
+        if (fp == NULL) {
+                return;
+        }
+        char name[64];
+        unsigned long long value;
+        while (fscanf(fp, "%63s %llu", name, &value) == 2) {
+                if (strcmp(name, "numa_hit") == 0) counters->hit = value;
+                else if (strcmp(name, "numa_miss") == 0) counters->miss = value;
+                else if (strcmp(name, "numa_foreign") == 0) counters->foreign = value;
+                else if (strcmp(name, "numa_other") == 0) counters->other = value;
+        }
+        fclose(fp);
+}
+
+/**
+ * @brief Pins the calling thread to a set of CPUs.
+ * @param `set` The CPUs; an empty set leaves the thread where it is.
+ */
+static void pin(const cpu_set_t *set) {
+        if (CPU_COUNT(set) == 0) {
+                return;
+        }
+        int rc = pthread_setaffinity_np(pthread_self(), sizeof(*set), set);
+        if (rc != 0) {
+                syslog(LOG_WARNING, "Cannot set CPU affinity: %s", strerror(rc));
+        }
+}
+
+/**
+ * @brief Parses the `-a` specification and records the NUMA counters at start.
+ * @param `spec` The specification, `<accept>/<workers>/<storage>`.
+ * @return 0 on success, -1 on a malformed specification.
+ */
+int aesdcpu_init(const char *spec) {
+        const char *p = spec;
+        for (int role = 0; role < ROLES; role++) {
+                if (parse_cpu_list(p, &role_cpus[role], &p) != 0) {
+                        return -1;
+                }
+                if (*p == '/') {
+                        p++;
+                } else if (role < ROLES - 1) {
+                        // Omitted trailing roles stay unpinned.
+                        for (int rest = role + 1; rest < ROLES; rest++) {
+                                CPU_ZERO(&role_cpus[rest]);
+                        }
+                        break;
+                }
+        }
+        if (*p != '\0') {
+                return -1;
+        }
+        node_count = read_node_count();
+        read_numa_counters(&numa_start);
+        enabled = true;
+        return 0;
+}
+
+/**
+ * @brief Pins the calling thread to the CPUs of a role.
+ * @param `role` `AESDCPU_ACCEPT`, `AESDCPU_WORKER` or `AESDCPU_STORAGE`.
+ * @details Threads the caller creates afterwards inherit the affinity.
+ */
+void aesdcpu_enter(int role) {
+        if (enabled) {
+                pin(&role_cpus[role]);
+        }
+}
+
+/**
+ * @brief Moves the calling connection thread to the CPU that received its packets.
+ * @param `client_fd` The connected client socket.
+ * @details `SO_INCOMING_CPU` names the CPU whose receive queue last handled the socket.
+ * Before the first packet arrives it is the CPU that handled the handshake, which is
+ * the same receive queue for as long as the flow hashes to it.
+ */
+void aesdcpu_steer(int client_fd) {
+        if (!enabled) {
+                return;
+        }
+        int cpu = -1;
+        socklen_t len = sizeof(cpu);
+        const cpu_set_t *workers = &role_cpus[AESDCPU_WORKER];
+        if (getsockopt(client_fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == 0 && cpu >= 0 && cpu < CPU_SETSIZE &&
+            (CPU_COUNT(workers) == 0 || CPU_ISSET(cpu, workers))) {
+                cpu_set_t own;
+                CPU_ZERO(&own);
+                CPU_SET(cpu, &own);
+                pin(&own);
+                atomic_fetch_add(&stat_steered, 1);
+                return;
+        }
+        pin(workers);
+        atomic_fetch_add(&stat_fallback, 1);
+}
+
+/**
+ * @brief The number of NUMA nodes to place buffers on.
+ * @return The nodes of the host with `-a`, otherwise 1.
+ */
+int aesdcpu_node_count(void) {
+        return enabled ? node_count : 1;
+}
+
+/**
+ * @brief Reports how connections were steered and the cross-node allocations since start.
+ * @details The counters are host-wide, so other processes contribute to them too; they
+ * are reported next to the values at start so a run with and without `-a` can be compared.
+ */
+void aesdcpu_close(void) {
+        if (!enabled) {
+                return;
+        }
+        struct numa_counters now;
+        read_numa_counters(&now);
+        uint64_t hit = now.hit - numa_start.hit;
+        uint64_t miss = now.miss - numa_start.miss;
+        syslog(LOG_INFO, "CPU placement: %lu connections steered to their receiving CPU, %lu to the worker CPUs; "
+               "%d NUMA nodes, %llu pages allocated node-locally and %llu cross-node (%.2f%%), "
+               "%llu foreign, %llu by threads of another node (at start: %llu miss, %llu other)",
+               (unsigned long)atomic_load(&stat_steered), (unsigned long)atomic_load(&stat_fallback), node_count,
+               (unsigned long long)hit, (unsigned long long)miss,
+               hit + miss ? 100.0 * (double)miss / (double)(hit + miss) : 0.0,
+               (unsigned long long)(now.foreign - numa_start.foreign),
+               (unsigned long long)(now.other - numa_start.other),
+               (unsigned long long)numa_start.miss, (unsigned long long)numa_start.other);
+        enabled = false;
+}
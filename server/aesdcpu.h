@@ -0,0 +1,32 @@
+/**
+ *  @file aesdcpu.h
+ *  @brief CPU affinity and NUMA placement of server threads.
+ *
+ *  With `-a <accept>/<workers>/<storage>` each part is a CPU list (e.g. `0/2-7,10/1`; an
+ *  empty part leaves that role unpinned):
+ *  - the main thread, which accepts connections, runs on the `accept` CPUs;
+ *  - a connection thread moves to the CPU that received its connection's packets
+ *    (`SO_INCOMING_CPU`), so it runs where the NIC interrupts and the socket buffers
+ *    are; if that CPU is not one of the `workers` CPUs, it runs on the `workers` CPUs;
+ *  - the background threads of the store (replication, compaction, cold blocks, cursor
+ *    checkpoints) run on the `storage` CPUs. They inherit the affinity of the main thread,
+ *    which holds the storage affinity while it starts them.
+ *
+ *  Pinned threads allocate node-locally by first touch, and the buffer arena keeps one
+ *  region per NUMA node (see aesdarena.h). The counters of cross-node allocations in
+ *  `/proc/vmstat` are reported for the lifetime of the server on close.
+ */
+#ifndef AESDCPU_H
+#define AESDCPU_H
+
+#define AESDCPU_ACCEPT 0        /**< @brief Role of the main thread. */
+#define AESDCPU_WORKER 1        /**< @brief Role of connection threads. */
+#define AESDCPU_STORAGE 2       /**< @brief Role of the background threads of the store. */
+
+int aesdcpu_init(const char *spec);
+void aesdcpu_enter(int role);
+void aesdcpu_steer(int client_fd);
+int aesdcpu_node_count(void);
+void aesdcpu_close(void);
+
+#endif /* AESDCPU_H */
@@ -0,0 +1,262 @@
+/**
+ *  @file aesdcursor.c
+ *  @brief Cursor table and batched checkpoint writer (see aesdcursor.h).
+ */
+#include "aesdcursor.h"
+
+#include <pthread.h>     /**< @brief Provides the table lock and the checkpoint thread. */
+#include <signal.h>      /**< @brief Provides `pthread_sigmask()`. */
+#include <stdatomic.h>   /**< @brief Provides the atomic cursor offsets. */
+#include <stdbool.h>     /**< @brief Provides a boolean type and values (`true`, `false`). */
+#include <stdio.h>       /**< @brief Provides `snprintf()`, `rename()`, `fopen()`, `fscanf()`. */
+#include <stdlib.h>      /**< @brief Provides `calloc()`, `free()`. */
+#include <string.h>      /**< @brief Provides `memcmp()`, `memcpy()`. */
+#include <sys/stat.h>    /**< @brief Provides `stat()` used to clamp loaded offsets to the data file. */
+#include <syslog.h>      /**< @brief Provides `syslog()`. */
+#include <time.h>        /**< @brief Provides `clock_gettime()`. */
+#include <unistd.h>      /**< @brief Provides `fdatasync()`, `unlink()`. */
+
+#define CURSOR_BUCKETS 256              /**< @brief Number of hash buckets (a power of two). */
+
+/**
+ * @struct aesdcursor
+ * @brief One named cursor. Entries live until `aesdcursor_close()`.
+ */
+struct aesdcursor {
+        char name[AESDCURSOR_NAME_MAX + 1];     /**< The cursor name, `[A-Za-z0-9_-]+`. */
+        _Atomic uint64_t offset;                /**< End of the last replay sent completely. */
+        struct aesdcursor *hash_next;           /**< Next cursor in the same hash bucket. */
+};
+
+// --- Cursor Table ---
+static struct aesdcursor *buckets[CURSOR_BUCKETS];                      /**< Hash buckets, chained through `hash_next`. */
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;          /**< Protects `buckets`. */
+static atomic_bool dirty = false;                                       /**< Whether a cursor moved since the last checkpoint. */
+static char cursor_path[272];                                           /**< The checkpoint file. */
+static char tmp_path[280];                                              /**< The checkpoint being written. */
+
+// --- Checkpoint Thread ---
+static pthread_t flush_thread;                                          /**< Writes the checkpoint. */
+static bool flush_running = false;                                      /**< Whether `flush_thread` was started. */
+static pthread_mutex_t stop_lock = PTHREAD_MUTEX_INITIALIZER;           /**< Protects `flush_stop`. */
+static pthread_cond_t stop_cond = PTHREAD_COND_INITIALIZER;             /**< Wakes the thread up early on shutdown. */
+static bool flush_stop = false;                                         /**< Asks the thread to exit. */
+
+/**
+ * @brief FNV-1a hash of a cursor name.
+ */
+static uint32_t cursor_hash(const char *name, size_t len) {
+        uint32_t h = 2166136261u;
+        for (size_t i = 0; i < len; i++) {
+                h = (h ^ (unsigned char)name[i]) * 16777619u;
+        }
+        return h;
+}
+
+/**
+ * @brief Writes every cursor to the checkpoint file if one moved since the last checkpoint.
+ * @details The file is replaced atomically, so a crash leaves either the old or the new
+ * checkpoint behind.
+ */
+static void checkpoint(void) {
+        if (!atomic_exchange(&dirty, false)) {
+                return;
+        }
+        FILE *fp = fopen(tmp_path, "w");
+        if (fp == NULL) {
+                syslog(LOG_ERR, "Cannot write %s: %m", tmp_path);
+                atomic_store(&dirty, true);
+                return;
+        }
+        pthread_mutex_lock(&table_lock);
+        for (size_t b = 0; b < CURSOR_BUCKETS; b++) {
+                for (struct aesdcursor *c = buckets[b]; c != NULL; c = c->hash_next) {
+                        fprintf(fp, "%s %llu\n", c->name, (unsigned long long)atomic_load(&c->offset));
+                }
+        }
+        pthread_mutex_unlock(&table_lock);
+        if (fflush(fp) != 0 || fdatasync(fileno(fp)) != 0 || fclose(fp) != 0 || rename(tmp_path, cursor_path) != 0) {
+                syslog(LOG_ERR, "Cannot checkpoint cursors to %s: %m", cursor_path);
+                atomic_store(&dirty, true);
+        }
+}
+
+/**
+ * @brief Checkpoint thread: writes the cursors every `AESDCURSOR_FLUSH_MS` while they move.
+ */
+static void *flush_main(void *arg) {
+        (void)arg;
+        sigset_t all;
+        sigfillset(&all);
+        pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+        pthread_mutex_lock(&stop_lock);
+        while (!flush_stop) {
+                struct timespec deadline;
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_nsec += (long)AESDCURSOR_FLUSH_MS * 1000000L;
+                deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+                deadline.tv_nsec %= 1000000000L;
+                pthread_cond_timedwait(&stop_cond, &stop_lock, &deadline);
+                pthread_mutex_unlock(&stop_lock);
+                checkpoint();
+                pthread_mutex_lock(&stop_lock);
+        }
+        pthread_mutex_unlock(&stop_lock);
+        return NULL;
+}
+
+/**
+ * @brief Returns the cursor named `name`, creating it at offset 0 on first use.
+ * @param `name` A valid cursor name, not NUL-terminated.
+ * @param `len` The length of the name in bytes.
+ * @return The cursor, or NULL if it cannot be allocated.
+ */
+static struct aesdcursor *lookup(const char *name, size_t len) {
+        uint32_t b = cursor_hash(name, len) & (CURSOR_BUCKETS - 1);
+        pthread_mutex_lock(&table_lock);
+        struct aesdcursor *c;
+        for (c = buckets[b]; c != NULL; c = c->hash_next) {
+                if (strlen(c->name) == len && memcmp(c->name, name, len) == 0) {
+                        break;
+                }
+        }
+        if (c == NULL && (c = calloc(1, sizeof(*c))) != NULL) {
+                memcpy(c->name, name, len);
+                c->name[len] = '\0';
+                atomic_init(&c->offset, 0);
+                c->hash_next = buckets[b];
+                buckets[b] = c;
+        }
+        pthread_mutex_unlock(&table_lock);
+        return c;
+}
+
+/**
+ * @brief Loads the cursors of an earlier run from the checkpoint file.
+ * @param `data_path` The data file the offsets point into.
+ * @details Offsets past the end of the data file are clamped to it, so a cursor never
+ * skips data appended after a crash lost the tail its offset pointed into. A missing
+ * checkpoint is not an error; the run then starts without cursors.
+ */
+static void load_checkpoint(const char *data_path) {
+        FILE *fp = fopen(cursor_path, "r");
+        if (fp == NULL) {
+                return;
+        }
+        struct stat st;
+        uint64_t size = stat(data_path, &st) == 0 ? (uint64_t)st.st_size : 0;
+        char name[AESDCURSOR_NAME_MAX + 1];
+        unsigned long long offset;
+        size_t loaded = 0;
+        while (fscanf(fp, "%64[A-Za-z0-9_-] %llu\n", name, &offset) == 2) {
+                struct aesdcursor *c = lookup(name, strlen(name));
+                if (c != NULL) {
+                        atomic_store(&c->offset, (uint64_t)offset < size ? (uint64_t)offset : size);
+                        loaded++;
+                }
+        }
+        fclose(fp);
+        syslog(LOG_INFO, "Loaded %zu cursors from %s", loaded, cursor_path);
+}
+
+/**
+ * @brief Enables cursors and starts the checkpoint thread.
+ * @param `data_path` The configured data file; the checkpoint is `<data_path>.cursors`.
+ * @param `resume` Whether the data file of an earlier run was kept, so its cursors are loaded.
+ * @return 0 on success, -1 on failure.
+ * @details Without `resume` the cursors start empty like the data file: offsets of an
+ * earlier run would point into a log that no longer exists.
+ */
+int aesdcursor_init(const char *data_path, bool resume) {
+        snprintf(cursor_path, sizeof(cursor_path), "%s.cursors", data_path);
+        snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", cursor_path);
+        if (resume) {
+                load_checkpoint(data_path);
+        } else {
+                unlink(cursor_path);
+        }
+        if (pthread_create(&flush_thread, NULL, flush_main, NULL) != 0) {
+                return -1;
+        }
+        flush_running = true;
+        return 0;
+}
+
+/**
+ * @brief Returns the cursor named by a `CURSOR <name>` packet, creating it at offset 0 on first use.
+ * @param `line` The first packet of a connection.
+ * @param `len` The length of the packet in bytes.
+ * @return The cursor, or NULL if the packet is not a valid preamble or cursors are disabled.
+ */
+struct aesdcursor *aesdcursor_parse_preamble(const char *line, size_t len) {
+        size_t plen = strlen(AESDCURSOR_PREAMBLE);
+        if (!flush_running || len <= plen || memcmp(line, AESDCURSOR_PREAMBLE, plen) != 0) {
+                return NULL;
+        }
+        const char *name = line + plen;
+        len -= plen;
+        // Strip the line terminator.
+        while (len > 0 && (name[len - 1] == '\n' || name[len - 1] == '\r')) {
+                len--;
+        }
+        if (len == 0 || len > AESDCURSOR_NAME_MAX) {
+                return NULL;
+        }
+        for (size_t i = 0; i < len; i++) {
+                char c = name[i];
+                // Names are written to the checkpoint one per line, separated by a space.
+                if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c == '-')) {
+                        return NULL;
+                }
+        }
+        return lookup(name, len);
+}
+
+/**
+ * @brief Returns the offset the next replay through `cursor` starts at.
+ */
+uint64_t aesdcursor_offset(const struct aesdcursor *cursor) {
+        return atomic_load(&((struct aesdcursor *)cursor)->offset);
+}
+
+/**
+ * @brief Records that everything before `offset` was sent to the cursor's client.
+ * @details Several connections may share a cursor; it never moves backwards.
+ */
+void aesdcursor_advance(struct aesdcursor *cursor, uint64_t offset) {
+        uint64_t old = atomic_load(&cursor->offset);
+        while (old < offset && !atomic_compare_exchange_weak(&cursor->offset, &old, offset)) {
+        }
+        atomic_store(&dirty, true);
+}
+
+/**
+ * @brief Stops the checkpoint thread, frees the cursors and removes or keeps the checkpoint.
+ * @param `keep` Whether the data file is kept; the checkpoint is then brought up to date
+ * and kept with it, otherwise it is removed together with the data file it describes.
+ */
+void aesdcursor_close(bool keep) {
+        if (!flush_running) {
+                return;
+        }
+        pthread_mutex_lock(&stop_lock);
+        flush_stop = true;
+        pthread_cond_signal(&stop_cond);
+        pthread_mutex_unlock(&stop_lock);
+        pthread_join(flush_thread, NULL);
+        flush_running = false;
+        if (keep) {
+                checkpoint();
+        }
+        for (size_t b = 0; b < CURSOR_BUCKETS; b++) {
+                while (buckets[b] != NULL) {
+                        struct aesdcursor *c = buckets[b];
+                        buckets[b] = c->hash_next;
+                        free(c);
+                }
+        }
+        if (!keep) {
+                unlink(cursor_path);
+        }
+}
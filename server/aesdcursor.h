@@ -0,0 +1,38 @@
+/**
+ *  @file aesdcursor.h
+ *  @brief Named client cursors so reconnecting clients resume instead of re-replaying.
+ *
+ *  With `-C` a connection whose first packet is `CURSOR <name>` is bound to the named
+ *  cursor. Its replays then only contain what was committed since the cursor's offset,
+ *  and every completely sent replay moves the cursor to its end. A client reconnecting
+ *  with the same name continues where its previous connection stopped.
+ *
+ *  Cursors are written to `<data_file>.cursors` by a background thread at most once per
+ *  `AESDCURSOR_FLUSH_MS`, one `<name> <offset>` line per cursor, through a temporary
+ *  file that is synced and renamed over the old one. Advancing a cursor only updates
+ *  memory, so it adds no I/O to the replay path.
+ *
+ *  With `-K` the data file and the checkpoint survive a restart, and the next run loads
+ *  the cursors back, so a client may also resume across server runs. A crash loses at
+ *  most the last `AESDCURSOR_FLUSH_MS` of cursor moves, which only replays that data again.
+ */
+#ifndef AESDCURSOR_H
+#define AESDCURSOR_H
+
+#include <stdbool.h>     /**< @brief Provides a boolean type and values (`true`, `false`). */
+#include <stddef.h>      /**< @brief Provides `size_t`. */
+#include <stdint.h>      /**< @brief Provides fixed width integer types (e.g., `uint64_t`). */
+
+#define AESDCURSOR_PREAMBLE "CURSOR "   /**< @brief Start of the first packet that selects a cursor. */
+#define AESDCURSOR_NAME_MAX 64          /**< @brief Longest accepted cursor name. */
+#define AESDCURSOR_FLUSH_MS 1000        /**< @brief Longest time a cursor update stays unwritten. */
+
+struct aesdcursor;
+
+int aesdcursor_init(const char *data_path, bool resume);
+struct aesdcursor *aesdcursor_parse_preamble(const char *line, size_t len);
+uint64_t aesdcursor_offset(const struct aesdcursor *cursor);
+void aesdcursor_advance(struct aesdcursor *cursor, uint64_t offset);
+void aesdcursor_close(bool keep);
+
+#endif /* AESDCURSOR_H */
@@ -0,0 +1,373 @@
+/**
+ *  @file aesddedup.c
+ *  @brief Deduplicating store with an XXH64 content index (see aesddedup.h).
+ */
+#include "aesddedup.h"
+#include "aesdmem.h"
+
+#include <errno.h>       /**< @brief Provides definitions for error numbers (e.g., `EINTR`). */
+#include <fcntl.h>       /**< @brief Provides `open()`, `O_APPEND`. */
+#include <limits.h>      /**< @brief Provides `IOV_MAX`. */
+#include <pthread.h>     /**< @brief Provides the mutex serialising appends. */
+#include <stdatomic.h>   /**< @brief Provides the atomic committed length. */
+#include <stdbool.h>     /**< @brief Provides a boolean type and values (`true`, `false`). */
+#include <stdint.h>      /**< @brief Provides fixed width integer types (e.g., `uint64_t`). */
+#include <stdio.h>       /**< @brief Provides `snprintf()`. */
+#include <stdlib.h>      /**< @brief Provides `calloc()`, `free()`. */
+#include <string.h>      /**< @brief Provides `memcpy()`, `memcmp()`. */
+#include <sys/mman.h>    /**< @brief Provides `mmap()` used by replays. */
+#include <sys/uio.h>     /**< @brief Provides `writev()` and `struct iovec`. */
+#include <syslog.h>      /**< @brief Provides `syslog()`. */
+#include <time.h>        /**< @brief Provides `clock_gettime()` used to measure replay cost. */
+#include <unistd.h>      /**< @brief Provides `pread()`, `fdatasync()`, `close()`, `unlink()`. */
+
+#define DEDUP_MAX_LEN 4096              /**< @brief Longer packets are always stored literally. */
+#define DEDUP_INITIAL_SLOTS 1024        /**< @brief Initial size of the content index (a power of two). */
+#define LITERAL_HDR_LEN 5               /**< @brief Tag plus 4-byte length. */
+#define REFERENCE_LEN 9                 /**< @brief Tag plus 8-byte offset of the literal. */
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+/**
+ * @struct dedup_slot
+ * @brief One entry of the content index; `off == 0` marks an empty slot.
+ */
+struct dedup_slot {
+        uint64_t hash;          /**< XXH64 of the payload. */
+        uint64_t off;           /**< Offset of the literal record plus one. */
+        uint32_t len;           /**< Payload length. */
+};
+
+// --- Store State ---
+static int dedup_fd = -1;                                       /**< The dedup file, opened for appending. */
+static char dedup_path[272];                                    /**< Path of the dedup file. */
+static pthread_mutex_t dedup_lock = PTHREAD_MUTEX_INITIALIZER;  /**< Serialises appends, commits and the index. */
+static uint64_t written = 0;                                    /**< Bytes appended to the dedup file. */
+static _Atomic uint64_t committed = 0;                          /**< Bytes made durable; replays never read past this. */
+static struct dedup_slot *slots = NULL;                         /**< The content index. */
+static size_t slot_count = 0;                                   /**< Number of slots (a power of two). */
+static size_t used_count = 0;                                   /**< Number of occupied slots. */
+
+// --- Statistics (reported on close) ---
+static uint64_t stat_packets = 0;                               /**< Packets appended. */
+static uint64_t stat_repeats = 0;                               /**< Packets stored as references. */
+static uint64_t stat_logical = 0;                               /**< Payload bytes appended. */
+static _Atomic uint64_t stat_replays = 0;                       /**< Replays served. */
+static _Atomic uint64_t stat_replay_ns = 0;                     /**< Total time spent in replays. */
+static _Atomic uint64_t stat_replay_bytes = 0;                  /**< Total bytes sent by replays. */
+
+// --- XXH64 ---
+#define XXH_P1 11400714785074694791ULL
+#define XXH_P2 14029467366897019727ULL
+#define XXH_P3 1609587929392839161ULL
+#define XXH_P4 9650029242287828579ULL
+#define XXH_P5 2870177450012600261ULL
+
+static uint64_t xxh_rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+static uint64_t xxh_read64(const unsigned char *p) { uint64_t v; memcpy(&v, p, 8); return v; }
+static uint32_t xxh_read32(const unsigned char *p) { uint32_t v; memcpy(&v, p, 4); return v; }
+static uint64_t xxh_round(uint64_t acc, uint64_t input) { return xxh_rotl(acc + input * XXH_P2, 31) * XXH_P1; }
+static uint64_t xxh_merge(uint64_t acc, uint64_t v) { return (acc ^ xxh_round(0, v)) * XXH_P1 + XXH_P4; }
+
+/**
+ * @brief XXH64 of `len` bytes at `data` (seed 0).
+ * @details A fast non-cryptographic hash that only needs 64-bit multiplications, so it
+ * is also cheap on 32-bit targets.
+ */
+static uint64_t xxh64(const void *data, size_t len) {
+        const unsigned char *p = data;
+        const unsigned char *end = p + len;
+        uint64_t h;
+        if (len >= 32) {
+                uint64_t v1 = XXH_P1 + XXH_P2, v2 = XXH_P2, v3 = 0, v4 = -XXH_P1;
+                do {
+                        v1 = xxh_round(v1, xxh_read64(p));
+                        v2 = xxh_round(v2, xxh_read64(p + 8));
+                        v3 = xxh_round(v3, xxh_read64(p + 16));
+                        v4 = xxh_round(v4, xxh_read64(p + 24));
+                        p += 32;
+                } while (end - p >= 32);
+                h = xxh_rotl(v1, 1) + xxh_rotl(v2, 7) + xxh_rotl(v3, 12) + xxh_rotl(v4, 18);
+                h = xxh_merge(h, v1);
+                h = xxh_merge(h, v2);
+                h = xxh_merge(h, v3);
+                h = xxh_merge(h, v4);
+        } else {
+                h = XXH_P5;
+        }
+        h += len;
+        while (end - p >= 8) {
+                h ^= xxh_round(0, xxh_read64(p));
+                h = xxh_rotl(h, 27) * XXH_P1 + XXH_P4;
+                p += 8;
+        }
+        if (end - p >= 4) {
+                h ^= (uint64_t)xxh_read32(p) * XXH_P1;
+                h = xxh_rotl(h, 23) * XXH_P2 + XXH_P3;
+                p += 4;
+        }
+        while (p < end) {
+                h ^= (*p++) * XXH_P5;
+                h = xxh_rotl(h, 11) * XXH_P1;
+        }
+        h ^= h >> 33;
+        h *= XXH_P2;
+        h ^= h >> 29;
+        h *= XXH_P3;
+        h ^= h >> 32;
+        return h;
+}
+
+/**
+ * @brief Creates an empty dedup file next to `data_path`.
+ * @return 0 on success, -1 on failure.
+ */
+int aesddedup_open(const char *data_path) {
+        snprintf(dedup_path, sizeof(dedup_path), "%s.dedup", data_path);
+        dedup_fd = open(dedup_path, O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+        if (dedup_fd == -1) {
+                syslog(LOG_ERR, "Cannot create %s: %m", dedup_path);
+                return -1;
+        }
+        return 0;
+}
+
+/**
+ * @brief Doubles the content index (or allocates the first one).
+ */
+static int index_grow(void) {
+        size_t count = slot_count ? slot_count * 2 : DEDUP_INITIAL_SLOTS;
+        struct dedup_slot *table = calloc(count, sizeof(*table));
+        if (table == NULL) {
+                return -1;
+        }
+        for (size_t i = 0; i < slot_count; i++) {
+                if (slots[i].off != 0) {
+                        size_t j = slots[i].hash & (count - 1);
+                        while (table[j].off != 0) j = (j + 1) & (count - 1);
+                        table[j] = slots[i];
+                }
+        }
+        free(slots);
+        aesdmem_release(AESDMEM_INDEX, slot_count * sizeof(*slots));
+        aesdmem_charge(AESDMEM_INDEX, count * sizeof(*table));
+        slots = table;
+        slot_count = count;
+        return 0;
+}
+
+/**
+ * @brief Looks for an earlier literal with the same bytes.
+ * @return Offset of the literal record, or -1 if there is none.
+ * @details Hash matches are confirmed by comparing the stored bytes, so a hash
+ * collision can never make a replay return the wrong packet.
+ */
+static int64_t index_find(uint64_t hash, const char *buf, size_t len) {
+        if (slot_count == 0) {
+                return -1;
+        }
+        char stored[DEDUP_MAX_LEN];
+        for (size_t i = hash & (slot_count - 1); slots[i].off != 0; i = (i + 1) & (slot_count - 1)) {
+                struct dedup_slot *s = &slots[i];
+                if (s->hash != hash || s->len != len) {
+                        continue;
+                }
+                off_t payload = (off_t)(s->off - 1 + LITERAL_HDR_LEN);
+                if (pread(dedup_fd, stored, len, payload) == (ssize_t)len && memcmp(stored, buf, len) == 0) {
+                        return (int64_t)(s->off - 1);
+                }
+        }
+        return -1;
+}
+
+/**
+ * @brief Adds a literal to the content index.
+ */
+static void index_insert(uint64_t hash, uint64_t off, size_t len) {
+        if ((used_count + 1) * 10 > slot_count * 7 && index_grow() != 0) {
+                return; // the packet is still stored, it just cannot be deduplicated against
+        }
+        size_t i = hash & (slot_count - 1);
+        while (slots[i].off != 0) i = (i + 1) & (slot_count - 1);
+        slots[i] = (struct dedup_slot) { .hash = hash, .off = off + 1, .len = (uint32_t)len };
+        used_count++;
+}
+
+/**
+ * @brief Writes `len` bytes to the dedup file.
+ */
+static int write_all(const void *buf, size_t len) {
+        const char *p = buf;
+        while (len > 0) {
+                ssize_t n = write(dedup_fd, p, len);
+                if (n < 0) {
+                        if (errno == EINTR) continue;
+                        return -1;
+                }
+                p += n;
+                len -= (size_t)n;
+        }
+        return 0;
+}
+
+/**
+ * @brief Appends a packet, as a reference if the same bytes were stored before.
+ * @return 0 on success, -1 on failure.
+ */
+int aesddedup_append(const char *buf, size_t len) {
+        int rc;
+        uint64_t hash = xxh64(buf, len);
+        pthread_mutex_lock(&dedup_lock);
+        stat_packets++;
+        stat_logical += len;
+        int64_t literal = len <= DEDUP_MAX_LEN ? index_find(hash, buf, len) : -1;
+        if (literal >= 0) {
+                unsigned char ref[REFERENCE_LEN] = { 'R' };
+                uint64_t off = (uint64_t)literal;
+                memcpy(ref + 1, &off, 8);
+                rc = write_all(ref, sizeof(ref));
+                if (rc == 0) {
+                        written += sizeof(ref);
+                        stat_repeats++;
+                }
+        } else {
+                unsigned char hdr[LITERAL_HDR_LEN] = { 'L' };
+                uint32_t len32 = (uint32_t)len;
+                memcpy(hdr + 1, &len32, 4);
+                struct iovec iov[2] = {
+                        { .iov_base = hdr, .iov_len = sizeof(hdr) },
+                        { .iov_base = (void *)buf, .iov_len = len },
+                };
+                rc = writev(dedup_fd, iov, 2) == (ssize_t)(sizeof(hdr) + len) ? 0 : -1;
+                if (rc == 0) {
+                        if (len <= DEDUP_MAX_LEN) {
+                                index_insert(hash, written, len);
+                        }
+                        written += sizeof(hdr) + len;
+                }
+        }
+        pthread_mutex_unlock(&dedup_lock);
+        return rc;
+}
+
+/**
+ * @brief Makes every appended record durable and visible to replays.
+ * @return 0 on success, -1 on failure.
+ */
+int aesddedup_commit(void) {
+        pthread_mutex_lock(&dedup_lock);
+        int rc = fdatasync(dedup_fd);
+        if (rc == 0) {
+                atomic_store(&committed, written);
+        }
+        pthread_mutex_unlock(&dedup_lock);
+        return rc;
+}
+
+/**
+ * @brief Sends `count` iovecs completely, resuming after partial writes.
+ */
+static int send_iov(int fd, struct iovec *iov, int count) {
+        while (count > 0) {
+                ssize_t n = writev(fd, iov, count);
+                if (n < 0) {
+                        if (errno == EINTR) continue;
+                        return -1;
+                }
+                // Skip the fully sent iovecs and trim the partially sent one.
+                while (count > 0 && (size_t)n >= iov->iov_len) {
+                        n -= (ssize_t)iov->iov_len;
+                        iov++;
+                        count--;
+                }
+                if (count > 0) {
+                        iov->iov_base = (char *)iov->iov_base + n;
+                        iov->iov_len -= (size_t)n;
+                }
+        }
+        return 0;
+}
+
+/**
+ * @brief Replays the committed packets, expanding references, to a client.
+ * @param `client_fd` The connected client socket.
+ * @return 0 on success, -1 on failure.
+ * @details No lock is held: the committed length is captured once and the committed
+ * part of the file is never rewritten.
+ */
+int aesddedup_replay(int client_fd) {
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        uint64_t len = atomic_load(&committed);
+        if (len == 0) {
+                return 0;
+        }
+        const unsigned char *map = mmap(NULL, (size_t)len, PROT_READ, MAP_SHARED, dedup_fd, 0);
+        if (map == MAP_FAILED) {
+                return -1;
+        }
+        struct iovec iov[IOV_MAX];
+        int count = 0;
+        int rc = 0;
+        uint64_t sent = 0;
+        uint64_t pos = 0;
+        // Loop invariant: `iov[0..count)` describes the packets of the records before `pos` not yet sent.
+        while (pos < len && rc == 0) {
+                uint64_t literal = pos;
+                if (map[pos] == 'R') {
+                        memcpy(&literal, map + pos + 1, 8);
+                        pos += REFERENCE_LEN;
+                }
+                uint32_t plen;
+                memcpy(&plen, map + literal + 1, 4);
+                if (literal == pos) {
+                        pos += LITERAL_HDR_LEN + plen;
+                }
+                iov[count].iov_base = (void *)(map + literal + LITERAL_HDR_LEN);
+                iov[count].iov_len = plen;
+                sent += plen;
+                if (++count == IOV_MAX) {
+                        rc = send_iov(client_fd, iov, count);
+                        count = 0;
+                }
+        }
+        if (rc == 0 && count > 0) {
+                rc = send_iov(client_fd, iov, count);
+        }
+        munmap((void *)map, (size_t)len);
+
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        atomic_fetch_add(&stat_replays, 1);
+        atomic_fetch_add(&stat_replay_bytes, sent);
+        atomic_fetch_add(&stat_replay_ns, (uint64_t)((t1.tv_sec - t0.tv_sec) * 1000000000LL + (t1.tv_nsec - t0.tv_nsec)));
+        return rc;
+}
+
+/**
+ * @brief Reports the dedup ratio and replay cost, then removes the dedup file.
+ * @param `keep` Whether the dedup file is kept, like the data file with "-K".
+ */
+void aesddedup_close(bool keep) {
+        if (dedup_fd == -1) {
+                return;
+        }
+        uint64_t replays = atomic_load(&stat_replays);
+        syslog(LOG_INFO, "Dedup: %llu packets, %llu repeats, %llu bytes stored as %llu (ratio %.2f); "
+               "%llu replays, %llu bytes, %.1f us per replay",
+               (unsigned long long)stat_packets, (unsigned long long)stat_repeats,
+               (unsigned long long)stat_logical, (unsigned long long)written,
+               written ? (double)stat_logical / (double)written : 0.0,
+               (unsigned long long)replays, (unsigned long long)atomic_load(&stat_replay_bytes),
+               replays ? (double)atomic_load(&stat_replay_ns) / 1000.0 / (double)replays : 0.0);
+        close(dedup_fd);
+        dedup_fd = -1;
+        if (!keep) {
+                unlink(dedup_path);
+        }
+        free(slots);
+        aesdmem_release(AESDMEM_INDEX, slot_count * sizeof(*slots));
+        slots = NULL;
+        slot_count = 0;
+        used_count = 0;
+}
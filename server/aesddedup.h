@@ -0,0 +1,27 @@
+/**
+ *  @file aesddedup.h
+ *  @brief Content-addressed deduplicating store for repeated packets.
+ *
+ *  With `-D` packets on the shared log are stored in `<data_file>.dedup` instead of
+ *  the data file. Every packet is hashed with XXH64; a packet whose bytes were stored
+ *  before is written as a 9-byte reference to the earlier copy instead of a second
+ *  copy. A replay maps the committed part of the file and expands references into
+ *  an iovec array, so repeated bytes are sent from the one stored copy.
+ *
+ *  Record layout (host byte order):
+ *  - literal: `'L'`, 4-byte length, payload;
+ *  - reference: `'R'`, 8-byte offset of the literal record it repeats.
+ */
+#ifndef AESDDEDUP_H
+#define AESDDEDUP_H
+
+#include <stdbool.h>     /**< @brief Provides a boolean type and values (`true`, `false`). */
+#include <stddef.h>      /**< @brief Provides `size_t`. */
+
+int aesddedup_open(const char *data_path);
+int aesddedup_append(const char *buf, size_t len);
+int aesddedup_commit(void);
+int aesddedup_replay(int client_fd);
+void aesddedup_close(bool keep);
+
+#endif /* AESDDEDUP_H */
@@ -0,0 +1,318 @@
+/**
+ *  @file aesddirect.c
+ *  @brief `O_DIRECT` data file with an aligned tail buffer and buffer pool (see aesddirect.h).
+ */
+#define _GNU_SOURCE
+#include "aesddirect.h"
+
+#include <errno.h>       /**< @brief Provides definitions for error numbers (e.g., `EINTR`). */
+#include <fcntl.h>       /**< @brief Provides `open()`, `O_DIRECT`. */
+#include <pthread.h>     /**< @brief Provides the mutexes and the condition variable of the pool. */
+#include <stdatomic.h>   /**< @brief Provides the atomic committed length. */
+#include <stdint.h>      /**< @brief Provides fixed width integer types (e.g., `uint64_t`). */
+#include <stdlib.h>      /**< @brief Provides `posix_memalign()`, `free()`. */
+#include <string.h>      /**< @brief Provides `memcpy()`, `memmove()`, `memset()`. */
+#include <sys/mman.h>    /**< @brief Provides `mmap()` and `mincore()` used to report page cache residency. */
+#include <sys/socket.h>  /**< @brief Provides `send()`. */
+#include <sys/stat.h>    /**< @brief Provides `fstat()`. */
+#include <syslog.h>      /**< @brief Provides `syslog()`. */
+#include <time.h>        /**< @brief Provides `clock_gettime()` used to measure replay cost. */
+#include <unistd.h>      /**< @brief Provides `pread()`, `pwrite()`, `ftruncate()`, `fdatasync()`, `close()`. */
+
+/** @brief Rounds `n` up to the next multiple of `DIRECT_ALIGN`. */
+#define ALIGN_UP(n) (((n) + DIRECT_ALIGN - 1) & ~(uint64_t)(DIRECT_ALIGN - 1))
+/** @brief Rounds `n` down to a multiple of `DIRECT_ALIGN`. */
+#define ALIGN_DOWN(n) ((n) & ~(uint64_t)(DIRECT_ALIGN - 1))
+
+// --- Store State ---
+static int direct_fd = -1;                                      /**< The data file, opened with `O_DIRECT`. */
+static pthread_mutex_t direct_lock = PTHREAD_MUTEX_INITIALIZER; /**< Serialises appends and commits. */
+static char *tail = NULL;                                       /**< Aligned buffer holding the log from `tail_off` on. */
+static uint64_t tail_off = 0;                                   /**< File offset of `tail[0]`, a multiple of `DIRECT_ALIGN`. */
+static size_t tail_len = 0;                                     /**< Bytes of the log in `tail`. */
+static size_t tail_synced = 0;                                  /**< Bytes of `tail` already written and synced. */
+static _Atomic uint64_t committed = 0;                          /**< Bytes made durable; replays never read past this. */
+
+// --- Buffer Pool State ---
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;   /**< Guards `pool`. */
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;     /**< Signalled when a buffer is returned. */
+static char *pool[DIRECT_POOL_BUFS];                            /**< Free aligned buffers. */
+static int pool_free = 0;                                       /**< Number of buffers in `pool`. */
+
+// --- Statistics (reported on close) ---
+static uint64_t stat_writes = 0;                                /**< Direct writes issued. */
+static uint64_t stat_written = 0;                               /**< Bytes written, padding and rewritten blocks included. */
+static _Atomic uint64_t stat_replays = 0;                       /**< Replays served. */
+static _Atomic uint64_t stat_replay_ns = 0;                     /**< Total time spent in replays. */
+static _Atomic uint64_t stat_replay_bytes = 0;                  /**< Total bytes sent by replays. */
+
+/**
+ * @brief Takes a buffer from the pool, waiting while all of them are in use.
+ */
+static char *pool_take(void) {
+        pthread_mutex_lock(&pool_lock);
+        while (pool_free == 0) {
+                pthread_cond_wait(&pool_cond, &pool_lock);
+        }
+        char *buf = pool[--pool_free];
+        pthread_mutex_unlock(&pool_lock);
+        return buf;
+}
+
+/**
+ * @brief Returns a buffer to the pool.
+ */
+static void pool_put(char *buf) {
+        pthread_mutex_lock(&pool_lock);
+        pool[pool_free++] = buf;
+        pthread_cond_signal(&pool_cond);
+        pthread_mutex_unlock(&pool_lock);
+}
+
+/**
+ * @brief Writes `len` bytes of `tail` from `start` on to the data file.
+ * @pre `start` and `len` are multiples of `DIRECT_ALIGN`; the caller holds `direct_lock`.
+ */
+static int write_tail(size_t start, size_t len) {
+        while (len > 0) {
+                ssize_t n = pwrite(direct_fd, tail + start, len, (off_t)(tail_off + start));
+                if (n < 0) {
+                        if (errno == EINTR) continue;
+                        syslog(LOG_ERR, "Direct write at %llu failed: %m", (unsigned long long)(tail_off + start));
+                        return -1;
+                }
+                stat_writes++;
+                stat_written += (uint64_t)n;
+                start += (size_t)n;
+                len -= (size_t)n;
+        }
+        return 0;
+}
+
+/**
+ * @brief Opens the data file for direct I/O and allocates the tail buffer and the pool.
+ * @param `data_path` The data file.
+ * @return 0 on success, -1 on failure (e.g. the file system does not support `O_DIRECT`).
+ * @details The partial block at the end of an existing file is read into the tail buffer,
+ * so appends continue right after it.
+ */
+int aesddirect_open(const char *data_path) {
+        direct_fd = open(data_path, O_RDWR | O_CREAT | O_DIRECT | O_CLOEXEC, 0644);
+        if (direct_fd == -1) {
+                syslog(LOG_ERR, "Cannot open %s for direct I/O: %m", data_path);
+                return -1;
+        }
+        if (posix_memalign((void **)&tail, DIRECT_ALIGN, DIRECT_BUF_LEN) != 0) {
+                goto fail;
+        }
+        for (pool_free = 0; pool_free < DIRECT_POOL_BUFS; pool_free++) {
+                if (posix_memalign((void **)&pool[pool_free], DIRECT_ALIGN, DIRECT_BUF_LEN) != 0) {
+                        goto fail;
+                }
+        }
+        struct stat st;
+        if (fstat(direct_fd, &st) != 0) {
+                goto fail;
+        }
+        tail_off = ALIGN_DOWN((uint64_t)st.st_size);
+        tail_len = (size_t)((uint64_t)st.st_size - tail_off);
+        if (tail_len > 0 && pread(direct_fd, tail, DIRECT_ALIGN, (off_t)tail_off) < (ssize_t)tail_len) {
+                goto fail;
+        }
+        tail_synced = tail_len;
+        atomic_store(&committed, (uint64_t)st.st_size);
+        return 0;
+fail:
+        syslog(LOG_ERR, "Cannot set up direct I/O on %s: %m", data_path);
+        aesddirect_close();
+        return -1;
+}
+
+/**
+ * @brief Copies bytes into the tail buffer, writing it out whenever it fills up.
+ * @pre The caller holds `direct_lock`.
+ */
+static int tail_add(const char *buf, size_t len) {
+        while (len > 0) {
+                size_t n = DIRECT_BUF_LEN - tail_len;
+                if (n > len) n = len;
+                memcpy(tail + tail_len, buf, n);
+                tail_len += n;
+                buf += n;
+                len -= n;
+                if (tail_len == DIRECT_BUF_LEN) {
+                        // A full buffer is whole blocks; the part already synced need not be written again.
+                        size_t start = (size_t)ALIGN_DOWN(tail_synced);
+                        if (write_tail(start, DIRECT_BUF_LEN - start) != 0) {
+                                return -1;
+                        }
+                        tail_off += DIRECT_BUF_LEN;
+                        tail_len = 0;
+                        tail_synced = 0;
+                }
+        }
+        return 0;
+}
+
+/**
+ * @brief Makes every appended byte durable and visible to replays.
+ * @return 0 on success, -1 on failure.
+ * @pre The caller holds `direct_lock`.
+ * @details The blocks from the first unsynced one to the end of the tail are written,
+ * the last one zero-padded; the padding is cut off again before the sync. Afterwards the
+ * complete blocks leave the tail buffer, so it only ever keeps the last partial block.
+ */
+static int commit_tail(void) {
+        int rc = 0;
+        if (tail_len > tail_synced) {
+                size_t start = (size_t)ALIGN_DOWN(tail_synced);
+                size_t end = (size_t)ALIGN_UP(tail_len);
+                memset(tail + tail_len, 0, end - tail_len);
+                rc = write_tail(start, end - start);
+                if (rc == 0 && end != tail_len && ftruncate(direct_fd, (off_t)(tail_off + tail_len)) != 0) {
+                        syslog(LOG_ERR, "Cannot trim the padding of the data file: %m");
+                        rc = -1;
+                }
+        }
+        if (rc == 0 && fdatasync(direct_fd) != 0) {
+                rc = -1;
+        }
+        if (rc == 0) {
+                atomic_store(&committed, tail_off + tail_len);
+                size_t full = (size_t)ALIGN_DOWN(tail_len);
+                memmove(tail, tail + full, tail_len - full);
+                tail_off += full;
+                tail_len -= full;
+                tail_synced = tail_len;
+        }
+        return rc;
+}
+
+/**
+ * @brief Appends a packet given in two pieces (e.g. a held-back start and the rest) and commits it.
+ * @param `prefix` The first piece, may be NULL if `prefix_len` is 0.
+ * @param `prefix_len` Bytes in `prefix`.
+ * @param `buf` The second piece, may be NULL if `len` is 0.
+ * @param `len` Bytes in `buf`.
+ * @param `snapshot` Receives the committed length right after the packet, for `aesddirect_replay()`.
+ * @return 0 on success, -1 on failure.
+ * @details Both pieces and the commit happen under one lock, so no other packet lands
+ * between them and the snapshot ends with this packet.
+ */
+int aesddirect_append(const char *prefix, size_t prefix_len, const char *buf, size_t len, uint64_t *snapshot) {
+        pthread_mutex_lock(&direct_lock);
+        int rc = tail_add(prefix, prefix_len) == 0 && tail_add(buf, len) == 0 && commit_tail() == 0 ? 0 : -1;
+        *snapshot = atomic_load(&committed);
+        pthread_mutex_unlock(&direct_lock);
+        return rc;
+}
+
+/**
+ * @brief Sends `len` bytes completely.
+ */
+static int send_all(int fd, const char *buf, size_t len) {
+        while (len > 0) {
+                ssize_t n = send(fd, buf, len, 0);
+                if (n < 0) {
+                        if (errno == EINTR) continue;
+                        return -1;
+                }
+                buf += n;
+                len -= (size_t)n;
+        }
+        return 0;
+}
+
+/**
+ * @brief Replays a snapshot of the log to a client with aligned direct reads.
+ * @param `client_fd` The connected client socket.
+ * @param `len` The snapshot, a committed length returned by `aesddirect_append()`.
+ * @return 0 on success, -1 on failure.
+ * @details No lock is held while reading: a commit only ever rewrites the block holding
+ * the end of the log, with the same bytes before that end. The read of the last block can go past the committed length (into
+ * padding or newer packets); only the committed bytes are sent.
+ */
+int aesddirect_replay(int client_fd, uint64_t len) {
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        char *buf = pool_take();
+        int rc = 0;
+        uint64_t off = 0;
+        // Loop invariant: the committed bytes before `off` have been sent.
+        while (off < len && rc == 0) {
+                uint64_t want = len - off < DIRECT_BUF_LEN ? ALIGN_UP(len - off) : DIRECT_BUF_LEN;
+                ssize_t n = pread(direct_fd, buf, (size_t)want, (off_t)off);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) {
+                        syslog(LOG_ERR, "Direct read at %llu failed: %m", (unsigned long long)off);
+                        rc = -1;
+                        break;
+                }
+                // A read ends at a block boundary unless it reached the end of the file.
+                size_t usable = (uint64_t)n < len - off ? (size_t)n : (size_t)(len - off);
+                rc = send_all(client_fd, buf, usable);
+                off += usable;
+        }
+        pool_put(buf);
+
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        atomic_fetch_add(&stat_replays, 1);
+        atomic_fetch_add(&stat_replay_bytes, off);
+        atomic_fetch_add(&stat_replay_ns, (uint64_t)((t1.tv_sec - t0.tv_sec) * 1000000000LL + (t1.tv_nsec - t0.tv_nsec)));
+        return rc;
+}
+
+/**
+ * @brief Counts the pages of the data file that are resident in the page cache.
+ */
+static uint64_t resident_pages(uint64_t len, uint64_t *pages) {
+        long page = sysconf(_SC_PAGESIZE);
+        *pages = (len + (uint64_t)page - 1) / (uint64_t)page;
+        if (len == 0) {
+                return 0;
+        }
+        void *map = mmap(NULL, (size_t)len, PROT_READ, MAP_SHARED, direct_fd, 0);
+        if (map == MAP_FAILED) {
+                return 0;
+        }
+        unsigned char *vec = malloc((size_t)*pages);
+        uint64_t resident = 0;
+        if (vec != NULL && mincore(map, (size_t)len, vec) == 0) {
+                for (uint64_t i = 0; i < *pages; i++) {
+                        resident += vec[i] & 1;
+                }
+        }
+        free(vec);
+        munmap(map, (size_t)len);
+        return resident;
+}
+
+/**
+ * @brief Commits what is left, reports write and replay cost and the page cache footprint, and closes the file.
+ */
+void aesddirect_close(void) {
+        if (direct_fd != -1 && tail != NULL) {
+                pthread_mutex_lock(&direct_lock);
+                commit_tail();
+                pthread_mutex_unlock(&direct_lock);
+                uint64_t len = atomic_load(&committed);
+                uint64_t pages;
+                uint64_t resident = resident_pages(len, &pages);
+                uint64_t replays = atomic_load(&stat_replays);
+                syslog(LOG_INFO, "Direct I/O: %llu bytes in %llu writes of %llu bytes; "
+                       "%llu replays, %llu bytes, %.1f us per replay; %llu of %llu pages in the page cache",
+                       (unsigned long long)len, (unsigned long long)stat_writes, (unsigned long long)stat_written,
+                       (unsigned long long)replays, (unsigned long long)atomic_load(&stat_replay_bytes),
+                       replays ? (double)atomic_load(&stat_replay_ns) / 1000.0 / (double)replays : 0.0,
+                       (unsigned long long)resident, (unsigned long long)pages);
+        }
+        if (direct_fd != -1) {
+                close(direct_fd);
+                direct_fd = -1;
+        }
+        free(tail);
+        tail = NULL;
+        while (pool_free > 0) {
+                free(pool[--pool_free]);
+        }
+}
@@ -0,0 +1,32 @@
+/**
+ *  @file aesddirect.h
+ *  @brief Direct I/O store for the shared data file.
+ *
+ *  With `-O` the data file is written and replayed with `O_DIRECT`, so the write-once
+ *  log does not evict the page cache working sets of other services on the host.
+ *
+ *  `O_DIRECT` transfers must start at `DIRECT_ALIGN`-aligned offsets and cover whole
+ *  aligned blocks from aligned memory. Appends therefore collect in an aligned tail
+ *  buffer that starts at the last block boundary of the file. A commit writes the
+ *  blocks of the tail that changed, zero-padded to the block size, trims the padding
+ *  again with `ftruncate()` and syncs the file. Replays read the committed part with
+ *  aligned reads into buffers taken from a small pool of aligned buffers.
+ *
+ *  The file keeps the plain log format, so it can still be read as any other data file.
+ */
+#ifndef AESDDIRECT_H
+#define AESDDIRECT_H
+
+#include <stddef.h>      /**< @brief Provides `size_t`. */
+#include <stdint.h>      /**< @brief Provides fixed width integer types (e.g., `uint64_t`). */
+
+#define DIRECT_ALIGN 4096               /**< @brief Alignment of offsets, lengths and buffers of direct transfers. */
+#define DIRECT_BUF_LEN (64 * 1024)      /**< @brief Size of the tail buffer and of every pool buffer. */
+#define DIRECT_POOL_BUFS 8              /**< @brief Pool buffers, i.e. replays that can read at the same time. */
+
+int aesddirect_open(const char *data_path);
+int aesddirect_append(const char *prefix, size_t prefix_len, const char *buf, size_t len, uint64_t *snapshot);
+int aesddirect_replay(int client_fd, uint64_t len);
+void aesddirect_close(void);
+
+#endif /* AESDDIRECT_H */
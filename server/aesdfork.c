@@ -0,0 +1,224 @@
+/**
+ *  @file aesdfork.c
+ *  @brief Shared store header, cross-process append lock and worker supervision (see aesdfork.h).
+ */
+#include "aesdfork.h"
+
+#include <errno.h>       /**< @brief Provides definitions for error numbers (e.g., `EINTR`, `ECHILD`). */
+#include <linux/futex.h> /**< @brief Provides `FUTEX_WAIT`, `FUTEX_WAKE`. */
+#include <poll.h>        /**< @brief Provides `poll()` used to wait for the next signal. */
+#include <signal.h>      /**< @brief Provides `kill()`, `SIGTERM`, `SIGCHLD`. */
+#include <stdatomic.h>   /**< @brief Provides the atomic fields of the shared header. */
+#include <stdbool.h>     /**< @brief Provides a boolean type and values (`true`, `false`). */
+#include <stdio.h>       /**< @brief Provides `snprintf()`. */
+#include <stdlib.h>      /**< @brief Provides `calloc()`, `free()`, `_exit()`. */
+#include <sys/mman.h>    /**< @brief Provides `mmap()`, `munmap()`. */
+#include <sys/signalfd.h>/**< @brief Provides `struct signalfd_siginfo`. */
+#include <sys/syscall.h> /**< @brief Provides `SYS_futex`. */
+#include <sys/wait.h>    /**< @brief Provides `waitpid()`. */
+#include <syslog.h>      /**< @brief Provides `syslog()`. */
+#include <unistd.h>      /**< @brief Provides `fork()`, `getpid()`, `truncate()`, `read()`. */
+
+/**
+ * @struct aesdfork_header
+ * @brief The store header shared by the parent and all workers.
+ */
+struct aesdfork_header {
+        _Atomic uint32_t lock;          /**< Pid of the process holding the append lock, 0 when free; the futex word. */
+        _Atomic uint32_t waiters;       /**< Processes sleeping on `lock`, so an uncontended unlock skips the wake. */
+        _Atomic uint64_t committed;     /**< Committed length of the data file. */
+        _Atomic uint64_t acquired;      /**< Times the lock was taken. */
+        _Atomic uint64_t contended;     /**< Times the lock was found taken. */
+};
+
+static struct aesdfork_header *header = NULL;   /**< The shared header, or NULL outside prefork mode. */
+static char data_path[256];                     /**< The data file, truncated when a worker dies holding the lock. */
+
+/**
+ * @brief Waits on or wakes the shared (not process-private) futex `lock`.
+ */
+static long futex(int op, uint32_t value) {
+        return syscall(SYS_futex, (uint32_t *)&header->lock, op, value, NULL, NULL, 0);
+}
+
+/**
+ * @brief Maps the shared store header.
+ * @param `data_path` The data file the workers append to.
+ * @return 0 on success, -1 on failure.
+ * @pre Called before the workers are forked, so they inherit the mapping.
+ */
+int aesdfork_init(const char *path) {
+        snprintf(data_path, sizeof(data_path), "%s", path);
+        void *map = mmap(NULL, sizeof(*header), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (map == MAP_FAILED) {
+                return -1;
+        }
+        header = map;
+        return 0;
+}
+
+/**
+ * @brief Takes the append lock shared by all workers.
+ * @details The lock word holds the owner's pid, so threads of one worker exclude each
+ * other as well, and the parent can tell which worker held it when that worker died.
+ */
+void aesdfork_lock(void) {
+        uint32_t me = (uint32_t)getpid();
+        uint32_t owner = 0;
+        atomic_fetch_add(&header->acquired, 1);
+        if (atomic_compare_exchange_strong(&header->lock, &owner, me)) {
+                return;
+        }
+        atomic_fetch_add(&header->contended, 1);
+        // Loop invariant: `owner` is the lock word the last attempt found.
+        for (;;) {
+                atomic_fetch_add(&header->waiters, 1);
+                // Sleeps only while the word still names that owner, so a release in between is not missed.
+                futex(FUTEX_WAIT, owner);
+                atomic_fetch_sub(&header->waiters, 1);
+                owner = 0;
+                if (atomic_compare_exchange_strong(&header->lock, &owner, me)) {
+                        return;
+                }
+        }
+}
+
+/**
+ * @brief Releases the append lock.
+ */
+void aesdfork_unlock(void) {
+        atomic_store(&header->lock, 0);
+        if (atomic_load(&header->waiters) > 0) {
+                futex(FUTEX_WAKE, 1);
+        }
+}
+
+/**
+ * @brief Records the committed length of the data file.
+ * @param `committed_len` The committed length.
+ * @pre The caller holds the append lock.
+ */
+void aesdfork_commit(uint64_t committed_len) {
+        if (header != NULL) {
+                atomic_store(&header->committed, committed_len);
+        }
+}
+
+/**
+ * @brief Frees the append lock of a worker that died holding it.
+ * @param `pid` The dead worker.
+ * @details Whatever the worker appended after the last commit is cut off, so the next
+ * packet does not land behind half of another.
+ */
+static void recover_lock(pid_t pid) {
+        uint32_t owner = (uint32_t)pid;
+        if (!atomic_compare_exchange_strong(&header->lock, &owner, (uint32_t)getpid())) {
+                return;
+        }
+        uint64_t committed = atomic_load(&header->committed);
+        if (truncate(data_path, (off_t)committed) != 0) {
+                syslog(LOG_ERR, "Cannot cut %s back to %llu committed bytes: %m", data_path, (unsigned long long)committed);
+        }
+        syslog(LOG_WARNING, "Worker %d died holding the append lock; %s cut back to %llu committed bytes",
+               (int)pid, data_path, (unsigned long long)committed);
+        atomic_store(&header->lock, 0);
+        futex(FUTEX_WAKE, INT32_MAX);
+}
+
+/**
+ * @brief Forks one worker.
+ * @return The worker's pid, or -1 if it could not be forked.
+ */
+static pid_t spawn(void (*worker_main)(void)) {
+        pid_t pid = fork();
+        if (pid == 0) {
+                worker_main();
+                _exit(EXIT_SUCCESS);
+        }
+        return pid;
+}
+
+/**
+ * @brief Forks the workers and supervises them until they have all exited.
+ * @param `workers` Number of worker processes.
+ * @param `signal_fd` Delivers `SIGINT`, `SIGTERM` and `SIGCHLD` to the parent.
+ * @param `worker_main` Serves connections in a worker; it returns once the worker drained.
+ * @return 0 once every worker exited after a shutdown signal, -1 if none could be forked.
+ * @details A worker that exits before shutdown was asked for crashed (or was killed); it
+ * is replaced right away.
+ */
+int aesdfork_run(int workers, int signal_fd, void (*worker_main)(void)) {
+        pid_t *pids = calloc((size_t)workers, sizeof(*pids));
+        if (pids == NULL) {
+                return -1;
+        }
+        int alive = 0;
+        for (int i = 0; i < workers; i++) {
+                pids[i] = spawn(worker_main);
+                alive += pids[i] > 0;
+        }
+        if (alive == 0) {
+                free(pids);
+                return -1;
+        }
+        bool stopping = false;
+        unsigned respawned = 0;
+        // Loop invariant: `alive` counts the entries of `pids` that name a running worker.
+        while (alive > 0) {
+                struct signalfd_siginfo si;
+                ssize_t n = read(signal_fd, &si, sizeof(si));
+                if (n != (ssize_t)sizeof(si)) {
+                        // `signal_fd` is non-blocking; wait for the next signal.
+                        struct pollfd pfd = { .fd = signal_fd, .events = POLLIN };
+                        poll(&pfd, 1, -1);
+                        continue;
+                }
+                if (si.ssi_signo == SIGINT || si.ssi_signo == SIGTERM) {
+                        syslog(LOG_INFO, "Caught signal %u, draining %d workers", si.ssi_signo, alive);
+                        stopping = true;
+                        for (int i = 0; i < workers; i++) {
+                                if (pids[i] > 0) kill(pids[i], SIGTERM);
+                        }
+                        continue;
+                }
+                // `SIGCHLD` signals are merged, so reap every worker that exited.
+                int status;
+                pid_t pid;
+                while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+                        int i = 0;
+                        while (i < workers && pids[i] != pid) i++;
+                        if (i == workers) {
+                                continue;
+                        }
+                        recover_lock(pid);
+                        pids[i] = 0;
+                        alive--;
+                        if (stopping) {
+                                continue;
+                        }
+                        syslog(LOG_WARNING, "Worker %d %s %d, starting a new one", (int)pid,
+                               WIFSIGNALED(status) ? "killed by signal" : "exited with status",
+                               WIFSIGNALED(status) ? WTERMSIG(status) : WEXITSTATUS(status));
+                        pids[i] = spawn(worker_main);
+                        alive += pids[i] > 0;
+                        respawned++;
+                }
+        }
+        free(pids);
+        syslog(LOG_INFO, "Prefork: %d workers, %u respawned; append lock taken %llu times, %.1f%% contended; "
+               "%llu bytes committed", workers, respawned, (unsigned long long)atomic_load(&header->acquired),
+               header->acquired ? 100.0 * (double)atomic_load(&header->contended) / (double)atomic_load(&header->acquired) : 0.0,
+               (unsigned long long)atomic_load(&header->committed));
+        return 0;
+}
+
+/**
+ * @brief Unmaps the shared store header.
+ */
+void aesdfork_close(void) {
+        if (header == NULL) {
+                return;
+        }
+        munmap(header, sizeof(*header));
+        header = NULL;
+}
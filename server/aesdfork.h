@@ -0,0 +1,31 @@
+/**
+ *  @file aesdfork.h
+ *  @brief Prefork mode: several worker processes sharing one listening socket and one data file.
+ *
+ *  With `-W <n>` the server forks n worker processes after it starts listening. Every
+ *  worker accepts from the shared listening socket and serves its connections like a
+ *  single server would; the parent only supervises. The workers share an anonymous
+ *  `MAP_SHARED` store header that holds:
+ *  - the append lock, a futex word holding the pid of the process that owns it (0 when
+ *    free), which replaces `store_lock` across processes;
+ *  - the committed length of the data file, set by every commit under the lock.
+ *
+ *  A worker that dies is reaped and respawned by the parent. If it died holding the
+ *  append lock, the parent takes the lock over, truncates the data file back to the
+ *  committed length (dropping the torn append) and releases it, so the other workers
+ *  carry on. On `SIGINT`/`SIGTERM` the parent forwards the signal, each worker drains
+ *  its own connections, and the parent exits once all of them have.
+ */
+#ifndef AESDFORK_H
+#define AESDFORK_H
+
+#include <stdint.h>      /**< @brief Provides fixed width integer types (e.g., `uint64_t`). */
+
+int aesdfork_init(const char *data_path);
+void aesdfork_lock(void);
+void aesdfork_unlock(void);
+void aesdfork_commit(uint64_t committed_len);
+int aesdfork_run(int workers, int signal_fd, void (*worker_main)(void));
+void aesdfork_close(void);
+
+#endif /* AESDFORK_H */
@@ -0,0 +1,184 @@
+/**
+ *  @file aesdkv.c
+ *  @brief Open-addressing key index (see aesdkv.h).
+ */
+#include "aesdkv.h"
+#include "aesdmem.h"
+
+#include <pthread.h>     /**< @brief Provides the reader/writer lock guarding the table. */
+#include <stdlib.h>      /**< @brief Provides `calloc()`, `malloc()`, `free()`. */
+#include <string.h>      /**< @brief Provides `memcmp()`, `memcpy()`. */
+
+#define KV_INITIAL_SLOTS 1024           /**< @brief Initial table size (a power of two). */
+
+/**
+ * @struct kv_slot
+ * @brief One slot of the table; `key == NULL` marks an empty slot (keys are never deleted).
+ */
+struct kv_slot {
+        char *key;              /**< Heap copy of the key, not NUL-terminated. */
+        uint32_t key_len;       /**< Length of `key`. */
+        uint32_t hash;          /**< Cached hash of `key`, used when growing. */
+        uint64_t offset;        /**< Offset of the latest value in the data file. */
+        uint32_t len;           /**< Length of the latest value, including its newline. */
+};
+
+// --- Index State ---
+static struct kv_slot *slots = NULL;                            /**< The table, `slot_count` entries. */
+static size_t slot_count = 0;                                   /**< Number of slots (a power of two). */
+static size_t used_count = 0;                                   /**< Number of occupied slots. */
+static pthread_rwlock_t kv_lock = PTHREAD_RWLOCK_INITIALIZER;   /**< GETs share the table, PUTs own it. */
+
+/**
+ * @brief FNV-1a hash of a key.
+ */
+static uint32_t kv_hash(const char *key, size_t len) {
+        uint32_t h = 2166136261u;
+        for (size_t i = 0; i < len; i++) {
+                h = (h ^ (unsigned char)key[i]) * 16777619u;
+        }
+        return h;
+}
+
+/**
+ * @brief Finds the slot holding `key`, or the empty slot where it would be inserted.
+ * @pre `slots` is allocated and not full.
+ */
+static struct kv_slot *kv_probe(struct kv_slot *table, size_t count, const char *key, size_t len, uint32_t hash) {
+        size_t mask = count - 1;
+        // Loop invariant: every slot between `hash & mask` and `i` holds a different key.
+        for (size_t i = hash & mask;; i = (i + 1) & mask) {
+                struct kv_slot *s = &table[i];
+                if (s->key == NULL || (s->hash == hash && s->key_len == len && memcmp(s->key, key, len) == 0)) {
+                        return s;
+                }
+        }
+}
+
+/**
+ * @brief Doubles the table (or allocates the first one).
+ * @return 0 on success, -1 if memory runs out.
+ */
+static int kv_grow(void) {
+        size_t count = slot_count ? slot_count * 2 : KV_INITIAL_SLOTS;
+        struct kv_slot *table = calloc(count, sizeof(*table));
+        if (table == NULL) {
+                return -1;
+        }
+        for (size_t i = 0; i < slot_count; i++) {
+                if (slots[i].key != NULL) {
+                        *kv_probe(table, count, slots[i].key, slots[i].key_len, slots[i].hash) = slots[i];
+                }
+        }
+        free(slots);
+        aesdmem_release(AESDMEM_INDEX, slot_count * sizeof(*slots));
+        aesdmem_charge(AESDMEM_INDEX, count * sizeof(*table));
+        slots = table;
+        slot_count = count;
+        return 0;
+}
+
+/**
+ * @brief Records that the latest value of `key` is `len` bytes at `offset` in the data file.
+ * @return 0 on success, -1 if memory runs out.
+ */
+int aesdkv_put(const char *key, size_t key_len, uint64_t offset, uint32_t len) {
+        uint32_t hash = kv_hash(key, key_len);
+        int rc = 0;
+        pthread_rwlock_wrlock(&kv_lock);
+        // Keep the load factor below 70% so probe sequences stay short.
+        if ((used_count + 1) * 10 > slot_count * 7 && kv_grow() != 0) {
+                rc = -1;
+                goto out;
+        }
+        struct kv_slot *s = kv_probe(slots, slot_count, key, key_len, hash);
+        if (s->key == NULL) {
+                if ((s->key = malloc(key_len)) == NULL) {
+                        rc = -1;
+                        goto out;
+                }
+                memcpy(s->key, key, key_len);
+                aesdmem_charge(AESDMEM_INDEX, key_len);
+                s->key_len = (uint32_t)key_len;
+                s->hash = hash;
+                used_count++;
+        }
+        s->offset = offset;
+        s->len = len;
+out:
+        pthread_rwlock_unlock(&kv_lock);
+        return rc;
+}
+
+/**
+ * @brief Looks up where the latest value of `key` is stored.
+ * @return `true` if the key is known.
+ */
+bool aesdkv_get(const char *key, size_t key_len, uint64_t *offset, uint32_t *len) {
+        bool found = false;
+        pthread_rwlock_rdlock(&kv_lock);
+        if (slots != NULL) {
+                struct kv_slot *s = kv_probe(slots, slot_count, key, key_len, kv_hash(key, key_len));
+                if (s->key != NULL) {
+                        *offset = s->offset;
+                        *len = s->len;
+                        found = true;
+                }
+        }
+        pthread_rwlock_unlock(&kv_lock);
+        return found;
+}
+
+/**
+ * @brief Moves every indexed value after the data file has been compacted.
+ * @param `boundary` Length of the part of the old file that was rewritten.
+ * @param `shrink` By how many bytes the rewritten part shrank; values at or past
+ * `boundary` moved towards the start of the file by this amount.
+ * @param `old_offsets` Offsets of the values kept by the compactor in the old file, ascending.
+ * @param `new_offsets` Offsets of the same values in the new file.
+ * @param `count` Number of entries in `old_offsets` and `new_offsets`.
+ * @pre The caller holds the store lock, so no `PUT` or `GET` runs concurrently.
+ */
+void aesdkv_relocate(uint64_t boundary, uint64_t shrink, const uint64_t *old_offsets, const uint64_t *new_offsets, size_t count) {
+        pthread_rwlock_wrlock(&kv_lock);
+        for (size_t i = 0; i < slot_count; i++) {
+                struct kv_slot *s = &slots[i];
+                if (s->key == NULL) {
+                        continue;
+                }
+                if (s->offset >= boundary) {
+                        s->offset -= shrink;
+                        continue;
+                }
+                // Binary search for the value among the ones the compactor kept.
+                size_t lo = 0, hi = count;
+                while (lo < hi) {
+                        size_t mid = lo + (hi - lo) / 2;
+                        if (old_offsets[mid] < s->offset) lo = mid + 1;
+                        else hi = mid;
+                }
+                if (lo < count && old_offsets[lo] == s->offset) {
+                        s->offset = new_offsets[lo];
+                }
+        }
+        pthread_rwlock_unlock(&kv_lock);
+}
+
+/**
+ * @brief Frees the index.
+ */
+void aesdkv_close(void) {
+        pthread_rwlock_wrlock(&kv_lock);
+        for (size_t i = 0; i < slot_count; i++) {
+                if (slots[i].key != NULL) {
+                        aesdmem_release(AESDMEM_INDEX, slots[i].key_len);
+                }
+                free(slots[i].key);
+        }
+        free(slots);
+        aesdmem_release(AESDMEM_INDEX, slot_count * sizeof(*slots));
+        slots = NULL;
+        slot_count = 0;
+        used_count = 0;
+        pthread_rwlock_unlock(&kv_lock);
+}
@@ -0,0 +1,29 @@
+/**
+ *  @file aesdkv.h
+ *  @brief In-memory key index for the keyed record mode of aesdsocket.
+ *
+ *  With `-k` a packet of the form `PUT <key> <value>` is appended to the data file
+ *  as usual, and the index remembers where the latest value of `<key>` lives in the
+ *  file. `GET <key>` is then answered with a single `sendfile()` of that value
+ *  instead of a replay of the whole log.
+ *
+ *  The index is an open-addressing hash table with linear probing, doubled when it
+ *  becomes 70% full. It is safe to use from several connection threads.
+ */
+#ifndef AESDKV_H
+#define AESDKV_H
+
+#include <stdbool.h>     /**< @brief Provides a boolean type and values (`true`, `false`). */
+#include <stddef.h>      /**< @brief Provides `size_t`. */
+#include <stdint.h>      /**< @brief Provides fixed width integer types (e.g., `uint64_t`). */
+
+#define AESDKV_PUT "PUT "               /**< @brief Start of a packet that stores a value. */
+#define AESDKV_GET "GET "               /**< @brief Start of a packet that fetches a value. */
+#define AESDKV_KEY_MAX 255              /**< @brief Longest accepted key. */
+
+int aesdkv_put(const char *key, size_t key_len, uint64_t offset, uint32_t len);
+bool aesdkv_get(const char *key, size_t key_len, uint64_t *offset, uint32_t *len);
+void aesdkv_relocate(uint64_t boundary, uint64_t shrink, const uint64_t *old_offsets, const uint64_t *new_offsets, size_t count);
+void aesdkv_close(void);
+
+#endif /* AESDKV_H */
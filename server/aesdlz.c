@@ -0,0 +1,154 @@
+/**
+ *  @file aesdlz.c
+ *  @brief LZ4 block format compressor and decompressor (see aesdlz.h).
+ */
+#include "aesdlz.h"
+
+#include <stdbool.h>     /**< @brief Provides a boolean type and values (`true`, `false`). */
+#include <string.h>      /**< @brief Provides `memcpy()`. */
+
+#define LZ_MINMATCH 4                           /**< @brief Shortest match the format can express. */
+#define LZ_LASTLITERALS 5                       /**< @brief The last bytes of a block are always literals. */
+#define LZ_MFLIMIT 12                           /**< @brief The last match starts at least this far from the end. */
+
+static uint32_t lz_read32(const uint8_t *p) { uint32_t v; memcpy(&v, p, 4); return v; }
+static uint32_t lz_hash(uint32_t v) { return (v * 2654435761u) >> (32 - AESDLZ_HASH_BITS); }
+
+/**
+ * @brief Writes the extra bytes of a length whose 4-bit field in the token is saturated.
+ */
+static uint8_t *lz_put_len(uint8_t *op, size_t len) {
+        while (len >= 255) {
+                *op++ = 255;
+                len -= 255;
+        }
+        *op++ = (uint8_t)len;
+        return op;
+}
+
+/**
+ * @brief Writes one sequence: the literals `lits[0..lit)` followed by an optional match.
+ */
+static uint8_t *lz_put_sequence(uint8_t *op, const uint8_t *lits, size_t lit, size_t offset, size_t match_len) {
+        uint8_t *token = op++;
+        *token = (uint8_t)((lit >= 15 ? 15 : lit) << 4);
+        if (lit >= 15) op = lz_put_len(op, lit - 15);
+        memcpy(op, lits, lit);
+        op += lit;
+        if (match_len == 0) {
+                return op;
+        }
+        *op++ = (uint8_t)(offset & 0xff);
+        *op++ = (uint8_t)(offset >> 8);
+        size_t ml = match_len - LZ_MINMATCH;
+        *token |= (uint8_t)(ml >= 15 ? 15 : ml);
+        if (ml >= 15) op = lz_put_len(op, ml - 15);
+        return op;
+}
+
+/**
+ * @brief Compresses `n` bytes (at most `AESDLZ_BLOCK_MAX`) into the LZ4 block format.
+ * @param `src` The input.
+ * @param `n` Length of the input.
+ * @param `dst` Output buffer of at least `AESDLZ_BOUND(n)` bytes.
+ * @param `level` 1 (fastest) to 9 (smallest).
+ * @param `work` Scratch memory, not shared with another thread while compressing.
+ * @return The compressed length.
+ * @details Every position is linked into a hash chain; up to `1 << (level - 1)` earlier
+ * positions with the same hash are compared and the longest match wins.
+ */
+size_t aesdlz_compress(const uint8_t *src, size_t n, uint8_t *dst, int level, struct aesdlz_work *work) {
+        int32_t *head = work->head;
+        int32_t *chain = work->chain;
+        int attempts = 1 << (level - 1);
+        uint8_t *op = dst;
+        size_t anchor = 0;
+        size_t ip = 0;
+        for (size_t i = 0; i < (1u << AESDLZ_HASH_BITS); i++) head[i] = -1;
+        size_t limit = n > LZ_MFLIMIT ? n - LZ_MFLIMIT : 0;
+        // Loop invariant: `src[0..anchor)` has been encoded; `src[anchor..ip)` are pending literals.
+        while (ip < limit) {
+                uint32_t seq = lz_read32(src + ip);
+                uint32_t h = lz_hash(seq);
+                size_t best_len = 0;
+                size_t best_pos = 0;
+                int32_t cand = head[h];
+                for (int a = 0; a < attempts && cand >= 0; a++, cand = chain[cand]) {
+                        if (lz_read32(src + cand) != seq) continue;
+                        size_t len = LZ_MINMATCH;
+                        size_t max = n - LZ_LASTLITERALS - ip;
+                        while (len < max && src[cand + len] == src[ip + len]) len++;
+                        if (len > best_len) {
+                                best_len = len;
+                                best_pos = (size_t)cand;
+                        }
+                }
+                chain[ip] = head[h];
+                head[h] = (int32_t)ip;
+                if (best_len < LZ_MINMATCH) {
+                        ip++;
+                        continue;
+                }
+                op = lz_put_sequence(op, src + anchor, ip - anchor, ip - best_pos, best_len);
+                // Link the positions inside the match too, so later matches can start there.
+                for (size_t p = ip + 1; p < ip + best_len && p < limit; p++) {
+                        h = lz_hash(lz_read32(src + p));
+                        chain[p] = head[h];
+                        head[h] = (int32_t)p;
+                }
+                ip += best_len;
+                anchor = ip;
+        }
+        op = lz_put_sequence(op, src + anchor, n - anchor, 0, 0);
+        return (size_t)(op - dst);
+}
+
+/**
+ * @brief Reads the extra bytes of a saturated length field.
+ * @return false if the input ends first.
+ */
+static bool lz_get_len(const uint8_t *src, size_t n, size_t *ip, size_t *len) {
+        uint8_t b;
+        do {
+                if (*ip >= n) return false;
+                b = src[(*ip)++];
+                *len += b;
+        } while (b == 255);
+        return true;
+}
+
+/**
+ * @brief Decompresses an LZ4 block.
+ * @return The decompressed length, or -1 if the input is malformed or does not fit into `cap` bytes.
+ */
+ssize_t aesdlz_decompress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap) {
+        size_t ip = 0;
+        size_t op = 0;
+        while (ip < n) {
+                uint8_t token = src[ip++];
+                size_t lit = token >> 4;
+                if (lit == 15 && !lz_get_len(src, n, &ip, &lit)) return -1;
+                if (lit > n - ip || lit > cap - op) return -1;
+                memcpy(dst + op, src + ip, lit);
+                ip += lit;
+                op += lit;
+                if (ip == n) {
+                        break; // the last sequence has no match
+                }
+                if (n - ip < 2) return -1;
+                size_t offset = (size_t)src[ip] | ((size_t)src[ip + 1] << 8);
+                ip += 2;
+                size_t ml = token & 15;
+                if (ml == 15 && !lz_get_len(src, n, &ip, &ml)) return -1;
+                ml += LZ_MINMATCH;
+                if (offset == 0 || offset > op || ml > cap - op) return -1;
+                if (offset >= ml) {
+                        memcpy(dst + op, dst + op - offset, ml);
+                } else {
+                        // Overlapping match: repeats the last `offset` bytes.
+                        for (size_t i = 0; i < ml; i++) dst[op + i] = dst[op - offset + i];
+                }
+                op += ml;
+        }
+        return (ssize_t)op;
+}
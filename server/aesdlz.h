@@ -0,0 +1,32 @@
+/**
+ *  @file aesdlz.h
+ *  @brief In-tree LZ77 block codec writing the LZ4 block format.
+ *
+ *  Used for cold data file blocks (`-z`) and compressed replays (`-w`). Blocks are at
+ *  most `AESDLZ_BLOCK_MAX` bytes, so every match offset fits the format's 16 bits.
+ *  The level (1 to 9) sets how many earlier positions with the same hash are tried
+ *  for every match: 1 is fastest, 9 gives the best ratio.
+ */
+#ifndef AESDLZ_H
+#define AESDLZ_H
+
+#include <stdint.h>      /**< @brief Provides fixed width integer types (e.g., `uint8_t`). */
+#include <sys/types.h>   /**< @brief Provides `ssize_t`. */
+
+#define AESDLZ_BLOCK_MAX (64 * 1024)            /**< @brief Largest block the codec accepts. */
+#define AESDLZ_BOUND(n) ((n) + (n) / 255 + 16)  /**< @brief Worst-case compressed size of `n` bytes. */
+#define AESDLZ_HASH_BITS 16                     /**< @brief Size of the match finder's hash table. */
+
+/**
+ * @struct aesdlz_work
+ * @brief Scratch memory of the compressor; one per compressing thread.
+ */
+struct aesdlz_work {
+        int32_t head[1u << AESDLZ_HASH_BITS];   /**< Latest position per hash. */
+        int32_t chain[AESDLZ_BLOCK_MAX];        /**< Previous position with the same hash. */
+};
+
+size_t aesdlz_compress(const uint8_t *src, size_t n, uint8_t *dst, int level, struct aesdlz_work *work);
+ssize_t aesdlz_decompress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap);
+
+#endif /* AESDLZ_H */
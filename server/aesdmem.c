@@ -0,0 +1,170 @@
+/**
+ *  @file aesdmem.c
+ *  @brief Memory accounting and budget (see aesdmem.h).
+ */
+#include "aesdmem.h"
+
+#include <pthread.h>     /**< @brief Provides the lock and condition paused connections wait on. */
+#include <stdatomic.h>   /**< @brief Provides the atomic counters charged by every thread. */
+#include <stdio.h>       /**< @brief Provides `snprintf()`. */
+#include <syslog.h>      /**< @brief Provides `syslog()`. */
+#include <time.h>        /**< @brief Provides `clock_gettime()` for the pause deadline. */
+
+static const char *class_names[AESDMEM_CLASSES] = { "recv", "replay", "pending", "cache", "index" };
+
+// --- Accounting State ---
+static _Atomic int64_t used[AESDMEM_CLASSES];                   /**< Bytes charged to each class. */
+static _Atomic int64_t total = 0;                               /**< Sum of `used`. */
+static _Atomic int64_t peak = 0;                                /**< Highest `total` seen. */
+static _Atomic uint64_t budget = 0;                             /**< The budget in bytes, 0 for none. */
+static atomic_bool budgeted = false;                            /**< Whether a budget was ever set. */
+static atomic_int waiting = 0;                                  /**< Connections paused in `aesdmem_admit()`. */
+static pthread_mutex_t room_lock = PTHREAD_MUTEX_INITIALIZER;   /**< Guards the wait for `room`. */
+static pthread_cond_t room = PTHREAD_COND_INITIALIZER;          /**< Signalled when the total falls below the low watermark. */
+
+// --- Statistics (reported on close) ---
+static atomic_ulong stat_paused = 0;            /**< Reads paused by back-pressure. */
+static atomic_ulong stat_overrun = 0;           /**< Pauses that ended at `MEM_PAUSE_MS` with the budget still exceeded. */
+static _Atomic uint64_t stat_pause_ns = 0;      /**< Time connections spent paused. */
+static _Atomic uint64_t stat_evicted = 0;       /**< Cache bytes dropped under pressure. */
+
+/**
+ * @brief Sets the budget.
+ * @param `bytes` The budget, or 0 to account without a limit.
+ * @details Lowering it takes effect before the next packet of every connection; raising
+ * it wakes connections paused by the old one.
+ */
+void aesdmem_set_budget(uint64_t bytes) {
+        atomic_store(&budget, bytes);
+        if (bytes > 0) {
+                atomic_store(&budgeted, true);
+        }
+        pthread_mutex_lock(&room_lock);
+        pthread_cond_broadcast(&room);
+        pthread_mutex_unlock(&room_lock);
+}
+
+/**
+ * @brief The budget in bytes, 0 if there is none.
+ */
+uint64_t aesdmem_budget(void) {
+        return atomic_load(&budget);
+}
+
+/**
+ * @brief `pct` percent of the budget `b`, in bytes.
+ */
+static int64_t watermark(uint64_t b, int pct) {
+        return (int64_t)(b / 100 * (uint64_t)pct + b % 100 * (uint64_t)pct / 100);
+}
+
+/**
+ * @brief Charges `bytes` to class `cls`.
+ */
+void aesdmem_charge(int cls, size_t bytes) {
+        atomic_fetch_add_explicit(&used[cls], (int64_t)bytes, memory_order_relaxed);
+        int64_t now = atomic_fetch_add_explicit(&total, (int64_t)bytes, memory_order_relaxed) + (int64_t)bytes;
+        int64_t high = atomic_load_explicit(&peak, memory_order_relaxed);
+        while (now > high && !atomic_compare_exchange_weak(&peak, &high, now));
+}
+
+/**
+ * @brief Gives back `bytes` charged to class `cls`, waking paused connections once there is room.
+ */
+void aesdmem_release(int cls, size_t bytes) {
+        atomic_fetch_sub_explicit(&used[cls], (int64_t)bytes, memory_order_relaxed);
+        int64_t now = atomic_fetch_sub_explicit(&total, (int64_t)bytes, memory_order_relaxed) - (int64_t)bytes;
+        if (atomic_load(&waiting) > 0 && now < watermark(atomic_load(&budget), MEM_LOW_PCT)) {
+                pthread_mutex_lock(&room_lock);
+                pthread_cond_broadcast(&room);
+                pthread_mutex_unlock(&room_lock);
+        }
+}
+
+/**
+ * @brief Whether the total has reached the high watermark of the budget.
+ */
+bool aesdmem_pressure(void) {
+        uint64_t b = atomic_load(&budget);
+        return b > 0 && atomic_load_explicit(&total, memory_order_relaxed) >= watermark(b, MEM_HIGH_PCT);
+}
+
+/**
+ * @brief Pauses a connection between two packets while the server is under memory pressure.
+ * @details Returns right away without pressure. Otherwise waits until the total falls
+ * below the low watermark, the budget is raised, or `MEM_PAUSE_MS` passed.
+ */
+void aesdmem_admit(void) {
+        if (!aesdmem_pressure()) {
+                return;
+        }
+        atomic_fetch_add(&stat_paused, 1);
+        struct timespec start, deadline;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += MEM_PAUSE_MS / 1000;
+        deadline.tv_nsec += (long)(MEM_PAUSE_MS % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+        }
+        int rc = 0;
+        pthread_mutex_lock(&room_lock);
+        atomic_fetch_add(&waiting, 1);
+        // Loop invariant: the total was at or above the low watermark when last checked.
+        while (rc == 0 && atomic_load(&budget) > 0 &&
+               atomic_load(&total) >= watermark(atomic_load(&budget), MEM_LOW_PCT)) {
+                rc = pthread_cond_timedwait(&room, &room_lock, &deadline);
+        }
+        atomic_fetch_sub(&waiting, 1);
+        pthread_mutex_unlock(&room_lock);
+        if (rc != 0) {
+                atomic_fetch_add(&stat_overrun, 1);
+        }
+        struct timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        atomic_fetch_add(&stat_pause_ns, (uint64_t)((end.tv_sec - start.tv_sec) * 1000000000LL + (end.tv_nsec - start.tv_nsec)));
+}
+
+/**
+ * @brief Records that a cache dropped `bytes` because of memory pressure.
+ */
+void aesdmem_evicted(size_t bytes) {
+        atomic_fetch_add(&stat_evicted, bytes);
+}
+
+/**
+ * @brief Formats the current usage, one `key=value` line each.
+ * @param `buf` Receives the lines.
+ * @param `len` Capacity of `buf`; the lines are cut short if it is too small.
+ */
+void aesdmem_metrics(char *buf, size_t len) {
+        size_t off = 0;
+        for (int cls = 0; cls < AESDMEM_CLASSES && off < len; cls++) {
+                int n = snprintf(buf + off, len - off, "mem_%s=%lld\n", class_names[cls], (long long)atomic_load(&used[cls]));
+                off += n > 0 ? (size_t)n : 0;
+        }
+        if (off < len) {
+                snprintf(buf + off, len - off, "mem_total=%lld\nmem_peak=%lld\nmem_budget=%llu\nmem_pressure=%d\n"
+                             "mem_paused=%lu\nmem_paused_ms=%.1f\nmem_evicted=%llu\n",
+                             (long long)atomic_load(&total), (long long)atomic_load(&peak),
+                             (unsigned long long)atomic_load(&budget), aesdmem_pressure(),
+                             (unsigned long)atomic_load(&stat_paused), (double)atomic_load(&stat_pause_ns) / 1e6,
+                             (unsigned long long)atomic_load(&stat_evicted));
+        }
+}
+
+/**
+ * @brief Reports the peak usage against the budget and how often back-pressure acted.
+ */
+void aesdmem_close(void) {
+        if (!atomic_load(&budgeted)) {
+                return;
+        }
+        syslog(LOG_INFO, "Memory: peak %lld bytes of a %llu byte budget, %lld still charged; "
+               "%lu reads paused for %.1f ms (%lu past %d ms), %llu cache bytes evicted",
+               (long long)atomic_load(&peak), (unsigned long long)atomic_load(&budget), (long long)atomic_load(&total),
+               (unsigned long)atomic_load(&stat_paused), (double)atomic_load(&stat_pause_ns) / 1e6,
+               (unsigned long)atomic_load(&stat_overrun), MEM_PAUSE_MS,
+               (unsigned long long)atomic_load(&stat_evicted));
+}
@@ -0,0 +1,53 @@
+/**
+ *  @file aesdmem.h
+ *  @brief Memory accounting and a global memory budget with back-pressure.
+ *
+ *  Every buffer the server holds on behalf of clients is charged to one class:
+ *  - `AESDMEM_RECV`: receive buffers of connections;
+ *  - `AESDMEM_REPLAY`: send buffers of replays in progress;
+ *  - `AESDMEM_PENDING`: the start of long packets held until their newline arrives;
+ *  - `AESDMEM_CACHE`: compressed replay frames (see aesdwire.h);
+ *  - `AESDMEM_INDEX`: the key, time and content indexes (see aesdkv.h, aesdtime.h, aesddedup.h).
+ *
+ *  With `-M <MiB>` (or the `memory_budget` tunable, see aesdconf.h) the total is held
+ *  under a budget by back-pressure instead of failing allocations:
+ *  - once the total reaches `MEM_HIGH_PCT` of the budget, a connection that is between
+ *    packets stops reading until the total falls below `MEM_LOW_PCT`, for at most
+ *    `MEM_PAUSE_MS` per packet (the memory may be held by the paused connections
+ *    themselves, so a pause must not wait forever);
+ *  - caches are evicted: the next compressed replay drops every cached frame and caches
+ *    no new ones while the pressure lasts.
+ *
+ *  The budget and the counters are per process; in prefork mode (`-W`) each worker has
+ *  its own. The current usage is answered by `METRICS` on the control socket and the
+ *  peak is reported on close.
+ */
+#ifndef AESDMEM_H
+#define AESDMEM_H
+
+#include <stdbool.h>     /**< @brief Provides a boolean type and values (`true`, `false`). */
+#include <stddef.h>      /**< @brief Provides `size_t`. */
+#include <stdint.h>      /**< @brief Provides fixed width integer types (e.g., `uint64_t`). */
+
+#define AESDMEM_RECV 0          /**< @brief Receive buffers of connections. */
+#define AESDMEM_REPLAY 1        /**< @brief Send buffers of replays. */
+#define AESDMEM_PENDING 2       /**< @brief Long packets held by connections. */
+#define AESDMEM_CACHE 3         /**< @brief Compressed replay frames. */
+#define AESDMEM_INDEX 4         /**< @brief Key, time and content indexes. */
+#define AESDMEM_CLASSES 5       /**< @brief Number of classes. */
+
+#define MEM_HIGH_PCT 90         /**< @brief Share of the budget at which back-pressure starts. */
+#define MEM_LOW_PCT 75          /**< @brief Share of the budget below which paused reads resume. */
+#define MEM_PAUSE_MS 500        /**< @brief Longest a connection is paused before one packet. */
+
+void aesdmem_set_budget(uint64_t bytes);
+uint64_t aesdmem_budget(void);
+void aesdmem_charge(int cls, size_t bytes);
+void aesdmem_release(int cls, size_t bytes);
+bool aesdmem_pressure(void);
+void aesdmem_admit(void);
+void aesdmem_evicted(size_t bytes);
+void aesdmem_metrics(char *buf, size_t len);
+void aesdmem_close(void);
+
+#endif /* AESDMEM_H */
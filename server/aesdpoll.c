@@ -0,0 +1,117 @@
+/**
+ *  @file aesdpoll.c
+ *  @brief Spin-then-block receive wait (see aesdpoll.h).
+ */
+#include "aesdpoll.h"
+
+#include <errno.h>       /**< @brief Provides definitions for error numbers (e.g., `EAGAIN`). */
+#include <poll.h>        /**< @brief Provides `poll()`, the blocking half of the wait. */
+#include <stdatomic.h>   /**< @brief Provides the atomic statistics updated by connection threads. */
+#include <stdbool.h>     /**< @brief Provides a boolean type and values (`true`, `false`). */
+#include <stdint.h>      /**< @brief Provides fixed width integer types (e.g., `uint64_t`). */
+#include <string.h>      /**< @brief Provides `strerror()`. */
+#include <sys/socket.h>  /**< @brief Provides `recv()`, `setsockopt()`, `SO_BUSY_POLL`. */
+#include <syslog.h>      /**< @brief Provides `syslog()`. */
+#include <time.h>        /**< @brief Provides `clock_gettime()` used to bound the spin. */
+
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69  /**< @brief Linux 5.11; older headers lack it and older kernels reject it. */
+#endif
+
+// --- Busy-Poll State (written by `aesdpoll_init()` only) ---
+static uint64_t spin_ns = 0;            /**< Spin budget per wait; 0 when busy polling is off. */
+
+// --- Statistics (reported on close) ---
+static atomic_ulong stat_spin_hits = 0;         /**< Waits that data (or end-of-file) ended while spinning. */
+static atomic_ulong stat_blocked = 0;           /**< Waits that outlasted the spin and blocked. */
+static atomic_ulong stat_kernel_busy = 0;       /**< Sockets the kernel busy-polls for. */
+static atomic_ullong stat_spin_ns = 0;          /**< Time spent spinning. */
+
+/**
+ * @brief Nanoseconds of `CLOCK_MONOTONIC`.
+ */
+static uint64_t now_ns(void) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * @brief Enables busy polling with a spin budget.
+ * @param `spin_us` Microseconds a wait spins before it blocks.
+ */
+void aesdpoll_init(long spin_us) {
+        spin_ns = (uint64_t)spin_us * 1000;
+}
+
+/**
+ * @brief Asks the kernel to busy-poll the receive queue of a connection.
+ * @param `client_fd` The connected client socket.
+ * @details Failing is not an error: the socket is then only spun on from user space.
+ */
+void aesdpoll_prepare(int client_fd) {
+        if (spin_ns == 0) {
+                return;
+        }
+        int budget_us = (int)(spin_ns / 1000);
+        int one = 1;
+        if (setsockopt(client_fd, SOL_SOCKET, SO_BUSY_POLL, &budget_us, sizeof(budget_us)) != 0) {
+                static atomic_bool warned = false;
+                if (!atomic_exchange(&warned, true)) {
+                        syslog(LOG_WARNING, "No kernel busy polling, spinning in user space only: %s", strerror(errno));
+                }
+                return;
+        }
+        setsockopt(client_fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &one, sizeof(one));
+        atomic_fetch_add(&stat_kernel_busy, 1);
+}
+
+/**
+ * @brief Waits until a connection has data or reached end-of-file.
+ * @param `client_fd` The connected client socket.
+ * @param `wake_fd` A descriptor that also ends the blocking half when readable, or -1.
+ * @return 0 once `recv()` will not block or `wake_fd` is readable, -1 if `poll()` failed.
+ * @details The spin peeks without consuming, so the caller's `recv()` reads the data.
+ * Only the blocking half watches `wake_fd`; the spin is short enough to finish first.
+ */
+int aesdpoll_wait(int client_fd, int wake_fd) {
+        char byte;
+        uint64_t start = now_ns();
+        uint64_t now = start;
+        // Loop invariant: the socket had neither data nor end-of-file at the last peek.
+        do {
+                ssize_t n = recv(client_fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+                if (n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+                        now = now_ns();
+                        atomic_fetch_add(&stat_spin_ns, now - start);
+                        atomic_fetch_add(&stat_spin_hits, 1);
+                        return 0;
+                }
+                now = now_ns();
+        } while (now - start < spin_ns);
+        atomic_fetch_add(&stat_spin_ns, now - start);
+        atomic_fetch_add(&stat_blocked, 1);
+        // `poll()` ignores the second entry while `wake_fd` is -1.
+        struct pollfd pfd[2] = { { .fd = client_fd, .events = POLLIN }, { .fd = wake_fd, .events = POLLIN } };
+        if (poll(pfd, 2, -1) < 0 && errno != EINTR) {
+                return -1;
+        }
+        return 0;
+}
+
+/**
+ * @brief Reports how many waits the spin satisfied.
+ */
+void aesdpoll_close(void) {
+        if (spin_ns == 0) {
+                return;
+        }
+        unsigned long hits = atomic_load(&stat_spin_hits);
+        unsigned long blocked = atomic_load(&stat_blocked);
+        syslog(LOG_INFO, "Busy polling (%llu us budget): %lu waits ended while spinning, %lu blocked (%.1f%% spin hits), "
+               "%.1f ms spun, %lu sockets busy-polled by the kernel",
+               (unsigned long long)(spin_ns / 1000), hits, blocked,
+               hits + blocked ? 100.0 * (double)hits / (double)(hits + blocked) : 0.0,
+               (double)atomic_load(&stat_spin_ns) / 1e6, (unsigned long)atomic_load(&stat_kernel_busy));
+        spin_ns = 0;
+}
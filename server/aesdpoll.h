@@ -0,0 +1,24 @@
+/**
+ *  @file aesdpoll.h
+ *  @brief Busy-polling receive wait for latency-critical connections.
+ *
+ *  With `-P <spin_us>` the thread serving a connection trades its CPU for latency: before
+ *  each receive it spins for up to `spin_us` microseconds with non-blocking `recv()` peeks
+ *  and only then blocks in `poll()`. Every connection socket also gets `SO_BUSY_POLL` (and
+ *  `SO_PREFER_BUSY_POLL`) with the same budget, so on drivers that support it those peeks
+ *  poll the NIC receive queue directly instead of waiting for its interrupt. Setting a
+ *  budget above `net.core.busy_read` needs `CAP_NET_ADMIN`; without it only the user
+ *  space spin is used.
+ *
+ *  Combined with `-t` and `-a` every connection has a dedicated, pinned thread. How many
+ *  waits the spin satisfied is reported on close.
+ */
+#ifndef AESDPOLL_H
+#define AESDPOLL_H
+
+void aesdpoll_init(long spin_us);
+void aesdpoll_prepare(int client_fd);
+int aesdpoll_wait(int client_fd, int wake_fd);
+void aesdpoll_close(void);
+
+#endif /* AESDPOLL_H */
@@ -0,0 +1,582 @@
+/**
+ *  @file aesdrepl.c
+ *  @brief Leader and follower threads for aesdsocket replication (see aesdrepl.h).
+ */
+#include "aesdrepl.h"
+#include "aesdshm.h"
+
+#include <arpa/inet.h>   /**< @brief Provides `inet_pton()`, `htonl()`. */
+#include <endian.h>      /**< @brief Provides `htobe64()`, `be64toh()`. */
+#include <errno.h>       /**< @brief Provides definitions for error numbers (e.g., `EINTR`, `EAGAIN`). */
+#include <fcntl.h>       /**< @brief Provides `open()`, `O_APPEND`. */
+#include <poll.h>        /**< @brief Provides `poll()`. */
+#include <pthread.h>     /**< @brief Provides threads, mutexes and condition variables. */
+#include <signal.h>      /**< @brief Provides `pthread_sigmask()`. */
+#include <stdatomic.h>   /**< @brief Provides atomic types shared between threads. */
+#include <stdbool.h>     /**< @brief Provides a boolean type and values (`true`, `false`). */
+#include <stdlib.h>      /**< @brief Provides `strtol()`. */
+#include <string.h>      /**< @brief Provides `memset()`, `strchr()`, `strncpy()`. */
+#include <sys/sendfile.h>/**< @brief Provides `sendfile()` used to ship log data without copying it. */
+#include <sys/socket.h>  /**< @brief Provides socket functions. */
+#include <sys/stat.h>    /**< @brief Provides `fstat()`. */
+#include <sys/un.h>      /**< @brief Provides `struct sockaddr_un`. */
+#include <syslog.h>      /**< @brief Provides `syslog()`. */
+#include <stdio.h>       /**< @brief Provides `snprintf()`. */
+#include <time.h>        /**< @brief Provides `clock_gettime()`. */
+#include <unistd.h>      /**< @brief Provides `close()`, `write()`, `fdatasync()`, `ftruncate()`, `pread()`. */
+
+#define FRAME_HDR_LEN 12                /**< @brief Size of a frame header: 8-byte offset plus 4-byte length. */
+#define RECONNECT_DELAY_S 1             /**< @brief Seconds the leader waits before reconnecting to the follower. */
+#define LAG_REPORT_INTERVAL_S 10        /**< @brief Minimum number of seconds between two lag reports in syslog. */
+
+// --- Shared State ---
+static pthread_t repl_thread;                   /**< The leader or follower thread. */
+static bool repl_running = false;               /**< Whether `repl_thread` has been started. */
+static atomic_bool repl_stop = false;           /**< Asks the thread to exit. */
+static atomic_int repl_listen_fd = -1;          /**< Follower listening socket, shut down by `aesdrepl_stop()`. */
+static atomic_int repl_conn_fd = -1;            /**< Current replication connection, shut down by `aesdrepl_stop()`. */
+static struct sockaddr_storage repl_addr;       /**< Address of the replication link. */
+static socklen_t repl_addr_len;                 /**< Length of `repl_addr`. */
+static char repl_data_path[256];                /**< Data file the thread reads from (leader) or appends to (follower). */
+
+// --- Leader State ---
+static pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;        /**< Protects `commit_len`. */
+static pthread_cond_t commit_cond = PTHREAD_COND_INITIALIZER;          /**< Signalled when `commit_len` grows. */
+static uint64_t commit_len = 0;                                         /**< Committed length of the leader's log. */
+static uint64_t leader_generation = 0;                                  /**< Generation of the leader's log, never 0. */
+
+// --- Follower State ---
+static _Atomic uint64_t follower_len = 0;       /**< Durable length of the follower's log. */
+static uint64_t follower_generation = 0;        /**< Generation of the leader's log mirrored, 0 before the first leader. */
+static int generation_fd = -1;                  /**< `<data_file>.repl`, holding `follower_generation`. */
+
+/**
+ * @brief Parses a replication target into a socket address.
+ * @param `target` A UNIX domain socket path (contains '/') or an IPv4 `host:port` pair.
+ * @return 0 on success, -1 if `target` cannot be parsed.
+ */
+static int parse_target(const char *target) {
+        memset(&repl_addr, 0, sizeof(repl_addr));
+        if (strchr(target, '/') != NULL) {
+                struct sockaddr_un *un = (struct sockaddr_un *)&repl_addr;
+                if (strlen(target) >= sizeof(un->sun_path)) {
+                        return -1;
+                }
+                un->sun_family = AF_UNIX;
+                strncpy(un->sun_path, target, sizeof(un->sun_path) - 1);
+                repl_addr_len = sizeof(*un);
+                return 0;
+        }
+        const char *colon = strrchr(target, ':');
+        char host[INET_ADDRSTRLEN];
+        if (colon == NULL || (size_t)(colon - target) >= sizeof(host)) {
+                return -1;
+        }
+        memcpy(host, target, colon - target);
+        host[colon - target] = '\0';
+        struct sockaddr_in *in = (struct sockaddr_in *)&repl_addr;
+        in->sin_family = AF_INET;
+        in->sin_port = htons((uint16_t)strtol(colon + 1, NULL, 10));
+        if (inet_pton(AF_INET, host, &in->sin_addr) != 1 || in->sin_port == 0) {
+                return -1;
+        }
+        repl_addr_len = sizeof(*in);
+        return 0;
+}
+
+/**
+ * @brief Writes exactly `len` bytes to a socket.
+ * @return 0 on success, -1 on failure.
+ */
+static int write_all(int fd, const void *buf, size_t len) {
+        const char *p = buf;
+        while (len > 0) {
+                ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+                if (n < 0) {
+                        if (errno == EINTR) continue;
+                        return -1;
+                }
+                p += n;
+                len -= (size_t)n;
+        }
+        return 0;
+}
+
+/**
+ * @brief Reads exactly `len` bytes from a socket.
+ * @return 1 on success, 0 if the peer closed the connection first, -1 on failure.
+ */
+static int read_all(int fd, void *buf, size_t len) {
+        char *p = buf;
+        while (len > 0) {
+                ssize_t n = recv(fd, p, len, 0);
+                if (n < 0) {
+                        if (errno == EINTR) continue;
+                        return -1;
+                }
+                if (n == 0) {
+                        return 0;
+                }
+                p += n;
+                len -= (size_t)n;
+        }
+        return 1;
+}
+
+/**
+ * @brief Blocks every signal in the calling thread so that signals keep being delivered to the main thread.
+ */
+static void block_signals(void) {
+        sigset_t all;
+        sigfillset(&all);
+        pthread_sigmask(SIG_BLOCK, &all, NULL);
+}
+
+/**
+ * @brief Returns the value of the monotonic clock in seconds.
+ */
+static time_t now_s(void) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec;
+}
+
+/**
+ * @brief Consumes every acknowledgement the follower has sent so far.
+ * @param `fd` The replication connection.
+ * @param `ack_buf` Partial acknowledgement carried over between calls (8 bytes).
+ * @param `ack_fill` Number of valid bytes in `ack_buf`.
+ * @param `acked` Updated to the newest acknowledged offset.
+ * @param `wait_ms` How long to wait for the first acknowledgement (0 to only drain).
+ * @return 0 on success, -1 if the connection failed or was closed.
+ */
+static int leader_read_acks(int fd, unsigned char *ack_buf, size_t *ack_fill, uint64_t *acked, int wait_ms) {
+        if (wait_ms > 0) {
+                struct pollfd pfd = { .fd = fd, .events = POLLIN };
+                if (poll(&pfd, 1, wait_ms) < 0 && errno != EINTR) {
+                        return -1;
+                }
+        }
+        for (;;) {
+                ssize_t n = recv(fd, ack_buf + *ack_fill, 8 - *ack_fill, MSG_DONTWAIT);
+                if (n < 0) {
+                        if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+                        if (errno == EINTR) continue;
+                        return -1;
+                }
+                if (n == 0) {
+                        return -1;
+                }
+                *ack_fill += (size_t)n;
+                if (*ack_fill == 8) {
+                        uint64_t be;
+                        memcpy(&be, ack_buf, 8);
+                        *acked = be64toh(be);
+                        *ack_fill = 0;
+                }
+        }
+}
+
+/**
+ * @brief Ships `len` bytes of the log starting at `offset` as a single frame.
+ * @return 0 on success, -1 on failure.
+ */
+static int leader_send_frame(int fd, int data_fd, uint64_t offset, uint32_t len) {
+        unsigned char hdr[FRAME_HDR_LEN];
+        uint64_t be_off = htobe64(offset);
+        uint32_t be_len = htonl(len);
+        memcpy(hdr, &be_off, 8);
+        memcpy(hdr + 8, &be_len, 4);
+        if (write_all(fd, hdr, sizeof(hdr)) != 0) {
+                return -1;
+        }
+        off_t pos = (off_t)offset;
+        size_t left = len;
+        while (left > 0) {
+                // `sendfile()` moves the bytes from the page cache to the socket without a user-space copy.
+                ssize_t n = sendfile(fd, data_fd, &pos, left);
+                if (n < 0) {
+                        if (errno == EINTR) continue;
+                        return -1;
+                }
+                if (n == 0) {
+                        return -1; // the log is shorter than its committed length
+                }
+                left -= (size_t)n;
+        }
+        return 0;
+}
+
+/**
+ * @brief Runs one replication session with the follower.
+ * @param `fd` A connected replication socket.
+ * @return Only returns when the session ends (error, follower gone or stop requested).
+ */
+static void leader_session(int fd) {
+        uint64_t be = htobe64(leader_generation);
+        if (write_all(fd, &be, sizeof(be)) != 0) {
+                return;
+        }
+        if (read_all(fd, &be, sizeof(be)) != 1) {
+                syslog(LOG_WARNING, "Replication: no handshake from follower");
+                return;
+        }
+        uint64_t shipped = be64toh(be);
+        uint64_t acked = shipped;
+        unsigned char ack_buf[8];
+        size_t ack_fill = 0;
+        int data_fd = -1;
+        time_t last_report = 0;
+        uint64_t last_lag = UINT64_MAX;
+
+        pthread_mutex_lock(&commit_lock);
+        uint64_t committed = commit_len;
+        pthread_mutex_unlock(&commit_lock);
+        if (shipped > committed) {
+                syslog(LOG_ERR, "Replication: follower is ahead of leader (%llu > %llu), refusing to ship",
+                       (unsigned long long)shipped, (unsigned long long)committed);
+                return;
+        }
+        syslog(LOG_INFO, "Replication: follower resumes at offset %llu", (unsigned long long)shipped);
+
+        while (!atomic_load(&repl_stop)) {
+                // Wait for new commits, waking up periodically to collect acknowledgements.
+                pthread_mutex_lock(&commit_lock);
+                if (commit_len == shipped && !atomic_load(&repl_stop)) {
+                        struct timespec deadline;
+                        clock_gettime(CLOCK_REALTIME, &deadline);
+                        deadline.tv_sec += 1;
+                        pthread_cond_timedwait(&commit_cond, &commit_lock, &deadline);
+                }
+                committed = commit_len;
+                pthread_mutex_unlock(&commit_lock);
+
+                if (committed > shipped && data_fd == -1) {
+                        data_fd = open(repl_data_path, O_RDONLY | O_CLOEXEC);
+                        if (data_fd == -1) {
+                                syslog(LOG_ERR, "Replication: cannot open %s: %m", repl_data_path);
+                                break;
+                        }
+                }
+                // Ship everything committed so far, keeping at most `AESDREPL_WINDOW` bytes unacknowledged.
+                bool failed = false;
+                while (shipped < committed && !atomic_load(&repl_stop)) {
+                        if (shipped - acked >= AESDREPL_WINDOW) {
+                                if (leader_read_acks(fd, ack_buf, &ack_fill, &acked, 1000) != 0) {
+                                        failed = true;
+                                        break;
+                                }
+                                continue;
+                        }
+                        uint64_t len = committed - shipped;
+                        if (len > AESDREPL_BATCH) len = AESDREPL_BATCH;
+                        if (len > AESDREPL_WINDOW - (shipped - acked)) len = AESDREPL_WINDOW - (shipped - acked);
+                        if (leader_send_frame(fd, data_fd, shipped, (uint32_t)len) != 0) {
+                                failed = true;
+                                break;
+                        }
+                        shipped += len;
+                }
+                if (failed || leader_read_acks(fd, ack_buf, &ack_fill, &acked, 0) != 0) {
+                        break;
+                }
+
+                uint64_t lag = committed - acked;
+                if (lag != last_lag && now_s() - last_report >= LAG_REPORT_INTERVAL_S) {
+                        syslog(LOG_INFO, "Replication: committed %llu, acknowledged %llu, lag %llu bytes",
+                               (unsigned long long)committed, (unsigned long long)acked, (unsigned long long)lag);
+                        last_report = now_s();
+                        last_lag = lag;
+                }
+        }
+        syslog(LOG_INFO, "Replication: session ended at acknowledged offset %llu", (unsigned long long)acked);
+        if (data_fd != -1) {
+                close(data_fd);
+        }
+}
+
+/**
+ * @brief Leader thread: (re)connects to the follower and runs replication sessions until stopped.
+ */
+static void *leader_thread(void *arg) {
+        (void)arg;
+        block_signals();
+        while (!atomic_load(&repl_stop)) {
+                int fd = socket(repl_addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+                if (fd == -1) {
+                        syslog(LOG_ERR, "Replication: socket failed: %m");
+                        break;
+                }
+                if (connect(fd, (struct sockaddr *)&repl_addr, repl_addr_len) == 0) {
+                        atomic_store(&repl_conn_fd, fd);
+                        leader_session(fd);
+                        atomic_store(&repl_conn_fd, -1);
+                }
+                close(fd);
+                if (!atomic_load(&repl_stop)) {
+                        sleep(RECONNECT_DELAY_S);
+                }
+        }
+        return NULL;
+}
+
+/**
+ * @brief Starts streaming committed appends of `data_path` to the follower at `target`.
+ * @param `target` UNIX domain socket path or IPv4 `host:port` of the follower.
+ * @param `data_path` The leader's data file.
+ * @return 0 on success, -1 on failure.
+ * @details The follower does not have to be up yet; the leader keeps reconnecting
+ * and resumes from whatever offset the follower reports.
+ */
+int aesdrepl_leader_start(const char *target, const char *data_path) {
+        if (parse_target(target) != 0) {
+                syslog(LOG_ERR, "Replication: invalid target %s", target);
+                return -1;
+        }
+        strncpy(repl_data_path, data_path, sizeof(repl_data_path) - 1);
+        // The data file was just truncated: a follower that mirrored an earlier run must start over.
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        leader_generation = ((uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec) ^ ((uint64_t)getpid() << 48);
+        if (leader_generation == 0) {
+                leader_generation = 1;
+        }
+        if (pthread_create(&repl_thread, NULL, leader_thread, NULL) != 0) {
+                return -1;
+        }
+        repl_running = true;
+        return 0;
+}
+
+/**
+ * @brief Tells the leader thread that the log has been committed up to `committed_len`.
+ * @param `committed_len` The new committed length of the data file.
+ */
+void aesdrepl_leader_commit(uint64_t committed_len) {
+        pthread_mutex_lock(&commit_lock);
+        if (committed_len > commit_len) {
+                commit_len = committed_len;
+                pthread_cond_signal(&commit_cond);
+        }
+        pthread_mutex_unlock(&commit_lock);
+}
+
+/**
+ * @brief Makes the follower mirror the leader generation `generation`.
+ * @param `data_fd` The follower's data file.
+ * @param `generation` Generation announced by the leader.
+ * @return 0 on success, -1 if the local log or `<data_file>.repl` cannot be updated.
+ * @details A new generation means the leader restarted with an empty log, so the local
+ * log is truncated before the new generation is recorded; a crash in between only
+ * truncates again on the next connection.
+ */
+static int follower_adopt(int data_fd, uint64_t generation) {
+        if (generation == follower_generation) {
+                return 0;
+        }
+        if (follower_generation != 0 || atomic_load(&follower_len) > 0) {
+                syslog(LOG_NOTICE, "Replication: leader restarted, discarding %llu bytes of the previous log",
+                       (unsigned long long)atomic_load(&follower_len));
+        }
+        if (ftruncate(data_fd, 0) != 0 || fdatasync(data_fd) != 0) {
+                syslog(LOG_ERR, "Replication: cannot truncate %s: %m", repl_data_path);
+                return -1;
+        }
+        atomic_store(&follower_len, 0);
+        aesdshm_publisher_replace(0);
+        uint64_t be = htobe64(generation);
+        if (pwrite(generation_fd, &be, sizeof(be), 0) != (ssize_t)sizeof(be) || fdatasync(generation_fd) != 0) {
+                syslog(LOG_ERR, "Replication: cannot record the leader generation: %m");
+                return -1;
+        }
+        follower_generation = generation;
+        return 0;
+}
+
+/**
+ * @brief Receives frames from one leader connection and appends them to the local log.
+ * @param `fd` The accepted replication connection.
+ * @param `data_fd` The follower's data file, opened for appending.
+ * @details Data is made durable and acknowledged once the socket has no more
+ * frames queued, so a burst of frames costs a single `fdatasync()`.
+ */
+static void follower_session(int fd, int data_fd) {
+        uint64_t be;
+        if (read_all(fd, &be, sizeof(be)) != 1) {
+                syslog(LOG_WARNING, "Replication: no handshake from leader");
+                return;
+        }
+        if (follower_adopt(data_fd, be64toh(be)) != 0) {
+                return;
+        }
+        uint64_t len = atomic_load(&follower_len);
+        be = htobe64(len);
+        if (write_all(fd, &be, sizeof(be)) != 0) {
+                return;
+        }
+        static char buf[AESDREPL_BATCH];
+        while (!atomic_load(&repl_stop)) {
+                unsigned char hdr[FRAME_HDR_LEN];
+                if (read_all(fd, hdr, sizeof(hdr)) != 1) {
+                        break;
+                }
+                uint64_t be_off;
+                uint32_t be_len;
+                memcpy(&be_off, hdr, 8);
+                memcpy(&be_len, hdr + 8, 4);
+                uint64_t offset = be64toh(be_off);
+                uint32_t frame_len = ntohl(be_len);
+                if (offset != len || frame_len > sizeof(buf)) {
+                        syslog(LOG_ERR, "Replication: unexpected frame at offset %llu (local length %llu)",
+                               (unsigned long long)offset, (unsigned long long)len);
+                        break;
+                }
+                if (read_all(fd, buf, frame_len) != 1) {
+                        break;
+                }
+                // A single `write()` per frame; readers only trust `follower_len`, never EOF.
+                if (write(data_fd, buf, frame_len) != (ssize_t)frame_len) {
+                        syslog(LOG_ERR, "Replication: write to %s failed: %m", repl_data_path);
+                        break;
+                }
+                len += frame_len;
+
+                // Batch durability: only sync and acknowledge once the pipeline is drained.
+                struct pollfd pfd = { .fd = fd, .events = POLLIN };
+                if (poll(&pfd, 1, 0) == 0) {
+                        if (fdatasync(data_fd) != 0) {
+                                syslog(LOG_ERR, "Replication: fdatasync failed: %m");
+                                break;
+                        }
+                        atomic_store(&follower_len, len);
+                        aesdshm_publisher_update(len);
+                        be = htobe64(len);
+                        if (write_all(fd, &be, sizeof(be)) != 0) {
+                                break;
+                        }
+                }
+        }
+}
+
+/**
+ * @brief Follower thread: accepts leader connections one at a time and applies their frames.
+ */
+static void *follower_thread(void *arg) {
+        int listen_fd = (int)(intptr_t)arg;
+        block_signals();
+        int data_fd = open(repl_data_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (data_fd == -1) {
+                syslog(LOG_ERR, "Replication: cannot open %s: %m", repl_data_path);
+                return NULL;
+        }
+        struct stat st;
+        if (fstat(data_fd, &st) == 0) {
+                atomic_store(&follower_len, (uint64_t)st.st_size);
+        }
+        char gen_path[sizeof(repl_data_path) + sizeof(".repl")];
+        snprintf(gen_path, sizeof(gen_path), "%s.repl", repl_data_path);
+        generation_fd = open(gen_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (generation_fd == -1) {
+                syslog(LOG_ERR, "Replication: cannot open %s: %m", gen_path);
+                close(data_fd);
+                return NULL;
+        }
+        uint64_t be;
+        if (pread(generation_fd, &be, sizeof(be), 0) == (ssize_t)sizeof(be)) {
+                follower_generation = be64toh(be);
+        }
+        while (!atomic_load(&repl_stop)) {
+                int fd = accept(listen_fd, NULL, NULL);
+                if (fd == -1) {
+                        if (errno == EINTR) continue;
+                        break;
+                }
+                atomic_store(&repl_conn_fd, fd);
+                syslog(LOG_INFO, "Replication: leader connected");
+                follower_session(fd, data_fd);
+                atomic_store(&repl_conn_fd, -1);
+                close(fd);
+                syslog(LOG_INFO, "Replication: leader disconnected at offset %llu",
+                       (unsigned long long)atomic_load(&follower_len));
+        }
+        close(generation_fd);
+        generation_fd = -1;
+        close(data_fd);
+        return NULL;
+}
+
+/**
+ * @brief Listens on `target` for a leader and mirrors its log into `data_path`.
+ * @param `target` UNIX domain socket path or IPv4 `host:port` to listen on.
+ * @param `data_path` The follower's data file.
+ * @return 0 on success, -1 on failure.
+ */
+int aesdrepl_follower_start(const char *target, const char *data_path) {
+        if (parse_target(target) != 0) {
+                syslog(LOG_ERR, "Replication: invalid target %s", target);
+                return -1;
+        }
+        strncpy(repl_data_path, data_path, sizeof(repl_data_path) - 1);
+        int fd = socket(repl_addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd == -1) {
+                return -1;
+        }
+        if (repl_addr.ss_family == AF_UNIX) {
+                unlink(((struct sockaddr_un *)&repl_addr)->sun_path);
+        } else {
+                int opt = 1;
+                setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+        }
+        if (bind(fd, (struct sockaddr *)&repl_addr, repl_addr_len) != 0 || listen(fd, 1) != 0) {
+                syslog(LOG_ERR, "Replication: cannot listen on %s: %m", target);
+                close(fd);
+                return -1;
+        }
+        atomic_store(&repl_listen_fd, fd);
+        if (pthread_create(&repl_thread, NULL, follower_thread, (void *)(intptr_t)fd) != 0) {
+                close(fd);
+                atomic_store(&repl_listen_fd, -1);
+                return -1;
+        }
+        repl_running = true;
+        return 0;
+}
+
+/**
+ * @brief Returns the durable length of the follower's log.
+ * @details Client replays on a follower stream exactly this many bytes, so they
+ * never include a frame that is still being written.
+ */
+uint64_t aesdrepl_follower_committed(void) {
+        return atomic_load(&follower_len);
+}
+
+/**
+ * @brief Stops the replication thread, if any, and waits for it to exit.
+ */
+void aesdrepl_stop(void) {
+        if (!repl_running) {
+                return;
+        }
+        atomic_store(&repl_stop, true);
+        pthread_mutex_lock(&commit_lock);
+        pthread_cond_signal(&commit_cond);
+        pthread_mutex_unlock(&commit_lock);
+        int fd = atomic_load(&repl_conn_fd);
+        if (fd != -1) {
+                shutdown(fd, SHUT_RDWR);
+        }
+        fd = atomic_load(&repl_listen_fd);
+        if (fd != -1) {
+                shutdown(fd, SHUT_RDWR);
+        }
+        pthread_join(repl_thread, NULL);
+        repl_running = false;
+        fd = atomic_exchange(&repl_listen_fd, -1);
+        if (fd != -1) {
+                close(fd);
+                if (repl_addr.ss_family == AF_UNIX) {
+                        unlink(((struct sockaddr_un *)&repl_addr)->sun_path);
+                }
+        }
+}
@@ -0,0 +1,37 @@
+/**
+ *  @file aesdrepl.h
+ *  @brief Asynchronous leader/follower replication of the aesdsocket data file.
+ *
+ *  A leader (`-r <target>`) streams every committed append to a follower
+ *  (`-F <target>`) over a local link. A target is either a UNIX domain socket path
+ *  (anything containing a '/') or an IPv4 `host:port` pair.
+ *
+ *  Wire protocol, all integers in network byte order:
+ *  - leader -> follower, once per connection: 8-byte generation of the leader's log, chosen
+ *    anew every time the leader starts (and truncates its data file).
+ *  - follower -> leader, once per connection: 8-byte offset the follower has durably stored.
+ *    A follower that mirrored another generation first truncates its log, so it answers 0
+ *    instead of an offset past the end of the restarted leader's log. The generation it
+ *    mirrors is kept in `<data_file>.repl` across follower restarts.
+ *  - leader -> follower: frames of an 8-byte log offset, a 4-byte length and `length` bytes of data.
+ *  - follower -> leader: 8-byte acknowledgements, each the new durable length of the follower's log.
+ *
+ *  The leader keeps up to `AESDREPL_WINDOW` unacknowledged bytes in flight, so
+ *  shipping is pipelined; the difference between the committed and acknowledged
+ *  offsets is the replication lag.
+ */
+#ifndef AESDREPL_H
+#define AESDREPL_H
+
+#include <stdint.h>      /**< @brief Provides fixed width integer types (e.g., `uint64_t`). */
+
+#define AESDREPL_BATCH (64 * 1024)      /**< @brief Largest payload the leader puts into a single frame. */
+#define AESDREPL_WINDOW (1024 * 1024)   /**< @brief Maximum number of shipped but unacknowledged bytes. */
+
+int aesdrepl_leader_start(const char *target, const char *data_path);
+void aesdrepl_leader_commit(uint64_t committed_len);
+int aesdrepl_follower_start(const char *target, const char *data_path);
+uint64_t aesdrepl_follower_committed(void);
+void aesdrepl_stop(void);
+
+#endif /* AESDREPL_H */
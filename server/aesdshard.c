@@ -0,0 +1,384 @@
+/**
+ *  @file aesdshard.c
+ *  @brief Sharded append log and its k-way merged replay (see aesdshard.h).
+ */
+#include "aesdshard.h"
+
+#include <errno.h>       /**< @brief Provides definitions for error numbers (e.g., `EINTR`). */
+#include <fcntl.h>       /**< @brief Provides `open()`, `O_APPEND`. */
+#include <pthread.h>     /**< @brief Provides the mutexes guarding the shard table and each shard. */
+#include <stdbool.h>     /**< @brief Provides a boolean type and values (`true`, `false`). */
+#include <stdio.h>       /**< @brief Provides `snprintf()`. */
+#include <stdlib.h>      /**< @brief Provides `malloc()`, `free()`. */
+#include <string.h>      /**< @brief Provides `memcpy()`. */
+#include <sys/socket.h>  /**< @brief Provides `send()`. */
+#include <sys/uio.h>     /**< @brief Provides `writev()` so header and payload are appended with one syscall. */
+#include <syslog.h>      /**< @brief Provides `syslog()`. */
+#include <time.h>        /**< @brief Provides `clock_gettime()` for the watermark wait. */
+#include <unistd.h>      /**< @brief Provides `pread()`, `fdatasync()`, `close()`, `unlink()`. */
+
+#define CURSOR_BUF_LEN 4096             /**< @brief Read-ahead buffer of each shard cursor during a replay. */
+#define REPLAY_BUF_LEN 4096             /**< @brief Output buffer a replay fills before sending to the client. */
+
+// --- Shard Table ---
+static struct aesdshard shards[AESDSHARD_MAX];                  /**< All shards, `shard_count` of them in use. */
+static int shard_count = 0;                                     /**< Number of shards configured with `-S`. */
+static char shard_base[240];                                    /**< Data file path the shard names derive from. */
+static pthread_mutex_t shard_lock = PTHREAD_MUTEX_INITIALIZER;  /**< Protects the `users` counts. */
+static _Atomic uint64_t next_seq = 0;                           /**< Global sequence counter shared by all shards. */
+static pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER; /**< Pairs with `commit_cond`. */
+static pthread_cond_t commit_cond = PTHREAD_COND_INITIALIZER;   /**< Signalled whenever the watermark may have moved. */
+
+/**
+ * @struct shard_cursor
+ * @brief Read position inside one shard during a merged replay.
+ */
+struct shard_cursor {
+        int fd;                 /**< Shard file descriptor (shared, only accessed with `pread()`). */
+        uint64_t pos;           /**< Offset of the next byte to consume. */
+        uint64_t end;           /**< Committed length captured when the replay started. */
+        uint64_t watermark;     /**< First sequence number the replay leaves out. */
+        char *buf;              /**< Read-ahead buffer of `CURSOR_BUF_LEN` bytes. */
+        uint64_t buf_pos;       /**< File offset of `buf[0]`. */
+        size_t buf_len;         /**< Number of valid bytes in `buf`. */
+        uint64_t seq;           /**< Sequence number of the record at `pos`. */
+        uint32_t len;           /**< Payload length of the record at `pos`. */
+};
+
+/**
+ * @brief Builds the file name of shard `index`.
+ */
+static void shard_path(char *path, size_t size, int index) {
+        snprintf(path, size, "%s.%d", shard_base, index);
+}
+
+/**
+ * @brief Creates `count` empty shard files next to `data_path`.
+ * @param `data_path` The configured data file; shards are named `<data_path>.<i>`.
+ * @param `count` Number of shards, between 1 and `AESDSHARD_MAX`.
+ * @return 0 on success, -1 on failure.
+ */
+int aesdshard_init(const char *data_path, int count) {
+        if (count < 1 || count > AESDSHARD_MAX) {
+                syslog(LOG_ERR, "Shard count must be between 1 and %d", AESDSHARD_MAX);
+                return -1;
+        }
+        snprintf(shard_base, sizeof(shard_base), "%s", data_path);
+        for (int i = 0; i < count; i++) {
+                char path[256];
+                shard_path(path, sizeof(path), i);
+                shards[i].index = i;
+                shards[i].fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+                if (shards[i].fd == -1) {
+                        syslog(LOG_ERR, "Cannot create shard %s: %m", path);
+                        shard_count = i;
+                        aesdshard_close(false);
+                        return -1;
+                }
+                pthread_mutex_init(&shards[i].lock, NULL);
+                shards[i].written = 0;
+                atomic_store(&shards[i].committed, 0);
+                atomic_store(&shards[i].pending_seq, UINT64_MAX);
+                shards[i].users = 0;
+        }
+        shard_count = count;
+        return 0;
+}
+
+/**
+ * @brief Assigns the calling connection to the shard with the fewest connections.
+ * @return The assigned shard; it is shared once there are more connections than shards.
+ */
+struct aesdshard *aesdshard_acquire(void) {
+        pthread_mutex_lock(&shard_lock);
+        struct aesdshard *best = &shards[0];
+        for (int i = 1; i < shard_count; i++) {
+                if (shards[i].users < best->users) {
+                        best = &shards[i];
+                }
+        }
+        best->users++;
+        pthread_mutex_unlock(&shard_lock);
+        return best;
+}
+
+/**
+ * @brief Unassigns a connection from its shard.
+ */
+void aesdshard_release(struct aesdshard *shard) {
+        pthread_mutex_lock(&shard_lock);
+        shard->users--;
+        pthread_mutex_unlock(&shard_lock);
+}
+
+/**
+ * @brief Appends one record to the caller's shard.
+ * @param `shard` The shard the caller is assigned to.
+ * @param `buf` The payload.
+ * @param `len` Length of the payload in bytes.
+ * @param `seq` Receives the sequence number of the record, or NULL.
+ * @return 0 on success, -1 on failure.
+ * @details The record gets the next global sequence number. The number is taken under
+ * the shard's mutex, so the records of a shard are in sequence order. It becomes visible
+ * to replays after `aesdshard_commit()`.
+ */
+int aesdshard_append(struct aesdshard *shard, const char *buf, size_t len, uint64_t *seq) {
+        unsigned char hdr[AESDSHARD_REC_HDR_LEN];
+        pthread_mutex_lock(&shard->lock);
+        // Announce the record before its number is taken, so a replay that sees the number
+        // taken also sees that the shard has a record pending.
+        if (atomic_load(&shard->pending_seq) == UINT64_MAX) {
+                atomic_store(&shard->pending_seq, atomic_load(&next_seq));
+        }
+        uint64_t rec_seq = atomic_fetch_add(&next_seq, 1);
+        uint32_t len32 = (uint32_t)len;
+        memcpy(hdr, &rec_seq, 8);
+        memcpy(hdr + 8, &len32, 4);
+        struct iovec iov[2] = {
+                { .iov_base = hdr, .iov_len = sizeof(hdr) },
+                { .iov_base = (void *)buf, .iov_len = len },
+        };
+        ssize_t n = writev(shard->fd, iov, 2);
+        if (n != (ssize_t)(sizeof(hdr) + len)) {
+                // The number is never used; it must not hold the watermark back.
+                if (shard->written == atomic_load(&shard->committed)) {
+                        atomic_store(&shard->pending_seq, UINT64_MAX);
+                }
+                pthread_mutex_unlock(&shard->lock);
+                pthread_mutex_lock(&commit_lock);
+                pthread_cond_broadcast(&commit_cond);
+                pthread_mutex_unlock(&commit_lock);
+                return -1;
+        }
+        shard->written += (uint64_t)n;
+        pthread_mutex_unlock(&shard->lock);
+        if (seq != NULL) {
+                *seq = rec_seq;
+        }
+        return 0;
+}
+
+/**
+ * @brief Makes everything appended to `shard` so far durable and visible to replays.
+ * @return 0 on success, -1 on failure.
+ * @details The sync runs without the shard's mutex, so the other connections of the shard
+ * keep appending; the records they append meanwhile are left to their own commits.
+ */
+int aesdshard_commit(struct aesdshard *shard) {
+        pthread_mutex_lock(&shard->lock);
+        uint64_t target = shard->written;
+        // Records appended after this point get this number or a later one.
+        uint64_t target_next = atomic_load(&next_seq);
+        pthread_mutex_unlock(&shard->lock);
+        if (fdatasync(shard->fd) != 0) {
+                return -1;
+        }
+        pthread_mutex_lock(&shard->lock);
+        // A commit of another connection may have finished first and gone further.
+        if (target >= atomic_load(&shard->committed)) {
+                atomic_store(&shard->committed, target);
+                atomic_store(&shard->pending_seq, shard->written > target ? target_next : UINT64_MAX);
+        }
+        pthread_mutex_unlock(&shard->lock);
+        pthread_mutex_lock(&commit_lock);
+        pthread_cond_broadcast(&commit_cond);
+        pthread_mutex_unlock(&commit_lock);
+        return 0;
+}
+
+/**
+ * @brief Returns the watermark: every sequence number below it is committed.
+ * @details A number taken after `next_seq` is read is left out by this bound; one taken
+ * before was announced in its shard's `pending_seq` first.
+ */
+static uint64_t watermark_now(void) {
+        uint64_t watermark = atomic_load(&next_seq);
+        for (int i = 0; i < shard_count; i++) {
+                uint64_t pending = atomic_load(&shards[i].pending_seq);
+                if (pending < watermark) watermark = pending;
+        }
+        return watermark;
+}
+
+/**
+ * @brief Waits, at most `AESDSHARD_WAIT_MS`, until the watermark is past `seq`.
+ */
+static void wait_watermark(uint64_t seq) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += AESDSHARD_WAIT_MS / 1000;
+        deadline.tv_nsec += (long)(AESDSHARD_WAIT_MS % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_mutex_lock(&commit_lock);
+        while (watermark_now() <= seq) {
+                if (pthread_cond_timedwait(&commit_cond, &commit_lock, &deadline) == ETIMEDOUT) {
+                        break;
+                }
+        }
+        pthread_mutex_unlock(&commit_lock);
+}
+
+/**
+ * @brief Sends exactly `len` bytes to a socket.
+ */
+static int send_all(int fd, const char *buf, size_t len) {
+        while (len > 0) {
+                ssize_t n = send(fd, buf, len, 0);
+                if (n < 0) {
+                        if (errno == EINTR) continue;
+                        return -1;
+                }
+                buf += n;
+                len -= (size_t)n;
+        }
+        return 0;
+}
+
+/**
+ * @brief Copies the next `n` bytes of a shard into `dst`, refilling the read-ahead buffer as needed.
+ * @return 0 on success, -1 on a short or failed read.
+ */
+static int cursor_read(struct shard_cursor *c, char *dst, size_t n) {
+        while (n > 0) {
+                if (c->pos < c->buf_pos || c->pos >= c->buf_pos + c->buf_len) {
+                        size_t want = CURSOR_BUF_LEN;
+                        if (c->end - c->pos < want) want = (size_t)(c->end - c->pos);
+                        ssize_t r = pread(c->fd, c->buf, want, (off_t)c->pos);
+                        if (r <= 0) {
+                                return -1;
+                        }
+                        c->buf_pos = c->pos;
+                        c->buf_len = (size_t)r;
+                }
+                size_t avail = (size_t)(c->buf_pos + c->buf_len - c->pos);
+                size_t take = avail < n ? avail : n;
+                memcpy(dst, c->buf + (c->pos - c->buf_pos), take);
+                c->pos += take;
+                dst += take;
+                n -= take;
+        }
+        return 0;
+}
+
+/**
+ * @brief Loads the header of the next record of a cursor.
+ * @return 1 if a record is available, 0 at the end of the committed data or at the
+ * watermark, -1 on failure.
+ */
+static int cursor_next(struct shard_cursor *c) {
+        if (c->end - c->pos < AESDSHARD_REC_HDR_LEN) {
+                return 0;
+        }
+        char hdr[AESDSHARD_REC_HDR_LEN];
+        if (cursor_read(c, hdr, sizeof(hdr)) != 0) {
+                return -1;
+        }
+        memcpy(&c->seq, hdr, 8);
+        memcpy(&c->len, hdr + 8, 4);
+        // The records of a shard are in sequence order, so the rest is past the watermark too.
+        return c->seq < c->watermark ? 1 : 0;
+}
+
+/**
+ * @brief Restores the min-heap property (by sequence number) below position `i`.
+ */
+static void heap_down(struct shard_cursor *cur, int *heap, int size, int i) {
+        for (;;) {
+                int l = 2 * i + 1, r = l + 1, m = i;
+                if (l < size && cur[heap[l]].seq < cur[heap[m]].seq) m = l;
+                if (r < size && cur[heap[r]].seq < cur[heap[m]].seq) m = r;
+                if (m == i) return;
+                int t = heap[i];
+                heap[i] = heap[m];
+                heap[m] = t;
+                i = m;
+        }
+}
+
+/**
+ * @brief Streams the committed records of all shards to a client in global sequence order.
+ * @param `client_fd` The connected client socket.
+ * @param `seq` The sequence number of the packet being answered; the replay first waits
+ * for the watermark to pass it (see `AESDSHARD_WAIT_MS`).
+ * @return 0 on success, -1 on failure.
+ * @details The watermark and then the committed length of every shard are captured once
+ * at the start, so the replay ends while other threads keep appending and never ends
+ * inside a record. Only records below the watermark are merged: every sequence number
+ * below it was taken before it was captured and is no longer pending, so its record is
+ * within the captured lengths and the replay is a prefix of the merged log.
+ */
+int aesdshard_replay(int client_fd, uint64_t seq) {
+        struct shard_cursor cur[AESDSHARD_MAX];
+        int heap[AESDSHARD_MAX];
+        int heap_size = 0;
+        int rc = -1;
+        char *mem = malloc((size_t)shard_count * CURSOR_BUF_LEN + REPLAY_BUF_LEN);
+        if (mem == NULL) {
+                return -1;
+        }
+        char *out = mem + (size_t)shard_count * CURSOR_BUF_LEN;
+        size_t out_len = 0;
+
+        wait_watermark(seq);
+        uint64_t watermark = watermark_now();
+        // A commit stores the committed length before it clears `pending_seq`.
+        for (int i = 0; i < shard_count; i++) {
+                cur[i] = (struct shard_cursor) {
+                        .fd = shards[i].fd,
+                        .end = atomic_load(&shards[i].committed),
+                        .watermark = watermark,
+                        .buf = mem + (size_t)i * CURSOR_BUF_LEN,
+                };
+                int r = cursor_next(&cur[i]);
+                if (r < 0) goto out;
+                if (r > 0) heap[heap_size++] = i;
+        }
+        for (int i = heap_size / 2 - 1; i >= 0; i--) {
+                heap_down(cur, heap, heap_size, i);
+        }
+
+        // Loop invariant: `heap` holds every cursor with a pending record, smallest sequence on top.
+        while (heap_size > 0) {
+                struct shard_cursor *c = &cur[heap[0]];
+                uint32_t left = c->len;
+                while (left > 0) {
+                        size_t take = REPLAY_BUF_LEN - out_len;
+                        if (take > left) take = left;
+                        if (cursor_read(c, out + out_len, take) != 0) goto out;
+                        out_len += take;
+                        left -= (uint32_t)take;
+                        if (out_len == REPLAY_BUF_LEN) {
+                                if (send_all(client_fd, out, out_len) != 0) goto out;
+                                out_len = 0;
+                        }
+                }
+                int r = cursor_next(c);
+                if (r < 0) goto out;
+                if (r == 0) heap[0] = heap[--heap_size];
+                heap_down(cur, heap, heap_size, 0);
+        }
+        rc = (out_len > 0) ? send_all(client_fd, out, out_len) : 0;
+out:
+        free(mem);
+        return rc;
+}
+
+/**
+ * @brief Closes and removes every shard file.
+ * @param `keep` Whether the shard files are kept, like the data file with "-K".
+ */
+void aesdshard_close(bool keep) {
+        for (int i = 0; i < shard_count; i++) {
+                char path[256];
+                shard_path(path, sizeof(path), i);
+                close(shards[i].fd);
+                pthread_mutex_destroy(&shards[i].lock);
+                if (!keep) {
+                        unlink(path);
+                }
+        }
+        shard_count = 0;
+}
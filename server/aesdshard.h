@@ -0,0 +1,57 @@
+/**
+ *  @file aesdshard.h
+ *  @brief Per-thread sharded append log with a merged global order.
+ *
+ *  With `-S <n>` every connection thread appends to a shard (`<data_file>.<i>`,
+ *  `n` shards) instead of contending for the single data file. A connection gets the
+ *  shard with the fewest connections; with more than `n` connections shards are
+ *  shared, and the connections of a shard take turns under its mutex. Each record is
+ *  stamped with a global sequence number taken from an atomic counter, and a replay
+ *  streams a k-way merge of the shards in sequence order, so clients still see one log.
+ *
+ *  Sequence numbers are taken at append and committed later, shard by shard. A replay
+ *  therefore only merges the records below a watermark under which every sequence number
+ *  is committed: the smallest number still pending in any shard. Every replay is then a
+ *  prefix of the one log, and a later replay never inserts a record before one it sent.
+ *  The replay that answers a packet first waits, at most `AESDSHARD_WAIT_MS`, for the
+ *  commits of other connections to lift the watermark past that packet.
+ *
+ *  On-disk record layout (host byte order, the files never leave the host):
+ *  8-byte sequence number, 4-byte payload length, payload.
+ */
+#ifndef AESDSHARD_H
+#define AESDSHARD_H
+
+#include <pthread.h>     /**< @brief Provides `pthread_mutex_t`. */
+#include <stdatomic.h>   /**< @brief Provides atomic types for the committed length. */
+#include <stdbool.h>     /**< @brief Provides a boolean type and values (`true`, `false`). */
+#include <stddef.h>      /**< @brief Provides `size_t`. */
+#include <stdint.h>      /**< @brief Provides fixed width integer types (e.g., `uint64_t`). */
+
+#define AESDSHARD_MAX 64                /**< @brief Upper bound on the number of shards. */
+#define AESDSHARD_REC_HDR_LEN 12        /**< @brief Size of a record header: 8-byte sequence plus 4-byte length. */
+#define AESDSHARD_WAIT_MS 1000          /**< @brief Longest a replay waits for the watermark to pass its own packet. */
+
+/**
+ * @struct aesdshard
+ * @brief One shard, shared by the connections assigned to it.
+ */
+struct aesdshard {
+        int index;                      /**< Position of the shard in the shard table. */
+        int fd;                         /**< Shard file, opened for appending. */
+        pthread_mutex_t lock;           /**< Serialises the appends and commits of the shard's connections. */
+        uint64_t written;               /**< Bytes appended so far, protected by `lock`. */
+        _Atomic uint64_t committed;     /**< Bytes made durable; replays never read past this. */
+        _Atomic uint64_t pending_seq;   /**< At most the sequence number of the first record past `committed`, `UINT64_MAX` if none. */
+        int users;                      /**< Connections assigned to the shard, protected by the table lock. */
+};
+
+int aesdshard_init(const char *data_path, int count);
+struct aesdshard *aesdshard_acquire(void);
+void aesdshard_release(struct aesdshard *shard);
+int aesdshard_append(struct aesdshard *shard, const char *buf, size_t len, uint64_t *seq);
+int aesdshard_commit(struct aesdshard *shard);
+int aesdshard_replay(int client_fd, uint64_t seq);
+void aesdshard_close(bool keep);
+
+#endif /* AESDSHARD_H */
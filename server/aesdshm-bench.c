@@ -0,0 +1,154 @@
+/**
+ *  @file aesdshm-bench.c
+ *  @brief Compares reading the log of a running aesdsocket through shared memory with a TCP replay.
+ *
+ *  Usage: aesdshm-bench [-p port] [-n rounds]
+ *
+ *  The server must run with `-m`. Every round reads the whole committed log once through
+ *  the shared-memory reader API and once through a TCP replay, counting its lines both
+ *  times so both sides touch every byte. A TCP replay is only sent in answer to a packet,
+ *  so each round also appends an empty packet (one newline) to the log. The cost of a
+ *  snapshot of the committed length, the only step of a tailing reader that repeats
+ *  while the log is idle, is measured as well.
+ */
+#include "aesdshm.h"
+
+#include <arpa/inet.h>   /**< @brief Provides `htons()`, `inet_pton()`. */
+#include <netinet/in.h>  /**< @brief Provides `struct sockaddr_in`. */
+#include <stdio.h>       /**< @brief Provides `printf()`, `perror()`. */
+#include <stdlib.h>      /**< @brief Provides `atoi()`, `EXIT_SUCCESS`, `EXIT_FAILURE`. */
+#include <string.h>      /**< @brief Provides `memchr()`. */
+#include <sys/socket.h>  /**< @brief Provides `socket()`, `connect()`, `send()`, `recv()`, `shutdown()`. */
+#include <time.h>        /**< @brief Provides `clock_gettime()`. */
+#include <unistd.h>      /**< @brief Provides `getopt()`, `close()`. */
+
+#define BENCH_PORT 9000                 /**< @brief Default port of the server. */
+#define BENCH_ROUNDS 20                 /**< @brief Default number of full reads per method. */
+#define BENCH_SNAPSHOTS 1000000         /**< @brief Snapshots timed for the per-snapshot cost. */
+#define RECV_LEN (64 * 1024)            /**< @brief Receive buffer of a TCP replay. */
+
+/**
+ * @brief Returns the time of `CLOCK_MONOTONIC` in seconds.
+ */
+static double now_s(void) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Counts the newlines in `len` bytes.
+ */
+static uint64_t count_lines(const char *buf, size_t len) {
+        uint64_t lines = 0;
+        const char *end = buf + len;
+        const char *nl;
+        while (buf < end && (nl = memchr(buf, '\n', (size_t)(end - buf))) != NULL) {
+                lines++;
+                buf = nl + 1;
+        }
+        return lines;
+}
+
+/**
+ * @brief Reads the whole log through a TCP replay.
+ * @param `port` The server's port on the loopback interface.
+ * @param `buf` A receive buffer of `RECV_LEN` bytes.
+ * @param `lines` Receives the number of lines replayed.
+ * @return The number of bytes replayed, or -1 on failure.
+ */
+static long long tcp_read(int port, char *buf, uint64_t *lines) {
+        struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons((uint16_t)port) };
+        inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+            send(fd, "\n", 1, 0) != 1 || shutdown(fd, SHUT_WR) != 0) {
+                if (fd != -1) close(fd);
+                return -1;
+        }
+        long long total = 0;
+        *lines = 0;
+        ssize_t n;
+        while ((n = recv(fd, buf, RECV_LEN, 0)) > 0) {
+                *lines += count_lines(buf, (size_t)n);
+                total += n;
+        }
+        close(fd);
+        return n < 0 ? -1 : total;
+}
+
+int main(int argc, char *argv[]) {
+        int port = BENCH_PORT;
+        int rounds = BENCH_ROUNDS;
+        int opt;
+        while ((opt = getopt(argc, argv, "p:n:")) != -1) {
+                switch (opt) {
+                case 'p':
+                        port = atoi(optarg);
+                        break;
+                case 'n':
+                        rounds = atoi(optarg);
+                        break;
+                default:
+                        fprintf(stderr, "Usage: %s [-p port] [-n rounds]\n", argv[0]);
+                        return EXIT_FAILURE;
+                }
+        }
+        if (rounds < 1) {
+                rounds = 1;
+        }
+        struct aesdshm_reader reader;
+        if (aesdshm_reader_open(&reader) != 0) {
+                perror("Error opening aesdsocket shared memory");
+                return EXIT_FAILURE;
+        }
+        char *buf = malloc(RECV_LEN);
+        if (buf == NULL) {
+                perror("Error allocating the receive buffer");
+                aesdshm_reader_close(&reader);
+                return EXIT_FAILURE;
+        }
+
+        // --- Snapshot cost ---
+        uint64_t len = 0;
+        double t0 = now_s();
+        for (int i = 0; i < BENCH_SNAPSHOTS; i++) {
+                aesdshm_reader_snapshot(&reader, &len, NULL);
+        }
+        double snapshot_ns = (now_s() - t0) * 1e9 / BENCH_SNAPSHOTS;
+
+        // --- Full reads, alternating so both see the same log ---
+        double shm_s = 0.0, tcp_s = 0.0;
+        uint64_t shm_bytes = 0, tcp_bytes = 0, shm_lines = 0, tcp_lines = 0;
+        for (int r = 0; r < rounds; r++) {
+                t0 = now_s();
+                const char *data = aesdshm_reader_view(&reader, &len);
+                if (data == NULL && len > 0) {
+                        perror("Error mapping aesdsocket data file");
+                        break;
+                }
+                shm_lines += count_lines(data, (size_t)len);
+                shm_s += now_s() - t0;
+                shm_bytes += len;
+
+                uint64_t lines;
+                t0 = now_s();
+                long long got = tcp_read(port, buf, &lines);
+                tcp_s += now_s() - t0;
+                if (got < 0) {
+                        perror("Error reading the TCP replay");
+                        break;
+                }
+                tcp_bytes += (uint64_t)got;
+                tcp_lines += lines;
+        }
+
+        printf("snapshot of the committed length: %.1f ns\n", snapshot_ns);
+        printf("shared memory: %d reads, %.3f ms per read, %.0f MB/s, %llu lines\n", rounds,
+               shm_s * 1000.0 / rounds, shm_s > 0 ? (double)shm_bytes / shm_s / 1e6 : 0.0, (unsigned long long)shm_lines);
+        printf("TCP replay:    %d reads, %.3f ms per read, %.0f MB/s, %llu lines\n", rounds,
+               tcp_s * 1000.0 / rounds, tcp_s > 0 ? (double)tcp_bytes / tcp_s / 1e6 : 0.0, (unsigned long long)tcp_lines);
+        free(buf);
+        aesdshm_reader_close(&reader);
+        return EXIT_SUCCESS;
+}
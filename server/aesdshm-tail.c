@@ -0,0 +1,55 @@
+/**
+ *  @file aesdshm-tail.c
+ *  @brief Prints the log of a running aesdsocket through the shared-memory reader API.
+ *
+ *  Usage: aesdshm-tail [-f]
+ *
+ *  Without arguments the committed content of the log is written to stdout. With
+ *  `-f` the program keeps following the log, printing newly committed data as it
+ *  appears, until interrupted.
+ */
+#include "aesdshm.h"
+
+#include <stdio.h>       /**< @brief Provides `fwrite()`, `perror()`. */
+#include <stdlib.h>      /**< @brief Provides `EXIT_SUCCESS`, `EXIT_FAILURE`. */
+#include <string.h>      /**< @brief Provides `strcmp()`. */
+#include <time.h>        /**< @brief Provides `nanosleep()`. */
+
+#define POLL_INTERVAL_NS (50 * 1000 * 1000)     /**< @brief How long `-f` waits between snapshots when the log is idle. */
+
+int main(int argc, char *argv[]) {
+        bool follow = argc >= 2 && strcmp(argv[1], "-f") == 0;
+        struct aesdshm_reader reader;
+        if (aesdshm_reader_open(&reader) != 0) {
+                perror("Error opening aesdsocket shared memory");
+                return EXIT_FAILURE;
+        }
+
+        uint64_t printed = 0;
+        uint64_t generation = 0;
+        struct timespec idle = { .tv_sec = 0, .tv_nsec = POLL_INTERVAL_NS };
+        do {
+                uint64_t len;
+                const char *data = aesdshm_reader_view(&reader, &len);
+                if (reader.generation != generation) {
+                        // The server restarted with a fresh log; start over from its beginning.
+                        generation = reader.generation;
+                        printed = 0;
+                }
+                if (data == NULL && len > 0) {
+                        perror("Error mapping aesdsocket data file");
+                        aesdshm_reader_close(&reader);
+                        return EXIT_FAILURE;
+                }
+                if (len > printed) {
+                        fwrite(data + printed, 1, len - printed, stdout);
+                        fflush(stdout);
+                        printed = len;
+                } else if (follow) {
+                        nanosleep(&idle, NULL);
+                }
+        } while (follow);
+
+        aesdshm_reader_close(&reader);
+        return EXIT_SUCCESS;
+}
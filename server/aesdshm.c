@@ -0,0 +1,126 @@
+/**
+ *  @file aesdshm.c
+ *  @brief Publisher side of the aesdsocket shared-memory reader API.
+ *
+ *  The server calls `aesdshm_publisher_update()` every time it commits data to
+ *  the data file. The update is a seqlock write, so readers never block the server
+ *  and the server never waits for readers.
+ */
+#include "aesdshm.h"
+
+#include <errno.h>       /**< @brief Provides definitions for error numbers. */
+#include <fcntl.h>       /**< @brief Provides `O_CREAT`, `O_RDWR`. */
+#include <string.h>      /**< @brief Provides `strncpy()`. */
+#include <sys/mman.h>    /**< @brief Provides `shm_open()`, `mmap()`, `munmap()`, `shm_unlink()`. */
+#include <syslog.h>      /**< @brief Provides `syslog()`. */
+#include <unistd.h>      /**< @brief Provides `ftruncate()`, `close()`. */
+
+/**
+ * @var shm_hdr
+ * @brief The writable mapping of the published header, or NULL when publishing is disabled.
+ */
+static struct aesdshm_header *shm_hdr = NULL;
+
+/**
+ * @brief Creates (or re-uses) the shared-memory header and points it at `data_path`.
+ * @param `data_path` Absolute path of the data file readers should map.
+ * @return 0 on success, -1 on failure (errors are logged to syslog).
+ * @details If a header from a previous run still exists its generation is carried
+ * forward and incremented, so readers still holding the old data file notice
+ * that it has been replaced.
+ */
+int aesdshm_publisher_open(const char *data_path) {
+        int fd = shm_open(AESDSHM_NAME, O_CREAT | O_RDWR, 0644);
+        if (fd == -1) {
+                syslog(LOG_ERR, "shm_open %s failed: %m", AESDSHM_NAME);
+                return -1;
+        }
+        if (ftruncate(fd, sizeof(struct aesdshm_header)) != 0) {
+                syslog(LOG_ERR, "ftruncate %s failed: %m", AESDSHM_NAME);
+                close(fd);
+                return -1;
+        }
+        void *p = mmap(NULL, sizeof(struct aesdshm_header), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        // The mapping keeps the object alive, the descriptor is no longer needed.
+        close(fd);
+        if (p == MAP_FAILED) {
+                syslog(LOG_ERR, "mmap %s failed: %m", AESDSHM_NAME);
+                return -1;
+        }
+        shm_hdr = p;
+
+        // A stale header from an earlier run keeps its generation so it can be bumped below.
+        uint64_t generation = 0;
+        if (shm_hdr->magic == AESDSHM_MAGIC && shm_hdr->version == AESDSHM_VERSION) {
+                generation = atomic_load_explicit(&shm_hdr->generation, memory_order_relaxed);
+        }
+
+        unsigned seq = atomic_load_explicit(&shm_hdr->seq, memory_order_relaxed);
+        // Force the sequence odd for the duration of the (re)initialisation.
+        seq |= 1u;
+        atomic_store_explicit(&shm_hdr->seq, seq, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+
+        shm_hdr->magic = AESDSHM_MAGIC;
+        shm_hdr->version = AESDSHM_VERSION;
+        strncpy(shm_hdr->data_path, data_path, AESDSHM_PATH_MAX - 1);
+        shm_hdr->data_path[AESDSHM_PATH_MAX - 1] = '\0';
+        atomic_store_explicit(&shm_hdr->committed_len, 0, memory_order_relaxed);
+        atomic_store_explicit(&shm_hdr->generation, generation + 1, memory_order_relaxed);
+
+        atomic_store_explicit(&shm_hdr->seq, seq + 1, memory_order_release);
+        syslog(LOG_INFO, "Publishing %s through shared memory %s", data_path, AESDSHM_NAME);
+        return 0;
+}
+
+/**
+ * @brief Publishes a new committed length of the data file.
+ * @param `committed_len` Number of bytes at the start of the data file that readers may access.
+ * @details Does nothing when the publisher has not been opened. Only a single
+ * thread may call this function at a time.
+ */
+void aesdshm_publisher_update(uint64_t committed_len) {
+        if (shm_hdr == NULL) {
+                return;
+        }
+        unsigned seq = atomic_load_explicit(&shm_hdr->seq, memory_order_relaxed);
+        atomic_store_explicit(&shm_hdr->seq, seq + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        atomic_store_explicit(&shm_hdr->committed_len, committed_len, memory_order_relaxed);
+        atomic_store_explicit(&shm_hdr->seq, seq + 2, memory_order_release);
+}
+
+/**
+ * @brief Announces that the data file has been replaced by a new file with `committed_len` committed bytes.
+ * @param `committed_len` Committed length of the new data file.
+ * @details Bumps the generation so readers re-open and re-map the file.
+ */
+void aesdshm_publisher_replace(uint64_t committed_len) {
+        if (shm_hdr == NULL) {
+                return;
+        }
+        unsigned seq = atomic_load_explicit(&shm_hdr->seq, memory_order_relaxed);
+        atomic_store_explicit(&shm_hdr->seq, seq + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        atomic_store_explicit(&shm_hdr->committed_len, committed_len, memory_order_relaxed);
+        atomic_store_explicit(&shm_hdr->generation,
+                              atomic_load_explicit(&shm_hdr->generation, memory_order_relaxed) + 1,
+                              memory_order_relaxed);
+        atomic_store_explicit(&shm_hdr->seq, seq + 2, memory_order_release);
+}
+
+/**
+ * @brief Unmaps and removes the shared-memory header.
+ * @details Readers that still have the header mapped keep a valid, frozen view
+ * of it; new readers fail to open it until the server publishes again.
+ */
+void aesdshm_publisher_close(void) {
+        if (shm_hdr == NULL) {
+                return;
+        }
+        munmap(shm_hdr, sizeof(struct aesdshm_header));
+        shm_hdr = NULL;
+        if (shm_unlink(AESDSHM_NAME) != 0 && errno != ENOENT) {
+                syslog(LOG_WARNING, "shm_unlink %s failed: %m", AESDSHM_NAME);
+        }
+}
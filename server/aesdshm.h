@@ -0,0 +1,74 @@
+/**
+ *  @file aesdshm.h
+ *  @brief Shared-memory header published by aesdsocket for local, read-only consumers.
+ *
+ *  When started with `-m`, aesdsocket creates a small POSIX shared-memory object
+ *  (`AESDSHM_NAME`) describing its data file. The object holds the path of the data
+ *  file and the committed length of the log, guarded by a seqlock. Local readers
+ *  `mmap()` the data file read-only and use the header to learn how many bytes are
+ *  safe to look at, so tailing or scanning the log costs no syscalls per read.
+ *
+ *  The publisher side (`aesdshm_publisher_*`) lives in aesdshm.c and is linked into
+ *  the server. The reader side (`aesdshm_reader_*`) lives in aesdshm_reader.c and is
+ *  meant to be linked into consumer programs.
+ */
+#ifndef AESDSHM_H
+#define AESDSHM_H
+
+#include <stdatomic.h>   /**< @brief Provides atomic types used by the seqlock (e.g., `atomic_uint`). */
+#include <stdbool.h>     /**< @brief Provides a boolean type and values (`true`, `false`). */
+#include <stddef.h>      /**< @brief Provides `size_t`. */
+#include <stdint.h>      /**< @brief Provides fixed width integer types (e.g., `uint64_t`). */
+
+#define AESDSHM_NAME "/aesdsocket"      /**< @brief Name of the POSIX shared-memory object holding the header. */
+#define AESDSHM_MAGIC 0x44534541u       /**< @brief "AESD" in little-endian byte order; identifies a valid header. */
+#define AESDSHM_VERSION 1u              /**< @brief Layout version of `struct aesdshm_header`. */
+#define AESDSHM_PATH_MAX 256            /**< @brief Maximum length of the data file path stored in the header. */
+
+/**
+ * @struct aesdshm_header
+ * @brief Layout of the shared-memory object published by aesdsocket.
+ * @details `seq` is a seqlock: the publisher makes it odd before changing
+ * `committed_len` or `generation` and even again afterwards. Readers retry until
+ * they observe the same even value before and after reading the fields.
+ * `generation` changes whenever the data file is recreated, telling readers to
+ * re-open and re-map it.
+ */
+struct aesdshm_header {
+        uint32_t magic;                         /**< Always `AESDSHM_MAGIC` once the header is initialised. */
+        uint32_t version;                       /**< Always `AESDSHM_VERSION`. */
+        atomic_uint seq;                        /**< Seqlock sequence counter (odd while an update is in progress). */
+        uint32_t reserved;                      /**< Padding, keeps the 64-bit fields naturally aligned. */
+        _Atomic uint64_t committed_len;         /**< Number of bytes at the start of the data file that are committed. */
+        _Atomic uint64_t generation;            /**< Incremented every time the data file is recreated. */
+        char data_path[AESDSHM_PATH_MAX];       /**< NUL-terminated absolute path of the data file. */
+};
+
+/**
+ * @struct aesdshm_reader
+ * @brief State held by a local consumer of the published log.
+ * @details All fields are private to aesdshm_reader.c; callers only pass the
+ * structure around.
+ */
+struct aesdshm_reader {
+        int hdr_fd;                             /**< Descriptor of the shared-memory object. */
+        const struct aesdshm_header *hdr;       /**< Read-only mapping of the header. */
+        int data_fd;                            /**< Read-only descriptor of the data file. */
+        const char *data;                       /**< Read-only mapping of the data file, or NULL. */
+        size_t data_map_len;                    /**< Length of the `data` mapping in bytes. */
+        uint64_t generation;                    /**< Generation of the data file currently mapped. */
+};
+
+// --- Publisher (server side) ---
+int aesdshm_publisher_open(const char *data_path);
+void aesdshm_publisher_update(uint64_t committed_len);
+void aesdshm_publisher_replace(uint64_t committed_len);
+void aesdshm_publisher_close(void);
+
+// --- Reader (consumer side) ---
+int aesdshm_reader_open(struct aesdshm_reader *reader);
+bool aesdshm_reader_snapshot(const struct aesdshm_reader *reader, uint64_t *committed_len, uint64_t *generation);
+const char *aesdshm_reader_view(struct aesdshm_reader *reader, uint64_t *committed_len);
+void aesdshm_reader_close(struct aesdshm_reader *reader);
+
+#endif /* AESDSHM_H */
@@ -0,0 +1,164 @@
+/**
+ *  @file aesdshm_reader.c
+ *  @brief Reader side of the aesdsocket shared-memory API.
+ *
+ *  A reader maps the published header and the data file read-only. Taking a
+ *  snapshot of the committed length is a seqlock read and costs no syscalls; the
+ *  data mapping is only replaced when the log outgrows it (the mapping size
+ *  doubles each time) or when the server recreates its data file.
+ */
+#include "aesdshm.h"
+
+#include <errno.h>       /**< @brief Provides definitions for error numbers (e.g., `EPROTO`). */
+#include <fcntl.h>       /**< @brief Provides `O_RDONLY`. */
+#include <sys/mman.h>    /**< @brief Provides `shm_open()`, `mmap()`, `munmap()`. */
+#include <unistd.h>      /**< @brief Provides `close()`. */
+
+#define AESDSHM_MIN_MAP_LEN (64 * 1024)         /**< @brief Smallest data mapping a reader creates, in bytes. */
+
+/**
+ * @brief Opens the header published by a running aesdsocket.
+ * @param `reader` The reader state to initialise.
+ * @return 0 on success, -1 on failure with `errno` set.
+ * @post On success the header is mapped; the data file is mapped lazily by `aesdshm_reader_view()`.
+ */
+int aesdshm_reader_open(struct aesdshm_reader *reader) {
+        reader->hdr = NULL;
+        reader->data_fd = -1;
+        reader->data = NULL;
+        reader->data_map_len = 0;
+        reader->generation = 0;
+
+        reader->hdr_fd = shm_open(AESDSHM_NAME, O_RDONLY, 0);
+        if (reader->hdr_fd == -1) {
+                return -1;
+        }
+        void *p = mmap(NULL, sizeof(struct aesdshm_header), PROT_READ, MAP_SHARED, reader->hdr_fd, 0);
+        if (p == MAP_FAILED) {
+                close(reader->hdr_fd);
+                return -1;
+        }
+        reader->hdr = p;
+        if (reader->hdr->magic != AESDSHM_MAGIC || reader->hdr->version != AESDSHM_VERSION) {
+                aesdshm_reader_close(reader);
+                errno = EPROTO;
+                return -1;
+        }
+        return 0;
+}
+
+/**
+ * @brief Reads a consistent committed length and generation from the header.
+ * @param `reader` An opened reader.
+ * @param `committed_len` Receives the committed length of the data file.
+ * @param `generation` Receives the generation of the data file (may be NULL).
+ * @return `true` once a consistent snapshot was read.
+ * @details Retries while the server is in the middle of an update; does not make any syscalls.
+ */
+bool aesdshm_reader_snapshot(const struct aesdshm_reader *reader, uint64_t *committed_len, uint64_t *generation) {
+        struct aesdshm_header *hdr = (struct aesdshm_header *)reader->hdr;
+        unsigned before, after;
+        uint64_t len, gen;
+        do {
+                before = atomic_load_explicit(&hdr->seq, memory_order_acquire);
+                if (before & 1u) {
+                        continue; // update in progress
+                }
+                len = atomic_load_explicit(&hdr->committed_len, memory_order_relaxed);
+                gen = atomic_load_explicit(&hdr->generation, memory_order_relaxed);
+                atomic_thread_fence(memory_order_acquire);
+                after = atomic_load_explicit(&hdr->seq, memory_order_relaxed);
+        } while ((before & 1u) || before != after);
+
+        *committed_len = len;
+        if (generation != NULL) {
+                *generation = gen;
+        }
+        return true;
+}
+
+/**
+ * @brief Drops the current data file mapping and descriptor, if any.
+ * @param `reader` The reader state.
+ */
+static void reader_unmap_data(struct aesdshm_reader *reader) {
+        if (reader->data != NULL) {
+                munmap((void *)reader->data, reader->data_map_len);
+                reader->data = NULL;
+                reader->data_map_len = 0;
+        }
+        if (reader->data_fd != -1) {
+                close(reader->data_fd);
+                reader->data_fd = -1;
+        }
+}
+
+/**
+ * @brief Returns a pointer to the committed part of the data file.
+ * @param `reader` An opened reader.
+ * @param `committed_len` Receives the number of bytes readable at the returned pointer.
+ * @return Pointer to the start of the log, or NULL on failure with `errno` set.
+ * When the log is empty a non-NULL pointer may not be available; in that case NULL
+ * is returned with `*committed_len == 0` and `errno == 0`.
+ * @details The pointer stays valid until the next call to `aesdshm_reader_view()` or
+ * `aesdshm_reader_close()`. As long as the log fits the current mapping and the data
+ * file is not recreated, the call makes no syscalls.
+ */
+const char *aesdshm_reader_view(struct aesdshm_reader *reader, uint64_t *committed_len) {
+        uint64_t len, gen;
+        aesdshm_reader_snapshot(reader, &len, &gen);
+        *committed_len = len;
+
+        if (gen != reader->generation) {
+                // The server recreated its data file; whatever we hold is stale.
+                reader_unmap_data(reader);
+                reader->generation = gen;
+        }
+        if (len == 0) {
+                errno = 0;
+                return reader->data;
+        }
+        if (reader->data_fd == -1) {
+                reader->data_fd = open(reader->hdr->data_path, O_RDONLY | O_CLOEXEC);
+                if (reader->data_fd == -1) {
+                        return NULL;
+                }
+        }
+        if (len > reader->data_map_len) {
+                // Grow the mapping geometrically so that remaps stay rare. Mapping past
+                // EOF is allowed; only committed bytes (which are inside the file) are
+                // ever touched.
+                size_t map_len = reader->data_map_len ? reader->data_map_len : AESDSHM_MIN_MAP_LEN;
+                while (map_len < len) {
+                        map_len *= 2;
+                }
+                if (reader->data != NULL) {
+                        munmap((void *)reader->data, reader->data_map_len);
+                        reader->data = NULL;
+                        reader->data_map_len = 0;
+                }
+                void *p = mmap(NULL, map_len, PROT_READ, MAP_SHARED, reader->data_fd, 0);
+                if (p == MAP_FAILED) {
+                        return NULL;
+                }
+                reader->data = p;
+                reader->data_map_len = map_len;
+        }
+        return reader->data;
+}
+
+/**
+ * @brief Releases every resource held by the reader.
+ * @param `reader` The reader state.
+ */
+void aesdshm_reader_close(struct aesdshm_reader *reader) {
+        reader_unmap_data(reader);
+        if (reader->hdr != NULL) {
+                munmap((void *)reader->hdr, sizeof(struct aesdshm_header));
+                reader->hdr = NULL;
+        }
+        if (reader->hdr_fd != -1) {
+                close(reader->hdr_fd);
+                reader->hdr_fd = -1;
+        }
+}
@@ -12,7 +12,7 @@
 #include <arpa/inet.h>   /**< @brief Provides definitions for internet operations (e.g., `inet_ntop()`). */
 #include <stdbool.h>     /**< @brief Provides a boolean type and values (`true`, `false`). */
 #include <errno.h>       /**< @brief Provides definitions for error numbers (e.g., `EINTR`). */
-#include <signal.h>      /**< @brief Provides definitions for signal handling (e.g., `sigaction`, `SIGINT`, `SIGTERM`). */
+#include <signal.h>      /**< @brief Provides definitions for signal handling (e.g., `sigprocmask()`, `SIGINT`, `SIGTERM`). */
 #include <stdio.h>       /**< @brief Provides standard input/output functions (e.g. `printf()`, `fopen()`, `fclose()`). */
 #include <stdlib.h>      /**< @brief Provides Provides general utility functions (e.g., `exit()`, `malloc()`, `free()`). */
 #include <string.h>      /**< @brief Provides string manipulation functions (e.g., `strcmp()`, `memset()`, `memchr()`). */
@@ -20,23 +20,93 @@
 #include <syslog.h>      /**< @brief Provides functions for logging messages to the system logger (e.g., `openlog()`, `syslog()`, `closelog()`). */
 #include <unistd.h>      /**< @brief Provides POSIX operating system API functions (e.g., `close()`, `fork()`, `setsid()`, `chdir()`, `unlink()`, `fsync()`). */
 #include <fcntl.h>       /**< @brief Provides functions for file control options (e.g., `open()`, `O_RDWR`). */
+#include <pthread.h>     /**< @brief Provides threads and mutexes for the thread-per-connection mode (e.g., `pthread_create()`). */
+#include <stdatomic.h>   /**< @brief Provides `atomic_bool` used to flag finished connection threads. */
+#include <sys/queue.h>   /**< @brief Provides the singly-linked list macros used for the connection thread list (e.g., `SLIST_INSERT_HEAD`). */
+#include <sys/stat.h>    /**< @brief Provides `fstat()` used to learn the committed length of the data file. */
+#include <poll.h>        /**< @brief Provides `poll()` used by the event loop and to wait for data before taking a receive buffer. */
+#include <sys/signalfd.h>/**< @brief Provides `signalfd()` delivering signals to the event loop. */
+#include <sys/eventfd.h> /**< @brief Provides `eventfd()` used by connection threads to wake the event loop. */
+#include <time.h>        /**< @brief Provides `clock_gettime()` used to time the drain. */
+
+#include "aesdshm.h"     /**< @brief Shared-memory publisher for local read-only consumers. */
+#include "aesdrepl.h"    /**< @brief Leader/follower replication of the data file. */
+#include "aesdshard.h"   /**< @brief Per-thread sharded append log with a merged replay. */
+#include "aesdtopic.h"   /**< @brief Named logs selected with a `TOPIC <name>` preamble. */
+#include "aesdkv.h"      /**< @brief Key index for the `PUT`/`GET` keyed record mode. */
+#include "aesdcompact.h" /**< @brief Background compaction of the data file. */
+#include "aesddedup.h"   /**< @brief Content-addressed store for repeated packets. */
+#include "aesdcold.h"    /**< @brief Block compression of the cold part of the data file. */
+#include "aesdwire.h"    /**< @brief Negotiated compressed replays with a cache of compressed blocks. */
+#include "aesdtime.h"    /**< @brief Sparse commit-time index answering `SINCE` and `RANGE`. */
+#include "aesdcursor.h"  /**< @brief Named client cursors with a batched checkpoint. */
+#include "aesdsplice.h"  /**< @brief Zero-copy ingest of `FRAME <len>` packets. */
+#include "aesddirect.h"  /**< @brief `O_DIRECT` data file that bypasses the page cache. */
+#include "aesdcache.h"   /**< @brief Rolling writeback and drop-behind of the data file. */
+#include "aesdarena.h"   /**< @brief Huge page backed arena for receive and replay buffers. */
+#include "aesdcpu.h"     /**< @brief CPU affinity and NUMA placement of server threads. */
+#include "aesdpoll.h"    /**< @brief Spin-then-block receive wait with kernel busy polling. */
+#include "aesdconf.h"    /**< @brief Runtime tunables from a config file and a control socket. */
+#include "aesdfork.h"    /**< @brief Prefork worker processes with a shared store header. */
+#include "aesdmem.h"     /**< @brief Memory accounting and a global budget with back-pressure. */
+#include "aesdbloom.h"   /**< @brief Per-segment Bloom filters answering `EXISTS <line>`. */
+#include "aesdcast.h"    /**< @brief Coalesced replays sharing reads through a block cache. */
+#include <sys/sendfile.h>/**< @brief Provides `sendfile()` used to answer `GET` straight from the data file. */
 
 // --- Macro Definitions ---
 #define PORT 9000                               /**< @brief The port number on which the server will listen for incoming connections. */
-#define BACKLOG 5                               /**< @brief The maximum length to which the queue of pending connections for sock_fd may grow. */
-#define MAX_RECV_BUF_LEN 4096                   /**< @brief The maximum size (in bytes) of the in-memory buffer used to receive data from clients. */
+#define BACKLOG 5                               /**< @brief The default length to which the queue of pending connections for sock_fd may grow (`backlog` tunable). */
+#define MAX_RECV_BUF_LEN 4096                   /**< @brief The default size (in bytes) of the receive and replay buffers (`recv_buffer`, `replay_buffer` tunables). */
 #define DATA_FILE "/var/tmp/aesdsocketdata"     /**< @brief The path to the file where received data is ultimately stored. */
+#define DRAIN_MS 5000                           /**< @brief The default time (in ms) a shutdown waits for connections to finish (`drain_ms` tunable). */
 
 // --- Global Variables ---
 /**
  * @var exit_flag
  * @brief A flag indicating whether teh server should terminate.
- * @details This flag is declared as `volatile sig_atomic_t` to ensure safe access 
- * from signal handlers and the main program loop. It is set to 1
- * when a `SIGINT` or `SIGTERM` signal is caught.
+ * @details It is set to 1 by the thread reading `signal_fd` when it delivers a `SIGINT` or
+ * `SIGTERM`; the server then drains its connections and exits.
  */
 volatile sig_atomic_t exit_flag = 0;
 
+/**
+ * @var signal_fd
+ * @brief Delivers `SIGINT`, `SIGTERM` (and `SIGHUP` with "-R") to the event loop.
+ * @details The signals are blocked in every thread, so no code runs in signal context and
+ * no blocking call is interrupted; the main thread reads them from this descriptor, or the
+ * stop watcher while the main thread serves connections itself (without "-t").
+ */
+int signal_fd = -1;
+
+/**
+ * @var conn_event
+ * @brief An eventfd connection threads write to when they finish, so the event loop reaps them right away.
+ */
+int conn_event = -1;
+
+/**
+ * @var keep_flag
+ * @brief A flag indicating whether the data file is kept on exit, set with "-K".
+ * @details Without it the data file is removed once the drain is done, as before. With it the
+ * files that hold the log instead (shards, topics, the dedup file) are kept too, and the
+ * ranges "-z" released are restored into the data file. Together with "-C" the data file and
+ * the cursor checkpoint also survive startup, so clients resume across server runs.
+ */
+bool keep_flag = false;
+
+/**
+ * @var worker_count
+ * @brief Number of prefork worker processes set with "-W <n>", or 0 to serve from this process.
+ */
+int worker_count = 0;
+
+/**
+ * @var memory_mib
+ * @brief Memory budget in MiB set with "-M <MiB>", or 0 to only account memory.
+ * @details Near the budget connections stop reading between packets and caches are dropped; see aesdmem.h.
+ */
+long memory_mib = 0;
+
 /**
  * @var daemon_flag
  * @brief A flag indicating whether the server should run in daemon mode.
@@ -44,6 +114,238 @@ volatile sig_atomic_t exit_flag = 0;
  */
 bool daemon_flag = false;
 
+/**
+ * @var shm_flag
+ * @brief A flag indicating whether the data file is published through shared memory.
+ * @details This flag is set to `true` if the program is started with the "-m" command-line argument.
+ * Local readers can then map the log read-only through the API in aesdshm.h.
+ */
+bool shm_flag = false;
+
+/**
+ * @var port
+ * @brief The TCP port the server listens on, `PORT` unless overridden with "-p <port>".
+ */
+int port = PORT;
+
+/**
+ * @var data_file
+ * @brief Path of the data file, `DATA_FILE` unless overridden with "-f <path>".
+ * @details Overriding both `port` and `data_file` allows several instances (e.g. a
+ * replication leader and its follower) to run on one host.
+ */
+const char *data_file = DATA_FILE;
+
+/**
+ * @var leader_target
+ * @brief Replication target set with "-r <target>", or NULL when this instance does not replicate.
+ */
+const char *leader_target = NULL;
+
+/**
+ * @var follower_target
+ * @brief Replication endpoint set with "-F <target>", or NULL when this instance is not a follower.
+ * @details A follower only receives data from its leader; client connections are served
+ * read-only, each received packet triggers a replay of the replicated log.
+ */
+const char *follower_target = NULL;
+
+/**
+ * @var thread_flag
+ * @brief A flag indicating whether every connection is served by its own thread.
+ * @details Set with "-t" (and implied by "-S"). Without it connections are served one at a time
+ * by the main thread.
+ */
+bool thread_flag = false;
+
+/**
+ * @var shard_count
+ * @brief Number of append shards set with "-S <n>", or 0 to append to the single data file.
+ */
+int shard_count = 0;
+
+/**
+ * @var topic_max_open
+ * @brief Maximum number of open topic files set with "-T <n>", or 0 when topics are disabled.
+ */
+int topic_max_open = 0;
+
+/**
+ * @var keyed_flag
+ * @brief A flag indicating whether `PUT <key> <value>` and `GET <key>` packets are interpreted.
+ * @details Set with "-k". Applies to connections on the shared data file.
+ */
+bool keyed_flag = false;
+
+/**
+ * @var compact_rate_kib
+ * @brief Read budget of the background compactor in KiB/s set with "-c <rate>", or 0 to disable compaction.
+ */
+long compact_rate_kib = 0;
+
+/**
+ * @var dedup_flag
+ * @brief A flag indicating whether packets are stored in the deduplicating store set with "-D".
+ */
+bool dedup_flag = false;
+
+/**
+ * @var cold_level
+ * @brief Compression level (1-9) of cold data file blocks set with "-z <level>", or 0 to keep the file uncompressed.
+ */
+int cold_level = 0;
+
+/**
+ * @var wire_level
+ * @brief Compression level (1-9) of negotiated compressed replays set with "-w <level>", or 0 when they are disabled.
+ */
+int wire_level = 0;
+
+/**
+ * @var time_index_flag
+ * @brief A flag indicating whether commits are time-stamped and `SINCE`/`RANGE` packets are answered, set with "-i".
+ */
+bool time_index_flag = false;
+
+/**
+ * @var exists_flag
+ * @brief A flag indicating whether `EXISTS <line>` packets are answered from per-segment Bloom filters, set with "-e".
+ */
+bool exists_flag = false;
+
+/**
+ * @var broadcast_kib
+ * @brief Block size in KiB of coalesced replays set with "-B <KiB>", or 0 for every replay to read on its own.
+ * @details Concurrent replays then share each read of the data file; see aesdcast.h.
+ */
+long broadcast_kib = 0;
+
+/**
+ * @var cursor_flag
+ * @brief A flag indicating whether connections may resume through a `CURSOR <name>` preamble, set with "-C".
+ */
+bool cursor_flag = false;
+
+/**
+ * @var frame_flag
+ * @brief A flag indicating whether `FRAME <len>` packets are received with `splice()`, set with "-b".
+ */
+bool frame_flag = false;
+
+/**
+ * @var direct_flag
+ * @brief A flag indicating whether the shared data file is written and replayed with `O_DIRECT`, set with "-O".
+ */
+bool direct_flag = false;
+
+/**
+ * @var cache_flag
+ * @brief A flag indicating whether the data file is written back early and dropped from the page cache once durable, set with "-H".
+ */
+bool cache_flag = false;
+
+/**
+ * @var arena_mib
+ * @brief Size in MiB of the huge page backed buffer arena set with "-A <MiB>", or 0 to keep buffers on the stack.
+ */
+long arena_mib = 0;
+
+/**
+ * @var lazy_flag
+ * @brief A flag indicating whether a connection only holds a receive buffer while it has data, set with "-L".
+ * @details Buffers are taken from the buffer arena (or `malloc()` without "-A") once data arrives and
+ * given back whenever no partial packet is pending, so idle connections hold none. The receive and
+ * replay buffers then never live on the stack, which keeps the stack a thread touches small too.
+ */
+bool lazy_flag = false;
+
+/**
+ * @var cpu_spec
+ * @brief CPU placement set with "-a <accept>/<workers>/<storage>", or NULL to leave threads unpinned.
+ * @details Each part is a CPU list; see aesdcpu.h.
+ */
+const char *cpu_spec = NULL;
+
+/**
+ * @var busy_poll_us
+ * @brief Spin budget in microseconds of the busy-polling receive wait set with "-P <us>", or 0 to block right away.
+ */
+long busy_poll_us = 0;
+
+/**
+ * @var conf_path
+ * @brief Config file of the runtime tunables set with "-R <path>", or NULL to keep the defaults.
+ * @details The tunables can also be changed through the control socket `<path>.sock`; see aesdconf.h.
+ */
+const char *conf_path = NULL;
+
+/**
+ * @var store_lock
+ * @brief Serialises appends and replays on the single data file.
+ * @details Appending a packet and replaying the file back must not interleave with another
+ * connection's append, otherwise a replay could contain half of someone else's packet.
+ * The sharded store does not need it: each thread owns its shard.
+ */
+pthread_mutex_t store_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Takes `store_lock`, or with "-W" the append lock shared by all worker processes.
+ */
+static void lock_store(void) {
+        if (worker_count > 0) {
+                aesdfork_lock();
+        } else {
+                pthread_mutex_lock(&store_lock);
+        }
+}
+
+/**
+ * @brief Releases what `lock_store()` took.
+ */
+static void unlock_store(void) {
+        if (worker_count > 0) {
+                aesdfork_unlock();
+        } else {
+                pthread_mutex_unlock(&store_lock);
+        }
+}
+
+/**
+ * @struct conn_store
+ * @brief Where the packets of one connection go.
+ * @details Exactly one of the members is used: the connection's topic if it sent a
+ * `TOPIC` preamble, otherwise its shard in sharded mode, otherwise the shared data file.
+ */
+struct conn_store {
+        FILE *fp;                       /**< The shared data file, opened by this connection. */
+        struct aesdshard *shard;        /**< The shard owned by this connection, or NULL. */
+        struct aesdtopic *topic;        /**< The topic selected by this connection, or NULL. */
+        unsigned generation;            /**< Compaction generation of the data file `fp` refers to. */
+        bool compressed;                /**< Whether the connection negotiated compressed replays. */
+        struct aesdcursor *cursor;      /**< The cursor this connection resumes from, or NULL. */
+        char *pending;                  /**< Start of a long packet not yet stored, whichever store it goes to. */
+        size_t pending_len;             /**< Bytes in `pending`. */
+        size_t pending_cap;             /**< Capacity of `pending`. */
+};
+
+/**
+ * @struct conn_thread
+ * @brief Bookkeeping for one connection served by its own thread.
+ */
+struct conn_thread {
+        pthread_t thread;                       /**< The thread serving the connection. */
+        int fd;                                 /**< The connected client socket. */
+        atomic_bool done;                       /**< Set by the thread right before it returns. */
+        char ip_string[INET_ADDRSTRLEN];        /**< Printable address of the client. */
+        SLIST_ENTRY(conn_thread) entries;       /**< Link in `conn_threads`. */
+};
+
+/**
+ * @var conn_threads
+ * @brief Connection threads that have not been joined yet. Only the main thread touches the list.
+ */
+SLIST_HEAD(conn_thread_list, conn_thread) conn_threads = SLIST_HEAD_INITIALIZER(conn_threads);
+
 /**
  * @var sock_fd
  * @brief The file descriptor for the listening socket.
@@ -60,52 +362,38 @@ int sock_fd = -1;
  */
 int conn_fd = -1;
 
+// --- Stop Watcher (without "-t") ---
+static pthread_mutex_t serving_lock = PTHREAD_MUTEX_INITIALIZER;       /**< Protects `serving_fd` and `serving_aborted`. */
+static pthread_cond_t serving_cond = PTHREAD_COND_INITIALIZER;         /**< Signalled when `serving_fd` goes back to -1. */
+static int serving_fd = -1;                                             /**< Connection the main thread is serving, or -1. */
+static int serving_aborted = 0;                                         /**< Whether that connection was shut down at the drain deadline. */
+static int64_t stop_ms = 0;                                             /**< When the stop was requested, for the drain report. */
+
 // --- Function Declarations ---
-static void signal_handler(int sig);
 static int sendall(int fd, const char *buf, size_t len);
-static int send_file_back(FILE *fp, int client_fd); // Renamed `conn_fd` to `client_fd` for clarity in this function's scope
+static int64_t now_ms(void);
+static int store_partial(struct conn_store *store, const char *buf, size_t len);
+static int send_file_back(FILE *fp, int client_fd, uint64_t committed, const struct aesdcold_pin *pin, unsigned generation); // Renamed `conn_fd` to `client_fd` for clarity in this function's scope
 
 /**
- * @struct sigaction sa
- * @brief Structure used to specify the action to be associated with a specific signal
- * @details This instance `sa` is configured to use the `signal_handler` function 
- * for handling signals. The `sa_flags` is set to 0, meaning no special flags.
+ * @brief Reads the pending signals from `signal_fd` and acts on them.
+ * @details `SIGHUP` re-reads the config file; `SIGINT` and `SIGTERM` set `exit_flag`,
+ * which starts the drain. Only one thread calls this: the main thread with "-t", the stop
+ * watcher otherwise.
  */
-struct sigaction sa = {
-        .sa_handler = signal_handler,   /**< Pointer to the signal-handling function. */
-        .sa_flags = 0                   /**< Special flags to affect behavior of a signal. */
-};
-
-/**
- * @brief Handles `SIGINT` and `SIGTERM` signals to allow graceful shutdown.
- * @param `sig` The signal number that was caught.
- * @details This function sets the global `exit_flag` to 1, logs the event,
- * and attempts to shut down the listening and connection sockets
- * to unblock any pending `accept()` or `recv()` calls.
- * @post The `exit_flag` is set to 1.
- * @post If `sock_fd` is valid, `shutdown(sock_fd, SHUT_RDWR)` is called.
- * @post If `conn_fd` is valid, `shutdown(conn_fd, SHUT_RDWR)` is called.
- */
-static void signal_handler(int sig) {
-        // Log that a signal was caught. The specific signal number `sig` could also be logged.
-        syslog(LOG_INFO, "Caught signal %d, setting exit flag", sig);
-        // Set the global exit flag to indicate the program should terminate.
-        exit_flag = 1;
-
-        // Attempt to gracefully shut down the sockets to unblock any blocking calls.
-        // This helps the main loop to recognize the `exit_flag` and terminate cleanly.
-
-        // Check if teh listening socket descriptor is valid.
-        if(sock_fd != -1) {
-                // Shut down the listening socet for both reading and writing.
-                // This will cause any pending `accept()` calls to return with an error.
-                shutdown(sock_fd, SHUT_RDWR);
-        }
-        // Check if the connection socket descriptor is valid.
-        if(conn_fd != -1) {
-                // Shut down the connection socket for both reading and writing.
-                // This will cause any pending `recv()` calls on this connection to return.
-                shutdown(conn_fd, SHUT_RDWR);
+static void handle_signals(void) {
+        struct signalfd_siginfo si;
+        while (read(signal_fd, &si, sizeof(si)) == (ssize_t)sizeof(si)) {
+                if (si.ssi_signo == SIGHUP) {
+                        aesdconf_reload();
+                        continue;
+                }
+                if (si.ssi_signo != SIGINT && si.ssi_signo != SIGTERM) {
+                        continue;
+                }
+                syslog(LOG_INFO, "Caught signal %u, draining connections", si.ssi_signo);
+                stop_ms = now_ms();
+                exit_flag = 1;
         }
 }
 
@@ -155,54 +443,144 @@ static int sendall(int fd, const char *buf, size_t len) {
 }
 
 /**
- * @brief Reads the entire content of a file and sends it over a socket.
+ * @brief Makes everything written through `fp` durable and publishes the new committed length.
+ * @param `fp` The data file stream the caller has written to.
+ * @param `committed` Receives the committed length of the data file.
+ * @return 0 on success, -1 on failure.
+ * @pre The caller holds `store_lock`.
+ * @details The file's size after the sync is the committed length; it is published to
+ * shared-memory readers, the replication leader and the prefork store header. With "-H" the cold part of the file
+ * is dropped from the page cache once the sync made it durable. The `durability` tunable
+ * selects the sync; each commit reads it, so a change applies from the next commit on.
+ */
+static int commit_data_file(FILE *fp, uint64_t *committed) {
+        // Ensure all buffered output for the stream `fp` is written to the underlying file.
+        if(fflush(fp) !=0) {
+                perror("fflush in `commit_data_file()`"); // Log error if fflush fails.
+                return -1; // Indicate failure.
+        }
+        // Everything up to the current end of file is about to be committed.
+        struct stat st;
+        if (fstat(fileno(fp), &st) != 0) {
+                perror("fstat in `commit_data_file()`");
+                return -1;
+        }
+        // With "-H" the complete windows are already on their way, so the sync only waits for the rest.
+        if (cache_flag) {
+                aesdcache_written(fileno(fp), (uint64_t)st.st_size);
+        }
+        // Ensure that all data for `fp` is physically written to teh storage device, as far as
+        // the `durability` tunable asks for. `fileno(fp)` gets the underlying file descriptor for the stream.
+        int durability = aesdconf_durability();
+        if ((durability == CONF_DURABILITY_FSYNC && fsync(fileno(fp)) != 0) ||
+            (durability == CONF_DURABILITY_FDATASYNC && fdatasync(fileno(fp)) != 0)) {
+                perror("fsync in `commit_data_file()`"); // Log error if fsync fails.
+                return -1; // Indicate failure.
+        }
+        // Let local readers and the replication follower see the committed data.
+        *committed = (uint64_t)st.st_size;
+        if (cache_flag) {
+                aesdcache_committed(fileno(fp), *committed);
+        }
+        aesdshm_publisher_update(*committed);
+        aesdrepl_leader_commit(*committed);
+        aesdcold_commit(*committed);
+        aesdtime_commit(*committed);
+        aesdbloom_commit(fileno(fp), *committed);
+        aesdfork_commit(*committed);
+        return 0;
+}
+
+/**
+ * @brief Reads the committed content of a file and sends it over a socket.
  * @param `fp` A pointer to the `FILE` stream to read from. The file should be open for reading.
  * @param `client_fd` The file descriptor of the client socket to send data to.
+ * @param `committed` The snapshot to replay: the committed length captured by `snapshot_data_file()`.
+ * @param `pin` With "-z", the cold blocks pinned together with the snapshot (see aesdcold.h).
+ * @param `generation` Compaction generation of the data file `fp` refers to.
  * @return 0 on success, -1 on failure.
  * @pre `fp` is a valid `FILE` pointer, opened for reading, and positioned correctly (this function rewinds it).
  * @pre `client_fd` is a valid, open, and connected socket file descriptor.
  * @post The entire content of the file pointed to by `fp` (from its beginning) has been send to `client_fd`,
  * or an error has occurred.
  * @post The file pointer `fp` is positioned at the end of the file.
- * @details This function first flushes any buffered data to the file, ensures it's written to disk,
- * then rewinds the file pointer to the beginning. It reads the file in chunks
- * and uses `sendall()` to transmit each chunk to the client.
+ * @details This function rewinds the file pointer to the beginning, reads the file in chunks
+ * and uses `sendall()` to transmit each chunk to the client. Exactly `committed` bytes are
+ * sent; the bytes of a snapshot never change, so `store_lock` is not needed. With "-z" the
+ * pinned cold blocks are replayed first and the file is read from where they end; the pin
+ * keeps the rest of the snapshot from being punched out of the file in the meantime.
  */
-static int send_file_back(FILE *fp, int conn_fd) {
-        // Ensure all buffered output for the stream `fp` is written to the underlying file.
-        if(fflush(fp) !=0) {
-                perror("fflush in `send_file_back()`"); // Log error if fflush fails.
-                return -1; // Indicate failure.
+static int send_file_back(FILE *fp, int conn_fd, uint64_t committed, const struct aesdcold_pin *pin, unsigned generation) {
+        // Cold blocks come from the compressed store; their range of the data file is a hole.
+        uint64_t cold = 0;
+        if (cold_level > 0 && aesdcold_replay(conn_fd, pin, &cold) != 0) {
+                perror("`aesdcold_replay()` in `send_file_back()` failed");
+                return -1;
         }
-        // Ensure that all data for `fp` is physically written to teh storage device.
-        // `fileno(fp)` gets the underlying file descriptor for the stream.
-        if(fsync(fileno(fp)) != 0) {
-                perror("fsync in `send_file_back()`"); // Log error if fsync fails.
-                return -1; // Indicate failure.
+        // Position the stream `fp` at the first byte not replayed yet (the beginning of the file
+        // unless cold blocks were sent).
+        if (fseeko(fp, (off_t)cold, SEEK_SET) != 0) {
+                perror("fseeko in `send_file_back()` failed");
+                return -1;
+        }
+        if (cache_flag) {
+                aesdcache_replay_begin(fileno(fp), cold, committed);
+        }
+        // With "-B" the replay shares its reads with concurrent ones instead (see aesdcast.h).
+        if (broadcast_kib > 0) {
+                if (aesdcast_replay(conn_fd, fileno(fp), cold, committed, generation) != 0) {
+                        perror("`aesdcast_replay()` in `send_file_back()` failed");
+                        return -1;
+                }
+                if (cache_flag) {
+                        aesdcache_replay_end(fileno(fp), committed);
+                }
+                return fseek(fp, 0, SEEK_END) == 0 ? 0 : -1;
         }
-        // Reset the file position indicator for the stream `fp` to the beginning of teh file.
-        // This is necessary to read the entire file content from the start.
-        rewind(fp);
 
         // Define a buffer to hold chunks of data read from the file.
-        // Its size is `MAX_RECV_BUF_LEN`
-        char send_buffer[MAX_RECV_BUF_LEN];
+        // Its size is the `replay_buffer` tunable; with "-A" it comes from the buffer arena instead of the stack.
+        size_t replay_len = (size_t)aesdconf_replay_buffer();
+        char stack_buffer[lazy_flag ? 1 : replay_len];
+        char *send_buffer = arena_mib > 0 || lazy_flag ? aesdarena_alloc(replay_len) : NULL;
+        if (send_buffer == NULL && lazy_flag) {
+                // With "-L" the stack buffer is a placeholder: fail the replay (and the connection).
+                perror("Error allocating a replay buffer in `send_file_back()`");
+                return -1;
+        }
+        if (send_buffer == NULL) {
+                send_buffer = stack_buffer;
+        }
+        aesdmem_charge(AESDMEM_REPLAY, replay_len);
+        int rc = 0;
         // Variable to store the number of bytes read by `fread()`.
         size_t bytes_read;
+        // Number of committed bytes not yet sent.
+        uint64_t remaining = committed - cold;
 
-        // Loop to read the file in chunks and send each chunk.
+        // Loop to read the committed part of the file in chunks and send each chunk.
         // Loop invariant: All data read from the file up to the current point has been attempted to be sent.
-        // Loop continues as long as `fread()` successfully reads more than 0 bytes.
-        while ((bytes_read = fread(send_buffer, 1, MAX_RECV_BUF_LEN, fp)) > 0) {
+        // Loop continues as long as committed bytes remain and `fread()` successfully reads more than 0 bytes.
+        while (remaining > 0 &&
+               (bytes_read = fread(send_buffer, 1, remaining < replay_len ? (size_t)remaining : replay_len, fp)) > 0) {
+                remaining -= bytes_read;
                 // `fread()` reads `bytes_read` items of size 1 byte from `fp` into `send_buffer`.
                 // If `bytes_read` is 0, it means EOF is reached or an error occurred.
                 
                 // Send the chunk of data read from the file using the `sendall()` helpfer function.
                 if (sendall(conn_fd, send_buffer, bytes_read)< 0) {
                         perror("`sendall()` in `send_file_back()` failed");
-                        return -1; // Indicate failure.
+                        rc = -1; // Indicate failure once the buffer is released.
+                        break;
                 }
         }
+        if (send_buffer != stack_buffer) {
+                aesdarena_free(send_buffer, replay_len);
+        }
+        aesdmem_release(AESDMEM_REPLAY, replay_len);
+        if (rc != 0) {
+                return rc;
+        }
 
         // After the loop, check if `fread()` exited due to an error (not just EOF).
         if (ferror(fp)) {
@@ -210,6 +588,10 @@ static int send_file_back(FILE *fp, int conn_fd) {
                 clearerr(fp); // Clear the error indicator for the stream.
                 return -1; // Indicate failure
         }
+        // The replay pulled the whole file into the cache; only the hot end is worth keeping.
+        if (cache_flag) {
+                aesdcache_replay_end(fileno(fp), committed);
+        }
 
         // Move the file pointer to the end of teh file. This is useful if teh file
         // will be appended to later by the same `FILE* fp` without re-opening.
@@ -222,95 +604,873 @@ static int send_file_back(FILE *fp, int conn_fd) {
 }
 
 /**
- * @brief Main function for the AESD socket server.
- * @param `argc` The number of command-line arguments.
- * @param `argv` An array of command-line argument strings.
- * @return EXIT_SUCCESS on successful completion, EXIT_FAILURE on error.
- * @details Initializes the server, sets up signal handling, binds to a port,
- * listens for connections, and enters a loop to accept and handle
- * cleint requests. If "-d" is passed as an argument, it runs as a daemon.
+ * @brief Captures the snapshot a replay streams.
+ * @param `fp` The data file stream the caller has written to.
+ * @param `committed` Receives the committed length of the data file.
+ * @return 0 on success, -1 on failure.
+ * @pre The caller holds `store_lock`.
+ * @details Commits what this connection appended. On a follower the replicated length is
+ * used instead, since a follower never writes through `fp`. Everything before the
+ * snapshot is complete packets and never changes, so the replay itself can run after
+ * `store_lock` is released while other connections keep appending.
  */
-int main(int argc, char* argv[]) {
-        // --- Initialization ---
-        sigemptyset(&sa.sa_mask);
-        sigaction(SIGINT, &sa, NULL);
-        sigaction(SIGTERM, &sa, NULL);
-        signal(SIGPIPE, SIG_IGN);
-        openlog(NULL, LOG_CONS, LOG_USER);
-        unlink(DATA_FILE);
+static int snapshot_data_file(FILE *fp, uint64_t *committed) {
+        if (follower_target != NULL) {
+                *committed = aesdrepl_follower_committed();
+                return 0;
+        }
+        return commit_data_file(fp, committed);
+}
 
+/**
+ * @brief Sends what was committed since a cursor's offset and moves the cursor past it.
+ * @param `fp` The shared data file.
+ * @param `client_fd` The connected client socket.
+ * @param `cursor` The cursor of the connection.
+ * @param `committed` The snapshot captured by `snapshot_data_file()`.
+ * @return 0 on success, -1 on failure.
+ * @details The cursor only moves once the whole slice has been sent, so a client that
+ * drops in the middle of a replay receives the slice again when it reconnects.
+ */
+static int send_file_since(FILE *fp, int client_fd, struct aesdcursor *cursor, uint64_t committed) {
+        off_t pos = (off_t)aesdcursor_offset(cursor);
+        while ((uint64_t)pos < committed) {
+                ssize_t n = sendfile(client_fd, fileno(fp), &pos, (size_t)(committed - (uint64_t)pos));
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) {
+                        perror("sendfile in `send_file_since()` failed");
+                        return -1;
+                }
+        }
+        aesdcursor_advance(cursor, committed);
+        return 0;
+}
 
-        // --- Handle Daemon Mode Argument ---
-        if(argc >= 2 && strcmp(argv[1], "-d") == 0) {
-                daemon_flag = true;
-                syslog(LOG_INFO, "Daemon mode requested."); // Log daemon mode activation.
+/**
+ * @brief Re-opens the shared data file if the compactor replaced it since the connection opened it.
+ * @param `store` Where the packets of this connection go.
+ * @return 0 on success, -1 if the data file cannot be re-opened.
+ * @pre The caller holds `store_lock`, so no swap can happen until it is released.
+ */
+static int refresh_data_file(struct conn_store *store) {
+        unsigned generation = aesdcompact_generation();
+        if (store->generation == generation) {
+                return 0;
+        }
+        FILE *fp = fopen(data_file, "a+");
+        if (fp == NULL) {
+                perror("Error re-opening compacted file");
+                return -1;
         }
+        fclose(store->fp);
+        store->fp = fp;
+        store->generation = generation;
+        return 0;
+}
 
+/**
+ * @brief Stores a `PUT <key> <value>` packet and indexes the value.
+ * @param `store` Where the packets of this connection go (the shared data file).
+ * @param `client_fd` The connected client socket.
+ * @param `buf` The packet.
+ * @param `len` The length of the packet in bytes.
+ * @return 0 on success, -1 on failure.
+ * @details The packet is appended to the data file verbatim, so the log (and its replay)
+ * still contains every `PUT`. The client receives "OK" once the packet is committed.
+ */
+static int store_put(struct conn_store *store, int client_fd, const char *buf, size_t len) {
+        const char *key = buf + strlen(AESDKV_PUT);
+        const char *space = memchr(key, ' ', len - (key - buf));
+        if (space == NULL || space == key || space - key > AESDKV_KEY_MAX) {
+                return sendall(client_fd, "ERR malformed PUT\n", 18);
+        }
+        size_t value_start = (size_t)(space + 1 - buf);
 
-        // --- Socket Creation and Setup ---
-        // open a stream socket bound to port 9000, if any of the socket connection steps fail return -1
-        sock_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-        if (sock_fd == -1) {
-                perror("Error creating Berkeley Stream Socket");
-                exit(EXIT_FAILURE);
+        lock_store();
+        // Flush first so that the size of the file is the offset this packet lands at.
+        struct stat st;
+        if (refresh_data_file(store) != 0 || fflush(store->fp) != 0 || fstat(fileno(store->fp), &st) != 0) {
+                unlock_store();
+                return -1;
         }
-        int opt = 1;
-        setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+        FILE *fp = store->fp;
+        fwrite(buf, 1, len, fp);
+        uint64_t committed;
+        int rc = commit_data_file(fp, &committed);
+        if (rc == 0) {
+                rc = aesdkv_put(key, space - key, (uint64_t)st.st_size + value_start, (uint32_t)(len - value_start));
+        }
+        unlock_store();
+        if (rc != 0) {
+                return -1;
+        }
+        return sendall(client_fd, "OK\n", 3);
+}
 
-        struct sockaddr_in serv_addr;
+/**
+ * @brief Answers a `GET <key>` packet with the latest value of the key.
+ * @param `store` Where the packets of this connection go (the shared data file).
+ * @param `client_fd` The connected client socket.
+ * @param `buf` The packet.
+ * @param `len` The length of the packet in bytes.
+ * @return 0 on success, -1 on failure.
+ * @details The value is sent with `sendfile()` straight from the page cache. `store_lock` is
+ * only held for the lookup, so a slow reader never holds up appends and replays: the
+ * connection's descriptor, refreshed under the lock, pins the file the offset belongs to
+ * even if the compactor swaps in a new one during the send.
+ */
+static int store_get(struct conn_store *store, int client_fd, const char *buf, size_t len) {
+        const char *key = buf + strlen(AESDKV_GET);
+        size_t key_len = len - (key - buf);
+        while (key_len > 0 && (key[key_len - 1] == '\n' || key[key_len - 1] == '\r')) {
+                key_len--;
+        }
+        uint64_t offset;
+        uint32_t value_len;
+        lock_store();
+        if (refresh_data_file(store) != 0) {
+                unlock_store();
+                return -1;
+        }
+        if (key_len == 0 || !aesdkv_get(key, key_len, &offset, &value_len)) {
+                unlock_store();
+                return sendall(client_fd, "ERR no such key\n", 16);
+        }
+        unlock_store();
+        off_t pos = (off_t)offset;
+        size_t left = value_len;
+        int rc = 0;
+        while (left > 0) {
+                ssize_t n = sendfile(client_fd, fileno(store->fp), &pos, left);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) {
+                        rc = -1;
+                        break;
+                }
+                left -= (size_t)n;
+        }
+        return rc;
+}
 
-        memset(&serv_addr, 0, sizeof(serv_addr));
+/**
+ * @brief Appends bytes to the shared data file.
+ * @param `fp` The data file stream.
+ * @param `buf` The bytes to append.
+ * @param `len` The number of bytes.
+ * @pre The caller holds `store_lock`.
+ * @details With "-H" a long append (the held-back start of a long packet) is handed to the
+ * kernel window by window, starting the writeback of each window while the next is written.
+ */
+static void append_data_file(FILE *fp, const char *buf, size_t len) {
+        if (!cache_flag) {
+                fwrite(buf, 1, len, fp);
+                return;
+        }
+        // Loop invariant: the bytes before `buf` are written and their complete windows are being written back.
+        while (len > 0) {
+                size_t n = len < CACHE_WINDOW ? len : CACHE_WINDOW;
+                fwrite(buf, 1, n, fp);
+                struct stat st;
+                if (fflush(fp) == 0 && fstat(fileno(fp), &st) == 0) {
+                        aesdcache_written(fileno(fp), (uint64_t)st.st_size);
+                }
+                buf += n;
+                len -= n;
+        }
+}
 
-        serv_addr.sin_family = AF_INET;                 // IPv4
-        serv_addr.sin_addr.s_addr = INADDR_ANY;         // accept connections on any interface
-        serv_addr.sin_port = htons(PORT);               // `htons()` converts a 16-bit number from host byte order to network byte order
+/**
+ * @brief Commits what the connection appended and replays the resulting snapshot.
+ * @param `store` Where the packets of this connection go (the shared data file).
+ * @param `client_fd` The connected client socket.
+ * @return 0 on success, -1 on failure.
+ * @pre The caller holds `store_lock`; it is released before the snapshot is streamed.
+ */
+static int commit_and_replay(struct conn_store *store, int client_fd) {
+        uint64_t committed;
+        if (snapshot_data_file(store->fp, &committed) != 0) {
+                unlock_store();
+                return -1;
+        }
+        // The cold blocks are part of the snapshot; the range of the data file past them
+        // stays readable until the replay ends.
+        struct aesdcold_pin pin = { 0, 0 };
+        if (cold_level > 0) {
+                aesdcold_pin(&pin);
+        }
+        unlock_store();
+        // Stream the snapshot while other connections keep appending behind it.
+        if (store->compressed) {
+                return aesdwire_replay(client_fd, fileno(store->fp), committed, store->generation);
+        }
+        if (store->cursor != NULL) {
+                return send_file_since(store->fp, client_fd, store->cursor, committed);
+        }
+        int rc = send_file_back(store->fp, client_fd, committed, &pin, store->generation);
+        if (cold_level > 0) {
+                aesdcold_unpin(&pin);
+        }
+        return rc;
+}
 
-        if(bind(sock_fd, (struct sockaddr*) &serv_addr, sizeof(serv_addr)) != 0) {
-                // ...
-                perror("Error binding Berkeley Stream Socket to port 9000");
-                close(sock_fd);
-                exit(EXIT_FAILURE);
+/**
+ * @brief Parses a Unix timestamp in seconds (fractions allowed) into milliseconds.
+ * @param `str` The timestamp; parsing stops at the first character that does not belong to it.
+ * @param `ms` Receives the timestamp in milliseconds.
+ * @param `rest` Receives a pointer to the first character after the timestamp.
+ * @return true if a non-negative timestamp was parsed.
+ */
+static bool parse_timestamp(const char *str, int64_t *ms, char **rest) {
+        double seconds = strtod(str, rest);
+        if (*rest == str || seconds < 0 || seconds > 9e15) {
+                return false;
         }
+        *ms = (int64_t)(seconds * 1000.0);
+        return true;
+}
 
-        // --- Daemonization (if requested) ---
-        if (daemon_flag == true) {
-            pid_t pid = fork();
-            if (pid < 0) {
-                perror("Error forking");
-                close(sock_fd);
-                exit(EXIT_FAILURE);
-            }
-            if (pid > 0) { // Parent exits
-                close(sock_fd);
-                exit(EXIT_SUCCESS);
-            }
-            // Child continues
-            setsid(); // New session
-            chdir("/"); // Change working directory
-            // Redirect I/O to /dev/null
-            int fd = open("/dev/null", O_RDWR);
-            dup2(fd, STDIN_FILENO);
-            dup2(fd, STDOUT_FILENO);
-            dup2(fd, STDERR_FILENO);
-            if (fd > 2) close(fd);
+/**
+ * @brief Answers a `SINCE <t>` or `RANGE <t0> <t1>` packet with the matching slice of the log.
+ * @param `store` Where the packets of this connection go (the shared data file).
+ * @param `client_fd` The connected client socket.
+ * @param `buf` The packet.
+ * @param `len` The length of the packet in bytes.
+ * @return 0 on success, -1 on failure.
+ * @details The packet is not stored. The lock is only held to look the slice up in the
+ * time index; committed bytes never change, so the `sendfile()` runs without it.
+ */
+static int store_slice(struct conn_store *store, int client_fd, const char *buf, size_t len) {
+        bool range = memcmp(buf, AESDTIME_RANGE, strlen(AESDTIME_RANGE)) == 0;
+        // `buf` is not NUL-terminated at the end of the packet, so parse a copy.
+        char args[64];
+        size_t args_len = len - strlen(AESDTIME_SINCE);
+        if (args_len >= sizeof(args)) {
+                return sendall(client_fd, "ERR malformed time query\n", 25);
+        }
+        memcpy(args, buf + strlen(AESDTIME_SINCE), args_len);
+        args[args_len] = '\0';
+        int64_t from_ms;
+        int64_t to_ms = INT64_MAX;
+        char *rest;
+        if (!parse_timestamp(args, &from_ms, &rest) || (range && !parse_timestamp(rest, &to_ms, &rest))) {
+                return sendall(client_fd, "ERR malformed time query\n", 25);
+        }
+        while (*rest == ' ' || *rest == '\r' || *rest == '\n') rest++;
+        if (*rest != '\0') {
+                return sendall(client_fd, "ERR malformed time query\n", 25);
         }
 
-        // listen and accept connections
-        listen(sock_fd, BACKLOG);                       // Socket is now actually enabled and passively listening for connections
-        
-        struct sockaddr_in client_addr;
-        socklen_t addr_size = sizeof(client_addr);
+        uint64_t start;
+        uint64_t end;
+        lock_store();
+        aesdtime_slice(from_ms, to_ms, &start, &end);
+        unlock_store();
+        off_t pos = (off_t)start;
+        while ((uint64_t)pos < end) {
+                ssize_t n = sendfile(client_fd, fileno(store->fp), &pos, (size_t)(end - (uint64_t)pos));
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) {
+                        return -1;
+                }
+        }
+        return 0;
+}
+
+/**
+ * @brief Answers an `EXISTS <line>` packet with `YES` or `NO`.
+ * @param `store` Where the packets of this connection go (the shared data file).
+ * @param `client_fd` The connected client socket.
+ * @param `buf` The packet.
+ * @param `len` The length of the packet in bytes.
+ * @return 0 on success, -1 on failure.
+ * @details The packet is not stored. The lock is only held to list the segments that
+ * may hold the line; their filters and the segments are read without it (see aesdbloom.h).
+ */
+static int store_exists(struct conn_store *store, int client_fd, const char *buf, size_t len) {
+        const char *line = buf + strlen(AESDBLOOM_EXISTS);
+        size_t line_len = len - strlen(AESDBLOOM_EXISTS);
+        if (line_len > 0 && line[line_len - 1] == '\n') {
+                line_len--;
+        }
+        struct aesdbloom_query query;
+        lock_store();
+        int rc = aesdbloom_lookup(line, line_len, &query);
+        unlock_store();
+        if (rc == 0) {
+                rc = aesdbloom_confirm(fileno(store->fp), line, line_len, &query);
+        }
+        if (rc < 0) {
+                return sendall(client_fd, "ERR lookup failed\n", 18);
+        }
+        return rc == 1 ? sendall(client_fd, "YES\n", 4) : sendall(client_fd, "NO\n", 3);
+}
+
+/**
+ * @brief Appends a complete packet to the log and replays the log back to the client.
+ * @param `store` Where the packets of this connection go.
+ * @param `client_fd` The connected client socket.
+ * @param `buf` The packet, including its terminating newline (if any).
+ * @param `len` The length of the packet in bytes.
+ * @return 0 on success, -1 on failure.
+ * @details In single-file mode the append and the commit happen under `store_lock`, which
+ * yields the snapshot (committed length) the replay streams after releasing the lock; a
+ * replay never contains a half-written packet of another connection, and never blocks it. In sharded mode the
+ * packet is committed to the caller's shard and the replay merges all shards. A topic
+ * replays only its own log. In keyed mode `PUT` and `GET` packets on the shared data file
+ * are answered by `store_put()` and `store_get()` instead of a replay. With "-D" the shared
+ * log is the deduplicating store, which does its own locking; with "-O" it is the direct I/O
+ * store, which does too. With "-i" `SINCE` and `RANGE`
+ * packets are answered by `store_slice()`, with "-e" `EXISTS` packets by `store_exists()`. A connection with a cursor only receives what
+ * its cursor has not seen yet.
+ */
+static int store_packet(struct conn_store *store, int client_fd, const char *buf, size_t len) {
+        // The tail of a long packet is never a command, whatever it starts with.
+        bool command = store->fp != NULL && store->topic == NULL && store->pending_len == 0;
+        if (keyed_flag && command) {
+                if (len > strlen(AESDKV_PUT) && memcmp(buf, AESDKV_PUT, strlen(AESDKV_PUT)) == 0) {
+                        return store_put(store, client_fd, buf, len);
+                }
+                if (len > strlen(AESDKV_GET) && memcmp(buf, AESDKV_GET, strlen(AESDKV_GET)) == 0) {
+                        return store_get(store, client_fd, buf, len);
+                }
+        }
+        if (time_index_flag && command && len > strlen(AESDTIME_SINCE) &&
+            (memcmp(buf, AESDTIME_SINCE, strlen(AESDTIME_SINCE)) == 0 ||
+             memcmp(buf, AESDTIME_RANGE, strlen(AESDTIME_RANGE)) == 0)) {
+                return store_slice(store, client_fd, buf, len);
+        }
+        if (exists_flag && command && len >= strlen(AESDBLOOM_EXISTS) &&
+            memcmp(buf, AESDBLOOM_EXISTS, strlen(AESDBLOOM_EXISTS)) == 0) {
+                return store_exists(store, client_fd, buf, len);
+        }
+        if (store->topic != NULL) {
+                int rc = aesdtopic_packet(store->topic, client_fd, store->pending, store->pending_len, buf, len);
+                store->pending_len = 0;
+                return rc;
+        }
+        // A shard record and a deduplicated literal each hold one whole packet.
+        if ((store->shard != NULL || dedup_flag) && store->pending_len > 0) {
+                if (store_partial(store, buf, len) != 0) {
+                        store->pending_len = 0;
+                        return -1;
+                }
+                buf = store->pending;
+                len = store->pending_len;
+                store->pending_len = 0;
+        }
+        if (store->shard != NULL) {
+                uint64_t seq;
+                if (aesdshard_append(store->shard, buf, len, &seq) != 0 || aesdshard_commit(store->shard) != 0) {
+                        return -1;
+                }
+                return aesdshard_replay(client_fd, seq);
+        }
+        if (dedup_flag) {
+                if (aesddedup_append(buf, len) != 0 || aesddedup_commit() != 0) {
+                        return -1;
+                }
+                return aesddedup_replay(client_fd);
+        }
+        if (direct_flag) {
+                uint64_t snapshot;
+                int rc = aesddirect_append(store->pending, store->pending_len, buf, len, &snapshot);
+                store->pending_len = 0;
+                return rc == 0 ? aesddirect_replay(client_fd, snapshot) : -1;
+        }
+        lock_store();
+        if (refresh_data_file(store) != 0) {
+                unlock_store();
+                return -1;
+        }
+        // A follower is read-only for clients: the packet only requests a replay.
+        if (follower_target == NULL) {
+                // The start of a long packet was held back so the packet lands in one piece.
+                append_data_file(store->fp, store->pending, store->pending_len);
+                append_data_file(store->fp, buf, len);
+        }
+        store->pending_len = 0;
+        return commit_and_replay(store, client_fd);
+}
+
+/**
+ * @brief Receives a `FRAME <len>` payload and appends it to the log as one packet.
+ * @param `store` Where the packets of this connection go (the shared data file).
+ * @param `client_fd` The connected client socket.
+ * @param `head` Payload bytes that were received together with the header.
+ * @param `head_len` The number of bytes in `head`, at most `frame_len`.
+ * @param `frame_len` The announced payload length.
+ * @return 0 on success, -1 on failure.
+ * @details The payload is staged with `splice()` before `store_lock` is taken, so a slow sender
+ * does not hold up other connections. The append, the commit and the replay then work like
+ * those of `store_packet()`.
+ */
+static int store_frame(struct conn_store *store, int client_fd, const char *head, size_t head_len, uint64_t frame_len) {
+        int staging = aesdsplice_receive(data_file, client_fd, head, head_len, frame_len);
+        if (staging == -1) {
+                return -1;
+        }
+        lock_store();
+        // Flush first so that the size of the file is the offset the frame lands at.
+        struct stat st;
+        if (refresh_data_file(store) != 0 || fflush(store->fp) != 0 || fstat(fileno(store->fp), &st) != 0 ||
+            aesdsplice_append(staging, data_file, (uint64_t)st.st_size, frame_len) != 0) {
+                unlock_store();
+                close(staging);
+                return -1;
+        }
+        close(staging);
+        return commit_and_replay(store, client_fd);
+}
+
+/**
+ * @brief Appends the start of a packet that does not fit into the receive buffer.
+ * @param `store` Where the packets of this connection go.
+ * @param `buf` The received bytes.
+ * @param `len` The number of received bytes.
+ * @details The bytes are held by the connection and appended together with the rest of
+ * the packet, whichever store it goes to, so a replay of another connection never ends
+ * inside this packet and the shard and deduplicating stores see it as one record.
+ * @return 0 on success, -1 if the bytes could not be stored; the packet then has a hole
+ * and the connection must not store the rest of it.
+ */
+static int store_partial(struct conn_store *store, const char *buf, size_t len) {
+        if (follower_target != NULL) {
+                return 0;
+        }
+        if (store->pending_len + len > store->pending_cap) {
+                size_t cap = store->pending_cap ? store->pending_cap : 2 * MAX_RECV_BUF_LEN;
+                while (cap < store->pending_len + len) cap *= 2;
+                char *pending = realloc(store->pending, cap);
+                if (pending == NULL) {
+                        perror("Error buffering a long packet");
+                        return -1;
+                }
+                aesdmem_charge(AESDMEM_PENDING, cap - store->pending_cap);
+                store->pending = pending;
+                store->pending_cap = cap;
+        }
+        memcpy(store->pending + store->pending_len, buf, len);
+        store->pending_len += len;
+        return 0;
+}
+
+/**
+ * @brief Receives more bytes of a connection, taking a receive buffer first if it holds none.
+ * @param `client_fd` The connected client socket.
+ * @param `buf` The receive buffer of the connection, or NULL; receives the buffer taken.
+ * @param `held` The number of bytes already in `*buf`.
+ * @param `len` The size of the receive buffer.
+ * @return What `recv()` returned, or -1 if no buffer could be taken.
+ * @details A connection without a buffer (only with "-L") waits for data with `poll()` and
+ * only then takes a buffer, so it holds none while idle. With "-P" every wait spins first
+ * (see aesdpoll.h). A `SIGINT` or `SIGTERM` ends the connection like the client's end-of-file
+ * would, since the drain shuts down its receiving side. Between two packets (`held` is 0) the connection first waits out
+ * memory pressure (see aesdmem.h), leaving the client's data in the socket buffers.
+ */
+static ssize_t receive_more(int client_fd, char **buf, int held, int len) {
+        if (held == 0) {
+                aesdmem_admit();
+        }
+        if (busy_poll_us > 0 || *buf == NULL) {
+                struct pollfd pfd = { .fd = client_fd, .events = POLLIN };
+                if (busy_poll_us > 0) {
+                        aesdpoll_wait(client_fd, -1);
+                } else {
+                        while (poll(&pfd, 1, -1) < 0 && errno == EINTR);
+                }
+        }
+        if (*buf == NULL) {
+                *buf = aesdarena_alloc((size_t)len);
+                if (*buf == NULL) {
+                        return -1;
+                }
+                aesdmem_charge(AESDMEM_RECV, (size_t)len);
+        }
+        return recv(client_fd, *buf + held, (size_t)(len - held), 0);
+}
+
+/**
+ * @brief Receives packets from one client until it disconnects.
+ * @param `client_fd` The connected client socket. It is not closed by this function.
+ * @param `ip_string` Printable address of the client, used for logging.
+ * @details Every newline-terminated packet is appended to the log, after which the whole
+ * log is sent back to the client. Data left without a newline when the client closes its
+ * side is treated as a final packet. With topics enabled, a first packet of the form
+ * `TOPIC <name>` is not stored; it routes the rest of the connection to that topic.
+ */
+static void handle_connection(int client_fd, const char *ip_string) {
+        struct conn_store store = { .fp = NULL, .shard = NULL, .topic = NULL };
+        aesdpoll_prepare(client_fd);
+        if (shard_count > 0) {
+                // Each connection appends to one shard for as long as it is connected.
+                store.shard = aesdshard_acquire();
+        } else {
+                // receive data over the connection and append it to /var/temp/aesdsocketdata (if the file doesn't exist, create it)
+                store.generation = aesdcompact_generation();
+                store.fp = fopen(data_file, "a+");
+                if(!store.fp) {
+                        perror("Error opening file");
+                        return;
+                }
+                // An idle connection should not keep a stdio buffer either; replays read into their own buffer.
+                if (lazy_flag) {
+                        setvbuf(store.fp, NULL, _IONBF, 0);
+                }
+        }
+        // The size of the receive buffer is the `recv_buffer` tunable when the connection starts.
+        // With "-A" the buffer comes from the buffer arena instead of the stack. With "-L"
+        // it is only taken once data arrives. Packets are parsed by length and never
+        // NUL-terminated, so the buffer is exactly `recv_len` and fills its arena class.
+        int recv_len = aesdconf_recv_buffer();
+        char stack_buffer[lazy_flag ? 1 : recv_len];
+        char *receive_buffer = NULL;
+        // With "-L" `receive_more()` takes the buffer and ends the connection if it cannot;
+        // only a full-size stack buffer is ever fallen back to.
+        if (!lazy_flag) {
+                receive_buffer = arena_mib > 0 ? aesdarena_alloc((size_t)recv_len) : NULL;
+                if (receive_buffer == NULL) {
+                        receive_buffer = stack_buffer;
+                }
+                aesdmem_charge(AESDMEM_RECV, (size_t)recv_len);
+        }
+        int msg_len = 0;
+        int total_received = 0;
+        // Only the very first packet of a connection may select a topic, compressed replays or a cursor.
+        bool first_packet = topic_max_open > 0 || wire_level > 0 || cursor_flag;
+
+        // Loop to receive data from client
+        // Loop invariant: `total_received` is the number of bytes currently in `receive_buffer` 
+        //                  that have not been processed (written to file or part of a complete packet).
+        // Loop invariant: `receive_buffer` contains data from `receive_buffer[0]` to `receive_buffer[total_received - 1]`
+        // Loop continues as long as `recv()` returns a positive value (bytes received).
+        // `recv()` attemps to read up to `recv_len - total_received` bytes into `receive_buffer + total_received`.
+        // The `0` flag means no special receive options.
+        while((msg_len = receive_more(client_fd, &receive_buffer, total_received, recv_len)) > 0) {
+                total_received += msg_len;
+                char *nl;
+                // Process complete lines (packets) ending with a newline character.
+                // Loop invariant: All complete lines before the current `receive_buffer` content have been processes.
+                // Loop continues as long as `memchr` finds a newline in the `total_received` bytes of `receive_buffer`.
+                while((nl = memchr(receive_buffer, '\n', total_received))) {
+                        size_t line_len = nl - receive_buffer + 1;
+                        // A `TOPIC` preamble only selects the topic; it is neither stored nor answered.
+                        // A `COMPRESS` preamble is answered to confirm the negotiation. A `CURSOR`
+                        // preamble selects the cursor and is answered with its first replay.
+                        bool preamble = false;
+                        if (first_packet) {
+                                first_packet = false;
+                                if (store.fp != NULL && aesdwire_is_preamble(receive_buffer, line_len)) {
+                                        store.compressed = true;
+                                        preamble = true;
+                                        sendall(client_fd, AESDWIRE_REPLY, strlen(AESDWIRE_REPLY));
+                                } else if (store.fp != NULL &&
+                                           (store.cursor = aesdcursor_parse_preamble(receive_buffer, line_len)) != NULL) {
+                                        preamble = true;
+                                        uint64_t committed;
+                                        lock_store();
+                                        int rc = refresh_data_file(&store) == 0 ? snapshot_data_file(store.fp, &committed) : -1;
+                                        unlock_store();
+                                        if (rc != 0 || send_file_since(store.fp, client_fd, store.cursor, committed) != 0) {
+                                                perror("send_file_since");
+                                        }
+                                } else if (topic_max_open > 0) {
+                                        store.topic = aesdtopic_parse_preamble(receive_buffer, line_len);
+                                        preamble = store.topic != NULL;
+                                }
+                        }
+                        uint64_t frame_len;
+                        if (!preamble && frame_flag && store.fp != NULL && store.topic == NULL && store.pending_len == 0 &&
+                            aesdsplice_parse_header(receive_buffer, line_len, &frame_len)) {
+                                // The payload may have arrived together with the header.
+                                size_t head_len = total_received - line_len;
+                                if (head_len > frame_len) head_len = (size_t)frame_len;
+                                if (store_frame(&store, client_fd, nl + 1, head_len, frame_len) < 0) {
+                                        perror("store_frame");
+                                        total_received = 0;
+                                        break;
+                                }
+                                line_len += head_len;
+                        } else if (!preamble && store_packet(&store, client_fd, receive_buffer, line_len) < 0) {
+                                perror("send_file_back");
+                                // The packet was stored; only its replay failed (e.g. aborted by a drain),
+                                // so it must not be stored again as a final packet.
+                                total_received = 0;
+                                break;
+                        }
+                        size_t remaining = total_received - line_len;
+                        memmove(receive_buffer, receive_buffer + line_len, remaining);
+                        total_received = remaining;
+                }
+                if (total_received >= recv_len) {
+                        first_packet = false;
+                        if (store_partial(&store, receive_buffer, total_received) != 0) {
+                                // Storing the rest would leave a hole in the packet: drop it with the connection.
+                                syslog(LOG_ERR, "Dropping the connection from %s: a long packet could not be stored", ip_string);
+                                store.pending_len = 0;
+                                total_received = 0;
+                                break;
+                        }
+                        total_received = 0;
+                }
+                // Without a partial packet the buffer goes back before the connection waits again.
+                if (lazy_flag && total_received == 0) {
+                        aesdarena_free(receive_buffer, (size_t)recv_len);
+                        aesdmem_release(AESDMEM_RECV, (size_t)recv_len);
+                        receive_buffer = NULL;
+                        aesdarena_idle();
+                }
+        }
+        if(total_received > 0) {
+                if (store_packet(&store, client_fd, receive_buffer, total_received) < 0) {
+                        perror("send_file_back");
+                }
+                total_received = 0;
+        }
+        if(msg_len < 0) { perror("Error receiving data"); }
+        // The start of a long packet the client never finished is still part of the log.
+        if (store.pending_len > 0 && store.topic != NULL) {
+                aesdtopic_partial(store.topic, store.pending, store.pending_len);
+        } else if (store.pending_len > 0 && store.shard != NULL) {
+                aesdshard_append(store.shard, store.pending, store.pending_len, NULL);
+                aesdshard_commit(store.shard);
+        } else if (store.pending_len > 0 && dedup_flag) {
+                aesddedup_append(store.pending, store.pending_len);
+                aesddedup_commit();
+        } else if (store.pending_len > 0 && direct_flag) {
+                uint64_t snapshot;
+                aesddirect_append(store.pending, store.pending_len, NULL, 0, &snapshot);
+        } else if (store.pending_len > 0) {
+                lock_store();
+                if (refresh_data_file(&store) == 0) {
+                        fwrite(store.pending, 1, store.pending_len, store.fp);
+                        fflush(store.fp);
+                        // Another worker dying would cut the file back to its committed length.
+                        uint64_t committed;
+                        if (worker_count > 0) {
+                                commit_data_file(store.fp, &committed);
+                        }
+                }
+                unlock_store();
+        }
+        free(store.pending);
+        aesdmem_release(AESDMEM_PENDING, store.pending_cap);
+        if (receive_buffer != stack_buffer) {
+                aesdarena_free(receive_buffer, (size_t)recv_len);
+        }
+        if (receive_buffer != NULL) {
+                aesdmem_release(AESDMEM_RECV, (size_t)recv_len);
+        }
+        if (store.fp != NULL) {
+                fsync(fileno(store.fp));
+                fclose(store.fp);
+        } else {
+                aesdshard_release(store.shard);
+        }
+        syslog(LOG_INFO, "Closed connection from %s", ip_string);
+}
+
+/**
+ * @brief Entry point of a connection thread.
+ * @param `arg` The `struct conn_thread` describing the connection.
+ * @return `arg`.
+ * @details The socket is shut down (so the client sees end-of-file) but only closed by the
+ * main thread when it joins this thread; that way the descriptor number cannot be reused
+ * while the main thread may still call `shutdown()` on it. `conn_event` tells the main
+ * thread the connection is done.
+ */
+static void *connection_thread(void *arg) {
+        struct conn_thread *ct = arg;
+        // Serve the connection on the CPU that receives its packets (with "-a").
+        aesdcpu_steer(ct->fd);
+        handle_connection(ct->fd, ct->ip_string);
+        shutdown(ct->fd, SHUT_RDWR);
+        atomic_store(&ct->done, true);
+        // Wake the event loop so it joins this thread.
+        uint64_t one = 1;
+        if (write(conn_event, &one, sizeof(one)) < 0) {
+                perror("Error signalling a finished connection");
+        }
+        return ct;
+}
+
+/**
+ * @brief Joins connection threads and releases their resources.
+ * @param `all` If `true`, every connection is shut down and every thread joined (used on exit);
+ * otherwise only threads that already finished are joined.
+ */
+static void reap_connection_threads(bool all) {
+        struct conn_thread **link = &SLIST_FIRST(&conn_threads);
+        // Loop invariant: `*link` is the next list entry that has not been examined.
+        while (*link != NULL) {
+                struct conn_thread *ct = *link;
+                if (!all && !atomic_load(&ct->done)) {
+                        link = &SLIST_NEXT(ct, entries);
+                        continue;
+                }
+                if (all) {
+                        // Unblock a thread waiting in `recv()`.
+                        shutdown(ct->fd, SHUT_RDWR);
+                }
+                pthread_join(ct->thread, NULL);
+                close(ct->fd);
+                *link = SLIST_NEXT(ct, entries);
+                free(ct);
+        }
+}
+
+/**
+ * @brief Milliseconds of `CLOCK_MONOTONIC`.
+ */
+static int64_t now_ms(void) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Lets every connection thread finish what it received, waiting at most `deadline_ms`.
+ * @param `deadline_ms` How long to wait before the remaining connections are aborted.
+ * @return The number of connections that had to be aborted.
+ * @details Each connection is shut down for reading: packets already received are still
+ * appended, committed and replayed, then the thread sees end-of-file and ends. Threads that
+ * are still busy at the deadline (e.g. replaying to a client that stopped reading) are
+ * shut down completely, which aborts their replay.
+ */
+static int drain_connection_threads(int deadline_ms) {
+        struct conn_thread *ct;
+        SLIST_FOREACH(ct, &conn_threads, entries) {
+                shutdown(ct->fd, SHUT_RD);
+        }
+        int64_t deadline = now_ms() + deadline_ms;
+        reap_connection_threads(false);
+        // Loop invariant: every finished thread before this iteration has been joined.
+        while (!SLIST_EMPTY(&conn_threads)) {
+                int64_t left = deadline - now_ms();
+                struct pollfd pfd = { .fd = conn_event, .events = POLLIN };
+                if (left <= 0 || (poll(&pfd, 1, (int)left) < 0 && errno != EINTR)) {
+                        break;
+                }
+                uint64_t finished;
+                if (read(conn_event, &finished, sizeof(finished)) < 0 && errno != EAGAIN) {
+                        break;
+                }
+                reap_connection_threads(false);
+        }
+        int aborted = 0;
+        SLIST_FOREACH(ct, &conn_threads, entries) {
+                aborted++;
+        }
+        reap_connection_threads(true);
+        return aborted;
+}
+
+/**
+ * @brief Makes the shared data file durable once more before the server exits.
+ * @details Connections sync the file as they close, but with the `durability` tunable at
+ * `fdatasync` or `none` this single sync is what makes all of it durable. The other stores
+ * sync themselves when they are closed.
+ */
+static void final_commit(void) {
+        if (shard_count > 0 || dedup_flag || direct_flag) {
+                return;
+        }
+        int fd = open(data_file, O_WRONLY);
+        if (fd == -1) {
+                return;
+        }
+        if (fsync(fd) != 0) {
+                syslog(LOG_ERR, "Final commit of %s failed: %m", data_file);
+        }
+        close(fd);
+}
+
+/**
+ * @brief Reads `signal_fd` while the main thread serves connections itself (without "-t").
+ * @details A replay blocks in `send()` or `sendfile()` of whichever module streams it, where
+ * `signal_fd` cannot be watched. Once a stop is requested the watcher wakes the event loop,
+ * shuts down the receiving side of the connection being served and gives it up to
+ * `drain_ms` to finish; then it shuts the connection down completely, which fails the
+ * blocked send.
+ */
+static void *stop_watcher(void *arg) {
+        (void)arg;
+        struct pollfd pfd = { .fd = signal_fd, .events = POLLIN };
+        while (!exit_flag) {
+                if (poll(&pfd, 1, -1) > 0) {
+                        handle_signals();
+                }
+        }
+        uint64_t one = 1;
+        if (write(conn_event, &one, sizeof(one)) < 0) {
+                perror("Error waking the event loop");
+        }
+        pthread_mutex_lock(&serving_lock);
+        if (serving_fd != -1) {
+                shutdown(serving_fd, SHUT_RD);
+                struct timespec deadline;
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                int64_t ns = deadline.tv_nsec + (int64_t)aesdconf_drain_ms() * 1000000;
+                deadline.tv_sec += ns / 1000000000;
+                deadline.tv_nsec = ns % 1000000000;
+                while (serving_fd != -1 && pthread_cond_timedwait(&serving_cond, &serving_lock, &deadline) == 0);
+                if (serving_fd != -1) {
+                        shutdown(serving_fd, SHUT_RDWR);
+                        serving_aborted = 1;
+                }
+        }
+        pthread_mutex_unlock(&serving_lock);
+        return NULL;
+}
+
+/**
+ * @brief Accepts and serves connections until a shutdown signal, then drains.
+ * @details The event loop waits for a connection, a signal or a finished connection
+ * thread. Once `exit_flag` is set it stops accepting, lets the connections finish what
+ * they received for up to `drain_ms` and commits the data file a last time.
+ */
+static void serve(void) {
+        struct sockaddr_in client_addr;
+        socklen_t addr_size = sizeof(client_addr);
         char ip_string[INET_ADDRSTRLEN];
         char log_string[64];
-        char receive_buffer[MAX_RECV_BUF_LEN + 1];
         
+        // The event loop waits for a connection, a signal or a finished connection thread.
+        // Without "-t" the stop watcher reads the signals and wakes the loop through `conn_event`.
+        pthread_t watcher;
+        if (!thread_flag && pthread_create(&watcher, NULL, stop_watcher, NULL) != 0) {
+                perror("Error creating the stop watcher");
+                return;
+        }
+        struct pollfd events[3] = {
+                { .fd = sock_fd, .events = POLLIN },
+                { .fd = thread_flag ? signal_fd : -1, .events = POLLIN },
+                { .fd = conn_event, .events = POLLIN },
+        };
+
         // Loop invariant: `exit_flag` is 0.
         // Loop invariant: `sock_fd` is a valid listening socket descriptor.
         // The loop continues as long as the `exit_flag` is not set (i.e., no termination signal received).
         while(!exit_flag) {
+                if (poll(events, 3, -1) < 0) {
+                        if (errno != EINTR) perror("Error waiting for events");
+                        continue;
+                }
+                if (events[1].revents & POLLIN) {
+                        handle_signals();
+                        continue;
+                }
+                if (events[2].revents & POLLIN) {
+                        uint64_t finished;
+                        if (read(conn_event, &finished, sizeof(finished)) > 0) {
+                                reap_connection_threads(false);
+                        }
+                }
+                if (!(events[0].revents & POLLIN)) {
+                        continue;
+                }
                 conn_fd = accept(sock_fd, (struct sockaddr*) &client_addr, &addr_size);
                 if (conn_fd == -1) {
-                        if (exit_flag && errno == EINTR) break;
+                        if (errno == EAGAIN || errno == EWOULDBLOCK) continue; // another worker took it
                         perror("Error accepting connection");
                         continue; // move on to next connection if one is ready
                 }
@@ -320,59 +1480,44 @@ int main(int argc, char* argv[]) {
                 snprintf(log_string, 64, "Accepted connection from %s", ip_string);
                 syslog(LOG_INFO, "%s", log_string);
 
-                // receive data over the connection and append it to /var/temp/aesdsocketdata (if the file doesn't exist, create it)
-                FILE *fp = fopen(DATA_FILE, "a+");
-                if(!fp) {
-                        perror("Error opening file");
-                        close(conn_fd);
-                        continue;
-                }
-                int msg_len = 0;
-                int total_received = 0;
-
-                // Loop to receive data from client
-                // Loop invariant: `total_received` is the number of bytes currently in `receive_buffer` 
-                //                  that have not been processed (written to file or part of a complete packet).
-                // Loop invariant: `receive_buffer` contains data from `receive_buffer[0]` to `receive_buffer[total_received - 1]`
-                // Loop continues as long as `recv()` returns a positive value (bytes received).
-                // `recv()` attemps to read up to `MAX_RECV_BUF_LEN - total_received` bytes into `receive_buffer + total_received`.
-                // The `0` flag means no special receive options.
-                while((msg_len = recv(conn_fd, receive_buffer + total_received, MAX_RECV_BUF_LEN - total_received, 0)) > 0) {
-                        total_received += msg_len;
-                        receive_buffer[total_received] = '\0';
-                        char *nl;
-                        // Process complete lines (packets) ending with a newline character.
-                        // Loop invariant: All complete lines before the current `receive_buffer` content have been processes.
-                        // Loop continues as long as `memchr` finds a newline in the `total_received` bytes of `receive_buffer`.
-                        while((nl = memchr(receive_buffer, '\n', total_received))) {
-                                size_t line_len = nl - receive_buffer + 1;
-                                fwrite(receive_buffer, 1, line_len, fp);
-                                if (send_file_back(fp, conn_fd) < 0) {
-                                        perror("send_file_back");
-                                        break;
-                                }
-                                size_t remaining = total_received - line_len;
-                                memmove(receive_buffer, nl + 1, remaining);
-                                total_received = remaining;
+                if (thread_flag) {
+                        // Hand the connection to a thread of its own and go back to `accept()`.
+                        struct conn_thread *ct = calloc(1, sizeof(*ct));
+                        if (ct == NULL) {
+                                perror("Error allocating connection thread");
+                                close(conn_fd);
+                                conn_fd = -1;
+                                continue;
                         }
-                        if (total_received >= MAX_RECV_BUF_LEN) {
-                                fwrite(receive_buffer, 1, total_received, fp);
-                                total_received = 0;
-                                fflush(fp);
+                        ct->fd = conn_fd;
+                        atomic_init(&ct->done, false);
+                        memcpy(ct->ip_string, ip_string, sizeof(ct->ip_string));
+                        // Connection threads inherit the blocked signals; only `signal_fd` receives them.
+                        int create_rc = pthread_create(&ct->thread, NULL, connection_thread, ct);
+                        if (create_rc != 0) {
+                                perror("Error creating connection thread");
+                                close(conn_fd);
+                                free(ct);
+                        } else {
+                                SLIST_INSERT_HEAD(&conn_threads, ct, entries);
                         }
+                        conn_fd = -1;
+                        continue;
                 }
-                if(total_received > 0) {
-                        fwrite(receive_buffer, 1, total_received, fp);
-                        if (send_file_back(fp, conn_fd) < 0) {
-                                perror("send_file_back");
-                                break;
-                        }
-                        total_received = 0;
+
+                // A connection accepted after the stop is not served: nothing would bound its replay.
+                pthread_mutex_lock(&serving_lock);
+                if (!exit_flag) {
+                        serving_fd = conn_fd;
+                }
+                pthread_mutex_unlock(&serving_lock);
+                if (serving_fd != -1) {
+                        handle_connection(conn_fd, ip_string);
+                        pthread_mutex_lock(&serving_lock);
+                        serving_fd = -1;
+                        pthread_cond_signal(&serving_cond);
+                        pthread_mutex_unlock(&serving_lock);
                 }
-                if(msg_len < 0) { perror("Error receiving data"); }
-                fsync(fileno(fp));
-                syslog(LOG_INFO, "Closed connection from %s", ip_string);
-                fclose(fp);
                 close(conn_fd);
                 conn_fd = -1;
         }
@@ -388,16 +1533,576 @@ int main(int argc, char* argv[]) {
                 conn_fd = -1; // Mark as closed.
         }
 
+        // Drain: stop accepting, let the connections finish what they received, commit once more.
+        close(sock_fd);
+        sock_fd = -1;
+        int aborted = drain_connection_threads(aesdconf_drain_ms());
+        if (!thread_flag) {
+                pthread_join(watcher, NULL);
+                aborted = serving_aborted;
+        }
+        final_commit();
+        syslog(LOG_INFO, "Drained in %lld ms, %d connections aborted at the %d ms deadline",
+               (long long)(now_ms() - stop_ms), aborted, aesdconf_drain_ms());
+}
+
+/**
+ * @brief Entry point of a prefork worker process.
+ * @details The signal and event descriptors are the parent's; a worker needs its own so
+ * that it only reads its own signals and its own finished threads. The statistics of the
+ * per-process modules are reported by each worker.
+ */
+static void worker_main(void) {
+        sigset_t signals;
+        pthread_sigmask(SIG_BLOCK, NULL, &signals);
+        close(signal_fd);
+        close(conn_event);
+        signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+        conn_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (signal_fd == -1 || conn_event == -1) {
+                perror("Error creating the signal and event descriptors of a worker");
+                return;
+        }
+        serve();
+        aesdcache_close();
+        aesdarena_close();
+        aesdcpu_close();
+        aesdpoll_close();
+        aesdcast_close();
+        aesdmem_close();
+}
+
+/**
+ * @brief Main function for the AESD socket server.
+ * @param `argc` The number of command-line arguments.
+ * @param `argv` An array of command-line argument strings.
+ * @return EXIT_SUCCESS on successful completion, EXIT_FAILURE on error.
+ * @details Initializes the server, sets up signal handling, binds to a port,
+ * listens for connections, and enters a loop to accept and handle
+ * cleint requests. If "-d" is passed as an argument, it runs as a daemon.
+ * If "-m" is passed, the data file is published read-only through shared memory.
+ * "-p <port>" and "-f <path>" override the listening port and the data file.
+ * "-r <target>" streams committed data to a follower, "-F <target>" runs as that follower.
+ * "-t" serves every connection in its own thread, "-S <n>" additionally spreads their appends
+ * over n shards. "-T <n>" enables `TOPIC <name>` preambles, keeping at most
+ * n topic files open. "-k" enables the `PUT <key> <value>` / `GET <key>` keyed record mode.
+ * "-c <KiB/s>" compacts the data file in the background, reading at most that many KiB per second.
+ * "-D" stores repeated packets once, as references to their first copy.
+ * "-z <level>" compresses cold blocks of the data file at the given level (1-9).
+ * "-w <level>" lets clients negotiate compressed replays with a `COMPRESS` preamble.
+ * "-i" keeps a commit-time index and answers `SINCE <t>` and `RANGE <t0> <t1>` packets.
+ * "-C" lets a client resume from a named cursor selected with a `CURSOR <name>` preamble.
+ * "-b" receives the payload of `FRAME <len>` packets with `splice()`.
+ * "-O" writes and replays the data file with `O_DIRECT`, keeping it out of the page cache.
+ * "-H" starts writeback of the data file early and drops its durable cold part from the page cache.
+ * "-A <MiB>" takes receive and replay buffers from a huge page backed arena of that size.
+ * "-L" lets a connection hold a receive buffer only while it has data pending.
+ * "-a <accept>/<workers>/<storage>" pins the accepting, connection and background threads to CPU lists.
+ * "-P <us>" spins for up to that many microseconds, busy polling the socket, before a receive blocks.
+ * "-R <path>" loads runtime tunables from a config file, re-read on `SIGHUP`, and opens a control socket.
+ * "-K" keeps the data file (and the shard, topic and dedup files) on exit instead of removing it;
+ *      with "-C" the next run continues that data file and its cursors.
+ * "-W <n>" serves from n prefork worker processes that share the listening socket and the data file.
+ * "-M <MiB>" keeps buffers, caches and indexes under that budget by pausing reads and dropping caches.
+ * "-e" answers `EXISTS <line>` packets from Bloom filters kept per segment of the data file.
+ * "-B <KiB>" lets concurrent replays share each read of the data file, in blocks of that size.
+ * `SIGINT` and `SIGTERM` drain the server: it stops accepting, lets connections finish
+ * what they received for up to `drain_ms`, commits the data file a last time and exits.
+ */
+int main(int argc, char* argv[]) {
+        // --- Initialization ---
+        signal(SIGPIPE, SIG_IGN);
+        openlog(NULL, LOG_CONS, LOG_USER);
+
+
+        // --- Handle Command-Line Arguments ---
+        int opt_char;
+        while ((opt_char = getopt(argc, argv, "dmp:f:r:F:tS:T:kc:Dz:w:iCbOHA:La:P:R:KW:M:eB:")) != -1) {
+                switch (opt_char) {
+                case 'd':
+                        daemon_flag = true;
+                        syslog(LOG_INFO, "Daemon mode requested."); // Log daemon mode activation.
+                        break;
+                case 'm':
+                        shm_flag = true;
+                        break;
+                case 'p':
+                        port = atoi(optarg);
+                        break;
+                case 'f':
+                        data_file = optarg;
+                        break;
+                case 'r':
+                        leader_target = optarg;
+                        break;
+                case 'F':
+                        follower_target = optarg;
+                        break;
+                case 't':
+                        thread_flag = true;
+                        break;
+                case 'S':
+                        shard_count = atoi(optarg);
+                        thread_flag = true;
+                        break;
+                case 'T':
+                        topic_max_open = atoi(optarg);
+                        break;
+                case 'k':
+                        keyed_flag = true;
+                        break;
+                case 'c':
+                        compact_rate_kib = atol(optarg);
+                        break;
+                case 'D':
+                        dedup_flag = true;
+                        break;
+                case 'z':
+                        cold_level = atoi(optarg);
+                        break;
+                case 'w':
+                        wire_level = atoi(optarg);
+                        break;
+                case 'i':
+                        time_index_flag = true;
+                        break;
+                case 'C':
+                        cursor_flag = true;
+                        break;
+                case 'b':
+                        frame_flag = true;
+                        break;
+                case 'O':
+                        direct_flag = true;
+                        break;
+                case 'H':
+                        cache_flag = true;
+                        break;
+                case 'A':
+                        arena_mib = atol(optarg);
+                        break;
+                case 'L':
+                        lazy_flag = true;
+                        break;
+                case 'a':
+                        cpu_spec = optarg;
+                        break;
+                case 'P':
+                        busy_poll_us = atol(optarg);
+                        break;
+                case 'R':
+                        conf_path = optarg;
+                        break;
+                case 'K':
+                        keep_flag = true;
+                        break;
+                case 'W':
+                        worker_count = atoi(optarg);
+                        break;
+                case 'M':
+                        memory_mib = atol(optarg);
+                        break;
+                case 'e':
+                        exists_flag = true;
+                        break;
+                case 'B':
+                        broadcast_kib = atol(optarg);
+                        break;
+                default:
+                        fprintf(stderr, "Usage: %s [-d] [-m] [-p port] [-f data_file] [-r target | -F target] [-t] [-S shards] [-T max_open_topics] [-k] [-c compact_kib_per_s] [-D] [-z level] [-w level] [-i] [-C] [-b] [-O] [-H] [-A arena_mib] [-L] [-a accept/workers/storage] [-P spin_us] [-R config_file] [-K] [-W workers] [-M memory_mib] [-e] [-B block_kib]\n", argv[0]);
+                        exit(EXIT_FAILURE);
+                }
+        }
+        if (leader_target != NULL && follower_target != NULL) {
+                fprintf(stderr, "-r and -F are mutually exclusive\n");
+                exit(EXIT_FAILURE);
+        }
+        // Shared memory and replication describe a single data file; shards have no such file.
+        if (shard_count > 0 && (shm_flag || leader_target != NULL || follower_target != NULL)) {
+                fprintf(stderr, "-S cannot be combined with -m, -r or -F\n");
+                exit(EXIT_FAILURE);
+        }
+        // Topics are neither published nor replicated, and a follower does not accept writes.
+        if (topic_max_open > 0 && (shm_flag || leader_target != NULL || follower_target != NULL)) {
+                fprintf(stderr, "-T cannot be combined with -m, -r or -F\n");
+                exit(EXIT_FAILURE);
+        }
+        // The key index points into the shared data file, which sharded and follower instances do not write.
+        if (keyed_flag && (shard_count > 0 || follower_target != NULL)) {
+                fprintf(stderr, "-k cannot be combined with -S or -F\n");
+                exit(EXIT_FAILURE);
+        }
+        // Compaction changes offsets, which replication relies on; shards have no shared data file.
+        if (compact_rate_kib > 0 && (shard_count > 0 || leader_target != NULL || follower_target != NULL)) {
+                fprintf(stderr, "-c cannot be combined with -S, -r or -F\n");
+                exit(EXIT_FAILURE);
+        }
+        // The deduplicated log is not the plain data file the other features read and rewrite.
+        if (dedup_flag && (shm_flag || leader_target != NULL || follower_target != NULL
+                           || shard_count > 0 || keyed_flag || compact_rate_kib > 0)) {
+                fprintf(stderr, "-D cannot be combined with -m, -r, -F, -S, -k or -c\n");
+                exit(EXIT_FAILURE);
+        }
+        // Cold ranges of the data file become holes, which readers of the raw file would see as zeros.
+        if (cold_level > 0 && (shm_flag || leader_target != NULL || follower_target != NULL || shard_count > 0
+                               || keyed_flag || compact_rate_kib > 0 || dedup_flag)) {
+                fprintf(stderr, "-z cannot be combined with -m, -r, -F, -S, -k, -c or -D\n");
+                exit(EXIT_FAILURE);
+        }
+        // Compressed replays are cut from the plain data file.
+        if (wire_level > 0 && (shard_count > 0 || dedup_flag || cold_level > 0)) {
+                fprintf(stderr, "-w cannot be combined with -S, -D or -z\n");
+                exit(EXIT_FAILURE);
+        }
+        // The index holds data file offsets, which compaction moves and cold blocks punch out;
+        // followers do not commit through the index and shards and dedup keep no such offsets.
+        if (time_index_flag && (shard_count > 0 || follower_target != NULL || compact_rate_kib > 0
+                                || cold_level > 0 || dedup_flag)) {
+                fprintf(stderr, "-i cannot be combined with -S, -F, -c, -z or -D\n");
+                exit(EXIT_FAILURE);
+        }
+        // Segments are data file ranges, which compaction moves and cold blocks punch out;
+        // followers do not commit through the filters and shards, dedup and direct I/O keep other files.
+        if (exists_flag && (shard_count > 0 || follower_target != NULL || compact_rate_kib > 0
+                            || cold_level > 0 || dedup_flag || direct_flag)) {
+                fprintf(stderr, "-e cannot be combined with -S, -F, -c, -z, -D or -O\n");
+                exit(EXIT_FAILURE);
+        }
+        // Cursors are data file offsets, which compaction moves and cold blocks punch out.
+        if (cursor_flag && (shard_count > 0 || compact_rate_kib > 0 || cold_level > 0 || dedup_flag)) {
+                fprintf(stderr, "-C cannot be combined with -S, -c, -z or -D\n");
+                exit(EXIT_FAILURE);
+        }
+        // A continued data file is only known to the store; the indexes and the follower start empty.
+        if (cursor_flag && keep_flag && (keyed_flag || time_index_flag || exists_flag
+                                         || leader_target != NULL || follower_target != NULL)) {
+                fprintf(stderr, "-C with -K cannot be combined with -k, -i, -e, -r or -F\n");
+                exit(EXIT_FAILURE);
+        }
+        // Frames are appended to the shared data file, which a follower does not accept writes to.
+        if (frame_flag && (shard_count > 0 || follower_target != NULL || dedup_flag)) {
+                fprintf(stderr, "-b cannot be combined with -S, -F or -D\n");
+                exit(EXIT_FAILURE);
+        }
+        // The other data file features read or write the file through the page cache.
+        if (direct_flag && (shm_flag || leader_target != NULL || follower_target != NULL || shard_count > 0
+                            || keyed_flag || compact_rate_kib > 0 || dedup_flag || cold_level > 0 || wire_level > 0
+                            || time_index_flag || cursor_flag || frame_flag)) {
+                fprintf(stderr, "-O cannot be combined with -m, -r, -F, -S, -k, -c, -D, -z, -w, -i, -C or -b\n");
+                exit(EXIT_FAILURE);
+        }
+        // Shards, dedup and direct I/O replay from their own files.
+        if (broadcast_kib > 0 && (shard_count > 0 || dedup_flag || direct_flag)) {
+                fprintf(stderr, "-B cannot be combined with -S, -D or -O\n");
+                exit(EXIT_FAILURE);
+        }
+        // Only the buffered shared data file goes through the page cache this way.
+        if (cache_flag && (shard_count > 0 || dedup_flag || direct_flag)) {
+                fprintf(stderr, "-H cannot be combined with -S, -D or -O\n");
+                exit(EXIT_FAILURE);
+        }
+        // Workers only share the data file and its store header; in-memory indexes, caches,
+        // background threads and the control socket would each exist once per worker.
+        if (worker_count > 0 && (shm_flag || leader_target != NULL || follower_target != NULL || shard_count > 0
+                                 || topic_max_open > 0 || keyed_flag || compact_rate_kib > 0 || dedup_flag
+                                 || cold_level > 0 || wire_level > 0 || time_index_flag || cursor_flag
+                                 || direct_flag || conf_path != NULL || exists_flag)) {
+                fprintf(stderr, "-W cannot be combined with -m, -r, -F, -S, -T, -k, -c, -D, -z, -w, -i, -C, -O, -R or -e\n");
+                exit(EXIT_FAILURE);
+        }
+        if (cpu_spec != NULL && aesdcpu_init(cpu_spec) != 0) {
+                fprintf(stderr, "Malformed CPU placement %s, expected <accept>/<workers>/<storage> CPU lists\n", cpu_spec);
+                exit(EXIT_FAILURE);
+        }
+        // Resumed cursors point into the data file of the previous run, so it is continued.
+        if (!(keep_flag && cursor_flag)) {
+                unlink(data_file);
+        }
+
+        // --- Control Plane ---
+        // Signals are blocked before any thread starts, so every thread inherits the mask and
+        // they only ever arrive through `signal_fd`.
+        sigset_t signals;
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGINT);
+        sigaddset(&signals, SIGTERM);
+        if (conf_path != NULL) {
+                sigaddset(&signals, SIGHUP);
+        }
+        // The prefork parent learns about exited workers through `SIGCHLD`.
+        if (worker_count > 0) {
+                sigaddset(&signals, SIGCHLD);
+        }
+        sigprocmask(SIG_BLOCK, &signals, NULL);
+        signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+        conn_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (signal_fd == -1 || conn_event == -1) {
+                perror("Error creating the signal and event descriptors");
+                exit(EXIT_FAILURE);
+        }
+
+
+        // --- Socket Creation and Setup ---
+        // open a stream socket bound to `port` (9000 by default), if any of the socket connection steps fail return -1
+        sock_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (sock_fd == -1) {
+                perror("Error creating Berkeley Stream Socket");
+                exit(EXIT_FAILURE);
+        }
+        int opt = 1;
+        setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+        struct sockaddr_in serv_addr;
+
+        memset(&serv_addr, 0, sizeof(serv_addr));
+
+        serv_addr.sin_family = AF_INET;                 // IPv4
+        serv_addr.sin_addr.s_addr = INADDR_ANY;         // accept connections on any interface
+        serv_addr.sin_port = htons(port);               // `htons()` converts a 16-bit number from host byte order to network byte order
+
+        if(bind(sock_fd, (struct sockaddr*) &serv_addr, sizeof(serv_addr)) != 0) {
+                // ...
+                perror("Error binding Berkeley Stream Socket to port");
+                close(sock_fd);
+                exit(EXIT_FAILURE);
+        }
+
+        // --- Daemonization (if requested) ---
+        if (daemon_flag == true) {
+            pid_t pid = fork();
+            if (pid < 0) {
+                perror("Error forking");
+                close(sock_fd);
+                exit(EXIT_FAILURE);
+            }
+            if (pid > 0) { // Parent exits
+                close(sock_fd);
+                exit(EXIT_SUCCESS);
+            }
+            // Child continues
+            setsid(); // New session
+            chdir("/"); // Change working directory
+            // Redirect I/O to /dev/null
+            int fd = open("/dev/null", O_RDWR);
+            dup2(fd, STDIN_FILENO);
+            dup2(fd, STDOUT_FILENO);
+            dup2(fd, STDERR_FILENO);
+            if (fd > 2) close(fd);
+        }
+
+        // --- CPU Placement (if requested) ---
+        // The background threads of the store inherit the storage CPUs from the main thread.
+        aesdcpu_enter(AESDCPU_STORAGE);
+
+        // --- Shared-Memory Publishing (if requested) ---
+        if (shm_flag && aesdshm_publisher_open(data_file) != 0) {
+                perror("Error publishing data file through shared memory");
+                close(sock_fd);
+                exit(EXIT_FAILURE);
+        }
+
+        // --- Replication (if requested) ---
+        if ((leader_target != NULL && aesdrepl_leader_start(leader_target, data_file) != 0) ||
+            (follower_target != NULL && aesdrepl_follower_start(follower_target, data_file) != 0)) {
+                perror("Error starting replication");
+                aesdshm_publisher_close();
+                close(sock_fd);
+                exit(EXIT_FAILURE);
+        }
+
+        // --- Sharded Store (if requested) ---
+        if (shard_count > 0 && aesdshard_init(data_file, shard_count) != 0) {
+                fprintf(stderr, "Error creating %d shards for %s\n", shard_count, data_file);
+                aesdrepl_stop();
+                close(sock_fd);
+                exit(EXIT_FAILURE);
+        }
+
+        // --- Topics (if requested) ---
+        if (topic_max_open > 0 && aesdtopic_init(data_file, topic_max_open) != 0) {
+                fprintf(stderr, "Error enabling topics\n");
+                aesdshard_close(false);
+                close(sock_fd);
+                exit(EXIT_FAILURE);
+        }
+
+        // --- Compaction (if requested) ---
+        if (compact_rate_kib > 0 && aesdcompact_start(data_file, &store_lock, compact_rate_kib, keyed_flag) != 0) {
+                fprintf(stderr, "Error starting the compactor\n");
+                aesdtopic_close(false);
+                close(sock_fd);
+                exit(EXIT_FAILURE);
+        }
+
+        // --- Deduplicating Store (if requested) ---
+        if (dedup_flag && aesddedup_open(data_file) != 0) {
+                fprintf(stderr, "Error creating the deduplicating store for %s\n", data_file);
+                aesdtopic_close(false);
+                close(sock_fd);
+                exit(EXIT_FAILURE);
+        }
+
+        // --- Cold Block Compression (if requested) ---
+        if (cold_level > 0 && aesdcold_start(data_file, cold_level) != 0) {
+                fprintf(stderr, "Error starting cold block compression\n");
+                aesdtopic_close(false);
+                close(sock_fd);
+                exit(EXIT_FAILURE);
+        }
+
+        // --- Time Index (if requested) ---
+        if (time_index_flag) {
+                aesdtime_init();
+        }
+
+        // --- Existence Filters (if requested) ---
+        if (exists_flag && aesdbloom_open(data_file) != 0) {
+                fprintf(stderr, "Error creating the existence filters\n");
+                aesdcold_stop(false);
+                aesdtopic_close(false);
+                close(sock_fd);
+                exit(EXIT_FAILURE);
+        }
+
+        // --- Client Cursors (if requested) ---
+        if (cursor_flag && aesdcursor_init(data_file, keep_flag) != 0) {
+                fprintf(stderr, "Error enabling client cursors\n");
+                aesdbloom_close(false);
+                aesdcold_stop(false);
+                aesdtopic_close(false);
+                close(sock_fd);
+                exit(EXIT_FAILURE);
+        }
+
+        // --- Compressed Replays (if requested) ---
+        if (wire_level > 0 && aesdwire_init(wire_level) != 0) {
+                fprintf(stderr, "Error enabling compressed replays\n");
+                aesdcursor_close(false);
+                aesdbloom_close(false);
+                aesdcold_stop(false);
+                aesdtopic_close(false);
+                close(sock_fd);
+                exit(EXIT_FAILURE);
+        }
+
+        // --- Direct I/O Store (if requested) ---
+        if (direct_flag && aesddirect_open(data_file) != 0) {
+                fprintf(stderr, "Error opening %s for direct I/O\n", data_file);
+                aesdtopic_close(false);
+                close(sock_fd);
+                exit(EXIT_FAILURE);
+        }
+
+        // --- Buffer Arena (if requested) ---
+        if (arena_mib > 0 && aesdarena_init((size_t)arena_mib * 1024 * 1024, aesdcpu_node_count()) != 0) {
+                fprintf(stderr, "Error mapping a buffer arena of %ld MiB\n", arena_mib);
+                aesddirect_close();
+                aesdtopic_close(false);
+                close(sock_fd);
+                exit(EXIT_FAILURE);
+        }
+
+        // --- Prefork Store Header (if requested) ---
+        if (worker_count > 0 && aesdfork_init(data_file) != 0) {
+                perror("Error mapping the prefork store header");
+                aesdarena_close();
+                close(sock_fd);
+                exit(EXIT_FAILURE);
+        }
+
+        // --- Busy Polling (if requested) ---
+        if (busy_poll_us > 0) {
+                aesdpoll_init(busy_poll_us);
+        }
+
+        // --- Coalesced Replays (if requested) ---
+        if (broadcast_kib != 0 && aesdcast_init(broadcast_kib) != 0) {
+                fprintf(stderr, "Error enabling coalesced replays, blocks must be %d to %d KiB\n",
+                        AESDCAST_MIN_KIB, AESDCAST_MAX_KIB);
+                aesdfork_close();
+                aesdarena_close();
+                close(sock_fd);
+                exit(EXIT_FAILURE);
+        }
+
+        // --- Memory Budget (if requested) ---
+        if (memory_mib > 0) {
+                aesdmem_set_budget((uint64_t)memory_mib * 1024 * 1024);
+        }
+
+        // The main thread only accepts from here on.
+        aesdcpu_enter(AESDCPU_ACCEPT);
+
+        // listen and accept connections
+        aesdconf_defaults(MAX_RECV_BUF_LEN, MAX_RECV_BUF_LEN, BACKLOG, DRAIN_MS);
+        listen(sock_fd, aesdconf_backlog());            // Socket is now actually enabled and passively listening for connections
+        // Every worker wakes up for a new connection, and all but one find it gone.
+        if (worker_count > 0) {
+                fcntl(sock_fd, F_SETFL, fcntl(sock_fd, F_GETFL) | O_NONBLOCK);
+        }
+
+        // --- Runtime Configuration (if requested) ---
+        if (conf_path != NULL) {
+                if (aesdconf_start(conf_path, sock_fd) != 0) {
+                        fprintf(stderr, "Error loading %s or opening its control socket\n", conf_path);
+                        aesdarena_close();
+                        aesddirect_close();
+                        aesdtopic_close(false);
+                        close(sock_fd);
+                        exit(EXIT_FAILURE);
+                }
+        }
+        
+        // --- Serving ---
+        if (worker_count > 0) {
+                // The workers serve; the parent supervises them until they drained.
+                if (aesdfork_run(worker_count, signal_fd, worker_main) != 0) {
+                        perror("Error forking workers");
+                }
+                close(sock_fd);
+                sock_fd = -1;
+        } else {
+                serve();
+        }
+        aesdconf_stop();
+
+        // Stop shipping to (or receiving from) the replication peer before the data file goes away.
+        aesdrepl_stop();
+        aesdcompact_stop();
+        aesdcold_stop(keep_flag);
+        aesdshard_close(keep_flag);
+        aesdtopic_close(keep_flag);
+        aesdkv_close();
+        aesddedup_close(keep_flag);
+        aesdwire_close();
+        aesdtime_close();
+        aesdbloom_close(keep_flag);
+        aesdcursor_close(keep_flag);
+        aesddirect_close();
+        aesdcache_close();
+        aesdarena_close();
+        aesdcpu_close();
+        aesdpoll_close();
+        aesdcast_close();
+        aesdmem_close();
+        aesdfork_close();
+
         // Log that the server is exiting due to a caught signal.
         syslog(LOG_INFO, "Caught signal, exiting");
-        // Delete the data file
-        if(unlink(DATA_FILE) == -1) {
-                syslog(LOG_WARNING, "Error unlinking %s on exit: %m", DATA_FILE);
+        // Delete the data file, unless it is to outlive the server.
+        if (keep_flag) {
+                syslog(LOG_DEBUG, "Keeping %s on exit.", data_file);
+        } else if(unlink(data_file) == -1) {
+                syslog(LOG_WARNING, "Error unlinking %s on exit: %m", data_file);
         } else {
-                syslog(LOG_DEBUG, "Successfully unlinked %s on exit.", DATA_FILE);
+                syslog(LOG_DEBUG, "Successfully unlinked %s on exit.", data_file);
         }
 
-        close(sock_fd);
+        close(signal_fd);
+        close(conn_event);
+
+        // Withdraw the shared-memory header so readers stop looking for a log that is gone.
+        aesdshm_publisher_close();
         
         // Close the connection to the system logger.
         closelog();
@@ -0,0 +1,158 @@
+/**
+ *  @file aesdsplice.c
+ *  @brief Zero-copy receive and append of framed packets (see aesdsplice.h).
+ */
+#define _GNU_SOURCE
+#include "aesdsplice.h"
+
+#include <errno.h>       /**< @brief Provides definitions for error numbers (e.g., `EINTR`). */
+#include <fcntl.h>       /**< @brief Provides `open()`, `splice()`, `O_TMPFILE`, `F_SETPIPE_SZ`. */
+#include <stdio.h>       /**< @brief Provides `snprintf()`. */
+#include <stdlib.h>      /**< @brief Provides `strtoull()`. */
+#include <string.h>      /**< @brief Provides `memcmp()`, `strrchr()`. */
+#include <sys/sendfile.h>/**< @brief Provides `sendfile()`, the fallback when `copy_file_range()` is unavailable. */
+#include <syslog.h>      /**< @brief Provides `syslog()`. */
+#include <unistd.h>      /**< @brief Provides `pipe2()`, `write()`, `copy_file_range()`, `close()`. */
+
+#define PIPE_LEN (1024 * 1024)  /**< @brief Requested pipe capacity; bounds one `splice()` step. */
+
+/**
+ * @brief Parses a `FRAME <len>` packet.
+ * @param `line` The packet, including its newline.
+ * @param `len` The length of the packet in bytes.
+ * @param `frame_len` Receives the announced payload length.
+ * @return true if the packet is a valid frame header.
+ */
+bool aesdsplice_parse_header(const char *line, size_t len, uint64_t *frame_len) {
+        size_t hlen = strlen(AESDSPLICE_HEADER);
+        char digits[24];
+        if (len <= hlen || memcmp(line, AESDSPLICE_HEADER, hlen) != 0) {
+                return false;
+        }
+        size_t n = 0;
+        for (size_t i = hlen; i < len && line[i] != '\n' && line[i] != '\r'; i++) {
+                if (line[i] < '0' || line[i] > '9' || n + 1 >= sizeof(digits)) {
+                        return false;
+                }
+                digits[n++] = line[i];
+        }
+        digits[n] = '\0';
+        if (n == 0) {
+                return false;
+        }
+        *frame_len = strtoull(digits, NULL, 10);
+        return *frame_len > 0 && *frame_len <= AESDSPLICE_MAX;
+}
+
+/**
+ * @brief Opens an anonymous staging file on the file system of the data file.
+ * @details `copy_file_range()` can only share or copy blocks within one file system.
+ */
+static int open_staging(const char *data_path) {
+        char dir[256];
+        snprintf(dir, sizeof(dir), "%s", data_path);
+        char *slash = strrchr(dir, '/');
+        if (slash == NULL) {
+                snprintf(dir, sizeof(dir), ".");
+        } else if (slash == dir) {
+                slash[1] = '\0';
+        } else {
+                *slash = '\0';
+        }
+        return open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+}
+
+/**
+ * @brief Receives a frame into a staging file.
+ * @param `data_path` The data file; the staging file is created next to it.
+ * @param `client_fd` The connected client socket.
+ * @param `head` Payload bytes that were already received together with the header.
+ * @param `head_len` The number of bytes in `head`, at most `frame_len`.
+ * @param `frame_len` The announced payload length.
+ * @return The staging file holding the complete payload, or -1 on failure.
+ * @details The rest of the payload goes socket → pipe → staging file with `splice()`.
+ */
+int aesdsplice_receive(const char *data_path, int client_fd, const char *head, size_t head_len, uint64_t frame_len) {
+        int pipefd[2] = { -1, -1 };
+        int staging = open_staging(data_path);
+        if (staging == -1 || pipe2(pipefd, O_CLOEXEC) != 0) {
+                syslog(LOG_ERR, "Cannot stage a frame: %m");
+                goto fail;
+        }
+        // A bigger pipe means fewer round trips; the default capacity still works.
+        fcntl(pipefd[1], F_SETPIPE_SZ, PIPE_LEN);
+        while (head_len > 0) {
+                ssize_t n = write(staging, head, head_len);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) goto fail;
+                head += n;
+                head_len -= (size_t)n;
+                frame_len -= (uint64_t)n;
+        }
+        // Loop invariant: `frame_len` payload bytes are still in the socket.
+        while (frame_len > 0) {
+                size_t want = frame_len < PIPE_LEN ? (size_t)frame_len : PIPE_LEN;
+                ssize_t in = splice(client_fd, NULL, pipefd[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+                if (in < 0 && errno == EINTR) continue;
+                if (in <= 0) {
+                        // The client closed or failed before sending the whole frame.
+                        goto fail;
+                }
+                ssize_t left = in;
+                while (left > 0) {
+                        ssize_t out = splice(pipefd[0], NULL, staging, NULL, (size_t)left, SPLICE_F_MOVE);
+                        if (out < 0 && errno == EINTR) continue;
+                        if (out <= 0) goto fail;
+                        left -= out;
+                }
+                frame_len -= (uint64_t)in;
+        }
+        close(pipefd[0]);
+        close(pipefd[1]);
+        return staging;
+fail:
+        if (pipefd[0] != -1) close(pipefd[0]);
+        if (pipefd[1] != -1) close(pipefd[1]);
+        if (staging != -1) close(staging);
+        return -1;
+}
+
+/**
+ * @brief Appends a staged frame to the data file.
+ * @param `staging_fd` The staging file returned by `aesdsplice_receive()`.
+ * @param `data_path` The data file.
+ * @param `offset` The current end of the data file.
+ * @param `frame_len` The payload length.
+ * @return 0 on success, -1 on failure.
+ * @pre The caller holds the store lock, so nothing else is appended at `offset` meanwhile.
+ * @details The data file streams are opened for appending, which `copy_file_range()` rejects,
+ * so the copy goes through a positional descriptor of its own.
+ */
+int aesdsplice_append(int staging_fd, const char *data_path, uint64_t offset, uint64_t frame_len) {
+        int out = open(data_path, O_WRONLY | O_CLOEXEC);
+        if (out == -1) {
+                return -1;
+        }
+        loff_t in_off = 0;
+        loff_t out_off = (loff_t)offset;
+        int rc = 0;
+        while ((uint64_t)in_off < frame_len) {
+                ssize_t n = copy_file_range(staging_fd, &in_off, out, &out_off, (size_t)(frame_len - (uint64_t)in_off), 0);
+                if (n < 0 && errno == EINTR) continue;
+                if (n < 0 && (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EINVAL)) {
+                        // Fall back to `sendfile()`, still without a copy through user space.
+                        if (lseek(out, out_off, SEEK_SET) < 0) {
+                                rc = -1;
+                                break;
+                        }
+                        n = sendfile(out, staging_fd, &in_off, (size_t)(frame_len - (uint64_t)in_off));
+                        if (n > 0) out_off += n;
+                }
+                if (n <= 0) {
+                        rc = -1;
+                        break;
+                }
+        }
+        close(out);
+        return rc;
+}
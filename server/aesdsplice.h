@@ -0,0 +1,27 @@
+/**
+ *  @file aesdsplice.h
+ *  @brief Framed ingest of large packets with `splice()`.
+ *
+ *  With `-b` a packet of the form `FRAME <len>` announces that the next `<len>` bytes of
+ *  the connection are one packet, whatever they contain. The payload is moved from the
+ *  socket through a pipe into an anonymous staging file next to the data file with
+ *  `splice()`, so it never enters user space. Once complete it is appended to the data
+ *  file in the kernel with `copy_file_range()` under the store lock, then committed and
+ *  replayed like any other packet. Staging first keeps a slow sender from holding the
+ *  lock while its frame trickles in, and keeps packets from interleaving.
+ */
+#ifndef AESDSPLICE_H
+#define AESDSPLICE_H
+
+#include <stdbool.h>     /**< @brief Provides a boolean type and values (`true`, `false`). */
+#include <stddef.h>      /**< @brief Provides `size_t`. */
+#include <stdint.h>      /**< @brief Provides fixed width integer types (e.g., `uint64_t`). */
+
+#define AESDSPLICE_HEADER "FRAME "      /**< @brief Start of a packet announcing a frame. */
+#define AESDSPLICE_MAX (1ULL << 32)     /**< @brief Largest accepted frame. */
+
+bool aesdsplice_parse_header(const char *line, size_t len, uint64_t *frame_len);
+int aesdsplice_receive(const char *data_path, int client_fd, const char *head, size_t head_len, uint64_t frame_len);
+int aesdsplice_append(int staging_fd, const char *data_path, uint64_t offset, uint64_t frame_len);
+
+#endif /* AESDSPLICE_H */
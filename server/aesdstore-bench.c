@@ -0,0 +1,336 @@
+/**
+ *  @file aesdstore-bench.c
+ *  @brief Benchmarks the store back ends of aesdsocket against the single data file.
+ *
+ *  Usage: aesdstore-bench append [-d dir] [-t threads] [-n packets] [-s shards] [-l len]
+ *         aesdstore-bench replay [-d dir] [-n packets] [-r repeat_pct] [-l len] [-R replays]
+ *
+ *  `append` measures contended append throughput: every thread appends and commits
+ *  `packets` packets of `len` bytes, the way a connection thread does,
+ *  - to the single data file: `fwrite()`, `fflush()` and `fdatasync()` under one lock;
+ *  - to `shards` shards (aesdshard.h): `aesdshard_append()` and `aesdshard_commit()`.
+ *  Both commit with `fdatasync()` (the `fdatasync` durability); the single file syncs
+ *  with `fsync()` by default, which is slower still. Replays are not part of this.
+ *
+ *  `replay` measures the dedup store (aesddedup.h) against the plain data file: a log of
+ *  `packets` packets, `repeat_pct` percent of them heartbeats repeated from a small set
+ *  and the rest unique `len`-byte packets, is stored both ways and replayed `replays`
+ *  times into a local socket drained by a second thread. The plain file is replayed the
+ *  way `send_file_back()` does by default, in reads and sends of 4 KiB.
+ */
+#include "aesddedup.h"
+#include "aesdshard.h"
+
+#include <fcntl.h>       /**< @brief Provides `open()`. */
+#include <pthread.h>     /**< @brief Provides `pthread_create()`, `pthread_join()`, the store lock. */
+#include <stdbool.h>     /**< @brief Provides a boolean type and values (`true`, `false`). */
+#include <stdio.h>       /**< @brief Provides `fopen()`, `fwrite()`, `printf()`. */
+#include <stdlib.h>      /**< @brief Provides `atoi()`, `malloc()`, `EXIT_SUCCESS`, `EXIT_FAILURE`. */
+#include <string.h>      /**< @brief Provides `memset()`, `strcmp()`. */
+#include <sys/socket.h>  /**< @brief Provides `socketpair()`, `send()`, `recv()`, `shutdown()`. */
+#include <sys/stat.h>    /**< @brief Provides `stat()`. */
+#include <time.h>        /**< @brief Provides `clock_gettime()`. */
+#include <unistd.h>      /**< @brief Provides `getopt()`, `pread()`, `fdatasync()`, `unlink()`. */
+
+#define BENCH_THREADS 8                 /**< @brief Default number of appending threads. */
+#define BENCH_PACKETS 500               /**< @brief Default packets per thread. */
+#define BENCH_SHARDS 8                  /**< @brief Default number of shards. */
+#define BENCH_LEN 100                   /**< @brief Default packet length, newline included. */
+#define BENCH_MAX_THREADS 256           /**< @brief Most appending threads. */
+#define BENCH_REPEAT_PCT 80             /**< @brief Default share of heartbeats in the replayed log. */
+#define BENCH_REPLAYS 50                /**< @brief Default number of replays per store. */
+#define BENCH_HEARTBEATS 16             /**< @brief Distinct heartbeat packets. */
+#define PLAIN_BUF_LEN 4096              /**< @brief Read and send size of a plain replay. */
+
+// --- Benchmark Settings ---
+static char data_path[256];                                     /**< The single data file; shards are named after it. */
+static int packets = BENCH_PACKETS;                             /**< Packets per thread. */
+static size_t packet_len = BENCH_LEN;                           /**< Bytes per packet. */
+static pthread_mutex_t store_lock = PTHREAD_MUTEX_INITIALIZER;  /**< The single file's store lock. */
+
+/**
+ * @brief Returns the time of `CLOCK_MONOTONIC` in seconds.
+ */
+static double now_s(void) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Fills a packet of `packet_len` bytes that ends with a newline.
+ */
+static char *make_packet(void) {
+        char *packet = malloc(packet_len);
+        if (packet != NULL) {
+                memset(packet, 'x', packet_len);
+                packet[packet_len - 1] = '\n';
+        }
+        return packet;
+}
+
+/**
+ * @brief Appending thread of the single data file; each has its own stream, like a connection.
+ */
+static void *single_main(void *arg) {
+        (void)arg;
+        char *packet = make_packet();
+        FILE *fp = fopen(data_path, "a");
+        long failed = packet == NULL || fp == NULL;
+        for (int i = 0; i < packets && !failed; i++) {
+                pthread_mutex_lock(&store_lock);
+                if (fwrite(packet, 1, packet_len, fp) != packet_len || fflush(fp) != 0 || fdatasync(fileno(fp)) != 0) {
+                        failed = 1;
+                }
+                pthread_mutex_unlock(&store_lock);
+        }
+        if (fp != NULL) {
+                fclose(fp);
+        }
+        free(packet);
+        return (void *)failed;
+}
+
+/**
+ * @brief Appending thread of the sharded log.
+ */
+static void *shard_main(void *arg) {
+        (void)arg;
+        char *packet = make_packet();
+        struct aesdshard *shard = aesdshard_acquire();
+        long failed = packet == NULL;
+        for (int i = 0; i < packets && !failed; i++) {
+                if (aesdshard_append(shard, packet, packet_len, NULL) != 0 || aesdshard_commit(shard) != 0) {
+                        failed = 1;
+                }
+        }
+        aesdshard_release(shard);
+        free(packet);
+        return (void *)failed;
+}
+
+/**
+ * @brief Runs `threads` copies of `body` and reports their packets per second.
+ * @return 0 on success, -1 if a thread failed.
+ */
+static int run(const char *name, void *(*body)(void *), int threads) {
+        pthread_t tids[BENCH_MAX_THREADS];
+        double t0 = now_s();
+        int started = 0;
+        for (; started < threads; started++) {
+                if (pthread_create(&tids[started], NULL, body, NULL) != 0) {
+                        break;
+                }
+        }
+        bool failed = started < threads;
+        for (int i = 0; i < started; i++) {
+                void *rc;
+                pthread_join(tids[i], &rc);
+                failed = failed || rc != NULL;
+        }
+        double s = now_s() - t0;
+        long total = (long)started * packets;
+        printf("%-12s %3d threads: %7ld appends in %.2f s, %8.0f appends/s, %6.1f us per append\n",
+               name, threads, total, s, (double)total / s, s * 1e6 / (double)total);
+        return failed ? -1 : 0;
+}
+
+/**
+ * @brief Drains a socket until its peer closes it.
+ */
+static void *drain_main(void *arg) {
+        int fd = *(int *)arg;
+        char buf[65536];
+        while (recv(fd, buf, sizeof(buf), 0) > 0) {
+        }
+        return NULL;
+}
+
+/**
+ * @brief Sends the first `len` bytes of a file in reads and sends of `PLAIN_BUF_LEN` bytes.
+ * @return 0 on success, -1 on failure.
+ */
+static int plain_replay(int fd, int client_fd, uint64_t len) {
+        char buf[PLAIN_BUF_LEN];
+        uint64_t pos = 0;
+        while (pos < len) {
+                size_t want = len - pos < PLAIN_BUF_LEN ? (size_t)(len - pos) : PLAIN_BUF_LEN;
+                ssize_t n = pread(fd, buf, want, (off_t)pos);
+                if (n <= 0) {
+                        return -1;
+                }
+                for (ssize_t sent = 0; sent < n;) {
+                        ssize_t m = send(client_fd, buf + sent, (size_t)(n - sent), 0);
+                        if (m <= 0) {
+                                return -1;
+                        }
+                        sent += m;
+                }
+                pos += (uint64_t)n;
+        }
+        return 0;
+}
+
+/**
+ * @brief Stores the same log in the plain file and in the dedup store, then replays both.
+ */
+static int bench_replay(int repeat_pct, int replays) {
+        char *packet = make_packet();
+        char dedup_file[272];
+        snprintf(dedup_file, sizeof(dedup_file), "%s.dedup", data_path);
+        unlink(data_path);
+        FILE *fp = fopen(data_path, "w");
+        if (packet == NULL || fp == NULL || aesddedup_open(data_path) != 0) {
+                fprintf(stderr, "Error creating %s and its dedup store\n", data_path);
+                if (fp != NULL) fclose(fp);
+                free(packet);
+                return -1;
+        }
+        // --- Build the log: heartbeats spread evenly among unique packets ---
+        uint64_t logical = 0;
+        int rc = 0;
+        for (int i = 0; i < packets && rc == 0; i++) {
+                char heartbeat[64];
+                const char *buf = packet;
+                size_t len = packet_len;
+                if ((long)i * repeat_pct / 100 != (long)(i + 1) * repeat_pct / 100) {
+                        len = (size_t)snprintf(heartbeat, sizeof(heartbeat), "HEARTBEAT node-%02d status=ok\n", i % BENCH_HEARTBEATS);
+                        buf = heartbeat;
+                } else {
+                        // Unique packets differ in their first bytes.
+                        snprintf(packet, packet_len, "%010d", i);
+                        packet[10] = ' ';
+                }
+                if (fwrite(buf, 1, len, fp) != len || aesddedup_append(buf, len) != 0) {
+                        rc = -1;
+                }
+                logical += len;
+        }
+        if (fclose(fp) != 0 || aesddedup_commit() != 0) {
+                rc = -1;
+        }
+        struct stat st;
+        if (rc == 0 && stat(dedup_file, &st) == 0) {
+                printf("log of %d packets, %d%% heartbeats: %llu bytes plain, %llu bytes deduplicated (ratio %.2f)\n",
+                       packets, repeat_pct, (unsigned long long)logical, (unsigned long long)st.st_size,
+                       st.st_size ? (double)logical / (double)st.st_size : 0.0);
+        }
+
+        // --- Replay both stores into a drained socket ---
+        int pair[2] = { -1, -1 };
+        int data_fd = open(data_path, O_RDONLY | O_CLOEXEC);
+        pthread_t drain;
+        bool draining = false;
+        if (rc == 0 && data_fd != -1 && socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == 0 &&
+            pthread_create(&drain, NULL, drain_main, &pair[1]) == 0) {
+                draining = true;
+        } else {
+                rc = -1;
+        }
+        double plain_s = 0.0, dedup_s = 0.0;
+        for (int r = 0; r < replays && rc == 0; r++) {
+                double t0 = now_s();
+                rc = plain_replay(data_fd, pair[0], logical);
+                plain_s += now_s() - t0;
+                t0 = now_s();
+                if (rc == 0) {
+                        rc = aesddedup_replay(pair[0]);
+                }
+                dedup_s += now_s() - t0;
+        }
+        if (draining) {
+                shutdown(pair[0], SHUT_WR);
+                pthread_join(drain, NULL);
+        }
+        if (rc == 0) {
+                printf("plain store:  %d replays, %8.1f us per replay, %6.0f MB/s\n", replays,
+                       plain_s * 1e6 / replays, (double)logical * replays / plain_s / 1e6);
+                printf("dedup store:  %d replays, %8.1f us per replay, %6.0f MB/s\n", replays,
+                       dedup_s * 1e6 / replays, (double)logical * replays / dedup_s / 1e6);
+        }
+        if (pair[0] != -1) {
+                close(pair[0]);
+                close(pair[1]);
+        }
+        if (data_fd != -1) {
+                close(data_fd);
+        }
+        aesddedup_close(false);
+        free(packet);
+        return rc;
+}
+
+/**
+ * @brief Compares contended appends to the single data file and to the shards.
+ */
+static int bench_append(int threads, int shards) {
+        unlink(data_path);
+        int rc = run("single file", single_main, threads);
+        unlink(data_path);
+        if (aesdshard_init(data_path, shards) != 0) {
+                fprintf(stderr, "Error creating %d shards for %s\n", shards, data_path);
+                return -1;
+        }
+        char name[32];
+        snprintf(name, sizeof(name), "%d shards", shards);
+        if (run(name, shard_main, threads) != 0) {
+                rc = -1;
+        }
+        aesdshard_close(false);
+        return rc;
+}
+
+int main(int argc, char *argv[]) {
+        const char *dir = "/tmp";
+        int threads = BENCH_THREADS;
+        int shards = BENCH_SHARDS;
+        int repeat_pct = BENCH_REPEAT_PCT;
+        int replays = BENCH_REPLAYS;
+        int opt;
+        bool replay = argc >= 2 && strcmp(argv[1], "replay") == 0;
+        if (argc < 2 || (!replay && strcmp(argv[1], "append") != 0)) {
+                fprintf(stderr, "Usage: %s append [-d dir] [-t threads] [-n packets] [-s shards] [-l len]\n"
+                        "       %s replay [-d dir] [-n packets] [-r repeat_pct] [-l len] [-R replays]\n", argv[0], argv[0]);
+                return EXIT_FAILURE;
+        }
+        optind = 2;
+        while ((opt = getopt(argc, argv, "d:t:n:s:l:r:R:")) != -1) {
+                switch (opt) {
+                case 'd':
+                        dir = optarg;
+                        break;
+                case 't':
+                        threads = atoi(optarg);
+                        break;
+                case 'n':
+                        packets = atoi(optarg);
+                        break;
+                case 's':
+                        shards = atoi(optarg);
+                        break;
+                case 'l':
+                        packet_len = (size_t)atoi(optarg);
+                        break;
+                case 'r':
+                        repeat_pct = atoi(optarg);
+                        break;
+                case 'R':
+                        replays = atoi(optarg);
+                        break;
+                default:
+                        fprintf(stderr, "Usage: %s append [-d dir] [-t threads] [-n packets] [-s shards] [-l len]\n"
+                                "       %s replay [-d dir] [-n packets] [-r repeat_pct] [-l len] [-R replays]\n", argv[0], argv[0]);
+                        return EXIT_FAILURE;
+                }
+        }
+        if (threads < 1 || threads > BENCH_MAX_THREADS || packets < 1 || packet_len < 12 || replays < 1 ||
+            repeat_pct < 0 || repeat_pct > 100) {
+                fprintf(stderr, "Threads must be between 1 and %d, packets and replays positive, length at least 12, "
+                        "the repeat share a percentage\n", BENCH_MAX_THREADS);
+                return EXIT_FAILURE;
+        }
+        snprintf(data_path, sizeof(data_path), "%s/aesdstore-bench", dir);
+        int rc = replay ? bench_replay(repeat_pct, replays) : bench_append(threads, shards);
+        unlink(data_path);
+        return rc == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,140 @@
+/**
+ *  @file aesdtime.c
+ *  @brief Sparse commit-time index of the data file (see aesdtime.h).
+ *
+ *  The index is only touched under the store lock: commits add entries, queries look
+ *  them up. The slice itself is sent without the lock, committed bytes never change.
+ */
+#include "aesdtime.h"
+#include "aesdmem.h"
+
+#include <stddef.h>      /**< @brief Provides `size_t`. */
+#include <stdlib.h>      /**< @brief Provides `realloc()`, `free()`. */
+#include <syslog.h>      /**< @brief Provides `syslog()`. */
+#include <time.h>        /**< @brief Provides `clock_gettime()`. */
+
+/**
+ * @struct time_entry
+ * @brief Every byte at or after `offset` was committed at or after `ms`.
+ */
+struct time_entry {
+        uint64_t offset;        /**< A commit boundary in the data file. */
+        int64_t ms;             /**< Commit time in milliseconds since the epoch. */
+};
+
+// --- Index State (guarded by the store lock) ---
+static bool time_enabled = false;               /**< Whether commits are stamped. */
+static struct time_entry *entries = NULL;       /**< The index, ascending in both fields. */
+static size_t entry_count = 0;                  /**< Entries in `entries`. */
+static size_t entry_cap = 0;                    /**< Capacity of `entries`. */
+static uint64_t last_committed = 0;             /**< Committed length seen by the previous commit. */
+static int64_t last_ms = 0;                     /**< Time of the previous commit. */
+
+/**
+ * @brief Enables the time index.
+ * @return 0 on success.
+ */
+int aesdtime_init(void) {
+        time_enabled = true;
+        return 0;
+}
+
+/**
+ * @brief Stamps the bytes committed since the previous call with the current time.
+ * @param `committed_len` The new committed length of the data file.
+ * @pre The caller holds the store lock.
+ * @details A new entry is only added once the log has grown by `AESDTIME_BLOCK_LEN` since
+ * the last one, which keeps the index sparse. Does nothing when the index is disabled.
+ */
+void aesdtime_commit(uint64_t committed_len) {
+        if (!time_enabled || committed_len <= last_committed) {
+                return;
+        }
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        int64_t ms = (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+        // The wall clock may step back; the index must stay sorted.
+        if (ms < last_ms) {
+                ms = last_ms;
+        }
+        last_ms = ms;
+        if (entry_count == 0 || last_committed >= entries[entry_count - 1].offset + AESDTIME_BLOCK_LEN) {
+                if (entry_count == entry_cap) {
+                        size_t cap = entry_cap ? entry_cap * 2 : 1024;
+                        struct time_entry *e = realloc(entries, cap * sizeof(*e));
+                        if (e == NULL) {
+                                // The previous entry keeps covering these bytes, just less precisely.
+                                last_committed = committed_len;
+                                return;
+                        }
+                        aesdmem_charge(AESDMEM_INDEX, (cap - entry_cap) * sizeof(*e));
+                        entries = e;
+                        entry_cap = cap;
+                }
+                entries[entry_count++] = (struct time_entry) { .offset = last_committed, .ms = ms };
+        }
+        last_committed = committed_len;
+}
+
+/**
+ * @brief Returns the number of entries whose time is at most `ms` (or less than `ms` if `strict`).
+ */
+static size_t entries_before(int64_t ms, bool strict) {
+        size_t lo = 0;
+        size_t hi = entry_count;
+        // Loop invariant: entries below `lo` qualify, entries at or above `hi` do not.
+        while (lo < hi) {
+                size_t mid = lo + (hi - lo) / 2;
+                if (strict ? entries[mid].ms < ms : entries[mid].ms <= ms) {
+                        lo = mid + 1;
+                } else {
+                        hi = mid;
+                }
+        }
+        return lo;
+}
+
+/**
+ * @brief Finds the part of the log committed between two times.
+ * @param `from_ms` Start of the range in milliseconds since the epoch.
+ * @param `to_ms` End of the range (inclusive), or `INT64_MAX` for "until now".
+ * @param `start` Receives the first offset of the slice.
+ * @param `end` Receives the offset after the slice.
+ * @return false if the index is disabled.
+ * @pre The caller holds the store lock.
+ * @details The slice starts at the last entry stamped before `from_ms` and ends at the
+ * first entry stamped after `to_ms`, so it covers the range completely. Nothing was
+ * committed after the latest commit, so a range starting later is empty.
+ */
+bool aesdtime_slice(int64_t from_ms, int64_t to_ms, uint64_t *start, uint64_t *end) {
+        if (!time_enabled) {
+                return false;
+        }
+        if (from_ms > last_ms) {
+                *start = *end = last_committed;
+                return true;
+        }
+        size_t before = entries_before(from_ms, true);
+        *start = before == 0 ? 0 : entries[before - 1].offset;
+        size_t upto = entries_before(to_ms, false);
+        *end = upto == entry_count ? last_committed : entries[upto].offset;
+        if (*end < *start) {
+                *end = *start;
+        }
+        return true;
+}
+
+/**
+ * @brief Frees the index.
+ */
+void aesdtime_close(void) {
+        if (time_enabled) {
+                syslog(LOG_INFO, "Time index: %zu entries for %llu bytes", entry_count, (unsigned long long)last_committed);
+        }
+        free(entries);
+        aesdmem_release(AESDMEM_INDEX, entry_cap * sizeof(*entries));
+        entries = NULL;
+        entry_count = 0;
+        entry_cap = 0;
+        time_enabled = false;
+}
@@ -0,0 +1,30 @@
+/**
+ *  @file aesdtime.h
+ *  @brief Sparse time index of the aesdsocket data file.
+ *
+ *  With `-i` every commit of the shared data file is stamped with the time it happened.
+ *  The stamps form a sparse index with at most one entry per `AESDTIME_BLOCK_LEN` bytes
+ *  of the log: entry `(offset, time)` says that every byte at or after `offset` was
+ *  committed at or after `time`. Packets of the form
+ *  - `SINCE <t>` replay what was committed at or after `t`,
+ *  - `RANGE <t0> <t1>` replay what was committed between `t0` and `t1`,
+ *  where times are Unix timestamps in seconds (fractions allowed). Both are answered
+ *  with a single `sendfile()` of the slice found by binary search. The slice is exact
+ *  at commit boundaries and may include up to one index block more on either side.
+ */
+#ifndef AESDTIME_H
+#define AESDTIME_H
+
+#include <stdbool.h>     /**< @brief Provides a boolean type and values (`true`, `false`). */
+#include <stdint.h>      /**< @brief Provides fixed width integer types (e.g., `uint64_t`). */
+
+#define AESDTIME_SINCE "SINCE "         /**< @brief Start of a packet that replays a recent slice. */
+#define AESDTIME_RANGE "RANGE "         /**< @brief Start of a packet that replays a time range. */
+#define AESDTIME_BLOCK_LEN 4096         /**< @brief Minimum log bytes between two index entries. */
+
+int aesdtime_init(void);
+void aesdtime_commit(uint64_t committed_len);
+bool aesdtime_slice(int64_t from_ms, int64_t to_ms, uint64_t *start, uint64_t *end);
+void aesdtime_close(void);
+
+#endif /* AESDTIME_H */
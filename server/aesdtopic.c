@@ -0,0 +1,271 @@
+/**
+ *  @file aesdtopic.c
+ *  @brief Topic hash map, lazy open and LRU-bounded file descriptors (see aesdtopic.h).
+ */
+#include "aesdtopic.h"
+
+#include <errno.h>       /**< @brief Provides definitions for error numbers (e.g., `EINTR`). */
+#include <fcntl.h>       /**< @brief Provides `open()`, `O_APPEND`. */
+#include <stdbool.h>     /**< @brief Provides a boolean type and values (`true`, `false`). */
+#include <stdio.h>       /**< @brief Provides `snprintf()`. */
+#include <stdlib.h>      /**< @brief Provides `calloc()`, `free()`. */
+#include <string.h>      /**< @brief Provides `memcmp()`, `memcpy()`, `strlen()`, `strcpy()`. */
+#include <sys/sendfile.h>/**< @brief Provides `sendfile()` used for replays. */
+#include <sys/stat.h>    /**< @brief Provides `fstat()`. */
+#include <syslog.h>      /**< @brief Provides `syslog()`. */
+#include <unistd.h>      /**< @brief Provides `write()`, `fdatasync()`, `close()`, `unlink()`. */
+
+#define TOPIC_BUCKETS 1024              /**< @brief Number of hash buckets (a power of two). */
+#define TOPIC_BASE_LEN 224              /**< @brief Size of the data file path the topic files derive from. */
+#define TOPIC_PATH_LEN (TOPIC_BASE_LEN + sizeof(".topic.") + AESDTOPIC_NAME_MAX)  /**< @brief Fits any topic file name. */
+
+// --- Topic Table ---
+static struct aesdtopic *buckets[TOPIC_BUCKETS];                        /**< Hash buckets, chained through `hash_next`. */
+static TAILQ_HEAD(topic_lru, aesdtopic) lru = TAILQ_HEAD_INITIALIZER(lru);  /**< Open, unpinned topics, most recently used first. */
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;          /**< Protects `buckets`, `lru`, `open_count` and every `fd`/`pins`. */
+static int open_count = 0;                                              /**< Number of topic files currently open. */
+static int open_max = 0;                                                /**< Bound on `open_count` set with `-T`. */
+static char topic_base[TOPIC_BASE_LEN];                                 /**< Data file path the topic file names derive from. */
+
+/**
+ * @brief FNV-1a hash of a topic name.
+ */
+static uint32_t topic_hash(const char *name, size_t len) {
+        uint32_t h = 2166136261u;
+        for (size_t i = 0; i < len; i++) {
+                h = (h ^ (unsigned char)name[i]) * 16777619u;
+        }
+        return h;
+}
+
+/**
+ * @brief Builds the file name of a topic.
+ */
+static void topic_path(char *path, size_t size, const char *name) {
+        snprintf(path, size, "%s.topic.%s", topic_base, name);
+}
+
+/**
+ * @brief Enables topics.
+ * @param `data_path` The configured data file; topic files are named `<data_path>.topic.<name>`.
+ * @param `max_open` Maximum number of topic files kept open at the same time.
+ * @return 0 on success, -1 if `max_open` is not positive or `data_path` is too long.
+ */
+int aesdtopic_init(const char *data_path, int max_open) {
+        if (max_open < 1) {
+                syslog(LOG_ERR, "The number of open topics must be positive");
+                return -1;
+        }
+        // A truncated base would put every topic file at a wrong path.
+        if (strlen(data_path) >= sizeof(topic_base)) {
+                syslog(LOG_ERR, "The data file path %s is too long for topic files (at most %d bytes)",
+                       data_path, TOPIC_BASE_LEN - 1);
+                return -1;
+        }
+        strcpy(topic_base, data_path);
+        open_max = max_open;
+        return 0;
+}
+
+/**
+ * @brief Looks up a topic by name, creating its (closed) entry on first use.
+ * @return The topic, or NULL if the name is invalid or memory runs out.
+ */
+static struct aesdtopic *topic_lookup(const char *name, size_t len) {
+        if (len == 0 || len > AESDTOPIC_NAME_MAX) {
+                return NULL;
+        }
+        for (size_t i = 0; i < len; i++) {
+                char c = name[i];
+                // Topic names become part of a file name, so only a safe alphabet is accepted.
+                if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c == '-')) {
+                        return NULL;
+                }
+        }
+        uint32_t b = topic_hash(name, len) & (TOPIC_BUCKETS - 1);
+        pthread_mutex_lock(&table_lock);
+        struct aesdtopic *t;
+        for (t = buckets[b]; t != NULL; t = t->hash_next) {
+                if (strlen(t->name) == len && memcmp(t->name, name, len) == 0) {
+                        break;
+                }
+        }
+        if (t == NULL && (t = calloc(1, sizeof(*t))) != NULL) {
+                memcpy(t->name, name, len);
+                pthread_mutex_init(&t->lock, NULL);
+                t->fd = -1;
+                t->hash_next = buckets[b];
+                buckets[b] = t;
+        }
+        pthread_mutex_unlock(&table_lock);
+        return t;
+}
+
+/**
+ * @brief Recognises a `TOPIC <name>` preamble.
+ * @param `line` The first packet of a connection.
+ * @param `len` Length of the packet, including its newline.
+ * @return The selected topic, or NULL if the packet is not a valid preamble.
+ */
+struct aesdtopic *aesdtopic_parse_preamble(const char *line, size_t len) {
+        size_t plen = strlen(AESDTOPIC_PREAMBLE);
+        if (len <= plen || memcmp(line, AESDTOPIC_PREAMBLE, plen) != 0) {
+                return NULL;
+        }
+        line += plen;
+        len -= plen;
+        // Strip the line terminator.
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+                len--;
+        }
+        return topic_lookup(line, len);
+}
+
+/**
+ * @brief Makes sure the topic file is open and prevents it from being evicted.
+ * @return 0 on success, -1 if the file cannot be opened.
+ * @details Opening a file while `open_max` files are open closes the least recently
+ * used idle topic first. If every open topic is in use the bound is exceeded temporarily.
+ */
+static int topic_pin(struct aesdtopic *t) {
+        pthread_mutex_lock(&table_lock);
+        if (t->fd == -1) {
+                struct aesdtopic *victim;
+                while (open_count >= open_max && (victim = TAILQ_LAST(&lru, topic_lru)) != NULL) {
+                        TAILQ_REMOVE(&lru, victim, lru);
+                        close(victim->fd);
+                        victim->fd = -1;
+                        open_count--;
+                }
+                char path[TOPIC_PATH_LEN];
+                topic_path(path, sizeof(path), t->name);
+                // Like the shared data file, a topic starts empty in every server run.
+                t->fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC | (t->created ? 0 : O_TRUNC), 0644);
+                if (t->fd == -1) {
+                        pthread_mutex_unlock(&table_lock);
+                        syslog(LOG_ERR, "Cannot open topic file %s: %m", path);
+                        return -1;
+                }
+                t->created = 1;
+                open_count++;
+        } else if (t->pins == 0) {
+                TAILQ_REMOVE(&lru, t, lru);
+        }
+        t->pins++;
+        pthread_mutex_unlock(&table_lock);
+        return 0;
+}
+
+/**
+ * @brief Releases a pin; the last one makes the topic the most recently used eviction candidate.
+ */
+static void topic_unpin(struct aesdtopic *t) {
+        pthread_mutex_lock(&table_lock);
+        if (--t->pins == 0) {
+                TAILQ_INSERT_HEAD(&lru, t, lru);
+        }
+        pthread_mutex_unlock(&table_lock);
+}
+
+/**
+ * @brief Writes `len` bytes to the topic file.
+ * @return 0 on success, -1 on failure.
+ */
+static int topic_write(struct aesdtopic *t, const char *buf, size_t len) {
+        while (len > 0) {
+                ssize_t n = write(t->fd, buf, len);
+                if (n < 0) {
+                        if (errno == EINTR) continue;
+                        return -1;
+                }
+                buf += n;
+                len -= (size_t)n;
+        }
+        return 0;
+}
+
+/**
+ * @brief Appends a complete packet to a topic and replays the topic back to the client.
+ * @param `topic` The topic selected by the connection.
+ * @param `client_fd` The connected client socket.
+ * @param `prefix` The start of a long packet held back by the connection, or NULL.
+ * @param `prefix_len` The length of `prefix` in bytes.
+ * @param `buf` The (rest of the) packet.
+ * @param `len` The length of `buf` in bytes.
+ * @return 0 on success, -1 on failure.
+ * @details The append and the commit happen under the topic lock and yield the snapshot
+ * to replay. The replay runs after the lock is released; the pin keeps the file open and
+ * committed bytes never change, so appends of other connections continue meanwhile.
+ */
+int aesdtopic_packet(struct aesdtopic *topic, int client_fd, const char *prefix, size_t prefix_len,
+                     const char *buf, size_t len) {
+        int rc = -1;
+        pthread_mutex_lock(&topic->lock);
+        if (topic_pin(topic) != 0) {
+                pthread_mutex_unlock(&topic->lock);
+                return -1;
+        }
+        struct stat st;
+        if (topic_write(topic, prefix, prefix_len) != 0 || topic_write(topic, buf, len) != 0 ||
+            fdatasync(topic->fd) != 0 || fstat(topic->fd, &st) != 0) {
+                pthread_mutex_unlock(&topic->lock);
+                goto out;
+        }
+        topic->committed = (uint64_t)st.st_size;
+        uint64_t snapshot = topic->committed;
+        pthread_mutex_unlock(&topic->lock);
+
+        // Stream exactly the snapshot of this topic, straight from the page cache.
+        off_t off = 0;
+        while ((uint64_t)off < snapshot) {
+                ssize_t n = sendfile(client_fd, topic->fd, &off, (size_t)(snapshot - (uint64_t)off));
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) goto out;
+        }
+        rc = 0;
+out:
+        topic_unpin(topic);
+        return rc;
+}
+
+/**
+ * @brief Appends bytes without committing them, such as the start of a packet the client never finished.
+ * @return 0 on success, -1 on failure.
+ */
+int aesdtopic_partial(struct aesdtopic *topic, const char *buf, size_t len) {
+        pthread_mutex_lock(&topic->lock);
+        int rc = topic_pin(topic);
+        if (rc == 0) {
+                rc = topic_write(topic, buf, len);
+                topic_unpin(topic);
+        }
+        pthread_mutex_unlock(&topic->lock);
+        return rc;
+}
+
+/**
+ * @brief Closes, removes and forgets every topic. Must only be called once no connection uses a topic.
+ * @param `keep` Whether the topic files are kept, like the data file with "-K".
+ */
+void aesdtopic_close(bool keep) {
+        for (int b = 0; b < TOPIC_BUCKETS; b++) {
+                struct aesdtopic *t = buckets[b];
+                while (t != NULL) {
+                        struct aesdtopic *next = t->hash_next;
+                        char path[TOPIC_PATH_LEN];
+                        topic_path(path, sizeof(path), t->name);
+                        if (t->fd != -1) {
+                                close(t->fd);
+                        }
+                        if (!keep) {
+                                unlink(path);
+                        }
+                        pthread_mutex_destroy(&t->lock);
+                        free(t);
+                        t = next;
+                }
+                buckets[b] = NULL;
+        }
+        TAILQ_INIT(&lru);
+        open_count = 0;
+}
@@ -0,0 +1,46 @@
+/**
+ *  @file aesdtopic.h
+ *  @brief Named logs (topics) multiplexed on one aesdsocket server.
+ *
+ *  With `-T <max_open>` a connection whose first packet is `TOPIC <name>` is routed
+ *  to a log of its own, `<data_file>.topic.<name>`, so its replays only contain that
+ *  topic's history. Topics live in a hash map and are opened lazily; at most
+ *  `max_open` topic files are kept open, the least recently used idle one is closed
+ *  when another has to be opened. Connections without the preamble keep using the
+ *  shared data file.
+ */
+#ifndef AESDTOPIC_H
+#define AESDTOPIC_H
+
+#include <pthread.h>     /**< @brief Provides the per-topic mutex. */
+#include <stdbool.h>     /**< @brief Provides a boolean type and values (`true`, `false`). */
+#include <stdint.h>      /**< @brief Provides fixed width integer types (e.g., `uint64_t`). */
+#include <stddef.h>      /**< @brief Provides `size_t`. */
+#include <sys/queue.h>   /**< @brief Provides the list macros used for the LRU list. */
+
+#define AESDTOPIC_PREAMBLE "TOPIC "     /**< @brief Start of the first packet that selects a topic. */
+#define AESDTOPIC_NAME_MAX 64           /**< @brief Longest accepted topic name. */
+
+/**
+ * @struct aesdtopic
+ * @brief One named log. Entries are never freed before `aesdtopic_close()`, only their files are closed.
+ */
+struct aesdtopic {
+        char name[AESDTOPIC_NAME_MAX + 1];      /**< The topic name, `[A-Za-z0-9_-]+`. */
+        pthread_mutex_t lock;                   /**< Serialises appends and replays on this topic. */
+        int fd;                                 /**< The topic file, or -1 while it is closed. */
+        int pins;                               /**< Number of threads currently using `fd`. */
+        int created;                            /**< Non-zero once the file was (re)created by this server run. */
+        uint64_t committed;                     /**< Committed length of the topic file. */
+        struct aesdtopic *hash_next;            /**< Next topic in the same hash bucket. */
+        TAILQ_ENTRY(aesdtopic) lru;             /**< Link in the LRU list while open and unpinned. */
+};
+
+int aesdtopic_init(const char *data_path, int max_open);
+struct aesdtopic *aesdtopic_parse_preamble(const char *line, size_t len);
+int aesdtopic_packet(struct aesdtopic *topic, int client_fd, const char *prefix, size_t prefix_len,
+                     const char *buf, size_t len);
+int aesdtopic_partial(struct aesdtopic *topic, const char *buf, size_t len);
+void aesdtopic_close(bool keep);
+
+#endif /* AESDTOPIC_H */
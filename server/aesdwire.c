@@ -0,0 +1,341 @@
+/**
+ *  @file aesdwire.c
+ *  @brief Compressed replay frames and their cache (see aesdwire.h).
+ */
+#include "aesdwire.h"
+#include "aesdlz.h"
+#include "aesdmem.h"
+
+#include <errno.h>       /**< @brief Provides definitions for error numbers (e.g., `EINTR`). */
+#include <pthread.h>     /**< @brief Provides the cache mutex. */
+#include <stdatomic.h>   /**< @brief Provides the reference counts of frames. */
+#include <stdlib.h>      /**< @brief Provides `malloc()`, `calloc()`, `realloc()`, `free()`. */
+#include <string.h>      /**< @brief Provides `memcmp()`, `memcpy()`, `memset()`. */
+#include <sys/socket.h>  /**< @brief Provides `send()`. */
+#include <syslog.h>      /**< @brief Provides `syslog()`. */
+#include <time.h>        /**< @brief Provides `clock_gettime()` used to measure compression cost. */
+#include <unistd.h>      /**< @brief Provides `pread()`. */
+
+#define FRAME_HDR_LEN 8         /**< @brief Raw length plus stored length. */
+
+/**
+ * @struct wire_frame
+ * @brief A complete frame, header included, ready to be sent.
+ * @details A frame is shared by the cache and the replays sending it; the last one to
+ * drop its reference frees it, so the cache can evict a frame a slow client is still
+ * being sent.
+ */
+struct wire_frame {
+        atomic_uint refs;       /**< One for the cache while it holds the frame, one per replay sending it. */
+        size_t len;             /**< Length of the frame. */
+        uint8_t buf[];          /**< The frame. */
+};
+
+// --- Cache State (guarded by `cache_lock`; frames are sent without it) ---
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;  /**< Protects the cache, the scratch buffers and the statistics. */
+static int wire_level = 0;                      /**< Compression level, 0 while disabled. */
+static struct aesdlz_work *work = NULL;         /**< Match finder state. */
+static uint8_t *raw = NULL;                     /**< One block read from the data file. */
+static struct wire_frame **frames = NULL;       /**< Cached frames of complete blocks, indexed by block number. */
+static size_t frame_cap = 0;                    /**< Entries in `frames`. */
+static size_t first_cached = 0;                 /**< Blocks below this one are no longer cached. */
+static unsigned cache_generation = 0;           /**< Data file generation the cache describes. */
+static struct wire_frame *tail = NULL;          /**< Frame of the partial last block. */
+static uint64_t tail_block = 0;                 /**< Block number of `tail`. */
+static size_t tail_raw = 0;                     /**< Raw length of `tail`. */
+
+// --- Statistics (reported on close) ---
+static uint64_t stat_replays = 0;               /**< Compressed replays served. */
+static uint64_t stat_raw = 0;                   /**< Log bytes those replays covered. */
+static uint64_t stat_wire = 0;                  /**< Bytes they put on the wire. */
+static uint64_t stat_compressed = 0;            /**< Log bytes compressed. */
+static uint64_t stat_compress_ns = 0;           /**< Time spent compressing. */
+static uint64_t stat_hits = 0;                  /**< Frames served from the cache. */
+
+/**
+ * @brief Enables compressed replays.
+ * @param `level` Compression level, 1 (fastest) to 9 (smallest).
+ * @return 0 on success, -1 on failure.
+ */
+int aesdwire_init(int level) {
+        if (level < 1 || level > 9) {
+                syslog(LOG_ERR, "The compression level must be between 1 and 9");
+                return -1;
+        }
+        work = malloc(sizeof(*work));
+        raw = malloc(AESDWIRE_BLOCK_LEN);
+        if (work == NULL || raw == NULL) {
+                free(work);
+                free(raw);
+                work = NULL;
+                raw = NULL;
+                return -1;
+        }
+        wire_level = level;
+        return 0;
+}
+
+/**
+ * @brief Returns whether `line` is the `COMPRESS` preamble.
+ * @details Always false while compressed replays are disabled, so the packet is stored as usual.
+ */
+bool aesdwire_is_preamble(const char *line, size_t len) {
+        size_t plen = strlen(AESDWIRE_PREAMBLE);
+        if (wire_level == 0 || len < plen || memcmp(line, AESDWIRE_PREAMBLE, plen) != 0) {
+                return false;
+        }
+        // Only a trailing line ending may follow.
+        for (size_t i = plen; i < len; i++) {
+                if (line[i] != '\n' && line[i] != '\r') return false;
+        }
+        return true;
+}
+
+/**
+ * @brief Sends exactly `len` bytes to a socket.
+ */
+static int send_all(int fd, const void *buf, size_t len) {
+        const char *p = buf;
+        while (len > 0) {
+                ssize_t n = send(fd, p, len, 0);
+                if (n < 0) {
+                        if (errno == EINTR) continue;
+                        return -1;
+                }
+                p += n;
+                len -= (size_t)n;
+        }
+        return 0;
+}
+
+/**
+ * @brief Stores `v` at `p` in little-endian byte order.
+ */
+static void put_le32(uint8_t *p, uint32_t v) {
+        p[0] = (uint8_t)v;
+        p[1] = (uint8_t)(v >> 8);
+        p[2] = (uint8_t)(v >> 16);
+        p[3] = (uint8_t)(v >> 24);
+}
+
+/**
+ * @brief Reads block `block` (`len` bytes) of the data file and builds its frame.
+ * @return The frame with one reference for the caller, or NULL on failure.
+ * @pre The caller holds `cache_lock`, which guards the scratch buffers.
+ */
+static struct wire_frame *build_frame(int data_fd, uint64_t block, size_t len) {
+        size_t got = 0;
+        off_t off = (off_t)(block * AESDWIRE_BLOCK_LEN);
+        while (got < len) {
+                ssize_t n = pread(data_fd, raw + got, len - got, off + (off_t)got);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) return NULL;
+                got += (size_t)n;
+        }
+        struct wire_frame *frame = malloc(sizeof(*frame) + FRAME_HDR_LEN + AESDLZ_BOUND(len));
+        if (frame == NULL) {
+                return NULL;
+        }
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        size_t stored = aesdlz_compress(raw, len, frame->buf + FRAME_HDR_LEN, wire_level, work);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        stat_compress_ns += (uint64_t)((t1.tv_sec - t0.tv_sec) * 1000000000LL + (t1.tv_nsec - t0.tv_nsec));
+        stat_compressed += len;
+        if (stored >= len) {
+                memcpy(frame->buf + FRAME_HDR_LEN, raw, len);
+                stored = len;
+        }
+        put_le32(frame->buf, (uint32_t)len);
+        put_le32(frame->buf + 4, (uint32_t)stored);
+        // Cached frames keep only what they use of the worst-case allocation.
+        struct wire_frame *fit = realloc(frame, sizeof(*frame) + FRAME_HDR_LEN + stored);
+        if (fit != NULL) {
+                frame = fit;
+        }
+        atomic_init(&frame->refs, 1);
+        frame->len = FRAME_HDR_LEN + stored;
+        aesdmem_charge(AESDMEM_CACHE, frame->len);
+        return frame;
+}
+
+/**
+ * @brief Drops a reference to a frame, freeing it with the last one.
+ * @return The bytes freed.
+ */
+static size_t frame_put(struct wire_frame *frame) {
+        if (frame == NULL || atomic_fetch_sub(&frame->refs, 1) != 1) {
+                return 0;
+        }
+        size_t len = frame->len;
+        aesdmem_release(AESDMEM_CACHE, len);
+        free(frame);
+        return len;
+}
+
+/**
+ * @brief Drops every cached frame.
+ * @return The bytes freed; frames still being sent are freed by their last replay.
+ * @pre The caller holds `cache_lock`.
+ */
+static size_t cache_flush(void) {
+        size_t freed = 0;
+        for (size_t i = first_cached; i < frame_cap; i++) {
+                freed += frame_put(frames[i]);
+                frames[i] = NULL;
+        }
+        first_cached = 0;
+        freed += frame_put(tail);
+        tail = NULL;
+        return freed;
+}
+
+/**
+ * @brief Prepares the cache for a replay of `full` complete blocks.
+ * @return The first block this replay caches, or -1 on failure.
+ * @pre The caller holds `cache_lock`.
+ */
+static long cache_begin(size_t full, unsigned generation) {
+        if (generation != cache_generation) {
+                cache_flush();
+                cache_generation = generation;
+        }
+        if (full > frame_cap) {
+                size_t cap = frame_cap ? frame_cap : 64;
+                while (cap < full) cap *= 2;
+                struct wire_frame **f = realloc(frames, cap * sizeof(*f));
+                if (f == NULL) {
+                        return -1;
+                }
+                memset(f + frame_cap, 0, (cap - frame_cap) * sizeof(*f));
+                frames = f;
+                frame_cap = cap;
+        }
+        // Only the most recent blocks stay cached, and none while memory is short.
+        size_t keep_from = full > AESDWIRE_CACHE_BLOCKS ? full - AESDWIRE_CACHE_BLOCKS : 0;
+        if (aesdmem_pressure()) {
+                aesdmem_evicted(cache_flush());
+                keep_from = full;
+        }
+        for (; first_cached < keep_from; first_cached++) {
+                frame_put(frames[first_cached]);
+                frames[first_cached] = NULL;
+        }
+        return (long)keep_from;
+}
+
+/**
+ * @brief Returns the frame of block `block` with a reference for the caller.
+ * @param `len` Raw length of the block: `AESDWIRE_BLOCK_LEN`, or less for the partial last block.
+ * @param `keep_from` The first complete block the replay caches (see `cache_begin()`).
+ * @return The frame, cached or built now, or NULL on failure.
+ * @details Takes `cache_lock` only to look the frame up or build it; a replay of another
+ * generation of the data file neither uses nor fills the cache.
+ */
+static struct wire_frame *frame_get(int data_fd, uint64_t block, size_t len, size_t keep_from, unsigned generation) {
+        pthread_mutex_lock(&cache_lock);
+        bool current = generation == cache_generation;
+        bool complete = len == AESDWIRE_BLOCK_LEN;
+        struct wire_frame **slot = NULL;
+        if (current && complete && block >= keep_from && block >= first_cached && block < frame_cap) {
+                slot = &frames[block];
+        } else if (current && !complete) {
+                if (tail != NULL && (tail_block != block || tail_raw != len)) {
+                        frame_put(tail);
+                        tail = NULL;
+                }
+                slot = &tail;
+        }
+        struct wire_frame *frame = slot != NULL ? *slot : NULL;
+        if (frame != NULL) {
+                stat_hits++;
+        } else {
+                frame = build_frame(data_fd, block, len);
+                if (frame != NULL && slot != NULL) {
+                        *slot = frame;
+                        if (!complete) {
+                                tail_block = block;
+                                tail_raw = len;
+                        }
+                } else {
+                        slot = NULL;
+                }
+        }
+        if (slot != NULL) {
+                atomic_fetch_add(&frame->refs, 1);
+        }
+        pthread_mutex_unlock(&cache_lock);
+        return frame;
+}
+
+/**
+ * @brief Sends the first `committed` bytes of the data file as compressed frames.
+ * @param `client_fd` The connected client socket.
+ * @param `data_fd` The data file.
+ * @param `committed` Committed length of the data file.
+ * @param `generation` Compaction generation of the data file; a new one invalidates the cache.
+ * @return 0 on success, -1 on failure.
+ * @details Runs without the store lock: committed blocks never change, and the frames are
+ * sent holding a reference rather than `cache_lock`, so a slow client holds up no one.
+ */
+int aesdwire_replay(int client_fd, int data_fd, uint64_t committed, unsigned generation) {
+        size_t full = (size_t)(committed / AESDWIRE_BLOCK_LEN);
+        size_t tail_len = (size_t)(committed % AESDWIRE_BLOCK_LEN);
+        pthread_mutex_lock(&cache_lock);
+        long keep_from = cache_begin(full, generation);
+        pthread_mutex_unlock(&cache_lock);
+        if (keep_from < 0) {
+                return -1;
+        }
+
+        int rc = 0;
+        uint64_t wire = 0;
+        for (size_t i = 0; i < full + (tail_len > 0) && rc == 0; i++) {
+                struct wire_frame *frame = frame_get(data_fd, i, i < full ? AESDWIRE_BLOCK_LEN : tail_len,
+                                                     (size_t)keep_from, generation);
+                if (frame == NULL) {
+                        return -1;
+                }
+                rc = send_all(client_fd, frame->buf, frame->len);
+                wire += frame->len;
+                frame_put(frame);
+        }
+        if (rc == 0) {
+                static const uint8_t end[FRAME_HDR_LEN] = { 0 };
+                rc = send_all(client_fd, end, sizeof(end));
+                wire += sizeof(end);
+        }
+        pthread_mutex_lock(&cache_lock);
+        stat_replays++;
+        stat_raw += committed;
+        stat_wire += wire;
+        pthread_mutex_unlock(&cache_lock);
+        return rc;
+}
+
+/**
+ * @brief Reports bytes saved against compression time and frees the cache.
+ */
+void aesdwire_close(void) {
+        if (wire_level == 0) {
+                return;
+        }
+        syslog(LOG_INFO, "Compressed replays: %llu replays, %llu bytes sent as %llu (%.1f%% saved); "
+               "%llu bytes compressed in %.1f ms (%.1f MB/s), %llu cached frames reused",
+               (unsigned long long)stat_replays, (unsigned long long)stat_raw, (unsigned long long)stat_wire,
+               stat_raw ? 100.0 * (1.0 - (double)stat_wire / (double)stat_raw) : 0.0,
+               (unsigned long long)stat_compressed, (double)stat_compress_ns / 1e6,
+               stat_compress_ns ? (double)stat_compressed * 1000.0 / (double)stat_compress_ns : 0.0,
+               (unsigned long long)stat_hits);
+        pthread_mutex_lock(&cache_lock);
+        cache_flush();
+        pthread_mutex_unlock(&cache_lock);
+        free(frames);
+        frames = NULL;
+        frame_cap = 0;
+        free(work);
+        work = NULL;
+        free(raw);
+        raw = NULL;
+        wire_level = 0;
+}
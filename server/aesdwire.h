@@ -0,0 +1,37 @@
+/**
+ *  @file aesdwire.h
+ *  @brief Negotiated compressed replays of the shared data file.
+ *
+ *  With `-w <level>` a connection whose first packet is `COMPRESS` is answered with
+ *  `COMPRESS lz4` and from then on receives every replay as a stream of frames:
+ *  - a 4-byte little-endian raw length,
+ *  - a 4-byte little-endian stored length,
+ *  - the payload: an LZ4 block (see aesdlz.h), or the raw bytes when both lengths are equal.
+ *
+ *  A frame with both lengths 0 ends the replay. Every frame but the last holds one
+ *  `AESDWIRE_BLOCK_LEN` block of the data file. Complete blocks never change, so the
+ *  most recent `AESDWIRE_CACHE_BLOCKS` of them are kept compressed in memory and served
+ *  to every client without compressing them again; only the partial last block is
+ *  compressed per replay, and reused while the log does not grow. Under memory pressure
+ *  (see aesdmem.h) the cache is dropped and only the last block is kept. Replays run
+ *  without the store lock; cached frames are reference counted, so the cache may drop a
+ *  frame that a slow client is still being sent.
+ */
+#ifndef AESDWIRE_H
+#define AESDWIRE_H
+
+#include <stdbool.h>     /**< @brief Provides a boolean type and values (`true`, `false`). */
+#include <stdint.h>      /**< @brief Provides fixed width integer types (e.g., `uint64_t`). */
+#include <stddef.h>      /**< @brief Provides `size_t`. */
+
+#define AESDWIRE_PREAMBLE "COMPRESS"    /**< @brief First packet that selects compressed replays. */
+#define AESDWIRE_REPLY "COMPRESS lz4\n" /**< @brief Answer confirming the negotiation. */
+#define AESDWIRE_BLOCK_LEN (64 * 1024)  /**< @brief Bytes of the log per frame. */
+#define AESDWIRE_CACHE_BLOCKS 256       /**< @brief Most recent complete blocks kept compressed. */
+
+int aesdwire_init(int level);
+bool aesdwire_is_preamble(const char *line, size_t len);
+int aesdwire_replay(int client_fd, int data_fd, uint64_t committed, unsigned generation);
+void aesdwire_close(void);
+
+#endif /* AESDWIRE_H */
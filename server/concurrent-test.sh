@@ -0,0 +1,98 @@
+#!/bin/bash
+# Concurrent writer test for aesdsocket
+#
+# Starts ./aesdsocket with -t (plus any options given after the counts), runs WRITERS
+# clients in parallel that each send PACKETS packets on connections of their own, and
+# checks that
+#   - every replay is a prefix of the final log that ends at a packet boundary,
+#   - every replay contains the packet it answers,
+#   - the final log holds every packet exactly once.
+# Every fifth packet is longer than the receive buffer.
+#
+# Usage: ./concurrent-test.sh [writers] [packets] [aesdsocket options...] (or make check)
+# e.g.   ./concurrent-test.sh 8 50 -S 4
+
+set -u
+
+cd `dirname $0`
+WRITERS=${1:-8}
+PACKETS=${2:-50}
+shift $(( $# < 2 ? $# : 2 ))
+PORT=${PORT:-9300}
+LONG_LEN=6000
+workdir=$(mktemp -d)
+trap 'kill ${server_pid} 2>/dev/null; rm -rf ${workdir}' EXIT
+
+# Sends stdin as one connection, half-closes it and prints the replay.
+client() {
+	python3 -c '
+import socket, sys
+s = socket.create_connection(("127.0.0.1", int(sys.argv[1])))
+s.sendall(sys.stdin.buffer.read())
+s.shutdown(socket.SHUT_WR)
+while True:
+    d = s.recv(65536)
+    if not d:
+        break
+    sys.stdout.buffer.write(d)
+' ${PORT}
+}
+
+# The packet number ${2} of writer ${1}, long for every fifth one.
+packet() {
+	if [ $(( $2 % 5 )) -eq 4 ]; then
+		printf 'w%d-%d %s\n' $1 $2 $(head -c ${LONG_LEN} /dev/zero | tr '\0' 'x')
+	else
+		printf 'w%d-%d\n' $1 $2
+	fi
+}
+
+./aesdsocket -t -p ${PORT} -f ${workdir}/data "$@" &
+server_pid=$!
+sleep 0.5
+
+for w in $(seq 0 $(( WRITERS - 1 ))); do
+	(
+		for i in $(seq 0 $(( PACKETS - 1 ))); do
+			packet $w $i | client > ${workdir}/replay.$w.$i
+		done
+	) &
+done
+wait $(jobs -p | grep -v "^${server_pid}$")
+
+printf 'final\n' | client > ${workdir}/final
+kill -TERM ${server_pid}
+wait ${server_pid}
+
+rc=0
+expected=$(( WRITERS * PACKETS + 1 ))
+lines=$(wc -l < ${workdir}/final)
+if [ ${lines} -ne ${expected} ]; then
+	echo "Final log holds ${lines} packets, expected ${expected}"
+	rc=1
+fi
+if [ $(sort ${workdir}/final | uniq -d | wc -l) -ne 0 ]; then
+	echo "Final log holds duplicate packets"
+	rc=1
+fi
+for w in $(seq 0 $(( WRITERS - 1 ))); do
+	for i in $(seq 0 $(( PACKETS - 1 ))); do
+		replay=${workdir}/replay.$w.$i
+		size=$(stat -c %s ${replay})
+		if ! cmp -s -n ${size} ${replay} ${workdir}/final; then
+			echo "Replay of w$w-$i is not a prefix of the final log"
+			rc=1
+		elif [ ${size} -gt 0 ] && [ "$(tail -c 1 ${replay} | od -An -c | tr -d ' ')" != '\n' ]; then
+			echo "Replay of w$w-$i ends inside a packet"
+			rc=1
+		elif ! packet $w $i | grep -qxFf - ${replay}; then
+			echo "Replay of w$w-$i misses its own packet"
+			rc=1
+		fi
+	done
+done
+
+if [ ${rc} -eq 0 ]; then
+	echo "${WRITERS} writers x ${PACKETS} packets: every replay is a packet-aligned prefix of the final log"
+fi
+exit ${rc}